@@ -82,6 +82,7 @@ _public uint8_t libccid_device_addr(ccidev_t dev);
 #define CCID_ERROR_CARD_TIMEOUT		8
 #define CCID_ERROR_AUTH			9
 #define CCID_ERROR_PIN_TIMEOUT		10 /* not implemented */
+#define CCID_ERROR_CARD_STATUS		11 /* error status word from card */
 
 _public ccid_t ccid_probe(ccidev_t dev, const char *tracefile);
 _public unsigned int ccid_num_slots(ccid_t ccid);
@@ -96,11 +97,78 @@ _public const char *ccid_name(ccid_t ccid);
 
 _public unsigned int ccid_error(ccid_t ccid);
 
+/** \ingroup g_ccid
+ * APDU handler for a simulated ISO 14443-4 tag, see \ref ccid_rfsim_tag.
+ * The response, status words and all, goes in rsp and its length in
+ * rsp_len which says how much room there is on entry. Return zero for
+ * the tag to stay silent.
+*/
+typedef int (*ccid_rfsim_apdu_t)(void *priv, const uint8_t *cmd, size_t len,
+				uint8_t *rsp, size_t *rsp_len);
+
+/** \ingroup g_ccid
+ * A virtual ISO 14443-A tag, see \ref ccid_rfsim_add_tag.
+*/
+struct ccid_rfsim_tag {
+	/** Length of UID: 4, 7 or 10 bytes */
+	uint8_t uid_len;
+	/** UID */
+	uint8_t uid[10];
+	/** Answer to request, zero to make one up from the UID length */
+	uint8_t atqa[2];
+	/** Select acknowledge: 0x20 for ISO 14443-4, 0x08 for MIFARE
+	 * Classic 1K, 0x00 for Type 2 */
+	uint8_t sak;
+	/** Length of ats, zero for a default one */
+	uint8_t ats_len;
+	/** Answer to select, starting with TL */
+	uint8_t ats[20];
+	/** GET_VERSION response of a Type 2 tag, all zero if it has none.
+	 * Those which have it also do FAST_READ */
+	uint8_t version[8];
+	/** Bit n set if the tag can't be heard at 106 << n kbit/s */
+	uint8_t bad_speeds;
+	/** Microseconds taken to work out each APDU response */
+	uint32_t apdu_usec;
+	/** APDU handler, NULL to answer everything with 6D00 */
+	ccid_rfsim_apdu_t apdu;
+	/** Opaque pointer passed to apdu */
+	void *priv;
+	/** MIFARE Classic or Type 2 tag memory, read and written in place */
+	uint8_t *mem;
+	/** Size of mem in bytes */
+	size_t mem_len;
+};
+
+/** \ingroup g_ccid
+ * How often frames go wrong in a simulated field, in parts per thousand.
+*/
+struct ccid_rfsim_faults {
+	/** Frames which never reach the tag */
+	unsigned int lost;
+	/** Answers received with a bad CRC */
+	unsigned int crc;
+	/** Answers received with parity or framing errors */
+	unsigned int framing;
+	/** Random number seed */
+	unsigned int seed;
+};
+
+_public ccid_t ccid_rfsim_open(const char *tracefile);
+_public int ccid_rfsim_add_tag(ccid_t ccid, const struct ccid_rfsim_tag *tag);
+_public int ccid_rfsim_remove_tag(ccid_t ccid, const uint8_t *uid,
+					size_t uid_len);
+_public int ccid_rfsim_faults(ccid_t ccid, const struct ccid_rfsim_faults *f);
+_public int ccid_rfsim_frame_size(ccid_t ccid, unsigned int mtu,
+					unsigned int mru);
+_public uint64_t ccid_rfsim_air_time(ccid_t ccid, int reset);
+
 /* Transact xfr buffers */
 _public xfr_t xfr_alloc(size_t txbuf, size_t rxbuf);
 _public void xfr_reset(xfr_t xfr);
 _public int xfr_tx_byte(xfr_t xfr, uint8_t byte);
 _public int xfr_tx_buf(xfr_t xfr, const uint8_t *ptr, size_t len);
+_public uint8_t *xfr_tx_reserve(xfr_t xfr, size_t len);
 
 _public uint8_t xfr_rx_sw1(xfr_t xfr);
 _public uint8_t xfr_rx_sw2(xfr_t xfr);
@@ -113,10 +181,129 @@ _public ccid_t cci_ccid(cci_t cci);
 
 _public int cci_power_off(cci_t cci);
 _public int cci_transact(cci_t cci, xfr_t xfr);
+_public int cci_submit(cci_t cci, xfr_t xfr);
+_public int cci_complete(cci_t cci, xfr_t xfr);
 _public unsigned int cci_error(cci_t cci);
 
-/* contact interfaces only */
+/** \ingroup g_cci
+ * Streaming read callback.
+ *
+ * Called once for each chunk of a transparent EF as it arrives. The data
+ * pointer is only valid for the duration of the call. Return zero to stop
+ * the stream.
+*/
+typedef int (*cci_stream_cb_t)(void *priv, unsigned int ofs,
+				const uint8_t *ptr, size_t len);
+_public int cci_read_binary_stream(cci_t cci, uint8_t cla,
+					unsigned int ofs, size_t len,
+					cci_stream_cb_t cb, void *priv);
+
+/* Logical channels */
+_public unsigned int cci_channel_open(cci_t cci);
+_public int cci_channel_close(cci_t cci, unsigned int chan);
+_public int cci_channel_transact(cci_t cci, unsigned int chan, xfr_t xfr);
+_public int cci_channel_find(cci_t cci, const uint8_t *id, size_t len);
+
 _public int cci_wait_for_card(cci_t cci);
+_public int cci_wait_for_removal(cci_t cci);
+
+/* RF interfaces only */
+_public int cci_rfid_native(cci_t cci, int enable);
+_public int cci_rfid_persist(cci_t cci, int enable);
+_public int cci_rfid_poll_interval(cci_t cci, unsigned int msec);
+
+/** \ingroup g_cci
+ * Card types \ref cci_power_on looks for, see \ref cci_rfid_protocols.
+*/
+#define CCI_RFID_PROTO_14443A	(1 << 0)
+#define CCI_RFID_PROTO_14443B	(1 << 1)
+#define CCI_RFID_PROTO_15693	(1 << 2)
+#define CCI_RFID_PROTO_ALL	(CCI_RFID_PROTO_14443A | \
+				CCI_RFID_PROTO_14443B | \
+				CCI_RFID_PROTO_15693)
+_public int cci_rfid_protocols(cci_t cci, unsigned int mask);
+
+/** \ingroup g_cci
+ * Number of round trip time buckets in \ref cci_rfid_stats.
+*/
+#define CCI_RFID_RTT_BUCKETS	12
+/** \ingroup g_cci
+ * RF link statistics, see \ref cci_rfid_stats.
+*/
+struct cci_rfid_stats {
+	/** Frames exchanged with the card */
+	uint32_t frames;
+	/** Frames which got no answer in time */
+	uint32_t timeouts;
+	/** Frames garbled by more than one card answering */
+	uint32_t collisions;
+	/** Frames received with a bad CRC */
+	uint32_t crc_errors;
+	/** Frames received with parity or framing errors */
+	uint32_t framing_errors;
+	/** Frames lost for other reasons, eg. talking to the reader */
+	uint32_t other_errors;
+	/** Blocks sent again by the ISO 14443-4 layer */
+	uint32_t retries;
+	/** Times a card was put down to a slower bit rate */
+	uint32_t demotions;
+	/** Recent share of frames received garbled, per thousand */
+	uint32_t noise;
+	/** Round trip times of good frames: bucket n counts those under
+	 * 256 << n microseconds, the last bucket all the rest */
+	uint32_t rtt[CCI_RFID_RTT_BUCKETS];
+};
+_public int cci_rfid_stats(cci_t cci, struct cci_rfid_stats *st, int reset);
+
+/** \ingroup g_cci
+ * An ISO 14443-A tag found by \ref cci_rfid_inventory.
+*/
+struct cci_rfid_tag {
+	/** Length of UID: 4, 7 or 10 bytes */
+	uint8_t uid_len;
+	/** UID */
+	uint8_t uid[10];
+	/** Select acknowledge */
+	uint8_t sak;
+	/** Answer to request */
+	uint8_t atqa[2];
+};
+_public unsigned int cci_rfid_inventory(cci_t cci, struct cci_rfid_tag *tags,
+					unsigned int max);
+_public int cci_rfid_select(cci_t cci, const struct cci_rfid_tag *tag);
+_public cci_t cci_rfid_open(cci_t cci, const struct cci_rfid_tag *tag);
+
+/** \ingroup g_cci
+ * Length of a MIFARE Classic key.
+*/
+#define CCI_MFC_KEY_LEN		6
+/** \ingroup g_cci
+ * Most MIFARE Classic keys that can be passed to \ref cci_mfc_set_keys.
+*/
+#define CCI_MFC_MAX_KEYS	32
+_public int cci_mfc_set_keys(cci_t cci, const uint8_t *keys,
+				unsigned int num);
+_public int cci_mfc_key_store(cci_t cci, int enable);
+_public int cci_mfc_read_sector(cci_t cci, unsigned int sector,
+				uint8_t *buf, size_t *len);
+_public int cci_mfc_write_sector(cci_t cci, unsigned int sector,
+				const uint8_t *buf, size_t len);
+_public int cci_mfc_read_card(cci_t cci, uint8_t *buf, size_t *len);
+_public int cci_mfc_write_card(cci_t cci, const uint8_t *buf, size_t len);
+
+_public unsigned int cci_t2t_pages(cci_t cci);
+_public int cci_t2t_read(cci_t cci, unsigned int page, unsigned int num,
+				uint8_t *buf, size_t *len);
+
+/** \ingroup g_cci
+ * Length of an ISO 15693 UID.
+*/
+#define CCI_ISO15693_UID_LEN	8
+_public unsigned int cci_iso15693_inventory(cci_t cci, uint8_t *uids,
+						unsigned int max);
+_public int cci_iso15693_read_blocks(cci_t cci, const uint8_t *uid,
+					unsigned int first, unsigned int num,
+					uint8_t *buf, size_t *len);
 
 /** \ingroup g_cci
  * Chip card is present in the slot, powered and clocked.
@@ -173,6 +360,8 @@ _public unsigned int cci_clock_status(cci_t cci);
 #define CHIPCARD_1_8V		0x3
 _public const uint8_t *cci_power_on(cci_t cci, unsigned int voltage,
 				size_t *atr_len);
+_public const uint8_t *cci_warm_reset(cci_t cci, size_t *atr_len);
+_public const uint8_t *cci_reactivate(cci_t cci, size_t *atr_len);
 
 /* -- Utility functions */
 _public void hex_dump(const uint8_t *ptr, size_t len, size_t llen);
@@ -15,6 +15,7 @@
 #define EMV_DATA_INT		0x2
 #define EMV_DATA_BCD		0x3
 #define EMV_DATA_DATE		0x4
+#define EMV_DATA_CN		0x5
 
 #define EMV_ERR_SYSTEM			0x0
 #define EMV_ERR_CCID			0x1
@@ -47,6 +48,7 @@ typedef int (*emv_dol_cb_t)(uint16_t tag, uint8_t *ptr, size_t len, void *priv);
 
 /* Setup/teardown */
 _public emv_t emv_init(cci_t cc);
+_public int emv_reset(emv_t e, cci_t cc);
 _public void emv_fini(emv_t e);
 
 /* error handling */
@@ -78,6 +80,7 @@ _public int emv_app_init(emv_t e);
 _public int emv_app_aip(emv_t e, emv_aip_t aip);
 
 /* Application data */
+_public void emv_set_lazy(emv_t e, int lazy);
 _public int emv_read_app_data(emv_t e);
 _public emv_data_t emv_retrieve_data(emv_t e, uint16_t id);
 _public emv_data_t *emv_retrieve_records(emv_t e, unsigned int *nmemb);
@@ -114,9 +117,16 @@ _public uint8_t *emv_construct_dol(emv_dol_cb_t cbfn,
 					const uint8_t *ptr, size_t len,
 					size_t *ret_len, void *priv);
 
+/* Terminal data objects that DOLs requested by the card are filled from */
+_public int emv_set_terminal_data(emv_t e, uint16_t tag,
+					const uint8_t *ptr, size_t len);
+
 _public const uint8_t *emv_generate_ac(emv_t e, uint8_t ref,
 					const uint8_t *tx, uint8_t len,
 					size_t *rlen);
+_public const uint8_t *emv_generate_ac_dol(emv_t e, uint8_t ref,
+					const uint8_t *cdol, size_t cdol_len,
+					size_t *rlen);
 
 /* Definitions from EMV spec */
 #define EMV_AC_AAC		0x00 /* app auth cryptogram . decliend */
@@ -18,6 +18,7 @@ _private void *gang_alloc(gang_t g, size_t sz) _malloc;
 _private void *gang_alloc_a(gang_t g, size_t sz, size_t align) _malloc;
 _private void *gang_alloc0(gang_t g, size_t sz) _malloc;
 _private void *gang_alloc0_a(gang_t g, size_t sz, size_t align) _malloc;
+_private void gang_reset(gang_t g, unsigned int max);
 _private void gang_free(gang_t g);
 
 #endif /* _GANG_HEADER_INCLUDED */
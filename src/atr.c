@@ -0,0 +1,111 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Answer-to-reset parsing, only as much as we need to drive the card:
+ * offered protocols, class indicator and the card capabilities found in
+ * the historical bytes (ISO 7816-3 S.8.2, ISO 7816-4 S.8.1.1).
+*/
+
+#include <ccid.h>
+
+#include "ccid-internal.h"
+
+#define ATR_TA		(1 << 4)
+#define ATR_TB		(1 << 5)
+#define ATR_TC		(1 << 6)
+#define ATR_TD		(1 << 7)
+
+#define HIST_CAT_TLV		0x80
+#define HIST_CAT_TLV_STATUS	0x00
+#define HIST_TAG_CAPS		0x7
+
+static void parse_hist(struct _atr *atr, const uint8_t *ptr, size_t len)
+{
+	const uint8_t *end;
+	unsigned int tag, l;
+
+	if ( len < 1 )
+		return;
+
+	switch(ptr[0]) {
+	case HIST_CAT_TLV:
+		end = ptr + len;
+		break;
+	case HIST_CAT_TLV_STATUS:
+		if ( len < 4 )
+			return;
+		end = ptr + len - 3;
+		break;
+	default:
+		return;
+	}
+
+	for(ptr++; ptr < end; ptr += l) {
+		tag = *ptr >> 4;
+		l = *ptr & 0xf;
+		ptr++;
+		if ( ptr + l > end )
+			break;
+		if ( tag == HIST_TAG_CAPS ) {
+			atr->a_ncaps = (l > sizeof(atr->a_caps)) ?
+					sizeof(atr->a_caps) : l;
+			memcpy(atr->a_caps, ptr, atr->a_ncaps);
+		}
+	}
+}
+
+_private int _atr_parse(struct _atr *atr, const uint8_t *ptr, size_t len)
+{
+	const uint8_t *end = ptr + len;
+	unsigned int y, k, i, t = 0;
+
+	memset(atr, 0, sizeof(*atr));
+
+	if ( len < 2 )
+		return 0;
+
+	y = ptr[1] & 0xf0;
+	k = ptr[1] & 0x0f;
+	ptr += 2;
+
+	for(i = 1; y; i++) {
+		uint8_t td = 0;
+
+		if ( y & ATR_TA ) {
+			if ( ptr >= end )
+				return 0;
+			/* first TA after T=15 is the class indicator */
+			if ( t == 15 && !atr->a_class )
+				atr->a_class = *ptr & 0x3f;
+			if ( i == 1 )
+				atr->a_ta1 = *ptr;
+			ptr++;
+		}
+		if ( y & ATR_TB )
+			ptr++;
+		if ( y & ATR_TC )
+			ptr++;
+		if ( y & ATR_TD ) {
+			if ( ptr >= end )
+				return 0;
+			td = *ptr++;
+			t = td & 0xf;
+			atr->a_protos |= (1 << t);
+		}
+		y = td & 0xf0;
+	}
+
+	/* T=0 is implicit if no protocol indicated */
+	if ( !(atr->a_protos & ~(1 << 15)) )
+		atr->a_protos |= (1 << 0);
+
+	if ( ptr + k > end )
+		return 0;
+
+	atr->a_hist = ptr;
+	atr->a_hist_len = k;
+	parse_hist(atr, ptr, k);
+	return 1;
+}
@@ -42,6 +42,22 @@ ccid_t cci_ccid(cci_t cci)
 	return cci->i_parent;
 }
 
+static const uint8_t *set_atr(struct _cci *cci, const uint8_t *atr,
+				size_t len, size_t *atr_len)
+{
+	if ( NULL == atr )
+		return NULL;
+
+	/* keep a copy, the xfr buffer it lives in gets recycled */
+	cci->i_atr_len = (len > CCI_MAX_ATR) ? CCI_MAX_ATR : len;
+	memcpy(cci->i_atr, atr, cci->i_atr_len);
+	_cci_channel_reset(cci);
+
+	if ( atr_len )
+		*atr_len = len;
+	return atr;
+}
+
 /** Power on a chip card slot.
  * \ingroup g_cci
  *
@@ -54,7 +70,107 @@ ccid_t cci_ccid(cci_t cci)
 const uint8_t *cci_power_on(cci_t cci, unsigned int voltage,
 				size_t *atr_len)
 {
-	return (*cci->i_ops->power_on)(cci, voltage, atr_len);
+	const uint8_t *atr;
+	size_t len;
+
+	atr = (*cci->i_ops->power_on)(cci, voltage, &len);
+	return set_atr(cci, atr, len, atr_len);
+}
+
+/** Warm reset a chip card.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t to reset, card must be active.
+ * @param atr_len Pointer to size_t to retrieve length of ATR message.
+ *
+ * Resets the card without removing power, the voltage selected at power on
+ * is kept.
+ *
+ * @return NULL for failure, pointer to ATR message otherwise.
+ */
+const uint8_t *cci_warm_reset(cci_t cci, size_t *atr_len)
+{
+	const uint8_t *atr;
+	size_t len;
+
+	if ( NULL == cci->i_ops->warm_reset ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return NULL;
+	}
+
+	atr = (*cci->i_ops->warm_reset)(cci, &len);
+	return set_atr(cci, atr, len, atr_len);
+}
+
+/** Reactivate a chip card with cached parameters.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t to reactivate.
+ * @param atr_len Pointer to size_t to retrieve length of ATR message.
+ *
+ * Recovers a card which was previously activated with \ref cci_power_on.
+ * An active card is warm reset, otherwise it is powered at the voltage
+ * found last time. If the ATR is unchanged, the previously negotiated
+ * protocol parameters are restored rather than negotiated again. Falls
+ * back to a cold start if nothing is cached.
+ *
+ * @return NULL for failure, pointer to ATR message otherwise.
+ */
+const uint8_t *cci_reactivate(cci_t cci, size_t *atr_len)
+{
+	const uint8_t *atr;
+	size_t len;
+
+	if ( NULL == cci->i_ops->reactivate ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return NULL;
+	}
+
+	atr = (*cci->i_ops->reactivate)(cci, &len);
+	return set_atr(cci, atr, len, atr_len);
+}
+
+/** Wait for a chip card to arrive.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t to wait on.
+ *
+ * Contact slots wait for the CCID to signal card insertion. RF fields
+ * are kept powered and probed at the interval set by
+ * \ref cci_rfid_poll_interval, the slot status becomes CHIPCARD_PRESENT
+ * as soon as any card answers.
+ *
+ * @return zero on failure.
+ */
+int cci_wait_for_card(cci_t cci)
+{
+	if ( NULL == cci->i_ops->wait ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	return (*cci->i_ops->wait)(cci, 1);
+}
+
+/** Wait for a chip card to be removed.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t to wait on.
+ *
+ * The counterpart of \ref cci_wait_for_card. On RF fields an active
+ * ISO 14443-4 card keeps its session while it's polled, other active
+ * cards are reset, so only call this once finished with those.
+ *
+ * @return zero on failure.
+ */
+int cci_wait_for_removal(cci_t cci)
+{
+	if ( NULL == cci->i_ops->wait ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	return (*cci->i_ops->wait)(cci, 0);
 }
 
 /** Perform a chip card transaction.
@@ -72,6 +188,49 @@ int cci_transact(cci_t cci, xfr_t xfr)
 	return (*cci->i_ops->transact)(cci, xfr);
 }
 
+/** Submit a chip card transaction without waiting for the response.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t for this transaction.
+ * @param xfr \ref xfr_t containing a command APDU.
+ *
+ * On contact slots the command is sent to the CCID straight away so the
+ * card can work on it while the host does something else. Other interfaces
+ * do the whole transaction in \ref cci_complete. Only one transaction may
+ * be outstanding on a slot, it must be completed before anything else is
+ * sent to that slot.
+ *
+ * @return zero on failure.
+ */
+int cci_submit(cci_t cci, xfr_t xfr)
+{
+	if ( cci->i_ops != &_contact_ops )
+		return 1;
+	return _PC_to_RDR_XfrBlock(cci->i_parent, cci->i_idx, xfr);
+}
+
+/** Complete a chip card transaction started with \ref cci_submit.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t for this transaction.
+ * @param xfr \ref xfr_t which was passed to \ref cci_submit.
+ *
+ * @return zero on failure.
+ */
+int cci_complete(cci_t cci, xfr_t xfr)
+{
+	struct _ccid *ccid = cci->i_parent;
+
+	if ( cci->i_ops != &_contact_ops )
+		return cci_transact(cci, xfr);
+
+	if ( !_RDR_to_PC(ccid, cci->i_idx, xfr) )
+		return 0;
+
+	_RDR_to_PC_DataBlock(ccid, xfr);
+	return 1;
+}
+
 /** Power off a chip card slot.
  * \ingroup g_cci
  *
@@ -81,5 +240,6 @@ int cci_transact(cci_t cci, xfr_t xfr)
  */
 int cci_power_off(cci_t cci)
 {
+	_cci_channel_reset(cci);
 	return (*cci->i_ops->power_off)(cci);
 }
@@ -0,0 +1,278 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Logical channel management (ISO 7816-4 S.5.1.1 and S.7.1.2). Keeps track
+ * of which channels are open and what application or DF was last selected
+ * on each so that callers can switch context without a fresh SELECT.
+*/
+
+#include <ccid.h>
+
+#include "ccid-internal.h"
+
+#define INS_MANAGE_CHANNEL	0x70
+#define INS_SELECT		0xa4
+
+#define CLA_FURTHER		0x40
+#define CLA_FURTHER_SM		0x20
+#define CLA_CHAIN		0x10
+#define CLA_FIRST_SM		0x0c
+
+void _cci_channel_reset(struct _cci *cci)
+{
+	cci->i_chan_open = 1;
+	memset(cci->i_chan, 0, sizeof(cci->i_chan));
+}
+
+static unsigned int max_channels(struct _cci *cci)
+{
+	struct _atr atr;
+	unsigned int n;
+
+	/* without card capabilities assume the basic 4 */
+	if ( !_atr_parse(&atr, cci->i_atr, cci->i_atr_len) ||
+			atr.a_ncaps < 3 )
+		return 4;
+
+	n = (atr.a_caps[2] & 0x7) + 1;
+	if ( n == 8 )
+		return CCI_MAX_CHANNELS;
+	return n;
+}
+
+/* Encode a channel in to CLA, switching between first and further
+ * interindustry encodings as needed, preserving command chaining, secure
+ * messaging and the proprietary class bit. Only classes with the
+ * interindustry layout can carry a channel: 0x00-0x1f and 0x40-0x7f, or
+ * the same with b8 set. GSM style 0xa0-0xbf classes, the RFU 0x20-0x3f
+ * and 0xff can't. The basic channel leaves CLA alone.
+ *
+ * Returns zero if the class can't be used on the channel.
+ */
+static int channel_cla(uint8_t *cla, unsigned int chan)
+{
+	uint8_t c = *cla;
+	uint8_t hi = c & 0x80;
+	uint8_t chain = c & CLA_CHAIN;
+	uint8_t sm;
+
+	if ( 0 == chan )
+		return 1;
+
+	if ( c == 0xff )
+		return 0;
+
+	if ( c & CLA_FURTHER )
+		sm = (c & CLA_FURTHER_SM) ? 0x08 : 0;
+	else if ( !(c & CLA_FURTHER_SM) )
+		sm = c & CLA_FIRST_SM;
+	else
+		return 0;
+
+	if ( chan < 4 )
+		*cla = hi | chain | sm | chan;
+	else
+		*cla = hi | CLA_FURTHER | ((sm) ? CLA_FURTHER_SM : 0) |
+			chain | (chan - 4);
+
+	return 1;
+}
+
+static int manage_channel(struct _cci *cci, uint8_t p1, uint8_t p2,
+				unsigned int *chan)
+{
+	struct _ccid *ccid = cci->i_parent;
+	struct _xfr *xfr;
+	const uint8_t *ptr;
+	size_t len;
+	int ret = 0;
+
+	xfr = _xfr_do_alloc(5, 3);
+	if ( NULL == xfr ) {
+		ccid->d_error = CCID_ERROR_NO_MEM;
+		return 0;
+	}
+
+	xfr_tx_byte(xfr, 0x00);
+	xfr_tx_byte(xfr, INS_MANAGE_CHANNEL);
+	xfr_tx_byte(xfr, p1);
+	xfr_tx_byte(xfr, p2);
+	if ( chan )
+		xfr_tx_byte(xfr, 1);
+
+	if ( !cci_transact(cci, xfr) )
+		goto out;
+
+	ptr = xfr_rx_data(xfr, &len);
+	if ( NULL == ptr ) {
+		ccid->d_error = CCID_ERROR_CARD_PROTO;
+		goto out;
+	}
+
+	if ( xfr_rx_sw1(xfr) != 0x90 ) {
+		trace(ccid, " o MANAGE CHANNEL: SW %.2x%.2x\n",
+			xfr_rx_sw1(xfr), xfr_rx_sw2(xfr));
+		ccid->d_error = CCID_ERROR_CARD_STATUS;
+		goto out;
+	}
+
+	if ( chan ) {
+		if ( len < 1 ) {
+			ccid->d_error = CCID_ERROR_CARD_PROTO;
+			goto out;
+		}
+		*chan = ptr[0];
+	}
+
+	ret = 1;
+out:
+	_xfr_do_free(xfr);
+	return ret;
+}
+
+/** Open a logical channel.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t with an active card.
+ *
+ * Issues MANAGE CHANNEL open and lets the card assign the channel number.
+ * Up to 4 channels are supported, or 20 if the card advertises extended
+ * logical channels in its ATR.
+ *
+ * @return zero on failure, channel number otherwise.
+ */
+unsigned int cci_channel_open(cci_t cci)
+{
+	struct _ccid *ccid = cci->i_parent;
+	unsigned int chan;
+
+	if ( !manage_channel(cci, 0x00, 0x00, &chan) )
+		return 0;
+
+	if ( chan == 0 || chan >= max_channels(cci) ) {
+		trace(ccid, " o Card assigned bad channel %u\n", chan);
+		manage_channel(cci, 0x80, chan, NULL);
+		ccid->d_error = CCID_ERROR_CARD_PROTO;
+		return 0;
+	}
+
+	cci->i_chan_open |= (1U << chan);
+	cci->i_chan[chan].c_sel_len = 0;
+	trace(ccid, " o Opened logical channel %u\n", chan);
+	return chan;
+}
+
+/** Close a logical channel.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t with an active card.
+ * @param chan Channel number as returned by \ref cci_channel_open.
+ *
+ * @return zero on failure.
+ */
+int cci_channel_close(cci_t cci, unsigned int chan)
+{
+	if ( chan == 0 || chan >= CCI_MAX_CHANNELS ||
+			!(cci->i_chan_open & (1U << chan)) ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	/* card still has it open if the close didn't go through */
+	if ( !manage_channel(cci, 0x80, chan, NULL) )
+		return 0;
+
+	cci->i_chan_open &= ~(1U << chan);
+	cci->i_chan[chan].c_sel_len = 0;
+	return 1;
+}
+
+/** Perform a chip card transaction on a logical channel.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t for this transaction.
+ * @param chan Channel number, zero for the basic channel.
+ * @param xfr \ref xfr_t containing a command APDU.
+ *
+ * The channel number is encoded in to the CLA byte of the command in xfr.
+ * The basic channel leaves CLA as it is. Other channels need a class with
+ * the interindustry layout, proprietary classes such as GSM's 0xa0 fail
+ * with CCID_ERROR_IN_VALUE.
+ * If the command is a SELECT and it succeeds, the selected identifier is
+ * remembered against the channel, see \ref cci_channel_find.
+ *
+ * @return zero on failure.
+ */
+int cci_channel_transact(cci_t cci, unsigned int chan, xfr_t xfr)
+{
+	struct _cci_chan *c;
+	uint8_t sw1;
+
+	if ( chan >= CCI_MAX_CHANNELS ||
+			!((cci->i_chan_open | 1) & (1U << chan)) ||
+			xfr->x_txlen < 4 ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	if ( !channel_cla(&xfr->x_txbuf[0], chan) ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	if ( !cci_transact(cci, xfr) )
+		return 0;
+
+	if ( xfr->x_txbuf[1] != INS_SELECT )
+		return 1;
+
+	c = &cci->i_chan[chan];
+	c->c_sel_len = 0;
+
+	if ( xfr->x_rxlen < 2 )
+		return 1;
+
+	sw1 = xfr_rx_sw1(xfr);
+	if ( sw1 != 0x90 && sw1 != 0x61 && sw1 != 0x9f )
+		return 1;
+
+	if ( xfr->x_txlen > 5 && xfr->x_txbuf[4] <= CCI_MAX_SEL &&
+			5U + xfr->x_txbuf[4] <= xfr->x_txlen ) {
+		c->c_sel_len = xfr->x_txbuf[4];
+		memcpy(c->c_sel, xfr->x_txbuf + 5, c->c_sel_len);
+	}
+
+	return 1;
+}
+
+/** Find a logical channel with a given application or DF selected.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t to search.
+ * @param id AID or file identifier as passed in the SELECT command.
+ * @param len Length of id in bytes.
+ *
+ * Generates no traffic accross physical bus to CCID.
+ *
+ * @return -1 if not found, channel number otherwise.
+ */
+int cci_channel_find(cci_t cci, const uint8_t *id, size_t len)
+{
+	unsigned int i;
+
+	if ( 0 == len )
+		return -1;
+
+	for(i = 0; i < CCI_MAX_CHANNELS; i++) {
+		if ( !((cci->i_chan_open | 1) & (1U << i)) )
+			continue;
+		if ( cci->i_chan[i].c_sel_len != len )
+			continue;
+		if ( !memcmp(cci->i_chan[i].c_sel, id, len) )
+			return i;
+	}
+
+	return -1;
+}
@@ -10,40 +10,82 @@
 
 #include "ccid-internal.h"
 
-static int select_params(struct _cci *cci, const uint8_t *atr, size_t len)
+static int get_params(struct _cci *cci)
 {
-	return 1;
-#if 0
 	struct _ccid *ccid = cci->i_parent;
-	xfr_t xfr;
+	struct _xfr *xfr;
+	int ret = 0;
 
-	xfr = xfr_alloc(256, 256);
+	xfr = _xfr_do_alloc(sizeof(struct ccid_t1), sizeof(struct ccid_t1));
 	if ( NULL == xfr )
 		return 0;
 
 	if ( !_PC_to_RDR_GetParameters(ccid, cci->i_idx, xfr) )
-		goto err;
+		goto out;
 	if ( !_RDR_to_PC(ccid, cci->i_idx, xfr) )
-		goto err;
+		goto out;
 	if ( !_RDR_to_PC_Parameters(ccid, xfr) )
-		goto err;
+		goto out;
+
+	cci->i_proto = xfr->x_rxhdr->in.bApp;
+	cci->i_params_len = (xfr->x_rxlen > sizeof(cci->i_params)) ?
+				sizeof(cci->i_params) : xfr->x_rxlen;
+	memcpy(cci->i_params, xfr->x_rxbuf, cci->i_params_len);
+	ret = 1;
+out:
+	_xfr_do_free(xfr);
+	return ret;
+}
 
-	xfr_free(xfr);
-	return 1;
-err:
-	xfr_free(xfr);
-	return 0;
-#endif
+static int set_params(struct _cci *cci)
+{
+	struct _ccid *ccid = cci->i_parent;
+	struct _xfr *xfr;
+	int ret = 0;
+
+	xfr = _xfr_do_alloc(sizeof(struct ccid_t1), sizeof(struct ccid_t1));
+	if ( NULL == xfr )
+		return 0;
+
+	xfr_tx_buf(xfr, cci->i_params, cci->i_params_len);
+	if ( !_PC_to_RDR_SetParameters(ccid, cci->i_idx, xfr, cci->i_proto) )
+		goto out;
+	if ( !_RDR_to_PC(ccid, cci->i_idx, xfr) )
+		goto out;
+	ret = _RDR_to_PC_Parameters(ccid, xfr);
+out:
+	_xfr_do_free(xfr);
+	return ret;
 }
 
-static const uint8_t *contact_power_on(struct _cci *cci, unsigned int voltage,
+/* Work out which voltage the card ended up at so that reactivation doesn't
+ * need to repeat the class search. Pick the lowest class the card claims
+ * in its ATR and the reader supports.
+ */
+static unsigned int atr_voltage(struct _cci *cci, const uint8_t *ptr,
+				size_t len)
+{
+	unsigned int support = cci->i_parent->d_desc.bVoltageSupport;
+	struct _atr atr;
+
+	if ( !_atr_parse(&atr, ptr, len) )
+		return CHIPCARD_AUTO_VOLTAGE;
+
+	if ( (atr.a_class & 0x4) && (support & CCID_1_8V) )
+		return CHIPCARD_1_8V;
+	if ( (atr.a_class & 0x2) && (support & CCID_3V) )
+		return CHIPCARD_3V;
+	if ( (atr.a_class & 0x1) && (support & CCID_5V) )
+		return CHIPCARD_5V;
+
+	return CHIPCARD_AUTO_VOLTAGE;
+}
+
+static const uint8_t *do_power_on(struct _cci *cci, unsigned int voltage,
 				size_t *atr_len)
 {
 	struct _ccid *ccid = cci->i_parent;
 
-	if ( cci->i_ops != &_contact_ops )
-		return NULL;
-
 	if ( !_PC_to_RDR_IccPowerOn(ccid, cci->i_idx, ccid->d_xfr, voltage) )
 		return NULL;
 
@@ -52,13 +94,81 @@ static const uint8_t *contact_power_on(struct _cci *cci, unsigned int voltage,
 	
 	_RDR_to_PC_DataBlock(ccid, ccid->d_xfr);
 
-	select_params(cci, ccid->d_xfr->x_rxbuf, ccid->d_xfr->x_rxlen);
-
 	if ( atr_len )
 		*atr_len = ccid->d_xfr->x_rxlen;
 	return ccid->d_xfr->x_rxbuf;
 }
 
+static const uint8_t *contact_power_on(struct _cci *cci, unsigned int voltage,
+				size_t *atr_len)
+{
+	const uint8_t *atr;
+	size_t len;
+
+	if ( cci->i_ops != &_contact_ops )
+		return NULL;
+
+	atr = do_power_on(cci, voltage, &len);
+	if ( NULL == atr )
+		return NULL;
+
+	if ( voltage == CHIPCARD_AUTO_VOLTAGE )
+		voltage = atr_voltage(cci, atr, len);
+	cci->i_voltage = voltage;
+
+	if ( !get_params(cci) )
+		cci->i_params_len = 0;
+
+	if ( atr_len )
+		*atr_len = len;
+	return atr;
+}
+
+/* The CCID does a warm reset if the slot is already powered */
+static const uint8_t *contact_warm_reset(struct _cci *cci, size_t *atr_len)
+{
+	if ( cci->i_status != CHIPCARD_ACTIVE ) {
+		cci->i_parent->d_error = CCID_ERROR_NO_CARD;
+		return NULL;
+	}
+
+	return do_power_on(cci, cci->i_voltage, atr_len);
+}
+
+static const uint8_t *contact_reactivate(struct _cci *cci, size_t *atr_len)
+{
+	struct _ccid *ccid = cci->i_parent;
+	const uint8_t *atr;
+	size_t len;
+
+	/* nothing cached, this has to be a cold start */
+	if ( !cci->i_atr_len )
+		return contact_power_on(cci, CHIPCARD_AUTO_VOLTAGE, atr_len);
+
+	if ( cci->i_status == CHIPCARD_ACTIVE )
+		atr = contact_warm_reset(cci, &len);
+	else
+		atr = do_power_on(cci, cci->i_voltage, &len);
+	if ( NULL == atr )
+		return NULL;
+
+	/* same card, same ATR: put back what we had negotiated */
+	if ( len == cci->i_atr_len && !memcmp(atr, cci->i_atr, len) &&
+			cci->i_params_len ) {
+		trace(ccid, " o Reactivate: restoring cached parameters\n");
+		if ( !set_params(cci) )
+			return NULL;
+	}else{
+		trace(ccid, " o Reactivate: ATR changed\n");
+		if ( !get_params(cci) )
+			cci->i_params_len = 0;
+	}
+
+	if ( atr_len )
+		*atr_len = len;
+	return atr;
+}
+
 static int contact_power_off(struct _cci *cci)
 {
 	struct _ccid *ccid = cci->i_parent;
@@ -111,24 +221,18 @@ unsigned int cci_clock_status(cci_t cci)
 	return _RDR_to_PC_SlotStatus(ccid, ccid->d_xfr);
 }
 
-/** Wait for insertion of a chip card in to the slot.
- * \ingroup g_cci
- *
- * @param cci \ref cci_t to wait on.
- *
- * @return Always succeeds and returns 1.
- */
-int cci_wait_for_card(cci_t cci)
+/* Slot changes are signalled by NotifySlotChange on the interrupt pipe */
+static int contact_wait(struct _cci *cci, int present)
 {
 	struct _ccid *ccid = cci->i_parent;
 
-	do {
+	for(;;) {
 		_PC_to_RDR_GetSlotStatus(ccid, cci->i_idx, ccid->d_xfr);
 		_RDR_to_PC(ccid, cci->i_idx, ccid->d_xfr);
-		if ( cci->i_status != CHIPCARD_NOT_PRESENT )
+		if ( (cci->i_status != CHIPCARD_NOT_PRESENT) == !!present )
 			break;
 		_cci_wait_for_interrupt(ccid);
-	} while( cci->i_status == CHIPCARD_NOT_PRESENT );
+	}
 	return 1;
 }
 
@@ -136,4 +240,7 @@ _private const struct _cci_ops _contact_ops = {
 	.power_on = contact_power_on,
 	.power_off = contact_power_off,
 	.transact = contact_transact,
+	.warm_reset = contact_warm_reset,
+	.reactivate = contact_reactivate,
+	.wait = contact_wait,
 };
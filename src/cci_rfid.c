@@ -7,11 +7,14 @@
 */
 
 #include <ccid.h>
+#include <unistd.h>
 
 #include "ccid-internal.h"
 #include "rfid-internal.h"
 #include "rfid_layer1.h"
 #include "iso14443a.h"
+#include "iso14443b.h"
+#include "iso15693.h"
 
 #if 0
 #define dprintf printf
@@ -21,6 +24,91 @@
 #define dhex_dump(a, b, c) do {} while(0)
 #endif
 
+/* 848k, 424k, 212k then 106k */
+#define RFID_RATE_FALLBACKS	3
+
+/* Tags resolved per pass of cci_rfid_inventory() */
+#define RFID_INVENTORY_BATCH	8
+
+/* If the PICC accepted PPS but can't be heard at the new rates it's stuck
+ * there, so start again from a fresh field. The rate cache has been told,
+ * the next go is slower.
+ */
+static int tcl_activate(struct _cci *cci)
+{
+	struct _rfid *rf = cci->i_priv;
+	unsigned int i;
+
+	for(i = 0; ; i++) {
+		memset(&rf->rf_l3p, 0, sizeof(rf->rf_l3p));
+		if ( _tcl_get_ats(cci, &rf->rf_tag, &rf->rf_l3p.tcl,
+					&rf->rf_rates) )
+			return 1;
+
+		if ( !(rf->rf_l3p.tcl.flags & TCL_HANDLE_F_RATE_FAIL) ||
+				i >= RFID_RATE_FALLBACKS )
+			return 0;
+
+		trace(cci->i_parent, " o RFID: falling back to lower rate\n");
+		if ( !_rfid_layer1_rf_power(cci, 0) ||
+				!_rfid_layer1_rf_power(cci, 1) ||
+				!_rfid_layer1_14443a_init(cci) ||
+				!_iso14443a_select_uid(cci, &rf->rf_tag) )
+			return 0;
+	}
+}
+
+/* No type A in the field, switch modulation and look for type B */
+static int do_select_b(struct _cci *cci)
+{
+	struct _rfid *rf = cci->i_priv;
+
+	memset(&rf->rf_tag, 0, sizeof(rf->rf_tag));
+
+	/* type A PICCs can't be heard after the switch */
+	rf->rf_gen++;
+	if ( !_rfid_layer1_14443b_init(cci) )
+		return 0;
+	if ( !_iso14443b_anticol(cci, 0, &rf->rf_tag) )
+		return 0;
+
+	dprintf("Found ISO-14443-B tag\n");
+	dhex_dump(rf->rf_tag.uid, rf->rf_tag.uid_len, 16);
+
+	if ( !_tcl_connect_b(cci, &rf->rf_tag, &rf->rf_l3p.tcl, &rf->rf_rates) )
+		return 0;
+
+	cci->i_status = CHIPCARD_ACTIVE;
+	rf->rf_l3 = (rfid_l3_t)_tcl_transact;
+	return 1;
+}
+
+/* Nothing doing in ISO 14443 either, try for a vicinity card */
+static int do_select_15693(struct _cci *cci)
+{
+	struct _rfid *rf = cci->i_priv;
+	struct _ccid *ccid = cci->i_parent;
+
+	memset(&rf->rf_tag, 0, sizeof(rf->rf_tag));
+
+	rf->rf_gen++;
+	if ( !_rfid_layer1_15693_init(cci) )
+		return 0;
+	if ( !_iso15693_select(cci, &rf->rf_tag) )
+		return 0;
+
+	dprintf("Found ISO-15693 tag: %u blocks of %u bytes\n",
+		rf->rf_tag.num_blks, rf->rf_tag.blk_size);
+
+	cci->i_status = CHIPCARD_ACTIVE;
+	rf->rf_l3 = (rfid_l3_t)_iso15693_transact;
+
+	/* nothing like an ATR, the UID will have to do */
+	memcpy(ccid->d_xfr->x_rxbuf, rf->rf_tag.uid, rf->rf_tag.uid_len);
+	ccid->d_xfr->x_rxlen = rf->rf_tag.uid_len;
+	return 1;
+}
+
 static int do_select(struct _cci *cci)
 {
 	struct _rfid *rf = cci->i_priv;
@@ -30,7 +118,15 @@ static int do_select(struct _cci *cci)
 	memset(&rf->rf_l3p, 0, sizeof(rf->rf_l3p));
 	rf->rf_l3 = NULL;
 
-	if ( !_iso14443a_anticol(cci, 0, &rf->rf_tag) ) {
+	if ( !(rf->rf_protos & CCI_RFID_PROTO_14443A) ||
+			!_iso14443a_anticol(cci, 0, &rf->rf_tag) ) {
+		/* each of these costs a modulation switch and timeouts */
+		if ( (rf->rf_protos & CCI_RFID_PROTO_14443B) &&
+				do_select_b(cci) )
+			return 1;
+		if ( (rf->rf_protos & CCI_RFID_PROTO_15693) &&
+				do_select_15693(cci) )
+			return 1;
 		cci->i_status = CHIPCARD_NOT_PRESENT;
 		return 0;
 	}
@@ -42,54 +138,217 @@ static int do_select(struct _cci *cci)
 	dhex_dump(rf->rf_tag.uid, rf->rf_tag.uid_len, 16);
 
 	if ( rf->rf_tag.tcl_capable ) {
-		ret = _tcl_get_ats(cci, &rf->rf_tag, &rf->rf_l3p.tcl);
-		if ( ret )
+		ret = tcl_activate(cci);
+		if ( ret ) {
 			rf->rf_l3 = (rfid_l3_t)_tcl_transact;
+			rf->rf_flags |= RFID_TAG_KNOWN;
+		}
 		return ret;
 	}
 
-#if 0
-	printf("Unsupported tag type\n");
-	if ( !_rfid_layer1_mfc_set_key(cci, MIFARE_CL_KEYA_DEFAULT) ) {
-		printf("set key failed\n");
-		return 0;
+	if ( rf->rf_tag.sak & ISO14443A_SAK_MIFARE ) {
+		/* no APDUs, use the cci_mfc_* calls. UID stands in for ATR */
+		dprintf("MIFARE Classic, %u sectors\n",
+			_mfc_num_sectors(&rf->rf_tag));
+		memcpy(cci->i_parent->d_xfr->x_rxbuf, rf->rf_tag.uid,
+			rf->rf_tag.uid_len);
+		cci->i_parent->d_xfr->x_rxlen = rf->rf_tag.uid_len;
+		return 1;
 	}
-	if ( !_rfid_layer1_mfc_auth(cci, RFID_CMD_MIFARE_AUTH1A,
-					*(uint32_t *)rf->rf_tag.uid, 0) ) {
-		printf("auth failed\n");
-		return 0;
+
+	if ( !(rf->rf_tag.sak & ISO14443A_SAK_T2T_MASK) ) {
+		/* Type 2 tag, use cci_t2t_read() */
+		dprintf("Type 2 tag\n");
+		memcpy(cci->i_parent->d_xfr->x_rxbuf, rf->rf_tag.uid,
+			rf->rf_tag.uid_len);
+		cci->i_parent->d_xfr->x_rxlen = rf->rf_tag.uid_len;
+		return 1;
 	}
-#endif
 
 	return 0;
 }
 
+/* Storage cards (MIFARE Classic, Ultralight, etc.) are presented by reader
+ * firmware with a PC/SC part 3 pseudo-ATR, historical bytes of the form:
+ * 80 4f <len> <RID: a0 00 00 03 06> <standard> <card name> ...
+ */
+static int storage_card(const uint8_t *ptr, size_t len)
+{
+	static const uint8_t pcsc_rid[] = {0xa0, 0x00, 0x00, 0x03, 0x06};
+	struct _atr atr;
+
+	if ( !_atr_parse(&atr, ptr, len) )
+		return 0;
+	if ( atr.a_hist_len < 3 + sizeof(pcsc_rid) )
+		return 0;
+	if ( atr.a_hist[0] != 0x80 || atr.a_hist[1] != 0x4f )
+		return 0;
+	return !memcmp(atr.a_hist + 3, pcsc_rid, sizeof(pcsc_rid));
+}
+
+static const uint8_t *native_power_on(struct _cci *cci, size_t *atr_len)
+{
+	struct _rfid *rf = cci->i_priv;
+	struct _cci *slot = rf->rf_native;
+	const uint8_t *atr;
+	size_t len;
+
+	atr = cci_power_on(slot, CHIPCARD_AUTO_VOLTAGE, &len);
+	if ( NULL == atr ) {
+		rf->rf_flags |= RFID_NATIVE_MISS;
+		return NULL;
+	}
+
+	if ( storage_card(atr, len) ) {
+		trace(cci->i_parent, " o RFID: storage card, using raw ASIC\n");
+		cci_power_off(slot);
+		return NULL;
+	}
+
+	trace(cci->i_parent, " o RFID: using reader firmware T=CL\n");
+	rf->rf_flags |= RFID_NATIVE_ACTIVE;
+	cci->i_status = CHIPCARD_ACTIVE;
+	if ( atr_len )
+		*atr_len = len;
+	return atr;
+}
+
+/* Wake up the PICC we had last time and select it by UID, skipping REQA
+ * and the anticollision rounds. Any PICC that turned up in the mean time
+ * stays quiet since the SELECT isn't for it.
+ */
+static int do_reselect(struct _cci *cci)
+{
+	struct _rfid *rf = cci->i_priv;
+
+	rf->rf_flags &= ~RFID_TAG_KNOWN;
+	rf->rf_l3 = NULL;
+	memset(&rf->rf_l3p, 0, sizeof(rf->rf_l3p));
+
+	if ( !_rfid_layer1_14443a_init(cci) )
+		return 0;
+	if ( !_iso14443a_select_uid(cci, &rf->rf_tag) )
+		return 0;
+	if ( !rf->rf_tag.tcl_capable )
+		return 0;
+	if ( !tcl_activate(cci) )
+		return 0;
+
+	trace(cci->i_parent, " o RFID: re-selected known PICC\n");
+	cci->i_status = CHIPCARD_ACTIVE;
+	rf->rf_l3 = (rfid_l3_t)_tcl_transact;
+	rf->rf_flags |= RFID_TAG_KNOWN;
+	return 1;
+}
+
 static const uint8_t *rfid_power_on(struct _cci *cci, unsigned int voltage,
 				size_t *atr_len)
 {
 	struct _ccid *ccid = cci->i_parent;
-	if ( !_rfid_layer1_rf_power(cci, 1) )
+	struct _rfid *rf = cci->i_priv;
+	const uint8_t *atr;
+
+	if ( (rf->rf_flags & (RFID_FIELD_ON|RFID_TAG_KNOWN)) ==
+			(RFID_FIELD_ON|RFID_TAG_KNOWN) ) {
+		if ( do_reselect(cci) )
+			goto out;
+		/* left halted, only a fresh field gets it answering REQA */
+		_rfid_layer1_rf_power(cci, 0);
+	}
+
+	rf->rf_flags &= ~(RFID_NATIVE_ACTIVE|RFID_NATIVE_MISS|RFID_TAG_KNOWN);
+	if ( rf->rf_flags & RFID_NATIVE_ENABLE ) {
+		/* firmware drives the ASIC behind our back */
+		rf->rf_flags &= ~RFID_FIELD_ON;
+		rf->rf_gen++;
+		atr = native_power_on(cci, atr_len);
+		if ( atr )
+			return atr;
+	}
+
+	if ( !(rf->rf_flags & RFID_FIELD_ON) &&
+			!_rfid_layer1_rf_power(cci, 1) )
 		return NULL;
 	if ( !_rfid_layer1_14443a_init(cci) )
 		return NULL;
 	if ( !do_select(cci) )
 		return NULL;
+
+	/* firmware didn't see a card we can talk T=CL to, so it can't do
+	 * the job on this reader
+	 */
+	if ( (rf->rf_flags & RFID_NATIVE_MISS) && rf->rf_tag.tcl_capable ) {
+		trace(ccid, " o RFID: reader firmware T=CL not working\n");
+		rf->rf_flags &= ~RFID_NATIVE_ENABLE;
+		rf->rf_native = NULL;
+	}
+
+out:
 	if ( atr_len )
 		*atr_len = ccid->d_xfr->x_rxlen;
 	return ccid->d_xfr->x_rxbuf;
 }
 
+/* Put the PICC to sleep but leave it in the field for do_reselect() */
+static int do_deselect(struct _cci *cci)
+{
+	struct _rfid *rf = cci->i_priv;
+
+	if ( !(rf->rf_flags & RFID_TAG_KNOWN) ||
+			cci->i_status != CHIPCARD_ACTIVE ||
+			rf->rf_tag.layer2 != RFID_LAYER2_ISO14443A )
+		return 0;
+
+	rf->rf_l3 = NULL;
+	if ( !_tcl_deselect(cci, &rf->rf_tag, &rf->rf_l3p.tcl) ) {
+		rf->rf_flags &= ~RFID_TAG_KNOWN;
+		return 0;
+	}
+
+	cci->i_status = CHIPCARD_PRESENT;
+	return 1;
+}
+
 static int rfid_power_off(struct _cci *cci)
 {
+	struct _rfid *rf = cci->i_priv;
+
+	if ( rf->rf_flags & RFID_NATIVE_ACTIVE ) {
+		cci->i_status = CHIPCARD_NOT_PRESENT;
+		rf->rf_flags &= ~RFID_NATIVE_ACTIVE;
+		return cci_power_off(rf->rf_native);
+	}
+
+	if ( (rf->rf_flags & RFID_PERSIST) && do_deselect(cci) )
+		return 1;
+
 	cci->i_status = CHIPCARD_NOT_PRESENT;
+	rf->rf_flags &= ~RFID_TAG_KNOWN;
 	return _rfid_layer1_rf_power(cci, 0);
 }
 
+/* Deselect and select again by UID, without dropping the field */
+static const uint8_t *rfid_reactivate(struct _cci *cci, size_t *atr_len)
+{
+	struct _rfid *rf = cci->i_priv;
+
+	if ( cci->i_status == CHIPCARD_ACTIVE && !do_deselect(cci) ) {
+		/* not one we can wake up again, start over */
+		_rfid_layer1_rf_power(cci, 0);
+		rf->rf_flags &= ~RFID_TAG_KNOWN;
+	}
+
+	return rfid_power_on(cci, CHIPCARD_AUTO_VOLTAGE, atr_len);
+}
+
 static int rfid_transact(struct _cci *cci, struct _xfr *xfr)
 {
 	struct _rfid *rf = cci->i_priv;
 	size_t rx_len;
 
+	if ( rf->rf_flags & RFID_NATIVE_ACTIVE )
+		return cci_transact(rf->rf_native, xfr);
+
 	if ( NULL == rf->rf_l3 ) {
 		printf("%s: called for unsupported protocol\n", __func__);
 		return 0;
@@ -105,6 +364,1055 @@ static int rfid_transact(struct _cci *cci, struct _xfr *xfr)
 	return 1;
 }
 
+/** Select between reader firmware and host driven ISO 14443-4.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t representing an RF field.
+ * @param enable non-zero to use reader firmware where possible.
+ *
+ * Some readers run the ISO 14443-4 protocol in firmware and accept APDUs
+ * directly, which is much faster than driving the RF ASIC from the host.
+ * This is used by default where available, storage cards such as MIFARE
+ * Classic still go via the ASIC. Disabling it forces the host driven path
+ * for all cards which is useful for debugging. Takes effect on the next
+ * power on.
+ *
+ * @return zero if the reader has no firmware path.
+ */
+int cci_rfid_native(cci_t cci, int enable)
+{
+	struct _rfid *rf;
+
+	if ( cci->i_ops != &_rfid_ops )
+		return 0;
+
+	rf = cci->i_priv;
+	if ( NULL == rf->rf_native )
+		return 0;
+
+	if ( enable )
+		rf->rf_flags |= RFID_NATIVE_ENABLE;
+	else
+		rf->rf_flags &= ~RFID_NATIVE_ENABLE;
+	return 1;
+}
+
+/** Keep the RF field up between sessions.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t representing an RF field.
+ * @param enable non-zero to keep the field on at power off.
+ *
+ * With this set, \ref cci_power_off sends an ISO 14443-4 PICC to sleep
+ * with DESELECT and leaves the field and the ASIC set up. The slot status
+ * becomes CHIPCARD_PRESENT. The next \ref cci_power_on wakes the same
+ * PICC with WUPA and selects it by UID straight away, without REQA or
+ * anticollision. It falls back to a full power on if the PICC has gone.
+ * \ref cci_reactivate does the same for an active card either way.
+ *
+ * @return zero if cci is not an RF field.
+ */
+int cci_rfid_persist(cci_t cci, int enable)
+{
+	struct _rfid *rf;
+
+	if ( cci->i_ops != &_rfid_ops ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	rf = cci->i_priv;
+	if ( enable ) {
+		rf->rf_flags |= RFID_PERSIST;
+		return 1;
+	}
+
+	rf->rf_flags &= ~RFID_PERSIST;
+	if ( cci->i_status == CHIPCARD_PRESENT &&
+			(rf->rf_flags & RFID_TAG_KNOWN) ) {
+		cci->i_status = CHIPCARD_NOT_PRESENT;
+		rf->rf_flags &= ~RFID_TAG_KNOWN;
+		return _rfid_layer1_rf_power(cci, 0);
+	}
+	return 1;
+}
+
+/* Take over the field for layer 2 commands issued directly by the
+ * application. Whatever card was active is forgotten, cycling the field
+ * makes sure it is back in idle state and answers again.
+ */
+static struct _rfid *field_take(struct _cci *cci, int cycle)
+{
+	struct _rfid *rf;
+
+	if ( cci->i_ops != &_rfid_ops ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return NULL;
+	}
+
+	rf = cci->i_priv;
+	if ( rf->rf_flags & RFID_NATIVE_ACTIVE ) {
+		rf->rf_flags &= ~RFID_NATIVE_ACTIVE;
+		cci_power_off(rf->rf_native);
+	}
+
+	cci->i_status = CHIPCARD_NOT_PRESENT;
+	rf->rf_l3 = NULL;
+	memset(&rf->rf_tag, 0, sizeof(rf->rf_tag));
+	memset(&rf->rf_l3p, 0, sizeof(rf->rf_l3p));
+	rf->rf_flags &= ~RFID_TAG_KNOWN;
+	rf->rf_gen++;
+
+	if ( (cycle && !_rfid_layer1_rf_power(cci, 0)) ||
+			!_rfid_layer1_rf_power(cci, 1) ) {
+		cci->i_parent->d_error = CCID_ERROR_CARD_IO;
+		return NULL;
+	}
+
+	return rf;
+}
+
+/* Get the field ready for ISO 15693 commands */
+static struct _rfid *field_15693(struct _cci *cci)
+{
+	struct _rfid *rf;
+
+	if ( cci->i_ops == &_rfid_ops && cci->i_status == CHIPCARD_ACTIVE ) {
+		rf = cci->i_priv;
+		if ( rf->rf_tag.layer2 == RFID_LAYER2_ISO15693 )
+			return rf;
+	}
+
+	rf = field_take(cci, 0);
+	if ( NULL == rf )
+		return NULL;
+
+	if ( !_rfid_layer1_15693_init(cci) ) {
+		cci->i_parent->d_error = CCID_ERROR_CARD_IO;
+		return NULL;
+	}
+
+	return rf;
+}
+
+/** Enumerate ISO 14443-A tags in the field.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t representing an RF field.
+ * @param tags Array to fill in with details of the tags found.
+ * @param max Number of entries in tags.
+ *
+ * The field is cycled and then each tag is resolved by anticollision in
+ * turn and halted so that it stays out of the way of the next. Any card
+ * previously powered on is deactivated. Use \ref cci_rfid_select to talk
+ * to one of the tags afterwards.
+ *
+ * @return number of tags found, zero if none or on error.
+ */
+unsigned int cci_rfid_inventory(cci_t cci, struct cci_rfid_tag *tags,
+				unsigned int max)
+{
+	struct rfid_tag tag[RFID_INVENTORY_BATCH];
+	unsigned int i, n, total = 0;
+
+	if ( NULL == field_take(cci, 1) )
+		return 0;
+
+	if ( !_rfid_layer1_14443a_init(cci) ) {
+		cci->i_parent->d_error = CCID_ERROR_CARD_IO;
+		return 0;
+	}
+
+	/* halted tags stay halted, so go in batches */
+	while( total < max ) {
+		n = max - total;
+		if ( n > RFID_INVENTORY_BATCH )
+			n = RFID_INVENTORY_BATCH;
+
+		n = _iso14443a_inventory(cci, tag, n);
+		for(i = 0; i < n; i++, total++) {
+			tags[total].uid_len = tag[i].uid_len;
+			memcpy(tags[total].uid, tag[i].uid, tag[i].uid_len);
+			tags[total].sak = tag[i].sak;
+			memcpy(tags[total].atqa, tag[i].atqa,
+				sizeof(tags[total].atqa));
+		}
+
+		if ( n < RFID_INVENTORY_BATCH )
+			break;
+	}
+
+	return total;
+}
+
+/** Select a tag found by \ref cci_rfid_inventory.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t representing an RF field.
+ * @param tag Tag to select.
+ *
+ * Wakes up halted tags with WUPA and selects the one with the given UID
+ * without going through anticollision again. ISO 14443-4 tags are then
+ * activated so that \ref cci_transact can be used.
+ *
+ * @return zero on failure.
+ */
+int cci_rfid_select(cci_t cci, const struct cci_rfid_tag *tag)
+{
+	struct _rfid *rf;
+
+	if ( tag->uid_len > sizeof(tag->uid) ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	rf = field_take(cci, 0);
+	if ( NULL == rf )
+		return 0;
+
+	if ( !_rfid_layer1_14443a_init(cci) ) {
+		cci->i_parent->d_error = CCID_ERROR_CARD_IO;
+		return 0;
+	}
+
+	rf->rf_tag.uid_len = tag->uid_len;
+	memcpy(rf->rf_tag.uid, tag->uid, tag->uid_len);
+	memcpy(rf->rf_tag.atqa, tag->atqa, sizeof(rf->rf_tag.atqa));
+	if ( !_iso14443a_select_uid(cci, &rf->rf_tag) ) {
+		cci->i_parent->d_error = CCID_ERROR_NO_CARD;
+		return 0;
+	}
+
+	cci->i_status = CHIPCARD_ACTIVE;
+	if ( !rf->rf_tag.tcl_capable )
+		return 1;
+
+	if ( !tcl_activate(cci) ) {
+		cci->i_parent->d_error = CCID_ERROR_CARD_PROTO;
+		return 0;
+	}
+
+	rf->rf_l3 = (rfid_l3_t)_tcl_transact;
+	rf->rf_flags |= RFID_TAG_KNOWN;
+	return 1;
+}
+
+/* Reader rates for whatever the field itself has selected */
+static int field_rates(struct _cci *cci)
+{
+	struct _rfid *rf = cci->i_priv;
+
+	if ( rf->rf_l3 == (rfid_l3_t)_tcl_transact )
+		return _tcl_set_rates(cci, &rf->rf_l3p.tcl);
+	return _rfid_layer1_set_speed(cci, RFID_14443A_SPEED_106K);
+}
+
+/* Still active, unless the field went away or was used for something
+ * else since
+ */
+static struct _rfid_cid *cid_live(struct _cci *cci)
+{
+	struct _rfid_cid *c = cci->i_priv;
+	struct _rfid *rf = c->c_field->i_priv;
+
+	if ( cci->i_status == CHIPCARD_ACTIVE && c->c_gen != rf->rf_gen ) {
+		trace(cci->i_parent, " o RFID: CID %u lost\n", c->c_tcl.cid);
+		cci->i_status = CHIPCARD_NOT_PRESENT;
+	}
+
+	return (cci->i_status == CHIPCARD_ACTIVE) ? c : NULL;
+}
+
+static int cid_deselect(struct _rfid_cid *c)
+{
+	int ret;
+
+	c->c_cci.i_status = CHIPCARD_NOT_PRESENT;
+	if ( !_tcl_set_rates(c->c_field, &c->c_tcl) )
+		return 0;
+	ret = _tcl_deselect(c->c_field, &c->c_tag, &c->c_tcl);
+	field_rates(c->c_field);
+	return ret;
+}
+
+/* Select by UID and RATS with our CID. PICCs already in layer 4 ignore
+ * WUPA, so the others sharing the field are left alone. There's no going
+ * back to a fresh field if the bit rates don't work out, the rate cache
+ * makes sure the next go is slower.
+ */
+static const uint8_t *cid_power_on(struct _cci *cci, unsigned int voltage,
+					size_t *atr_len)
+{
+	struct _rfid_cid *c = cci->i_priv;
+	struct _cci *field = c->c_field;
+	struct _rfid *rf = field->i_priv;
+	struct _ccid *ccid = cci->i_parent;
+	unsigned int cid = c->c_tcl.cid;
+
+	if ( cid_live(cci) )
+		cid_deselect(c);
+
+	if ( rf->rf_flags & RFID_NATIVE_ACTIVE ) {
+		ccid->d_error = CCID_ERROR_IN_VALUE;
+		return NULL;
+	}
+
+	c->c_open = 1;
+	c->c_gen = rf->rf_gen;
+	memset(&c->c_tcl, 0, sizeof(c->c_tcl));
+	c->c_tcl.cid = cid;
+
+	if ( (!(rf->rf_flags & RFID_FIELD_ON) &&
+			!_rfid_layer1_rf_power(field, 1)) ||
+			!_rfid_layer1_14443a_init(field) ) {
+		ccid->d_error = CCID_ERROR_CARD_IO;
+		return NULL;
+	}
+
+	if ( !_iso14443a_select_uid(field, &c->c_tag) ) {
+		ccid->d_error = CCID_ERROR_NO_CARD;
+		goto err;
+	}
+
+	if ( !c->c_tag.tcl_capable ||
+			!_tcl_get_ats(field, &c->c_tag, &c->c_tcl,
+					&rf->rf_rates) ) {
+		ccid->d_error = CCID_ERROR_CARD_PROTO;
+		goto err;
+	}
+
+	field_rates(field);
+
+	trace(ccid, " o RFID: PICC active as CID %u\n", cid);
+	cci->i_status = CHIPCARD_ACTIVE;
+	if ( atr_len )
+		*atr_len = ccid->d_xfr->x_rxlen;
+	return ccid->d_xfr->x_rxbuf;
+err:
+	field_rates(field);
+	return NULL;
+}
+
+static int cid_power_off(struct _cci *cci)
+{
+	struct _rfid_cid *c = cci->i_priv;
+	int ret = 1;
+
+	if ( cid_live(cci) )
+		ret = cid_deselect(c);
+
+	c->c_open = 0;
+	return ret;
+}
+
+static const uint8_t *cid_reactivate(struct _cci *cci, size_t *atr_len)
+{
+	return cid_power_on(cci, CHIPCARD_AUTO_VOLTAGE, atr_len);
+}
+
+static int cid_transact(struct _cci *cci, struct _xfr *xfr)
+{
+	struct _rfid_cid *c;
+	size_t rx_len;
+	int ret;
+
+	c = cid_live(cci);
+	if ( NULL == c ) {
+		cci->i_parent->d_error = CCID_ERROR_NO_CARD;
+		return 0;
+	}
+
+	if ( !_tcl_set_rates(c->c_field, &c->c_tcl) )
+		return 0;
+
+	rx_len = xfr->x_rxmax;
+	ret = _tcl_transact(c->c_field, &c->c_tag, &c->c_tcl,
+				xfr->x_txbuf, xfr->x_txlen,
+				xfr->x_rxbuf, &rx_len);
+	field_rates(c->c_field);
+	if ( !ret )
+		return 0;
+
+	xfr->x_rxlen = rx_len;
+	return 1;
+}
+
+static const struct _cci_ops cid_ops = {
+	.power_on = cid_power_on,
+	.power_off = cid_power_off,
+	.transact = cid_transact,
+	.reactivate = cid_reactivate,
+};
+
+/** Open an ISO 14443-4 PICC alongside others in the field.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t representing an RF field.
+ * @param tag Tag found by \ref cci_rfid_inventory.
+ *
+ * Gives the PICC a CID of its own and returns a separate \ref cci_t for
+ * it. \ref cci_power_on selects it by UID and activates it with that CID,
+ * returning the ATS. Several PICCs opened like this can then be used in
+ * turn with \ref cci_transact, each exchange is addressed by CID so none
+ * of them need to be halted or selected again in between. The card found
+ * by \ref cci_power_on on the field itself keeps working too.
+ *
+ * \ref cci_power_off sends the PICC DESELECT and gives up the CID, after
+ * which the returned \ref cci_t must not be used again. PICCs are lost if
+ * the field is powered off or used for anything other than ISO 14443-A,
+ * in which case the slot status goes to CHIPCARD_NOT_PRESENT and another
+ * \ref cci_power_on is needed. PICCs without CID support can't be used
+ * this way.
+ *
+ * @return NULL on failure, \ref cci_t for the PICC otherwise.
+ */
+cci_t cci_rfid_open(cci_t cci, const struct cci_rfid_tag *tag)
+{
+	struct _rfid_cid *c, *slot = NULL;
+	struct _rfid *rf;
+	unsigned int i;
+
+	if ( cci->i_ops != &_rfid_ops || tag->uid_len > sizeof(tag->uid) ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return NULL;
+	}
+
+	rf = cci->i_priv;
+	for(i = 0; i < RFID_MAX_CID; i++) {
+		c = &rf->rf_cid[i];
+		if ( !c->c_open ) {
+			if ( NULL == slot )
+				slot = c;
+			continue;
+		}
+		if ( c->c_tag.uid_len == tag->uid_len &&
+				!memcmp(c->c_tag.uid, tag->uid, tag->uid_len) )
+			return &c->c_cci;
+	}
+
+	if ( NULL == slot ) {
+		trace(cci->i_parent, " o RFID: out of CIDs\n");
+		cci->i_parent->d_error = CCID_ERROR_NO_MEM;
+		return NULL;
+	}
+
+	memset(slot, 0, sizeof(*slot));
+	slot->c_cci.i_parent = cci->i_parent;
+	slot->c_cci.i_idx = cci->i_idx;
+	slot->c_cci.i_status = CHIPCARD_PRESENT;
+	slot->c_cci.i_ops = &cid_ops;
+	slot->c_cci.i_priv = slot;
+	_cci_channel_reset(&slot->c_cci);
+
+	slot->c_field = cci;
+	slot->c_open = 1;
+	slot->c_tcl.cid = (slot - rf->rf_cid) + 1;
+	slot->c_tag.uid_len = tag->uid_len;
+	memcpy(slot->c_tag.uid, tag->uid, tag->uid_len);
+	memcpy(slot->c_tag.atqa, tag->atqa, sizeof(slot->c_tag.atqa));
+	return &slot->c_cci;
+}
+
+/* Selected tag must be a MIFARE Classic */
+static struct _rfid *mfc_tag(struct _cci *cci)
+{
+	struct _rfid *rf;
+
+	if ( cci->i_ops != &_rfid_ops ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return NULL;
+	}
+
+	rf = cci->i_priv;
+	if ( cci->i_status != CHIPCARD_ACTIVE ||
+			(rf->rf_flags & RFID_NATIVE_ACTIVE) ||
+			rf->rf_tag.layer2 != RFID_LAYER2_ISO14443A ||
+			rf->rf_tag.tcl_capable ||
+			!(rf->rf_tag.sak & ISO14443A_SAK_MIFARE) ) {
+		cci->i_parent->d_error = CCID_ERROR_NO_CARD;
+		return NULL;
+	}
+
+	return rf;
+}
+
+/** Set MIFARE Classic keys to try.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t representing an RF field.
+ * @param keys Keys, CCI_MFC_KEY_LEN bytes each.
+ * @param num Number of keys, up to CCI_MFC_MAX_KEYS.
+ *
+ * Each sector is authenticated by trying these keys in order, as both key
+ * A and key B. The keys are kept in memory and loaded in to the reader
+ * for each attempt. If \ref cci_mfc_key_store has been enabled they are
+ * written to the reader's key store instead, only those which changed
+ * since last time. The key which worked for a sector is remembered and
+ * tried first next time.
+ *
+ * @return zero on failure.
+ */
+int cci_mfc_set_keys(cci_t cci, const uint8_t *keys, unsigned int num)
+{
+	struct mfc_keys *k;
+	struct _rfid *rf;
+	unsigned int i;
+
+	if ( cci->i_ops != &_rfid_ops || num > CCI_MFC_MAX_KEYS ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	rf = cci->i_priv;
+	k = &rf->rf_mfc_keys;
+	for(i = 0; i < num; i++, keys += MIFARE_CL_KEY_LEN) {
+		if ( (k->in_ee & (1U << i)) &&
+				!memcmp(k->key[i], keys, MIFARE_CL_KEY_LEN) )
+			continue;
+
+		memcpy(k->key[i], keys, MIFARE_CL_KEY_LEN);
+		if ( (rf->rf_flags & RFID_MFC_STORE) &&
+				_rfid_layer1_mfc_store_key(cci, i, keys) )
+			k->in_ee |= (1U << i);
+		else
+			k->in_ee &= ~(1U << i);
+	}
+
+	k->num = num;
+	return 1;
+}
+
+/** Keep MIFARE Classic keys in the reader's key store.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t representing an RF field.
+ * @param enable non-zero to use the key store.
+ *
+ * Keys passed to \ref cci_mfc_set_keys from then on are written to the
+ * reader's EEPROM, which saves uploading a key for each authentication
+ * when the same keys are used for many cards. The EEPROM only takes so
+ * many writes and the keys stay in the reader after the program exits,
+ * so this is off by default. Disabling it goes back to loading keys from
+ * memory but doesn't wipe what is already stored.
+ *
+ * @return zero if cci is not an RF field.
+ */
+int cci_mfc_key_store(cci_t cci, int enable)
+{
+	struct _rfid *rf;
+
+	if ( cci->i_ops != &_rfid_ops ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	rf = cci->i_priv;
+	if ( enable ) {
+		rf->rf_flags |= RFID_MFC_STORE;
+	}else{
+		rf->rf_flags &= ~RFID_MFC_STORE;
+		rf->rf_mfc_keys.in_ee = 0;
+	}
+	return 1;
+}
+
+/** Read a MIFARE Classic sector.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t with an active MIFARE Classic card.
+ * @param sector Sector number.
+ * @param buf Buffer for the sector contents.
+ * @param len Size of buf, on return number of bytes read.
+ *
+ * Reads every block including the sector trailer, in which the card hides
+ * the keys. Sectors 32 and up on 4K cards have 16 blocks, others 4.
+ *
+ * @return zero on failure.
+ */
+int cci_mfc_read_sector(cci_t cci, unsigned int sector,
+			uint8_t *buf, size_t *len)
+{
+	struct _rfid *rf;
+	size_t sz;
+
+	rf = mfc_tag(cci);
+	if ( NULL == rf )
+		return 0;
+
+	sz = _mfc_sector_size(sector);
+	if ( sector >= _mfc_num_sectors(&rf->rf_tag) || sz > *len ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	if ( !_mfc_read_sector(cci, &rf->rf_tag, &rf->rf_l3p.mfc,
+				&rf->rf_mfc_keys, sector, buf) ) {
+		cci->i_parent->d_error = (rf->rf_l3p.mfc.key[sector]) ?
+					CCID_ERROR_CARD_IO : CCID_ERROR_AUTH;
+		return 0;
+	}
+
+	*len = sz;
+	return 1;
+}
+
+/** Write a MIFARE Classic sector.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t with an active MIFARE Classic card.
+ * @param sector Sector number.
+ * @param buf Sector contents, laid out as from \ref cci_mfc_read_sector.
+ * @param len Length of buf.
+ *
+ * Writes the data blocks. The sector trailer and the manufacturer block
+ * are left alone, so an image read from one card can be written back.
+ *
+ * @return zero on failure.
+ */
+int cci_mfc_write_sector(cci_t cci, unsigned int sector,
+			const uint8_t *buf, size_t len)
+{
+	struct _rfid *rf;
+
+	rf = mfc_tag(cci);
+	if ( NULL == rf )
+		return 0;
+
+	if ( sector >= _mfc_num_sectors(&rf->rf_tag) ||
+			len < _mfc_sector_size(sector) ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	if ( !_mfc_write_sector(cci, &rf->rf_tag, &rf->rf_l3p.mfc,
+				&rf->rf_mfc_keys, sector, buf) ) {
+		cci->i_parent->d_error = (rf->rf_l3p.mfc.key[sector]) ?
+					CCID_ERROR_CARD_IO : CCID_ERROR_AUTH;
+		return 0;
+	}
+
+	return 1;
+}
+
+/** Read a whole MIFARE Classic card.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t with an active MIFARE Classic card.
+ * @param buf Buffer for the card image, 1024 bytes will do for a 1K card
+ *            and 4096 for a 4K.
+ * @param len Size of buf, on return number of bytes read.
+ *
+ * Goes through the sectors in order, authenticating once for each. If a
+ * sector can't be read, len says how far it got.
+ *
+ * @return zero on failure.
+ */
+int cci_mfc_read_card(cci_t cci, uint8_t *buf, size_t *len)
+{
+	unsigned int sector, num;
+	size_t ofs = 0, sz;
+	struct _rfid *rf;
+
+	rf = mfc_tag(cci);
+	if ( NULL == rf )
+		return 0;
+
+	num = _mfc_num_sectors(&rf->rf_tag);
+	for(sector = 0; sector < num; sector++, ofs += sz) {
+		sz = *len - ofs;
+		if ( !cci_mfc_read_sector(cci, sector, buf + ofs, &sz) ) {
+			*len = ofs;
+			return 0;
+		}
+	}
+
+	*len = ofs;
+	return 1;
+}
+
+/** Write a whole MIFARE Classic card.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t with an active MIFARE Classic card.
+ * @param buf Card image, laid out as from \ref cci_mfc_read_card.
+ * @param len Length of buf.
+ *
+ * Writes the data blocks of each sector, see \ref cci_mfc_write_sector.
+ *
+ * @return zero on failure.
+ */
+int cci_mfc_write_card(cci_t cci, const uint8_t *buf, size_t len)
+{
+	unsigned int sector, num;
+	size_t ofs = 0;
+	struct _rfid *rf;
+
+	rf = mfc_tag(cci);
+	if ( NULL == rf )
+		return 0;
+
+	num = _mfc_num_sectors(&rf->rf_tag);
+	for(sector = 0; sector < num; sector++) {
+		if ( !cci_mfc_write_sector(cci, sector, buf + ofs, len - ofs) )
+			return 0;
+		ofs += _mfc_sector_size(sector);
+	}
+
+	return 1;
+}
+
+/* Selected tag must be an NFC Forum Type 2 tag */
+static struct _rfid *t2t_tag(struct _cci *cci)
+{
+	struct _rfid *rf;
+
+	if ( cci->i_ops != &_rfid_ops ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return NULL;
+	}
+
+	rf = cci->i_priv;
+	if ( cci->i_status != CHIPCARD_ACTIVE ||
+			(rf->rf_flags & RFID_NATIVE_ACTIVE) ||
+			rf->rf_tag.layer2 != RFID_LAYER2_ISO14443A ||
+			(rf->rf_tag.sak & ISO14443A_SAK_T2T_MASK) ) {
+		cci->i_parent->d_error = CCID_ERROR_NO_CARD;
+		return NULL;
+	}
+
+	if ( !(rf->rf_l3p.t2t.flags & T2T_HANDLE_F_PROBED) &&
+			!_t2t_probe(cci, &rf->rf_tag, &rf->rf_l3p.t2t) ) {
+		cci->i_parent->d_error = CCID_ERROR_CARD_IO;
+		return NULL;
+	}
+
+	return rf;
+}
+
+/** Number of pages on a Type 2 tag.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t with an active Type 2 tag (Ultralight, NTAG).
+ *
+ * @return number of 4 byte pages, zero on error.
+ */
+unsigned int cci_t2t_pages(cci_t cci)
+{
+	struct _rfid *rf;
+
+	rf = t2t_tag(cci);
+	if ( NULL == rf )
+		return 0;
+
+	return rf->rf_l3p.t2t.pages;
+}
+
+/** Read pages from a Type 2 tag.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t with an active Type 2 tag (Ultralight, NTAG).
+ * @param page First page to read.
+ * @param num Number of pages to read, zero for the rest of the tag.
+ * @param buf Buffer for the page data.
+ * @param len Size of buf, on return number of bytes read.
+ *
+ * Tags which support it are read with FAST_READ, as many pages per frame
+ * as the reader can receive. Otherwise every page of each 4 page READ is
+ * used. Either way a whole NTAG216 takes a handful of frames.
+ *
+ * @return zero on failure.
+ */
+int cci_t2t_read(cci_t cci, unsigned int page, unsigned int num,
+			uint8_t *buf, size_t *len)
+{
+	struct _rfid *rf;
+
+	rf = t2t_tag(cci);
+	if ( NULL == rf )
+		return 0;
+
+	if ( page > rf->rf_l3p.t2t.pages ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+	if ( !num )
+		num = rf->rf_l3p.t2t.pages - page;
+
+	if ( page + num > rf->rf_l3p.t2t.pages ||
+			(size_t)num * T2T_PAGE_SIZE > *len ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	if ( !_t2t_read(cci, &rf->rf_tag, &rf->rf_l3p.t2t, page, num, buf) ) {
+		cci->i_parent->d_error = CCID_ERROR_CARD_IO;
+		return 0;
+	}
+
+	*len = (size_t)num * T2T_PAGE_SIZE;
+	return 1;
+}
+
+/** Inventory ISO 15693 vicinity cards in the field.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t representing an RF field.
+ * @param uids Buffer for UIDs, CCI_ISO15693_UID_LEN bytes each.
+ * @param max Maximum number of UIDs to return.
+ *
+ * Runs 16 slot inventory rounds, resolving collisions by extending the
+ * UID mask 4 bits at a time, until every VICC in the field has answered
+ * on its own. UIDs are returned least significant byte first, as sent
+ * over the air. Switches the field to ISO 15693 modulation, so any
+ * other type of card previously powered on is lost.
+ *
+ * @return number of VICCs found, zero if none or on error.
+ */
+unsigned int cci_iso15693_inventory(cci_t cci, uint8_t *uids,
+					unsigned int max)
+{
+	if ( NULL == field_15693(cci) )
+		return 0;
+	return _iso15693_inventory(cci, uids, max);
+}
+
+/** Read blocks from an ISO 15693 vicinity card.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t representing an RF field.
+ * @param uid UID as returned from \ref cci_iso15693_inventory, or NULL
+ *            for the card found by \ref cci_power_on.
+ * @param first Number of first block to read.
+ * @param num Number of blocks to read.
+ * @param buf Buffer for the block data.
+ * @param len Size of buf, on return number of bytes read.
+ *
+ * Uses READ MULTIPLE BLOCKS with as many blocks per frame as the reader
+ * can receive in one go. Block size is taken from GET SYSTEM INFORMATION.
+ *
+ * @return zero on failure.
+ */
+int cci_iso15693_read_blocks(cci_t cci, const uint8_t *uid,
+				unsigned int first, unsigned int num,
+				uint8_t *buf, size_t *len)
+{
+	struct _ccid *ccid = cci->i_parent;
+	struct _rfid *rf;
+	uint8_t blk_size;
+	uint16_t num_blks;
+
+	rf = field_15693(cci);
+	if ( NULL == rf )
+		return 0;
+
+	if ( NULL == uid ) {
+		if ( rf->rf_tag.layer2 != RFID_LAYER2_ISO15693 ) {
+			ccid->d_error = CCID_ERROR_NO_CARD;
+			return 0;
+		}
+		uid = rf->rf_tag.uid;
+		blk_size = rf->rf_tag.blk_size;
+		num_blks = rf->rf_tag.num_blks;
+	}else if ( !_iso15693_sysinfo(cci, uid, &blk_size, &num_blks) ) {
+		ccid->d_error = CCID_ERROR_CARD_IO;
+		return 0;
+	}
+
+	if ( !blk_size || (num_blks && first + num > num_blks) ||
+			(size_t)num * blk_size > *len ) {
+		ccid->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	if ( !_iso15693_read_multiple(cci, uid, first, num, blk_size, buf) ) {
+		ccid->d_error = CCID_ERROR_CARD_IO;
+		return 0;
+	}
+
+	*len = (size_t)num * blk_size;
+	return 1;
+}
+
+/* silence from the field looks the same as a dead reader, only the
+ * transport leaves an error behind
+ */
+static int transport_error(struct _ccid *ccid)
+{
+	return (ccid->d_error == CCID_ERROR_DEVICE_REMOVED ||
+		ccid->d_error == CCID_ERROR_BUS ||
+		ccid->d_error == CCID_ERROR_NO_MEM);
+}
+
+/* Wait for an active card to stop answering without ending its session.
+ * T=CL cards are pinged with R(NAK) and the firmware slot reports removal
+ * itself, other cards have no such probe and get reset as before.
+ */
+static int active_wait(struct _cci *cci)
+{
+	struct _rfid *rf = cci->i_priv;
+	struct _ccid *ccid = cci->i_parent;
+	unsigned int miss = 0;
+
+	if ( rf->rf_flags & RFID_NATIVE_ACTIVE )
+		return cci_wait_for_removal(rf->rf_native);
+
+	if ( rf->rf_l3 != (rfid_l3_t)_tcl_transact )
+		return 1;
+
+	for(;;) {
+		ccid->d_error = 0;
+		if ( _tcl_ping(cci, &rf->rf_tag, &rf->rf_l3p.tcl) ) {
+			miss = 0;
+		}else if ( transport_error(ccid) ) {
+			trace(ccid, " o RFID: transport error while polling\n");
+			return 0;
+		}else if ( ++miss >= RFID_POLL_MISSES ) {
+			return 1;
+		}
+		usleep(rf->rf_poll_usec);
+	}
+}
+
+/* Keep the field up and probe with single short frames, much quicker
+ * than the full power on sequence. Only ISO 14443-A cards are noticed.
+ */
+static int rfid_wait(struct _cci *cci, int present)
+{
+	struct _rfid *rf = cci->i_priv;
+	struct _ccid *ccid = cci->i_parent;
+	unsigned int miss = 0;
+
+	if ( cci->i_status == CHIPCARD_ACTIVE ) {
+		if ( present )
+			return 1;
+		if ( !active_wait(cci) )
+			return 0;
+	}
+
+	/* an active card won't answer, cycling the field resets it */
+	if ( NULL == field_take(cci, 1) )
+		return 0;
+
+	if ( !_rfid_layer1_14443a_init(cci) ) {
+		ccid->d_error = CCID_ERROR_CARD_IO;
+		return 0;
+	}
+
+	for(;;) {
+		ccid->d_error = 0;
+		if ( _iso14443a_probe(cci, !present) ) {
+			if ( present )
+				break;
+			miss = 0;
+		}else if ( transport_error(ccid) ) {
+			trace(ccid, " o RFID: transport error while polling\n");
+			return 0;
+		}else if ( !present && ++miss >= RFID_POLL_MISSES ) {
+			break;
+		}
+		usleep(rf->rf_poll_usec);
+	}
+
+	trace(ccid, " o RFID: card %s\n",
+		(present) ? "arrived" : "removed");
+	cci->i_status = (present) ? CHIPCARD_PRESENT : CHIPCARD_NOT_PRESENT;
+	return 1;
+}
+
+/** Set RF presence polling interval.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t representing an RF field.
+ * @param msec Milliseconds between probes.
+ *
+ * Sets how often \ref cci_wait_for_card and \ref cci_wait_for_removal
+ * look for a card, which bounds how long it takes to notice one. Each
+ * probe is one short frame. The default is 50ms.
+ *
+ * @return zero if cci is not an RF field.
+ */
+int cci_rfid_poll_interval(cci_t cci, unsigned int msec)
+{
+	struct _rfid *rf;
+
+	if ( cci->i_ops != &_rfid_ops ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	rf = cci->i_priv;
+	rf->rf_poll_usec = msec * 1000;
+	return 1;
+}
+
+/** Choose which card types to look for.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t representing an RF field.
+ * @param mask CCI_RFID_PROTO_* flags.
+ *
+ * \ref cci_power_on tries each card type in the mask in turn, ISO
+ * 14443-A first, then B, then ISO 15693. Every type tried with no card
+ * of it about costs a switch of modulation and a timeout, so only ISO
+ * 14443-A is looked for by default. Takes effect on the next power on.
+ *
+ * @return zero if cci is not an RF field or the mask is empty.
+ */
+int cci_rfid_protocols(cci_t cci, unsigned int mask)
+{
+	struct _rfid *rf;
+
+	if ( cci->i_ops != &_rfid_ops ||
+			!(mask & CCI_RFID_PROTO_ALL) ||
+			(mask & ~CCI_RFID_PROTO_ALL) ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	rf = cci->i_priv;
+	rf->rf_protos = mask;
+	return 1;
+}
+
+/** Retrieve RF link statistics.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t representing an RF field.
+ * @param st Where to put the statistics, may be NULL.
+ * @param reset non-zero to zero the counters afterwards.
+ *
+ * Counts every frame exchanged on the field, including those for PICCs
+ * opened with \ref cci_rfid_open, by outcome, along with round trip
+ * times measured at the host. A poorly placed antenna shows up as a high
+ * noise figure and lots of CRC and framing errors. Cards which get no
+ * further than answering the odd frame show up as timeouts, so does
+ * polling with no card about. Generates no traffic accross physical bus
+ * to CCID.
+ *
+ * The same figures steer retries: an exchange which is being garbled
+ * gets extra goes and PICCs are put on slower bit rates, one which has
+ * gone quiet is given up on quickly.
+ *
+ * @return zero if cci is not an RF field.
+ */
+int cci_rfid_stats(cci_t cci, struct cci_rfid_stats *st, int reset)
+{
+	struct _rfid *rf;
+
+	if ( cci->i_ops != &_rfid_ops ) {
+		cci->i_parent->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	rf = cci->i_priv;
+	rf->rf_stats.noise = (rf->rf_noise * 1000) / RFID_NOISE_ONE;
+	if ( st )
+		memcpy(st, &rf->rf_stats, sizeof(*st));
+	if ( reset )
+		memset(&rf->rf_stats, 0, sizeof(rf->rf_stats));
+	return 1;
+}
+
 static void rfid_dtor(struct _cci *cci)
 {
 	struct _rfid *rf = cci->i_priv;
@@ -118,5 +1426,7 @@ _private const struct _cci_ops _rfid_ops = {
 	.power_on = rfid_power_on,
 	.power_off = rfid_power_off,
 	.transact = rfid_transact,
+	.reactivate = rfid_reactivate,
+	.wait = rfid_wait,
 	.dtor = rfid_dtor,
 };
@@ -0,0 +1,198 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2008 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Streaming READ BINARY of transparent EFs. Chunks are sized to the
+ * largest response the card and the CCID will carry and the request for
+ * the next chunk is put on the wire before the current one is handed to
+ * the caller, so the card is busy while the host consumes data.
+*/
+
+#include <ccid.h>
+
+#include "ccid-internal.h"
+
+#define STREAM_MAX_OFS		0x7fffU
+#define STREAM_SHORT_LE		0x100U
+#define STREAM_EXT_LE		0x10000U
+#define STREAM_CMD_LEN		7U
+
+static size_t stream_chunk(struct _cci *cci, unsigned int *ext)
+{
+	struct _ccid *ccid = cci->i_parent;
+	size_t max = STREAM_SHORT_LE;
+	size_t msg;
+	struct _atr atr;
+
+	*ext = 0;
+
+	if ( cci->i_ops != &_contact_ops )
+		return max;
+
+	if ( (ccid->d_desc.dwFeatures & CCID_T1_APDU_EXT) &&
+			_atr_parse(&atr, cci->i_atr, cci->i_atr_len) &&
+			atr.a_ncaps >= 3 &&
+			(atr.a_caps[2] & ATR_CAPS_EXT_LCLE) )
+		max = STREAM_EXT_LE;
+
+	/* response must fit in one CCID message along with SW1/SW2 */
+	msg = ccid->d_desc.dwMaxCCIDMessageLength;
+	if ( msg > sizeof(struct ccid_msg) + 2 + 1 ) {
+		msg -= sizeof(struct ccid_msg) + 2;
+		if ( max > msg )
+			max = msg;
+	}
+
+	if ( max > STREAM_SHORT_LE )
+		*ext = 1;
+	return max;
+}
+
+static void read_binary_cmd(struct _xfr *xfr, uint8_t cla, unsigned int ofs,
+				size_t le, unsigned int ext)
+{
+	xfr_reset(xfr);
+	xfr_tx_byte(xfr, cla);
+	xfr_tx_byte(xfr, 0xb0);
+	xfr_tx_byte(xfr, (ofs >> 8) & 0x7f);
+	xfr_tx_byte(xfr, ofs & 0xff);
+	if ( ext ) {
+		xfr_tx_byte(xfr, 0);
+		xfr_tx_byte(xfr, (le >> 8) & 0xff);
+	}
+	xfr_tx_byte(xfr, le & 0xff);
+}
+
+/** Read a transparent EF in chunks.
+ * \ingroup g_cci
+ *
+ * @param cci \ref cci_t with an active card and a selected EF.
+ * @param cla Class byte to use for READ BINARY.
+ * @param ofs Offset in to the file at which to start.
+ * @param len Number of bytes to read, zero to read until end of file.
+ * @param cb Callback to invoke for each chunk of data.
+ * @param priv Opaque pointer passed to cb.
+ *
+ * Issues READ BINARY commands with the largest Le supported by both the
+ * card and the CCID, using extended length if the ATR advertises it. The
+ * command for the following chunk is submitted before the callback is
+ * invoked. A callback returning zero stops the stream, this is not
+ * considered an error.
+ *
+ * @return zero on failure.
+ */
+int cci_read_binary_stream(cci_t cci, uint8_t cla, unsigned int ofs,
+				size_t len, cci_stream_cb_t cb, void *priv)
+{
+	struct _ccid *ccid = cci->i_parent;
+	struct _xfr *xfr[2] = {NULL, NULL};
+	size_t chunk, want, end, got;
+	unsigned int ext, cur = 0, start = ofs;
+	int pending = 0, ret = 0;
+	const uint8_t *ptr;
+	uint8_t sw1, sw2;
+
+	end = (len) ? ofs + len : STREAM_MAX_OFS + 1;
+	if ( end > STREAM_MAX_OFS + 1 ) {
+		ccid->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	chunk = stream_chunk(cci, &ext);
+
+	xfr[0] = _xfr_do_alloc(STREAM_CMD_LEN, chunk + 2);
+	xfr[1] = _xfr_do_alloc(STREAM_CMD_LEN, chunk + 2);
+	if ( NULL == xfr[0] || NULL == xfr[1] ) {
+		ccid->d_error = CCID_ERROR_NO_MEM;
+		goto out;
+	}
+
+	trace(ccid, " o READ BINARY stream: %zu byte chunks%s\n",
+		chunk, (ext) ? " (extended)" : "");
+
+	want = (end - ofs < chunk) ? end - ofs : chunk;
+	read_binary_cmd(xfr[cur], cla, ofs, want, ext);
+	if ( !cci_submit(cci, xfr[cur]) )
+		goto out;
+	pending = 1;
+
+	while( pending ) {
+		pending = 0;
+
+		if ( !cci_complete(cci, xfr[cur]) )
+			goto out;
+
+		ptr = xfr_rx_data(xfr[cur], &got);
+		if ( NULL == ptr ) {
+			ccid->d_error = CCID_ERROR_CARD_PROTO;
+			goto out;
+		}
+
+		sw1 = xfr_rx_sw1(xfr[cur]);
+		sw2 = xfr_rx_sw2(xfr[cur]);
+
+		switch(sw1) {
+		case 0x90:
+			break;
+		case 0x62:
+			/* end of file reached before Le bytes */
+			if ( sw2 != 0x82 )
+				goto bad_sw;
+			end = ofs + got;
+			break;
+		case 0x6c:
+			/* wrong Le, card tells us the right one */
+			want = (sw2) ? sw2 : STREAM_SHORT_LE;
+			read_binary_cmd(xfr[cur], cla, ofs, want, 0);
+			if ( !cci_submit(cci, xfr[cur]) )
+				goto out;
+			pending = 1;
+			continue;
+		case 0x6b:
+			/* offset beyond end of file */
+			if ( !len && ofs > start ) {
+				ret = 1;
+				goto out;
+			}
+			/* fall through */
+		default:
+		bad_sw:
+			trace(ccid, " o READ BINARY stream: SW %.2x%.2x\n",
+				sw1, sw2);
+			ccid->d_error = CCID_ERROR_CARD_STATUS;
+			goto out;
+		}
+
+		if ( got > want )
+			got = want;
+		if ( got < want )
+			end = ofs + got;
+
+		/* queue next chunk before handing this one over */
+		if ( ofs + got < end ) {
+			want = (end - ofs - got < chunk) ?
+					end - ofs - got : chunk;
+			read_binary_cmd(xfr[!cur], cla, ofs + got, want, ext);
+			if ( !cci_submit(cci, xfr[!cur]) )
+				goto out;
+			pending = 1;
+		}
+
+		if ( got && !(*cb)(priv, ofs, ptr, got) ) {
+			if ( pending )
+				cci_complete(cci, xfr[!cur]);
+			ret = 1;
+			goto out;
+		}
+
+		ofs += got;
+		cur = !cur;
+	}
+
+	ret = 1;
+out:
+	_xfr_do_free(xfr[0]);
+	_xfr_do_free(xfr[1]);
+	return ret;
+}
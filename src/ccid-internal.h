@@ -34,18 +34,57 @@ struct _cci_ops {
 					size_t *atr_len);
 	int (*power_off)(struct _cci *cci);
 	int (*transact)(struct _cci *cc, struct _xfr *xfr);
+	const uint8_t *(*warm_reset)(struct _cci *cci, size_t *atr_len);
+	const uint8_t *(*reactivate)(struct _cci *cci, size_t *atr_len);
+	/* block until a card is present (or absent if present is zero) */
+	int (*wait)(struct _cci *cci, int present);
 	void (*dtor)(struct _cci *cc);
 };
 extern const struct _cci_ops _contact_ops;
 extern const struct _cci_ops _rfid_ops;
 
+#define CCI_MAX_CHANNELS	20
+#define CCI_MAX_SEL		16
+struct _cci_chan {
+	uint8_t c_sel_len;
+	uint8_t c_sel[CCI_MAX_SEL];
+};
+
+#define CCI_MAX_ATR	33
 struct _cci {
 	struct _ccid *i_parent;
 	uint8_t i_idx;
 	uint8_t i_status;
+	uint8_t i_atr_len;
+	uint8_t i_atr[CCI_MAX_ATR];
 	const struct _cci_ops *i_ops;
 	void *i_priv;
+
+	/* activation parameters cached for reactivation (contact slots) */
+	uint8_t i_voltage;
+	uint8_t i_proto;
+	uint8_t i_params_len;
+	uint8_t i_params[sizeof(struct ccid_t1)];
+
+	/* logical channels, bit 0 (basic channel) always set */
+	uint32_t i_chan_open;
+	struct _cci_chan i_chan[CCI_MAX_CHANNELS];
+};
+_private void _cci_channel_reset(struct _cci *cci);
+
+/* Third software function byte of card capabilities (ISO 7816-4 8.1.1.2.7) */
+#define ATR_CAPS_CHAINING	(1 << 7)
+#define ATR_CAPS_EXT_LCLE	(1 << 6)
+struct _atr {
+	const uint8_t *a_hist;
+	uint8_t a_hist_len;
+	uint8_t a_ta1;
+	uint8_t a_class;
+	uint8_t a_ncaps;
+	uint8_t a_caps[3];
+	uint16_t a_protos;
 };
+_private int _atr_parse(struct _atr *atr, const uint8_t *ptr, size_t len);
 
 #define RFID_MAX_FIELDS 1
 
@@ -69,8 +108,11 @@ struct _ccid {
 	uint8_t 	d_seq;
 	uint8_t		d_bus, d_addr;
 
-	/* cci slots */
+	/* cci slots, those from d_pub_slots up are used internally and not
+	 * handed out by ccid_get_slot()
+	 */
 	unsigned int 	d_num_slots;
+	unsigned int 	d_pub_slots;
 	unsigned int 	d_max_slots;
 	struct _cci d_slot[CCID_MAX_SLOTS];
 
@@ -100,13 +142,15 @@ struct _xfr {
 };
 
 #define INTF_RFID_OMNI	(1<<0)
+/* last CCID slot is the reader firmware's contactless slot */
+#define INTF_RFID_NATIVE	(1<<1)
 struct _cci_interface {
 	int c, i, a;
 	const char *name;
 	unsigned int flags;
 };
 
-_private void _omnikey_init_prox(struct _ccid *ccid);
+_private void _omnikey_init_prox(struct _ccid *ccid, unsigned int flags);
 
 _private int _probe_descriptors(struct libusb_device *dev,
 				struct _cci_interface *intf);
@@ -124,7 +168,7 @@ _private int _PC_to_RDR_GetSlotStatus(struct _ccid *ccid, unsigned int slot,
 _private int _PC_to_RDR_GetParameters(struct _ccid *ccid, unsigned int slot,
 					struct _xfr *xfr);
 _private int _PC_to_RDR_SetParameters(struct _ccid *ccid, unsigned int slot,
-					struct _xfr *xfr);
+					struct _xfr *xfr, unsigned int proto);
 _private int _PC_to_RDR_ResetParameters(struct _ccid *ccid, unsigned int slot,
 					struct _xfr *xfr);
 _private int _PC_to_RDR_IccPowerOn(struct _ccid *ccid, unsigned int slot,
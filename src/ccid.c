@@ -477,15 +477,18 @@ int _PC_to_RDR_GetParameters(struct _ccid *ccid, unsigned int slot,
 }
 
 int _PC_to_RDR_SetParameters(struct _ccid *ccid, unsigned int slot,
-				struct _xfr *xfr)
+				struct _xfr *xfr, unsigned int proto)
 {
 	int ret;
 
 	memset(xfr->x_txhdr, 0, sizeof(*xfr->x_txhdr));
 	xfr->x_txhdr->bMessageType = PC_to_RDR_SetParameters;
+	xfr->x_txhdr->out.bApp[0] = proto & 0xff;
 	ret = _PC_to_RDR(ccid, slot, xfr);
-	if ( ret )
+	if ( ret ) {
 		trace(ccid, " Xmit: PC_to_RDR_SetParameters(%u)\n", slot);
+		_hex_dumpf(ccid->d_tf, xfr->x_txbuf, xfr->x_txlen, 16);
+	}
 
 	return ret;
 }
@@ -633,6 +636,7 @@ static int fill_ccid_desc(struct _ccid *ccid, const uint8_t *ptr, size_t len)
 	byteswap_desc(&ccid->d_desc);
 
 	ccid->d_num_slots = ccid->d_desc.bMaxSlotIndex + 1;
+	ccid->d_pub_slots = ccid->d_num_slots;
 	ccid->d_max_slots = ccid->d_desc.bMaxCCIDBusySlots;
 
 	trace(ccid, " o got %zu/%zu byte desc of type 0x%.2x\n",
@@ -989,7 +993,12 @@ ccid_t ccid_probe(ccidev_t dev, const char *tracefile)
 	if( !get_clock_freqs(ccid) )
 		goto out_close;
 
-	ccid->d_xfr = _xfr_do_alloc(ccid->d_max_out, ccid->d_max_in);
+	/* big enough for a whole CCID message, not just one packet */
+	x = ccid->d_desc.dwMaxCCIDMessageLength;
+	if ( x > sizeof(struct ccid_msg) )
+		x -= sizeof(struct ccid_msg);
+	ccid->d_xfr = _xfr_do_alloc((x > ccid->d_max_out) ? x : ccid->d_max_out,
+				(x > ccid->d_max_in) ? x : ccid->d_max_in);
 	if ( NULL == ccid->d_xfr )
 		goto out_close;
 
@@ -1006,7 +1015,7 @@ ccid_t ccid_probe(ccidev_t dev, const char *tracefile)
 
 	/* Fifth, Initialise any proprietary interfaces */
 	if ( intf.flags & INTF_RFID_OMNI )
-		_omnikey_init_prox(ccid);
+		_omnikey_init_prox(ccid, intf.flags);
 
 	ccid->d_bus = libusb_get_bus_number(dev);
 	ccid->d_addr = libusb_get_device_address(dev);
@@ -1075,7 +1084,7 @@ void ccid_close(ccid_t ccid)
  */
 unsigned int ccid_num_slots(ccid_t ccid)
 {
-	return ccid->d_num_slots;
+	return ccid->d_pub_slots;
 }
 
 /** Retrieve a handle to a CCID slot.
@@ -1086,7 +1095,7 @@ unsigned int ccid_num_slots(ccid_t ccid)
  */
 cci_t ccid_get_slot(ccid_t ccid, unsigned int num)
 {
-	if ( num < ccid->d_num_slots ) {
+	if ( num < ccid->d_pub_slots ) {
 		return ccid->d_slot + num;
 	}else{
 		return NULL;
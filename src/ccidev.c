@@ -130,6 +130,8 @@ static unsigned int parse_flags(const char *fn, unsigned int line,
 	for(ret = i = 0; i < ntok; i++) {
 		if ( !strcmp(tok[i], "RFID_OMNI") ) {
 			ret |= INTF_RFID_OMNI;
+		}else if ( !strcmp(tok[i], "RFID_NATIVE") ) {
+			ret |= INTF_RFID_NATIVE;
 		}else{
 			fprintf(stderr, "%s:%u: '%s' unknown device flag\n",
 				fn, line, tok[i]);
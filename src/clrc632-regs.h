@@ -10,8 +10,14 @@
 /* PAGE 0 */
 #define RC632_REG_PAGE0			0x00
 
+/* EEPROM: key store is from block 8 to the end, 12 bytes per coded key */
+#define RC632_E2_KEY_BASE		0x80
+#define RC632_E2_SIZE			0x200
+#define RC632_E2_BLOCK			16
+
 #define RC632_REG_COMMAND		0x01
 #define  RC632_CMD_IDLE			0
+#define  RC632_CMD_WRITE_E2		0x01
 #define  RC632_CMD_LOAD_KEY_E2		0x0b
 #define  RC632_CMD_AUTHENT1		0x0c
 #define  RC632_CMD_AUTHENT2		0x14
@@ -28,6 +34,7 @@
 
 #define RC632_REG_FIFO_LENGTH		0x04
 #define RC632_REG_SECONDARY_STATUS	0x05
+#define  RC632_SEC_ST_E2_READY		(1<<6)
 
 #define RC632_REG_INTERRUPT_EN		0x06
 #define  RC632_IRQ_LO_ALERT		(1<<0)
@@ -92,17 +99,34 @@
 
 #define RC632_REG_CODER_CONTROL		0x14
 #define  RC632_CDRCTRL_TXCD_MASK	0x7
+#define  RC632_CDRCTRL_TXCD_NRZ		(0)
 #define  RC632_CDRCTRL_TXCD_14443A	(1)
+#define  RC632_CDRCTRL_TXCD_ICODE_STD	(4)
+#define  RC632_CDRCTRL_TXCD_ICODE_FAST	(5)
+#define  RC632_CDRCTRL_TXCD_15693_STD	(6)
+#define  RC632_CDRCTRL_TXCD_15693_FAST	(7)
 
 #define  RC632_CDRCTRL_RATE_MASK	(7 << 3)
 #define  RC632_CDRCTRL_RATE_848K	(0 << 3)
 #define  RC632_CDRCTRL_RATE_424K	(1 << 3)
 #define  RC632_CDRCTRL_RATE_212K	(2 << 3)
 #define  RC632_CDRCTRL_RATE_106K	(3 << 3)
+#define  RC632_CDRCTRL_RATE_14443B	(4 << 3)
+#define  RC632_CDRCTRL_RATE_15693	(5 << 3)
+#define  RC632_CDRCTRL_15693_EOF_PULSE	(1 << 7)
 
 #define RC632_REG_MOD_WIDTH		0x15
 #define RC632_REG_MOD_WIDTH_SOF		0x16
 #define RC632_REG_TYPE_B_FRAMING	0x17
+#define  RC632_TBFRAMING_SOF_10L_2H	(0)
+#define  RC632_TBFRAMING_SOF_10L_3H	(1)
+#define  RC632_TBFRAMING_SOF_11L_2H	(2)
+#define  RC632_TBFRAMING_SOF_11L_3H	(3)
+#define  RC632_TBFRAMING_SPACE_SHIFT	2
+#define  RC632_TBFRAMING_EOF_10		(0 << 5)
+#define  RC632_TBFRAMING_EOF_11		(1 << 5)
+#define  RC632_TBFRAMING_NO_TX_EOF	(1 << 6)
+#define  RC632_TBFRAMING_NO_TX_SOF	(1 << 7)
 
 /* PAGE 3 */
 #define RC632_REG_PAGE3			0x18
@@ -112,6 +136,7 @@
 #define  RC632_RXCTRL1_GAIN_24DB	(1)
 #define  RC632_RXCTRL1_GAIN_31DB	(2)
 #define  RC632_RXCTRL1_GAIN_35DB	(3)
+#define  RC632_RXCTRL1_ISO15693		(1 << 3)
 #define  RC632_RXCTRL1_ISO14443		(2 << 3)
 #define  RC632_RXCTRL1_SUBCP_1		(0 << 5)
 #define  RC632_RXCTRL1_SUBCP_2		(1 << 5)
@@ -123,17 +148,27 @@
 #define RC632_REG_DECODER_CONTROL	0x1a
 #define  RC632_DECCTRL_MANCHESTER	(0 << 0)
 #define  RC632_DECCTRL_BPSK		(1 << 0)
+#define  RC632_DECCTRL_RX_INVERT	(1 << 2)
 #define  RC632_DECCTRL_RXFR_14443A	(1 << 3)
+#define  RC632_DECCTRL_RXFR_15693	(2 << 3)
+#define  RC632_DECCTRL_RXFR_14443B	(3 << 3)
 
 #define RC632_REG_BIT_PHASE		0x1b
 #define RC632_REG_RX_THRESHOLD		0x1c
 #define RC632_REG_BPSK_DEM_CONTROL	0x1d
+#define  RC632_BPSKD_TAUB_SHIFT		0
+#define  RC632_BPSKD_TAUD_SHIFT		2
+#define  RC632_BPSKD_FILTER_AMP_DETECT	(1 << 4)
+#define  RC632_BPSKD_NO_RX_EOF		(1 << 5)
+#define  RC632_BPSKD_NO_RX_EGT		(1 << 6)
+#define  RC632_BPSKD_NO_RX_SOF		(1 << 7)
 
 #define RC632_REG_RX_CONTROL2		0x1e
 #define  RC632_RXCTRL2_DECSRC_LOW	(0)
 #define  RC632_RXCTRL2_DECSRC_INT	(1)
 #define  RC632_RXCTRL2_DECSRC_SC	(2)
 #define  RC632_RXCTRL2_DECSRC_BB	(3)
+#define  RC632_RXCTRL2_AUTO_PD		(1<<6)
 #define  RC632_RXCTRL2_CLK_Q		(0<<7)
 #define  RC632_RXCTRL2_CLK_I		(1<<7)
 
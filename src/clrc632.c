@@ -11,6 +11,8 @@
 
 #include <ccid.h>
 #include <unistd.h>
+#include <limits.h>
+#include <time.h>
 #include <inttypes.h>
 
 #include "ccid-internal.h"
@@ -26,33 +28,200 @@
 
 #define TMO_AUTH1 140
 
-struct reg_file {
-	uint8_t reg;
-	uint8_t val;
+#define CLRC632_MULTI	(1 << 0)
+#define CLRC632_TYPE_B	(1 << 1)
+#define CLRC632_15693	(1 << 2)
+#define CLRC632_MODE	(CLRC632_TYPE_B|CLRC632_15693)
+/* Authent2 may have left crypto1 switched on in CONTROL */
+#define CLRC632_CRYPTO1	(1 << 3)
+#define CLRC632_NUM_REGS	0x40
+struct _clrc632 {
+	const struct _clrc632_ops *c_ops;
+	unsigned int c_flags;
+
+	/* write-through shadow of the control registers */
+	uint64_t c_valid;
+	uint8_t c_shadow[CLRC632_NUM_REGS];
+
+	/* PCD to PICC and PICC to PCD bit rates */
+	unsigned int c_tx_speed;
+	unsigned int c_rx_speed;
+
+	/* RF_ERR_* for the last exchange to fail */
+	unsigned int c_err;
 };
 
-static int reg_read(struct _ccid *ccid, const struct _clrc632_ops *ops,
+/* Control registers which only the host writes to may be shadowed. Not
+ * the page registers, not anything below BitFraming (command, FIFO,
+ * status, IRQ and control registers are all changed by the ASIC) and not
+ * ClockQControl which the ASIC writes with its calibration result.
+ */
+static int reg_cacheable(uint8_t reg)
+{
+	if ( reg < RC632_REG_BIT_FRAMING || reg >= RC632_REG_PAGE6 )
+		return 0;
+	if ( (reg & 0x7) == 0 )
+		return 0;
+	if ( reg == RC632_REG_CLOCK_Q_CONTROL )
+		return 0;
+	return 1;
+}
+
+static int shadow_hit(struct _clrc632 *rc, uint8_t reg)
+{
+	return reg_cacheable(reg) && (rc->c_valid & (1ULL << reg));
+}
+
+static void shadow_set(struct _clrc632 *rc, uint8_t reg, uint8_t val)
+{
+	if ( !reg_cacheable(reg) )
+		return;
+	rc->c_shadow[reg] = val;
+	rc->c_valid |= (1ULL << reg);
+}
+
+static void shadow_invalidate(struct _clrc632 *rc)
+{
+	rc->c_valid = 0;
+}
+
+static int reg_read(struct _ccid *ccid, struct _clrc632 *rc,
 			uint8_t reg, uint8_t *val)
 {
-	return (*ops->reg_read)(ccid, reg, val);
+	if ( shadow_hit(rc, reg) ) {
+		*val = rc->c_shadow[reg];
+		return 1;
+	}
+
+	if ( !(*rc->c_ops->reg_read)(ccid, reg, val) )
+		return 0;
+
+	shadow_set(rc, reg, *val);
+	return 1;
 }
 
-static int reg_write(struct _ccid *ccid, const struct _clrc632_ops *ops,
+static int reg_write(struct _ccid *ccid, struct _clrc632 *rc,
 			uint8_t reg, uint8_t val)
 {
-	return (*ops->reg_write)(ccid, reg, val);
+	if ( shadow_hit(rc, reg) && rc->c_shadow[reg] == val )
+		return 1;
+
+	if ( !(*rc->c_ops->reg_write)(ccid, reg, val) ) {
+		rc->c_valid &= ~(1ULL << (reg & 0x3f));
+		return 0;
+	}
+
+	shadow_set(rc, reg, val);
+	return 1;
 }
 
-static int fifo_read(struct _ccid *ccid, const struct _clrc632_ops *ops,
+static int fifo_read(struct _ccid *ccid, struct _clrc632 *rc,
 			uint8_t *buf, size_t len)
 {
-	return (*ops->fifo_read)(ccid, buf, len);
+	return (*rc->c_ops->fifo_read)(ccid, buf, len);
 }
 
-static int fifo_write(struct _ccid *ccid, const struct _clrc632_ops *ops,
+static int fifo_write(struct _ccid *ccid, struct _clrc632 *rc,
 			const uint8_t *buf, size_t len)
 {
-	return (*ops->fifo_write)(ccid, buf, len);
+	return (*rc->c_ops->fifo_write)(ccid, buf, len);
+}
+
+static void multi_broken(struct _ccid *ccid, struct _clrc632 *rc)
+{
+	trace(ccid, " o CLRC632: coalesced register access not supported\n");
+	rc->c_flags &= ~CLRC632_MULTI;
+}
+
+static int reg_write_batch(struct _ccid *ccid, struct _clrc632 *rc,
+				const struct reg_file *r,
+				unsigned int num)
+{
+	struct reg_file buf[CLRC632_MAX_MULTI];
+	unsigned int i, n;
+	int ret;
+
+	while( num && (rc->c_flags & CLRC632_MULTI) ) {
+		/* gather up writes which actually change something */
+		for(n = 0; num && n < CLRC632_MAX_MULTI; r++, num--) {
+			if ( shadow_hit(rc, r->reg) &&
+					rc->c_shadow[r->reg] == r->val )
+				continue;
+			buf[n++] = *r;
+		}
+		if ( !n )
+			break;
+
+		ret = (*rc->c_ops->reg_write_multi)(ccid, buf, n);
+		if ( ret < 0 ) {
+			/* state of these is unknown now, go one by one */
+			multi_broken(ccid, rc);
+			for(i = 0; i < n; i++) {
+				if ( !reg_write(ccid, rc, buf[i].reg,
+						buf[i].val) )
+					return 0;
+			}
+			break;
+		}
+		if ( !ret ) {
+			shadow_invalidate(rc);
+			return 0;
+		}
+		for(i = 0; i < n; i++)
+			shadow_set(rc, buf[i].reg, buf[i].val);
+	}
+
+	for(i = 0; i < num; i++) {
+		if ( !reg_write(ccid, rc, r[i].reg, r[i].val) )
+			return 0;
+	}
+	return 1;
+}
+
+static int reg_read_batch(struct _ccid *ccid, struct _clrc632 *rc,
+				struct reg_file *r,
+				unsigned int num)
+{
+	struct reg_file buf[CLRC632_MAX_MULTI];
+	struct reg_file *dst[CLRC632_MAX_MULTI];
+	unsigned int i, n;
+	int ret;
+
+	while( num && (rc->c_flags & CLRC632_MULTI) ) {
+		for(n = 0; num && n < CLRC632_MAX_MULTI; r++, num--) {
+			if ( shadow_hit(rc, r->reg) ) {
+				r->val = rc->c_shadow[r->reg];
+				continue;
+			}
+			buf[n].reg = r->reg;
+			dst[n++] = r;
+		}
+		if ( !n )
+			break;
+
+		ret = (*rc->c_ops->reg_read_multi)(ccid, buf, n);
+		if ( ret < 0 ) {
+			multi_broken(ccid, rc);
+			for(i = 0; i < n; i++) {
+				if ( !reg_read(ccid, rc, dst[i]->reg,
+						&dst[i]->val) )
+					return 0;
+			}
+			break;
+		}
+		if ( !ret )
+			return 0;
+		for(i = 0; i < n; i++) {
+			dst[i]->val = buf[i].val;
+			shadow_set(rc, buf[i].reg, buf[i].val);
+		}
+	}
+
+	for(i = 0; i < num; i++) {
+		if ( !reg_read(ccid, rc, r[i].reg, &r[i].val) )
+			return 0;
+	}
+	return 1;
 }
 
 static int asic_clear_bits(struct _ccid *ccid, void *priv,
@@ -97,20 +266,12 @@ static int asic_set_mask(struct _ccid *ccid, void *priv, uint8_t reg,
 	return reg_write(ccid, priv, reg, (val & ~mask) | (bits & mask));
 }
 
-static int reg_write_batch(struct _ccid *ccid, void *priv,
-				const struct reg_file *r,
-				unsigned int num)
-{
-	unsigned int i;
-	for(i = 0; i < num; i++) {
-		if ( !reg_write(ccid, priv, r[i].reg, r[i].val) )
-			return 0;
-	}
-	return 1;
-}
-
 static int asic_power(struct _ccid *ccid, void *priv, unsigned int on)
 {
+	struct _clrc632 *rc = priv;
+
+	shadow_invalidate(rc);
+	rc->c_flags &= ~CLRC632_CRYPTO1;
 	if ( on ) {
 		return asic_clear_bits(ccid, priv, RC632_REG_CONTROL,
 						RC632_CONTROL_POWERDOWN);
@@ -122,13 +283,18 @@ static int asic_power(struct _ccid *ccid, void *priv, unsigned int on)
 
 static int rf_power(struct _ccid *ccid, void *priv, unsigned int on)
 {
+	struct _clrc632 *rc = priv;
 	int ret;
 
+	/* the tag and possibly the ASIC state are gone, start afresh */
+	shadow_invalidate(rc);
+	rc->c_flags &= ~CLRC632_CRYPTO1;
+
 	if ( on ) {
-		ret = asic_clear_bits(ccid, priv, RC632_REG_TX_CONTROL,
+		ret = asic_set_bits(ccid, priv, RC632_REG_TX_CONTROL,
 				RC632_TXCTRL_TX1_RF_EN|RC632_TXCTRL_TX2_RF_EN);
 	}else{
-		ret = asic_set_bits(ccid, priv, RC632_REG_TX_CONTROL,
+		ret = asic_clear_bits(ccid, priv, RC632_REG_TX_CONTROL,
 				RC632_TXCTRL_TX1_RF_EN|RC632_TXCTRL_TX2_RF_EN);
 	}
 
@@ -151,13 +317,116 @@ static int clear_irqs(struct _ccid *ccid, void *priv, uint8_t bits)
 			(~RC632_INT_SET) & bits);
 }
 
-/* Wait until RC632 is idle or TIMER IRQ has happened */
-static int wait_idle_timer(struct _ccid *ccid, void *priv)
+struct asic_status {
+	uint8_t stat;
+	uint8_t err;
+	uint8_t irq;
+	uint8_t cmd;
+};
+
+/* Fetch everything wait_idle_timer needs to look at. With coalesced
+ * access it's one exchange, otherwise only read what's relevant.
+ */
+static int read_status(struct _ccid *ccid, struct _clrc632 *rc,
+			struct asic_status *st)
 {
-	uint8_t stat, irq, cmd;
+	struct reg_file r[] = {
+		{ .reg = RC632_REG_PRIMARY_STATUS },
+		{ .reg = RC632_REG_ERROR_FLAG },
+		{ .reg = RC632_REG_INTERRUPT_RQ },
+		{ .reg = RC632_REG_COMMAND },
+	};
+
+	if ( rc->c_flags & CLRC632_MULTI ) {
+		if ( !reg_read_batch(ccid, rc, r, ARRAY_SIZE(r)) )
+			return 0;
+		st->stat = r[0].val;
+		st->err = r[1].val;
+		st->irq = r[2].val;
+		st->cmd = r[3].val;
+		return 1;
+	}
 
-	if ( !reg_read(ccid, priv, RC632_REG_INTERRUPT_EN, &irq) )
+	if ( !reg_read(ccid, rc, RC632_REG_PRIMARY_STATUS, &st->stat) )
 		return 0;
+	st->err = st->irq = 0;
+	if ( (st->stat & RC632_STAT_ERR) &&
+			!reg_read(ccid, rc, RC632_REG_ERROR_FLAG, &st->err) )
+		return 0;
+	if ( (st->stat & RC632_STAT_IRQ) &&
+			!reg_read(ccid, rc, RC632_REG_INTERRUPT_RQ, &st->irq) )
+		return 0;
+	return reg_read(ccid, rc, RC632_REG_COMMAND, &st->cmd);
+}
+
+/* Minimum frame delay time is ~86us (1172/fc), allow a bit more */
+#define FDT_USEC	100
+#define POLL_MIN_USEC	250
+#define POLL_MAX_USEC	8000
+#define RX_GUESS	16
+
+/* ISO 15693 response delay t1 is 4320/fc */
+#define ISO15693_T1_USEC	320
+
+/* Time on air for an exchange at the current bit rates. One etu is 128/fc
+ * at 106kbit/s and halves with each step up, each direction has its own.
+ * Bytes are 9 bits with parity, plus a couple for start and end of frame.
+ * ISO 15693 high data rate is 512/fc per bit both ways, no parity, SOF and
+ * EOF about two bytes worth.
+ */
+static uint64_t frame_usec(struct _clrc632 *rc, unsigned int tx_len,
+				unsigned int rx_len)
+{
+	uint64_t bits, usec;
+
+	if ( rc->c_flags & CLRC632_15693 ) {
+		bits = (tx_len + rx_len + 4) * 8ULL;
+		return (bits * 512 * 1000000ULL) / ISO14443_FREQ_CARRIER +
+			ISO15693_T1_USEC;
+	}
+
+	bits = tx_len * 9ULL + 2;
+	usec = (bits * 128 * 1000000ULL) /
+		((uint64_t)ISO14443_FREQ_CARRIER << rc->c_tx_speed);
+	bits = rx_len * 9ULL + 2;
+	usec += (bits * 128 * 1000000ULL) /
+		((uint64_t)ISO14443_FREQ_CARRIER << rc->c_rx_speed);
+	return usec + FDT_USEC;
+}
+
+#define TIMER_RELAX_FACTOR 10
+
+static unsigned int rf_errors(uint8_t val)
+{
+	unsigned int err = 0;
+
+	if ( val & RC632_ERR_FLAG_COL_ERR )
+		err |= RF_ERR_COLLISION;
+	if ( val & RC632_ERR_FLAG_CRC_ERR )
+		err |= RF_ERR_CRC;
+	if ( val & (RC632_ERR_FLAG_PARITY_ERR|RC632_ERR_FLAG_FRAMING_ERR) )
+		err |= RF_ERR_FRAMING;
+	return err;
+}
+
+/* Wait until RC632 is idle or TIMER IRQ has happened. Nothing is looked at
+ * until the exchange could have completed (expect usec), after that poll
+ * with exponential backoff. The ASIC timer (set for timeout usec) is what
+ * normally ends a failed exchange, the host side limit is just a backstop.
+ */
+static int wait_idle_timer(struct _ccid *ccid, void *priv,
+				uint64_t expect, uint64_t timeout)
+{
+	struct _clrc632 *rc = priv;
+	struct asic_status st;
+	struct timespec start;
+	uint64_t delay, limit, el;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	limit = 2 * TIMER_RELAX_FACTOR * timeout + 100000;
+	delay = expect / 4;
+	if ( delay < POLL_MIN_USEC )
+		delay = POLL_MIN_USEC;
 
 	if ( !reg_write(ccid, priv, RC632_REG_INTERRUPT_EN, RC632_IRQ_SET
 				| RC632_IRQ_TIMER
@@ -165,47 +434,49 @@ static int wait_idle_timer(struct _ccid *ccid, void *priv)
 				| RC632_IRQ_RX ) )
 		return 0;
 
+	el = _rfid_usec_since(&start);
+	if ( el < expect )
+		usleep(expect - el);
+
 	while (1) {
-		if ( !reg_read(ccid, priv, RC632_REG_PRIMARY_STATUS, &stat) )
+		if ( !read_status(ccid, priv, &st) )
 			return 0;
-		if (stat & RC632_STAT_ERR) {
-			uint8_t err;
-			if ( !reg_read(ccid, priv, RC632_REG_ERROR_FLAG, &err) )
-				return 0;
-			if (err & (RC632_ERR_FLAG_COL_ERR |
+		if ( (st.stat & RC632_STAT_ERR) &&
+			(st.err & (RC632_ERR_FLAG_COL_ERR |
 				   RC632_ERR_FLAG_PARITY_ERR |
 				   RC632_ERR_FLAG_FRAMING_ERR |
 				/* FIXME: why get we CRC errors in CL2 anticol
 				 * at iso14443a operation with mifare UL? */
 				/*   RC632_ERR_FLAG_CRC_ERR | */
-				   0)) {
-				//printf("error during wait\n");
-				return 0;
-			}
-		}
-		if (stat & RC632_STAT_IRQ) {
-			if ( !reg_read(ccid, priv,
-				RC632_REG_INTERRUPT_RQ, &irq) )
-				return 0;
-
-			if (irq & RC632_IRQ_TIMER && !(irq & RC632_IRQ_RX)) {
-				/* timed out */
-				//printf("..timed out\n");
-				clear_irqs(ccid, priv, RC632_IRQ_TIMER);
-				return 0;
-			}
+				   0)) ) {
+			rc->c_err = rf_errors(st.err);
+			return 0;
 		}
-
-		if ( !reg_read(ccid, priv, RC632_REG_COMMAND, &cmd) )
+		if ( (st.stat & RC632_STAT_IRQ) &&
+			(st.irq & RC632_IRQ_TIMER) &&
+			!(st.irq & RC632_IRQ_RX) ) {
+			/* timed out */
+			rc->c_err = RF_ERR_TIMEOUT;
+			clear_irqs(ccid, priv, RC632_IRQ_TIMER);
 			return 0;
+		}
 
-		if (cmd == 0) {
+		if (st.cmd == 0) {
 			clear_irqs(ccid, priv, RC632_IRQ_RX);
 			return 1;
 		}
 
-		/* poll every millisecond */
-		usleep(1000);
+		if ( _rfid_usec_since(&start) > limit ) {
+			trace(ccid, " o CLRC632: no completion after %"
+				PRIu64"us\n", limit);
+			rc->c_err = RF_ERR_TIMEOUT;
+			return 0;
+		}
+
+		usleep(delay);
+		delay *= 2;
+		if ( delay > POLL_MAX_USEC )
+			delay = POLL_MAX_USEC;
 	}
 }
 
@@ -250,8 +521,7 @@ static void best_prescaler(uint64_t timeout, uint8_t *prescaler,
 //		__func__, timeout, best_prescaler, best_divisor);
 }
 
-#define TIMER_RELAX_FACTOR 10
-static int timer_set(struct _ccid *ccid, void *priv, uint64_t timeout)
+static unsigned int timer_regs(uint64_t timeout, struct reg_file *r)
 {
 	uint8_t prescaler, divisor;
 
@@ -259,52 +529,62 @@ static int timer_set(struct _ccid *ccid, void *priv, uint64_t timeout)
 
 	best_prescaler(timeout, &prescaler, &divisor);
 
-	if ( !reg_write(ccid, priv, RC632_REG_TIMER_CLOCK,
-			      prescaler & 0x1f) )
-		return 0;
-
-	if ( !reg_write(ccid, priv, RC632_REG_TIMER_CONTROL,
-			      RC632_TMR_START_TX_END|RC632_TMR_STOP_RX_BEGIN) )
-		return 0;
-
+	r[0].reg = RC632_REG_TIMER_CLOCK;
+	r[0].val = prescaler & 0x1f;
+	r[1].reg = RC632_REG_TIMER_CONTROL;
+	r[1].val = RC632_TMR_START_TX_END|RC632_TMR_STOP_RX_BEGIN;
 	/* clear timer irq bit */
-	if ( !clear_irqs(ccid, priv, RC632_IRQ_TIMER) )
-		return 0;
-
+	r[2].reg = RC632_REG_INTERRUPT_RQ;
+	r[2].val = (~RC632_INT_SET) & RC632_IRQ_TIMER;
 	/* enable timer IRQ */
-	if ( !reg_write(ccid, priv, RC632_REG_INTERRUPT_EN,
-			RC632_IRQ_SET | RC632_IRQ_TIMER) )
-		return 0;
-
-	if ( !reg_write(ccid, priv, RC632_REG_TIMER_RELOAD, divisor) )
-		return 0;
+	r[3].reg = RC632_REG_INTERRUPT_EN;
+	r[3].val = RC632_IRQ_SET | RC632_IRQ_TIMER;
+	r[4].reg = RC632_REG_TIMER_RELOAD;
+	r[4].val = divisor;
+	return 5;
+}
 
-	return 1;
+static int timer_set(struct _ccid *ccid, void *priv, uint64_t timeout)
+{
+	struct reg_file r[5];
+	return reg_write_batch(ccid, priv, r, timer_regs(timeout, r));
 }
 
 static int set_rf_mode(struct _ccid *ccid, void *priv, const struct rf_mode *rf)
 {
+	struct _clrc632 *rc = priv;
 	uint8_t red;
 
 	if ( !reg_write(ccid, priv, RC632_REG_BIT_FRAMING,
 				(rf->rx_align << 4) | (rf->tx_last_bits)) )
 		return 0;
 
-	if ( rf->flags & RF_CRYPTO1 ) {
+	/* only a successful Authent2 turns crypto on, all we can do is
+	 * switch it off for plain frames. CONTROL isn't shadowed so don't
+	 * go near it unless we know crypto might be on.
+	 */
+	if ( !(rf->flags & RF_CRYPTO1) && (rc->c_flags & CLRC632_CRYPTO1) ) {
 		if ( !asic_clear_bits(ccid, priv, RC632_REG_CONTROL,
 					RC632_CONTROL_CRYPTO1_ON) )
 			return 0;
-	}else{
-		if ( !asic_set_bits(ccid, priv, RC632_REG_CONTROL,
-					RC632_CONTROL_CRYPTO1_ON) )
-			return 0;
+		rc->c_flags &= ~CLRC632_CRYPTO1;
 	}
 
+	/* ISO 15693 slot marker is an EOF on its own */
+	if ( (rc->c_flags & CLRC632_15693) &&
+			!asic_set_mask(ccid, priv, RC632_REG_CODER_CONTROL,
+				RC632_CDRCTRL_15693_EOF_PULSE,
+				(rf->flags & RF_EOF_ONLY) ?
+					RC632_CDRCTRL_15693_EOF_PULSE : 0) )
+		return 0;
+
 	red = 0;
 	if ( rf->flags & RF_TX_CRC )
 		red |= RC632_CR_TX_CRC_ENABLE;
 	if ( rf->flags & RF_RX_CRC )
 		red |= RC632_CR_RX_CRC_ENABLE;
+	if ( rf->flags & RF_CRC3309 )
+		red |= RC632_CR_CRC3309;
 	if ( rf->flags & RF_PARITY_ENABLE )
 		red |= RC632_CR_PARITY_ENABLE;
 	if ( !(rf->flags & RF_PARITY_EVEN) )
@@ -323,7 +603,19 @@ static int get_rf_mode(struct _ccid *ccid, void *priv, const struct rf_mode *rf)
 
 static int get_error(struct _ccid *ccid, void *priv, uint8_t *err)
 {
-	return reg_read(ccid, priv, RC632_REG_ERROR_FLAG, err);
+	uint8_t val;
+
+	if ( !reg_read(ccid, priv, RC632_REG_ERROR_FLAG, &val) )
+		return 0;
+
+	*err = rf_errors(val);
+	return 1;
+}
+
+static unsigned int last_error(struct _ccid *ccid, void *priv)
+{
+	struct _clrc632 *rc = priv;
+	return rc->c_err;
 }
 
 static int get_coll_pos(struct _ccid *ccid, void *priv, uint8_t *pos)
@@ -339,6 +631,9 @@ static int transact(struct _ccid *ccid, void *priv,
 			 uint64_t timer,
 			 unsigned int toggle)
 {
+	struct _clrc632 *rc = priv;
+	struct reg_file r[7];
+	uint64_t expect;
 	int cur_tx_len;
 	uint8_t rx_avail;
 	const uint8_t *cur_tx_buf = tx_buf;
@@ -346,22 +641,24 @@ static int transact(struct _ccid *ccid, void *priv,
 //	printf("%s: timeout=%"PRIu64", rx_len=%u, tx_len=%u\n",
 //		__func__, timer, *rx_len, tx_len);
 
+	rc->c_err = 0;
+
 	if (tx_len > 64)
 		cur_tx_len = 64;
 	else
 		cur_tx_len = tx_len;
 
-	if ( !reg_write(ccid, priv, RC632_REG_COMMAND, RC632_CMD_IDLE) )
-		return 0;
+	r[0].reg = RC632_REG_COMMAND;
+	r[0].val = RC632_CMD_IDLE;
 	/* clear all interrupts */
-	if ( !reg_write(ccid, priv, RC632_REG_INTERRUPT_RQ, 0x7f) )
-		return 0;
-
-	if ( !timer_set(ccid, priv, timer) )
+	r[1].reg = RC632_REG_INTERRUPT_RQ;
+	r[1].val = 0x7f;
+	if ( !reg_write_batch(ccid, priv, r, 2 + timer_regs(timer, r + 2)) )
 		return 0;
 
 	do {
-		if ( !fifo_write(ccid, priv, cur_tx_buf, cur_tx_len) )
+		if ( cur_tx_len && !fifo_write(ccid, priv, cur_tx_buf,
+						cur_tx_len) )
 			return 0;
 
 		if (cur_tx_buf == tx_buf) {
@@ -385,20 +682,26 @@ static int transact(struct _ccid *ccid, void *priv,
 	//if (toggle == 1)
 	//	tcl_toggle_pcb(ccid, priv);
 
-	if ( !wait_idle_timer(ccid, priv) ) {
+	/* guess at a typical response, longer ones are caught by backoff */
+	expect = frame_usec(priv, tx_len, (*rx_len < RX_GUESS) ?
+						*rx_len : RX_GUESS);
+	if ( !wait_idle_timer(ccid, priv, expect, timer) ) {
 		return 0;
 	}
 
 	if ( !reg_read(ccid, priv, RC632_REG_FIFO_LENGTH, &rx_avail) )
 		return 0;
 
-	if (rx_avail > *rx_len)
-		printf("rx_avail(%d) > rx_len(%d), JFYI\n", rx_avail, *rx_len);
-	else if (*rx_len > rx_avail)
+	if (rx_avail > *rx_len) {
+		trace(ccid, " o CLRC632: %u bytes received, room for %u\n",
+			rx_avail, *rx_len);
+	}else if (*rx_len > rx_avail) {
 		*rx_len = rx_avail;
+	}
 
 	if (rx_avail == 0) {
-		printf("RX: FIFO empty\n");
+		/* went idle without hearing anything */
+		rc->c_err = RF_ERR_TIMEOUT;
 		return 0;
 	}
 
@@ -445,7 +748,7 @@ static int mfc_set_key(struct _ccid *ccid, void *priv, const uint8_t *key)
 		return 0;
 
 	//if ( !wait_idle(ccid, priv, TMO_AUTH1) )
-	if ( !wait_idle_timer(ccid, priv) )
+	if ( !wait_idle_timer(ccid, priv, 0, TMO_AUTH1 * 10) )
 		return 0;
 
 	if ( !reg_read(ccid, priv, RC632_REG_ERROR_FLAG, &reg) )
@@ -457,14 +760,93 @@ static int mfc_set_key(struct _ccid *ccid, void *priv, const uint8_t *key)
 	return 1;
 }
 
-static int mfc_set_key_ee(struct _ccid *ccid, void *priv, unsigned int addr)
+/* WriteE2 runs until told to stop, the data must not cross an EEPROM block
+ * since each block is programmed in one go (about 6ms).
+ */
+#define E2_PROG_USEC	1000
+#define E2_PROG_TRIES	20
+static int e2_write(struct _ccid *ccid, void *priv, unsigned int addr,
+			const uint8_t *buf, size_t len)
+{
+	uint8_t frame[2 + RC632_E2_BLOCK];
+	unsigned int i;
+	uint8_t reg;
+	size_t n;
+
+	for(; len; addr += n, buf += n, len -= n) {
+		n = RC632_E2_BLOCK - (addr % RC632_E2_BLOCK);
+		if ( n > len )
+			n = len;
+
+		frame[0] = addr & 0xff;
+		frame[1] = (addr >> 8) & 0xff;
+		memcpy(frame + 2, buf, n);
+
+		if ( !reg_write(ccid, priv, RC632_REG_COMMAND, RC632_CMD_IDLE) )
+			return 0;
+		if ( !flush_fifo(ccid, priv) )
+			return 0;
+		if ( !fifo_write(ccid, priv, frame, 2 + n) )
+			return 0;
+		if ( !reg_write(ccid, priv, RC632_REG_COMMAND,
+				RC632_CMD_WRITE_E2) )
+			return 0;
+
+		for(i = 0; i < E2_PROG_TRIES; i++) {
+			usleep(E2_PROG_USEC);
+			if ( !reg_read(ccid, priv,
+					RC632_REG_SECONDARY_STATUS, &reg) )
+				return 0;
+			if ( reg & RC632_SEC_ST_E2_READY )
+				break;
+		}
+
+		if ( !reg_write(ccid, priv, RC632_REG_COMMAND, RC632_CMD_IDLE) )
+			return 0;
+		if ( i == E2_PROG_TRIES )
+			return 0;
+
+		if ( !reg_read(ccid, priv, RC632_REG_ERROR_FLAG, &reg) )
+			return 0;
+		if ( reg & RC632_ERR_FLAG_ACCESS_ERR )
+			return 0;
+	}
+
+	return 1;
+}
+
+static unsigned int key_slot_addr(unsigned int slot)
+{
+	return RC632_E2_KEY_BASE + slot * RFID_MIFARE_KEY_CODED_LEN;
+}
+
+/* Keep a key in the EEPROM key store so that LoadKeyE2 can fetch it, saves
+ * uploading all 12 bytes over USB for each authentication.
+ */
+static int mfc_store_key(struct _ccid *ccid, void *priv, unsigned int slot,
+				const uint8_t *key)
+{
+	uint8_t coded_key[RFID_MIFARE_KEY_CODED_LEN];
+
+	if ( slot >= RFID_MFC_KEY_SLOTS )
+		return 0;
+
+	mfc_transform_key(key, coded_key);
+	return e2_write(ccid, priv, key_slot_addr(slot),
+			coded_key, sizeof(coded_key));
+}
+
+static int mfc_set_key_ee(struct _ccid *ccid, void *priv, unsigned int slot)
 {
 	uint8_t cmd_addr[2];
+	unsigned int addr;
 	uint8_t reg;
 
-	if (addr > 0xffff - RFID_MIFARE_KEY_CODED_LEN)
+	if ( slot >= RFID_MFC_KEY_SLOTS )
 		return 0;
 
+	addr = key_slot_addr(slot);
+
 	cmd_addr[0] = addr & 0xff;		/* LSB */
 	cmd_addr[1] = (addr >> 8) & 0xff;	/* MSB */
 
@@ -483,7 +865,7 @@ static int mfc_set_key_ee(struct _ccid *ccid, void *priv, unsigned int addr)
 		return 0;
 
 	//if ( !wait_idle(ccid, priv, TMO_AUTH1) )
-	if ( !wait_idle_timer(ccid, priv) )
+	if ( !wait_idle_timer(ccid, priv, 0, TMO_AUTH1) )
 		return 0;
 
 	if ( !reg_read(ccid, priv, RC632_REG_ERROR_FLAG, &reg) )
@@ -542,7 +924,8 @@ static int mfc_auth(struct _ccid *ccid, void *priv, uint8_t cmd,
 		return 0;
 
 	//if ( !wait_idle(ccid, priv, TMO_AUTH1) )
-	if ( !wait_idle_timer(ccid, priv) )
+	if ( !wait_idle_timer(ccid, priv, frame_usec(priv, sizeof(acmd) + 2, 4),
+				TMO_AUTH1) )
 		return 0;
 
 	if ( !reg_read(ccid, priv, RC632_REG_SECONDARY_STATUS, &reg) )
@@ -567,7 +950,8 @@ static int mfc_auth(struct _ccid *ccid, void *priv, uint8_t cmd,
 
 	/* Wait until transmitter is idle */
 	//wait_idle(ccid, priv, TMO_AUTH1);
-	if ( !wait_idle_timer(ccid, priv) )
+	if ( !wait_idle_timer(ccid, priv,
+				frame_usec(priv, 8, 8), TMO_AUTH1) )
 		return 0;
 
 	/* Check whether authentication was successful */
@@ -579,6 +963,7 @@ static int mfc_auth(struct _ccid *ccid, void *priv, uint8_t cmd,
 		return 0;
 	}
 
+	((struct _clrc632 *)priv)->c_flags |= CLRC632_CRYPTO1;
 	return 1;
 }
 
@@ -667,12 +1052,143 @@ static const struct reg_file rf_14443a_init[] = {
 
 static int iso14443a_init(struct _ccid *ccid, void *priv)
 {
+	struct _clrc632 *rc = priv;
+
 	if ( !flush_fifo(ccid, priv) )
 		return 0;
+	rc->c_tx_speed = rc->c_rx_speed = RFID_14443A_SPEED_106K;
+	rc->c_flags &= ~CLRC632_MODE;
 	return reg_write_batch(ccid, priv, rf_14443a_init,
 				ARRAY_SIZE(rf_14443a_init));
 }
 
+/* 10% ASK with NRZ coding out, BPSK subcarrier back, CRC per ISO 3309 */
+#define TYPE_B_BPSK_DEM	((0x2 << RC632_BPSKD_TAUB_SHIFT) | \
+			 (0x3 << RC632_BPSKD_TAUD_SHIFT) | \
+			 RC632_BPSKD_FILTER_AMP_DETECT | \
+			 RC632_BPSKD_NO_RX_EOF | \
+			 RC632_BPSKD_NO_RX_EGT)
+static const struct reg_file rf_14443b_init[] = {
+	{ .reg =	RC632_REG_TX_CONTROL,
+	  .val =	RC632_TXCTRL_MOD_SRC_INT |
+			RC632_TXCTRL_TX2_INV |
+			RC632_TXCTRL_TX2_RF_EN |
+			RC632_TXCTRL_TX1_RF_EN },
+	{ .reg = 	RC632_REG_CW_CONDUCTANCE,
+	  .val = 	0x3f },
+	{ .reg = 	RC632_REG_MOD_CONDUCTANCE,
+	  .val = 	0x04 },
+	{ .reg = 	RC632_REG_CODER_CONTROL,
+	  .val = 	RC632_CDRCTRL_TXCD_NRZ |
+	  		RC632_CDRCTRL_RATE_14443B },
+	{ .reg = 	RC632_REG_MOD_WIDTH,
+	  .val = 	0x13 },
+	{ .reg = 	RC632_REG_MOD_WIDTH_SOF,
+	  .val = 	0x3f },
+	{ .reg = 	RC632_REG_TYPE_B_FRAMING,
+	  .val = 	RC632_TBFRAMING_SOF_11L_3H |
+	  		(6 << RC632_TBFRAMING_SPACE_SHIFT) |
+			RC632_TBFRAMING_EOF_11 },
+	{ .reg = 	RC632_REG_RX_CONTROL1,
+	  .val = 	RC632_RXCTRL1_GAIN_35DB |
+	  		RC632_RXCTRL1_ISO14443 |
+			RC632_RXCTRL1_SUBCP_8},
+	{ .reg = 	RC632_REG_DECODER_CONTROL,
+	  .val = 	RC632_DECCTRL_BPSK |
+	  		RC632_DECCTRL_RXFR_14443B },
+	{ .reg = 	RC632_REG_BIT_PHASE,
+	  .val = 	0xad },
+	{ .reg = 	RC632_REG_RX_THRESHOLD,
+	  .val = 	0xff },
+	{ .reg = 	RC632_REG_BPSK_DEM_CONTROL,
+	  .val = 	TYPE_B_BPSK_DEM },
+	{ .reg = 	RC632_REG_RX_CONTROL2,
+	  .val = 	RC632_RXCTRL2_AUTO_PD |
+	  		RC632_RXCTRL2_DECSRC_INT },
+	{ .reg = 	RC632_REG_RX_WAIT,
+	  .val = 	3 },
+	{ .reg = 	RC632_REG_CHANNEL_REDUNDANCY,
+	  .val = 	RC632_CR_TX_CRC_ENABLE |
+	  		RC632_CR_RX_CRC_ENABLE |
+			RC632_CR_CRC3309 },
+	{ .reg =	RC632_REG_CRC_PRESET_LSB,
+	  .val = 	0xff },
+	{ .reg = 	RC632_REG_CRC_PRESET_MSB,
+	  .val =	0xff },
+};
+
+static int iso14443b_init(struct _ccid *ccid, void *priv)
+{
+	struct _clrc632 *rc = priv;
+
+	if ( !flush_fifo(ccid, priv) )
+		return 0;
+	rc->c_tx_speed = rc->c_rx_speed = RFID_14443A_SPEED_106K;
+	rc->c_flags = (rc->c_flags & ~CLRC632_MODE) | CLRC632_TYPE_B;
+	return reg_write_batch(ccid, priv, rf_14443b_init,
+				ARRAY_SIZE(rf_14443b_init));
+}
+
+/* 10% ASK, 1 out of 4 coding out, single subcarrier high rate back */
+static const struct reg_file rf_15693_init[] = {
+	{ .reg =	RC632_REG_TX_CONTROL,
+	  .val =	RC632_TXCTRL_MOD_SRC_INT |
+			RC632_TXCTRL_TX2_INV |
+			RC632_TXCTRL_TX2_RF_EN |
+			RC632_TXCTRL_TX1_RF_EN },
+	{ .reg = 	RC632_REG_CW_CONDUCTANCE,
+	  .val = 	0x3f },
+	{ .reg = 	RC632_REG_MOD_CONDUCTANCE,
+	  .val = 	0x03 },
+	{ .reg = 	RC632_REG_CODER_CONTROL,
+	  .val = 	RC632_CDRCTRL_TXCD_15693_FAST |
+	  		RC632_CDRCTRL_RATE_15693 },
+	{ .reg = 	RC632_REG_MOD_WIDTH,
+	  .val = 	0x3f },
+	{ .reg = 	RC632_REG_MOD_WIDTH_SOF,
+	  .val = 	0x3f },
+	{ .reg = 	RC632_REG_TYPE_B_FRAMING,
+	  .val = 	0 },
+	{ .reg = 	RC632_REG_RX_CONTROL1,
+	  .val = 	RC632_RXCTRL1_GAIN_35DB |
+	  		RC632_RXCTRL1_ISO15693 |
+			RC632_RXCTRL1_SUBCP_16},
+	{ .reg = 	RC632_REG_DECODER_CONTROL,
+	  .val = 	RC632_DECCTRL_RX_INVERT |
+	  		RC632_DECCTRL_RXFR_15693 },
+	{ .reg = 	RC632_REG_BIT_PHASE,
+	  .val = 	0xe0 },
+	{ .reg = 	RC632_REG_RX_THRESHOLD,
+	  .val = 	0xff },
+	{ .reg = 	RC632_REG_BPSK_DEM_CONTROL,
+	  .val = 	0 },
+	{ .reg = 	RC632_REG_RX_CONTROL2,
+	  .val = 	RC632_RXCTRL2_DECSRC_INT |
+	  		RC632_RXCTRL2_CLK_Q },
+	{ .reg = 	RC632_REG_RX_WAIT,
+	  .val = 	8 },
+	{ .reg = 	RC632_REG_CHANNEL_REDUNDANCY,
+	  .val = 	RC632_CR_TX_CRC_ENABLE |
+	  		RC632_CR_RX_CRC_ENABLE |
+			RC632_CR_CRC3309 },
+	{ .reg =	RC632_REG_CRC_PRESET_LSB,
+	  .val = 	0xff },
+	{ .reg = 	RC632_REG_CRC_PRESET_MSB,
+	  .val =	0xff },
+};
+
+static int iso15693_init(struct _ccid *ccid, void *priv)
+{
+	struct _clrc632 *rc = priv;
+
+	if ( !flush_fifo(ccid, priv) )
+		return 0;
+	rc->c_tx_speed = rc->c_rx_speed = RFID_14443A_SPEED_106K;
+	rc->c_flags = (rc->c_flags & ~CLRC632_MODE) | CLRC632_15693;
+	return reg_write_batch(ccid, priv, rf_15693_init,
+				ARRAY_SIZE(rf_15693_init));
+}
+
 static struct {
 	uint8_t subc_pulses;
 	uint8_t rx_coding;
@@ -715,46 +1231,74 @@ static struct {
 	},
 };
 
-static int set_speed(struct _ccid *ccid, void *priv, unsigned int i)
+/* Coder (and modulation width) is the transmit side, everything else is
+ * the receiver so the two directions can be set independently.
+ */
+static int set_speeds(struct _ccid *ccid, void *priv, unsigned int tx,
+			unsigned int rx)
 {
-	if ( i >= ARRAY_SIZE(rate) )
+	struct _clrc632 *rc = priv;
+	uint8_t coding, dem, cdr;
+
+	if ( tx >= ARRAY_SIZE(rate) || rx >= ARRAY_SIZE(rate) )
 		return 0;
+
+	coding = rate[rx].rx_coding;
+	dem = rate[rx].bpsk_dem_ctrl;
+	cdr = rate[tx].rate;
+
+	/* type B is BPSK at all rates and has its own coder setting */
+	if ( rc->c_flags & CLRC632_TYPE_B ) {
+		coding = RC632_DECCTRL_BPSK;
+		if ( rx == RFID_14443A_SPEED_106K )
+			dem = TYPE_B_BPSK_DEM;
+		if ( tx == RFID_14443A_SPEED_106K )
+			cdr = RC632_CDRCTRL_RATE_14443B;
+	}
 	
 	if ( !asic_set_mask(ccid, priv, RC632_REG_RX_CONTROL1,
 			   RC632_RXCTRL1_SUBCP_MASK,
-			   rate[i].subc_pulses) )
+			   rate[rx].subc_pulses) )
 		return 0;
 
 	if ( !asic_set_mask(ccid, priv, RC632_REG_DECODER_CONTROL,
 			   RC632_DECCTRL_BPSK,
-			   rate[i].rx_coding) )
+			   coding) )
 		return 0;
 
-	if ( !reg_write(ccid, priv, RC632_REG_RX_THRESHOLD, rate[i].rx_threshold) )
+	if ( !reg_write(ccid, priv, RC632_REG_RX_THRESHOLD,
+			rate[rx].rx_threshold) )
 		return 0;
 
-	if ( rate[i].rx_coding == RC632_DECCTRL_BPSK &&
-		!reg_write(ccid, priv, RC632_REG_BPSK_DEM_CONTROL,
-				rate[i].bpsk_dem_ctrl) )
+	if ( coding == RC632_DECCTRL_BPSK &&
+		!reg_write(ccid, priv, RC632_REG_BPSK_DEM_CONTROL, dem) )
 		return 0;
 
 	if ( !asic_set_mask(ccid, priv, RC632_REG_CODER_CONTROL,
 			RC632_CDRCTRL_RATE_MASK,
-			rate[i].rate) )
+			cdr) )
 		return 0;
 
-	if ( !reg_write(ccid, priv, RC632_REG_MOD_WIDTH, rate[i].mod_width) )
+	if ( !reg_write(ccid, priv, RC632_REG_MOD_WIDTH, rate[tx].mod_width) )
 		return 0;
 
+	rc->c_tx_speed = tx;
+	rc->c_rx_speed = rx;
 	return 1;
 }
 
+static int set_speed(struct _ccid *ccid, void *priv, unsigned int i)
+{
+	return set_speeds(ccid, priv, i, i);
+}
+
 static unsigned int get_speeds(struct _ccid *ccid, void *priv)
 {
 	return (1 << RFID_14443A_SPEED_106K) |
 		(1 << RFID_14443A_SPEED_212K) |
 		(1 << RFID_14443A_SPEED_424K) |
-		(1 << RFID_14443A_SPEED_848K);
+		(1 << RFID_14443A_SPEED_848K) |
+		RFID_SPEEDS_ASYM;
 }
 
 static unsigned int carrier_freq(struct _ccid *ccid, void *priv)
@@ -772,6 +1316,11 @@ static unsigned int get_mru(struct _ccid *ccid, void *priv)
 	return 64;
 }
 
+static void dtor(struct _ccid *ccid, void *priv)
+{
+	free(priv);
+}
+
 static const struct rfid_layer1_ops l1_ops = {
 	.rf_power = rf_power,
 
@@ -780,40 +1329,94 @@ static const struct rfid_layer1_ops l1_ops = {
 	.get_error = get_error,
 	.get_coll_pos = get_coll_pos,
 	.set_speed = set_speed,
+	.set_speeds = set_speeds,
 	.transact = transact,
+	.last_error = last_error,
 
 	.iso14443a_init = iso14443a_init,
+	.iso14443b_init = iso14443b_init,
+	.iso15693_init = iso15693_init,
 
 	.mfc_set_key = mfc_set_key,
 	.mfc_set_key_ee = mfc_set_key_ee,
+	.mfc_store_key = mfc_store_key,
 	.mfc_auth = mfc_auth,
 
 	.carrier_freq = carrier_freq,
 	.get_speeds = get_speeds,
 	.mtu = get_mtu,
 	.mru = get_mru,
+
+	.dtor = dtor,
 };
 
+/* Check that coalesced register access does what it says on the tin by
+ * writing the (idle) timer registers and reading them back both ways.
+ */
+static void probe_multi(struct _ccid *ccid, struct _clrc632 *rc)
+{
+	static const struct reg_file w[] = {
+		{ .reg = RC632_REG_TIMER_RELOAD, .val = 0x5a },
+		{ .reg = RC632_REG_TIMER_CLOCK, .val = 0x0a },
+	};
+	struct reg_file r[] = {
+		{ .reg = RC632_REG_TIMER_RELOAD },
+		{ .reg = RC632_REG_TIMER_CLOCK },
+	};
+	uint8_t val;
+
+	if ( NULL == rc->c_ops->reg_write_multi ||
+			NULL == rc->c_ops->reg_read_multi )
+		return;
+
+	if ( (*rc->c_ops->reg_write_multi)(ccid, w, ARRAY_SIZE(w)) <= 0 )
+		goto broken;
+	if ( (*rc->c_ops->reg_read_multi)(ccid, r, ARRAY_SIZE(r)) <= 0 )
+		goto broken;
+	if ( r[0].val != w[0].val || r[1].val != w[1].val )
+		goto broken;
+	if ( !reg_read(ccid, rc, RC632_REG_TIMER_RELOAD, &val) ||
+			val != w[0].val )
+		goto broken;
+
+	rc->c_flags |= CLRC632_MULTI;
+	trace(ccid, " o CLRC632: using coalesced register access\n");
+	return;
+broken:
+	multi_broken(ccid, rc);
+}
+
 int _clrc632_init(struct _cci *cci, const struct _clrc632_ops *asic_ops)
 {
 	struct _ccid *ccid = cci->i_parent;
-	void *priv = (void *)asic_ops;
+	struct _clrc632 *priv;
 
-	if ( !asic_power(ccid, priv, 0) )
+	priv = calloc(1, sizeof(*priv));
+	if ( NULL == priv )
 		return 0;
 
+	priv->c_ops = asic_ops;
+
+	if ( !asic_power(ccid, priv, 0) )
+		goto err;
+
 	usleep(10000);
 
 	if ( !asic_power(ccid, priv, 1) )
-		return 0;
+		goto err;
 
 	if ( !asic_set_bits(ccid, priv, RC632_REG_PAGE0, 0) )
-		return 0;
+		goto err;
 	if ( !asic_set_bits(ccid, priv, RC632_REG_TX_CONTROL, 0x5b) )
-		return 0;
+		goto err;
+
+	probe_multi(ccid, priv);
 
 	if ( !_rfid_init(cci, &l1_ops, priv) )
-		return 0;
+		goto err;
 
 	return 1;
+err:
+	free(priv);
+	return 0;
 }
@@ -6,11 +6,28 @@
 #ifndef _CLRC632_H
 #define _CLRC632_H
 
+struct reg_file {
+	uint8_t reg;
+	uint8_t val;
+};
+
+/* Most register accesses that may be coalesced in to a single exchange */
+#define CLRC632_MAX_MULTI	16
+
 struct _clrc632_ops {
 	int (*fifo_read)(struct _ccid *ccid, uint8_t *buf, size_t len);
 	int (*fifo_write)(struct _ccid *ccid, const uint8_t *buf, size_t len);
 	int (*reg_read)(struct _ccid *ccid, uint8_t reg, uint8_t *val);
 	int (*reg_write)(struct _ccid *ccid, uint8_t reg, uint8_t val);
+
+	/* Optional. Access up to CLRC632_MAX_MULTI registers in one go.
+	 * Return -1 if the response was not understood, in which case the
+	 * driver falls back to single register accesses.
+	 */
+	int (*reg_write_multi)(struct _ccid *ccid,
+				const struct reg_file *r, unsigned int num);
+	int (*reg_read_multi)(struct _ccid *ccid,
+				struct reg_file *r, unsigned int num);
 };
 
 _private int _clrc632_init(struct _cci *cci, const struct _clrc632_ops *ops);
@@ -16,7 +16,6 @@
 #include <openssl/engine.h>
 
 #include <gang.h>
-#include <mpool.h>
 
 #define EMV_ERR_TYPE_SHIFT	30
 #define EMV_ERR_CODE_MASK	((1 << EMV_ERR_TYPE_SHIFT) - 1)
@@ -36,16 +35,42 @@ struct _emv_tag {
 	const char *t_label;
 };
 
+/* One decoded BER-TLV object. All objects for a card live in one array, the
+ * direct children of any constructed object are contiguous within it.
+ */
 struct _emv_data {
 	const struct _emv_tag *d_tag;
-	uint16_t d_id;
-	uint16_t d_flags;
 	const uint8_t *d_data;
-	size_t d_len;
 	struct _emv_data **d_elem;
-	unsigned int d_nmemb;
+	uint16_t d_id;
+	uint16_t d_flags;
+	uint16_t d_len;
+	uint16_t d_parent;
+	uint16_t d_child;
+	uint16_t d_nmemb;
 };
 
+#define EMV_DATA_ROOT		0xffff
+#define EMV_DATA_MAX_ELEM	0xffff
+
+/* Most that is kept for the next card by emv_reset() */
+#define EMV_DB_KEEP_ELEM	1024
+#define EMV_DB_KEEP_SLABS	4
+#define EMV_APP_KEEP		8
+#define EMV_SCRATCH_KEEP	0x1000
+
+/* Tag dictionary, generated from emv_tags.db */
+_private extern const struct _emv_tag _emv_tags[];
+_private extern const uint8_t _emv_tag_page[0x100];
+_private extern const uint8_t _emv_tag_idx[][0x100];
+
+#define EMV_TAG_UNKNOWN		(_emv_tags)
+
+static inline const struct _emv_tag *_emv_find_tag(uint16_t id)
+{
+	return _emv_tags + _emv_tag_idx[_emv_tag_page[id >> 8]][id & 0xff];
+}
+
 static inline int emv_data_atomic(struct _emv_data *d)
 {
 	return !!(d->d_tag->t_type & EMV_DATA_ATOMIC);
@@ -55,23 +80,76 @@ static inline int emv_data_composite(struct _emv_data *d)
 	return !(d->d_tag->t_type & EMV_DATA_ATOMIC);
 }
 
+/* Tag lookup, sorted by tag and then by position in the card */
+struct _emv_idx {
+	uint16_t i_tag;
+	uint16_t i_elem;
+};
+
 struct _emv_db {
+	struct _emv_data *db_ent;
+	unsigned int db_nent;
+	unsigned int db_alloc;
+
+	/* built once all records are in, in one allocation */
+	void *db_tab;
+	size_t db_tab_sz;
+	struct _emv_data **db_ptr;
 	unsigned int db_nmemb;
-	struct _emv_data **db_elem;
+	struct _emv_idx *db_idx;
 	unsigned int db_numrec;
 	struct _emv_data **db_rec;
 	unsigned int db_numsda;
 	struct _emv_data **db_sda;
+
+	/* records decoded so far, less than db_numrec in lazy mode */
+	unsigned int db_ndecoded;
+};
+
+/* Terminal data objects, these are what DOLs are filled in from */
+#define EMV_MAX_TDATA		16
+#define EMV_TDATA_LEN		32
+struct _emv_tdata {
+	uint16_t td_tag;
+	uint8_t td_len;
+	uint8_t td_val[EMV_TDATA_LEN];
+};
+
+/* A DOL compiled down to a list of copies from terminal data objects in to
+ * the command data. Plans are looked up by the DOL bytes so cards of the
+ * same profile share them.
+ */
+#define EMV_DOL_DEFAULT		0 /* left justified */
+#define EMV_DOL_NUMERIC		1 /* right justified */
+#define EMV_DOL_CN		2 /* left justified, 0xff padded */
+struct _emv_dol_step {
+	const struct _emv_tdata *s_src;
+	uint8_t s_ofs;
+	uint8_t s_len;
+	uint8_t s_rule;
 };
 
+struct _emv_dol_plan {
+	const uint8_t *p_dol;
+	size_t p_dol_len;
+	unsigned int p_nstep;
+	uint8_t p_len;
+	struct _emv_dol_step p_step[0];
+};
+
+#define EMV_DOL_CACHE		4
+#define EMV_MAX_PDOL		64
+#define EMV_MAX_AFL		252
+
 struct _emv_app {
 	uint8_t a_recno;
 	uint8_t a_prio;
 	uint8_t a_id_sz;
-	/* uint8_t a_pad0; */
+	uint8_t a_pdol_len;
 	uint8_t a_id[16];
 	char a_name[16];
 	char a_pname[16];
+	uint8_t a_pdol[EMV_MAX_PDOL];
 	struct list_head a_list;
 };
 
@@ -79,8 +157,8 @@ struct _emv {
 	/* hardware */
 	cci_t e_dev;
 	xfr_t e_xfr;
+	xfr_t e_xfr_next; /* second buffer for pipelined commands */
 
-	mpool_t e_data;
 	gang_t e_files;
 	struct _emv_db e_db;
 
@@ -88,30 +166,35 @@ struct _emv {
 	unsigned int e_num_apps;
 	struct list_head e_apps;
 	struct _emv_app *e_app;
+	unsigned int e_num_spare;
+	struct list_head e_app_spare;
+
+	/* DOL construction */
+	struct _emv_tdata e_tdata[EMV_MAX_TDATA];
+	unsigned int e_num_tdata;
+	struct _emv_dol_plan *e_plan[EMV_DOL_CACHE];
+	unsigned int e_plan_next;
 
 	emv_aip_t e_aip;
-	uint8_t *e_afl;
+	uint8_t e_afl[EMV_MAX_AFL];
 	size_t e_afl_len;
 
 	/* crypto stuff */
 	uint8_t e_sda_ok;
 	uint8_t e_dda_ok;
 	uint8_t e_cda_ok; /* for the future */
-	uint8_t _pad0;
+	uint8_t e_lazy;
 
 	RSA *e_ca_pk;
 	RSA *e_iss_pk;
 	RSA *e_icc_pk;
 
+	uint8_t *e_scratch;
+	size_t e_scratch_sz;
+
 	emv_err_t e_err;
 };
 
-#define DOL_NUM_TAGS(x) (sizeof(x)/sizeof(struct dol_tag))
-struct dol_tag {
-	const char *tag;
-	size_t tag_len;
-	int(*op)(uint8_t *ptr, size_t len, void *priv);
-};
 
 /* Utility functions */
 _private uint8_t _emv_sw1(emv_t e);
@@ -120,8 +203,12 @@ _private int _emv_pin2pb(const char *pin, uint8_t *pb);
 
 /* Internal state functions */
 _private void _emv_auth_reset(emv_t e);
+_private RSA *_emv_rsa_key(RSA **pkey, const uint8_t *mod, size_t mod_len,
+				const uint8_t *exp, size_t exp_len);
+_private uint8_t *_emv_scratch(emv_t e, size_t len);
 
 /* Application selection */
+_private void _emv_reset_applist(emv_t e);
 _private void _emv_free_applist(emv_t e);
 _private void _emv_init_applist(emv_t e);
 
@@ -130,23 +217,32 @@ _private int _emv_app_init(emv_t e, const uint8_t *aid, size_t aid_len);
 
 /* Application data retrieval */
 _private int _emv_read_app_data(struct _emv *e);
+_private void _emv_reset_db(struct _emv *e);
+_private void _emv_free_db(struct _emv *e);
 _private const struct _emv_data *_emv_retrieve_data(emv_t, uint16_t id);
 
 /* DOL construction */
-_private uint8_t *_emv_construct_dol(emv_dol_cb_t cbfn,
-					const uint8_t *ptr, size_t len,
-					size_t *ret_len, void *priv);
+_private const struct _emv_dol_plan *_emv_dol_plan(emv_t e,
+						const uint8_t *dol,
+						size_t len);
+_private void _emv_dol_fill(const struct _emv_dol_plan *p, uint8_t *buf);
+_private int _emv_dol_xfr(const struct _emv_dol_plan *p, xfr_t xfr);
+_private void _emv_dol_flush(emv_t e);
 
 /* APDU construction + transactions */
 _private int _emv_read_record(emv_t e, uint8_t sfi, uint8_t record);
+_private int _emv_read_record_submit(emv_t e, uint8_t sfi, uint8_t record);
+_private int _emv_read_record_complete(emv_t e, uint8_t sfi, uint8_t record);
 _private int _emv_select(emv_t e, const uint8_t *name, size_t nlen);
 _private int _emv_select_next(emv_t e, const uint8_t *name, size_t nlen);
 _private int _emv_verify(emv_t e, uint8_t fmt, const uint8_t *p, uint8_t plen);
 _private int _emv_get_data(emv_t e, uint8_t p1, uint8_t p2);
-_private int _emv_get_proc_opts(emv_t e, const uint8_t *pdol, uint8_t len);
+_private int _emv_get_proc_opts(emv_t e, const struct _emv_dol_plan *pdol);
 
 _private int _emv_generate_ac(emv_t e, uint8_t ref,
 				const uint8_t *data, uint8_t len);
+_private int _emv_generate_ac_dol(emv_t e, uint8_t ref,
+				const struct _emv_dol_plan *cdol);
 _private int _emv_int_authenticate(emv_t e, const uint8_t *data, uint8_t len);
 
 _private void _emv_sys_error(struct _emv *e);
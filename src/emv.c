@@ -46,40 +46,6 @@ int _emsa_pss_decode(const uint8_t *msg, size_t msg_len,
 	return 1;
 }
 
-#if 0
-static int tag_cmp(const struct dol_tag *tag, const uint8_t *idb, size_t len)
-{
-	if ( tag->tag_len < len )
-		return 1;
-	if ( tag->tag_len > len )
-		return -1;
-	return memcmp(idb, tag->tag, len);
-}
-
-static const struct dol_tag *find_tag(const struct dol_tag *tags,
-					unsigned int num_tags,
-					const uint8_t *idb,
-					size_t tag_len)
-{
-	while ( num_tags ) {
-		unsigned int i;
-		int cmp;
-
-		i = num_tags / 2U;
-		cmp = tag_cmp(tags + i, idb, tag_len);
-		if ( cmp < 0 ) {
-			num_tags = i;
-		}else if ( cmp > 0 ) {
-			tags = tags + (i + 1U);
-			num_tags = num_tags - (i + 1U);
-		}else
-			return tags + i;
-	}
-
-	return NULL;
-}
-#endif
-
 static uint8_t *construct_dol(emv_dol_cb_t cbfn, const uint8_t *ptr, size_t len,
 				size_t *ret_len, void *priv)
 {
@@ -105,7 +71,7 @@ static uint8_t *construct_dol(emv_dol_cb_t cbfn, const uint8_t *ptr, size_t len,
 		return NULL;
 
 	for(tmp = ptr; tmp < end; tmp++) {
-		//const struct dol_tag *tag;
+		const struct _emv_tag *t;
 		size_t tag_len;
 		uint16_t tag;
 
@@ -123,24 +89,12 @@ static uint8_t *construct_dol(emv_dol_cb_t cbfn, const uint8_t *ptr, size_t len,
 		}
 
 		tmp += tag_len;
-#if 0
-		tag = find_tag(tags, num_tags, tmp, tag_len);
-
-		if ( NULL == tag || NULL == tag->op ||
-				!(*tag->op)(dtmp, *tmp, priv) ) {
-			if ( NULL == tag ) {
-				size_t i;
-				printf("Unknown tag in DOL: ");
-				for (i = 0; i < tag_len; i++)
-					printf("%.2x", tmp[i - tag_len]);
-				printf("\n");
-			}
-			memset(dtmp, 0, *tmp);
-		}
-#else
-		if ( NULL == cbfn || !(*cbfn)(tag, dtmp, *tmp, priv) )
+
+		/* constructed objects are always zero filled */
+		t = _emv_find_tag(tag);
+		if ( NULL == cbfn || !(t->t_type & EMV_DATA_ATOMIC) ||
+				!(*cbfn)(tag, dtmp, *tmp, priv) )
 			memset(dtmp, 0, *tmp);
-#endif
 		dtmp += *tmp;
 	}
 
@@ -154,12 +108,6 @@ uint8_t *emv_construct_dol(emv_dol_cb_t cbfn, const uint8_t *ptr, size_t len,
 	return construct_dol(cbfn, ptr, len, ret_len, priv);
 }
 
-uint8_t *_emv_construct_dol(emv_dol_cb_t cbfn, const uint8_t *ptr, size_t len,
-				size_t *ret_len, void *priv)
-{
-	return construct_dol(cbfn, ptr, len, ret_len, priv);
-}
-
 int _emv_pin2pb(const char *pin, emv_pb_t pb)
 {
 	unsigned int i;
@@ -195,12 +143,33 @@ const uint8_t *emv_generate_ac(emv_t e, uint8_t ref,
 	return xfr_rx_data(e->e_xfr, rlen);
 }
 
-/* Reset authentication related state */
+const uint8_t *emv_generate_ac_dol(emv_t e, uint8_t ref,
+				const uint8_t *cdol, size_t cdol_len,
+				size_t *rlen)
+{
+	const struct _emv_dol_plan *p;
+
+	p = _emv_dol_plan(e, cdol, cdol_len);
+	if ( NULL == p )
+		return NULL;
+
+	if ( !_emv_generate_ac_dol(e, ref, p) )
+		return NULL;
+	return xfr_rx_data(e->e_xfr, rlen);
+}
+
+/* Reset authentication related state, the key objects are kept and
+ * loaded with new keys by _emv_rsa_key()
+ */
 void _emv_auth_reset(emv_t e)
 {
 	e->e_sda_ok = 0;
 	e->e_dda_ok = 0;
 	e->e_cda_ok = 0;
+}
+
+static void auth_free(emv_t e)
+{
 	RSA_free(e->e_ca_pk);
 	RSA_free(e->e_iss_pk);
 	RSA_free(e->e_icc_pk);
@@ -209,22 +178,92 @@ void _emv_auth_reset(emv_t e)
 	e->e_icc_pk = NULL;
 }
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/* RSA became opaque in 1.1, these stand in for its accessors before that */
+static int RSA_set0_key(RSA *r, BIGNUM *n, BIGNUM *e, BIGNUM *d)
+{
+	if ( NULL == n || NULL == e )
+		return 0;
+
+	BN_free(r->n);
+	BN_free(r->e);
+	r->n = n;
+	r->e = e;
+	return 1;
+}
+
+static void RSA_clear_flags(RSA *r, int flags)
+{
+	r->flags &= ~flags;
+}
+#endif
+
+/* Load a public key in to *pkey, which is allocated the first time round
+ * and owned by the emv_t after that. Montgomery contexts are not cached
+ * since the modulus changes with every card.
+ */
+RSA *_emv_rsa_key(RSA **pkey, const uint8_t *mod, size_t mod_len,
+			const uint8_t *exp, size_t exp_len)
+{
+	BIGNUM *n, *x;
+	RSA *key;
+
+	key = *pkey;
+	if ( NULL == key ) {
+		key = RSA_new();
+		if ( NULL == key )
+			return NULL;
+		RSA_clear_flags(key, RSA_FLAG_CACHE_PUBLIC);
+		*pkey = key;
+	}
+
+	n = BN_bin2bn(mod, mod_len, NULL);
+	x = BN_bin2bn(exp, exp_len, NULL);
+	if ( NULL == n || NULL == x || !RSA_set0_key(key, n, x, NULL) ) {
+		BN_free(n);
+		BN_free(x);
+		return NULL;
+	}
+
+	return key;
+}
+
+/* Temporary buffer for building up messages to be hashed, it is only grown
+ * and is kept across cards up to EMV_SCRATCH_KEEP bytes
+ */
+uint8_t *_emv_scratch(emv_t e, size_t len)
+{
+	uint8_t *buf;
+
+	if ( len <= e->e_scratch_sz )
+		return e->e_scratch;
+
+	buf = realloc(e->e_scratch, len);
+	if ( NULL == buf )
+		return NULL;
+
+	e->e_scratch = buf;
+	e->e_scratch_sz = len;
+	return buf;
+}
+
 static void do_emv_fini(emv_t e)
 {
 	if ( e ) {
-		_emv_auth_reset(e);
+		auth_free(e);
+
+		free(e->e_scratch);
 
 		_emv_free_applist(e);
 
-		free(e->e_app);
+		_emv_free_db(e);
 
-		mpool_free(e->e_data);
-		gang_free(e->e_files);
+		_emv_dol_flush(e);
 
-		free(e->e_afl);
- 
 		if ( e->e_xfr )
 			xfr_free(e->e_xfr);
+		if ( e->e_xfr_next )
+			xfr_free(e->e_xfr_next);
 
 		free(e);
 	}
@@ -246,31 +285,56 @@ emv_t emv_init(cci_t cc)
 	if ( e ) {
 		e->e_dev = cc;
 		INIT_LIST_HEAD(&e->e_apps);
+		INIT_LIST_HEAD(&e->e_app_spare);
 
 		e->e_xfr = xfr_alloc(1024, 1204);
 		if ( NULL == e->e_xfr )
 			goto err;
 
-		e->e_data = mpool_new(sizeof(struct _emv_data), 0);
-		if ( NULL == e->e_data )
+		e->e_xfr_next = xfr_alloc(1024, 1204);
+		if ( NULL == e->e_xfr_next )
 			goto err;
 
 		e->e_files = gang_new(0, 0);
 		if ( NULL == e->e_files )
-			goto err_free_data;
+			goto err;
 	}
 
 	return e;
 
-//err_free_files:
-//	gang_free(e->e_files);
-err_free_data:
-	mpool_free(e->e_data);
 err:
 	do_emv_fini(e);
 	return NULL;
 }
 
+int emv_reset(emv_t e, cci_t cc)
+{
+	if ( cci_slot_status(cc) != CHIPCARD_ACTIVE ) {
+		_emv_ccid_error(e);
+		return 0;
+	}
+
+	e->e_dev = cc;
+	xfr_reset(e->e_xfr);
+	xfr_reset(e->e_xfr_next);
+
+	_emv_auth_reset(e);
+	_emv_reset_applist(e);
+	_emv_reset_db(e);
+
+	memset(e->e_aip, 0, sizeof(e->e_aip));
+	e->e_afl_len = 0;
+
+	if ( e->e_scratch_sz > EMV_SCRATCH_KEEP ) {
+		free(e->e_scratch);
+		e->e_scratch = NULL;
+		e->e_scratch_sz = 0;
+	}
+
+	_emv_success(e);
+	return 1;
+}
+
 void emv_fini(emv_t e)
 {
 	do_emv_fini(e);
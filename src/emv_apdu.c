@@ -108,6 +108,81 @@ int _emv_read_record(emv_t e, uint8_t sfi, uint8_t record)
 
 	return 1;
 }
+
+static void read_record_cmd(xfr_t xfr, uint8_t sfi, uint8_t record,
+				uint8_t le)
+{
+	xfr_reset(xfr);
+	xfr_tx_byte(xfr, 0x00);			/* CLA */
+	xfr_tx_byte(xfr, 0xb2);			/* INS: READ RECORD */
+	xfr_tx_byte(xfr, record);		/* P1: record index */
+	xfr_tx_byte(xfr, (sfi << 3) | (1 << 2));	/* P2 */
+	xfr_tx_byte(xfr, le);			/* Le */
+}
+
+/* Pipelined READ RECORD. The command goes out in e_xfr_next with Le=00,
+ * which T=1 and contactless cards answer directly. T=0 cards come back with
+ * 6Cxx or 61xx and get the second command at completion time. Completion
+ * swaps the buffers so that the response ends up in e_xfr as usual, and
+ * e_xfr_next is free for the next submission.
+ */
+int _emv_read_record_submit(emv_t e, uint8_t sfi, uint8_t record)
+{
+	read_record_cmd(e->e_xfr_next, sfi, record, 0);
+	if ( !cci_submit(e->e_dev, e->e_xfr_next) ) {
+		_emv_ccid_error(e);
+		return 0;
+	}
+	return 1;
+}
+
+int _emv_read_record_complete(emv_t e, uint8_t sfi, uint8_t record)
+{
+	xfr_t xfr = e->e_xfr_next;
+	uint8_t sw2;
+
+	e->e_xfr_next = e->e_xfr;
+	e->e_xfr = xfr;
+
+	if ( !cci_complete(e->e_dev, xfr) ) {
+		_emv_ccid_error(e);
+		return 0;
+	}
+
+	switch( xfr_rx_sw1(xfr) ) {
+	case 0x90:
+		return 1;
+	case 0x6c:
+		sw2 = xfr_rx_sw2(xfr);
+		read_record_cmd(xfr, sfi, record, sw2);
+		break;
+	case 0x61:
+		sw2 = xfr_rx_sw2(xfr);
+		xfr_reset(xfr);
+		xfr_tx_byte(xfr, 0x00);		/* CLA */
+		xfr_tx_byte(xfr, 0xc0);		/* INS: GET RESPONSE */
+		xfr_tx_byte(xfr, 0);		/* P1 */
+		xfr_tx_byte(xfr, 0);		/* P2 */
+		xfr_tx_byte(xfr, sw2);		/* Le */
+		break;
+	default:
+		_emv_icc_error(e);
+		return 0;
+	}
+
+	if ( !cci_transact(e->e_dev, xfr) ) {
+		_emv_ccid_error(e);
+		return 0;
+	}
+
+	if ( xfr_rx_sw1(xfr) != 0x90 ) {
+		_emv_icc_error(e);
+		return 0;
+	}
+
+	return 1;
+}
+
 int _emv_get_data(emv_t e, uint8_t p1, uint8_t p2)
 {
 	uint8_t sw2;
@@ -173,19 +248,11 @@ int _emv_verify(emv_t e, uint8_t fmt, const uint8_t *pin, uint8_t plen)
 	return 1;
 }
 
-int _emv_get_proc_opts(emv_t e, const uint8_t *dol, uint8_t len)
+/* Send the command in e_xfr and fetch the response data it leaves */
+static int transact_get_response(emv_t e)
 {
 	uint8_t sw2;
 
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x80);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xa8);		/* INS: GET DATA*/
-	xfr_tx_byte(e->e_xfr, 0);		/* P1 */
-	xfr_tx_byte(e->e_xfr, 0);		/* P2 */
-	xfr_tx_byte(e->e_xfr, len);		/* Lc */
-	xfr_tx_buf(e->e_xfr, dol, len);		/* Data: PDOL */
-	xfr_tx_byte(e->e_xfr, 0);		/* Le */
-
 	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
 		_emv_ccid_error(e);
 		return 0;
@@ -217,11 +284,34 @@ int _emv_get_proc_opts(emv_t e, const uint8_t *dol, uint8_t len)
 	return 1;
 }
 
+/* Command data filled in from the PDOL straight in to the xfr buffer */
+int _emv_get_proc_opts(emv_t e, const struct _emv_dol_plan *pdol)
+{
+	/* BER length of the template needs a second byte past 127 */
+	int long_len = (pdol->p_len > 0x7f);
+
+	xfr_reset(e->e_xfr);
+	xfr_tx_byte(e->e_xfr, 0x80);		/* CLA */
+	xfr_tx_byte(e->e_xfr, 0xa8);		/* INS: GET PROCESSING OPTIONS */
+	xfr_tx_byte(e->e_xfr, 0);		/* P1 */
+	xfr_tx_byte(e->e_xfr, 0);		/* P2 */
+	xfr_tx_byte(e->e_xfr, pdol->p_len + 2 + long_len);	/* Lc */
+	xfr_tx_byte(e->e_xfr, 0x83);		/* Data: command template */
+	if ( long_len )
+		xfr_tx_byte(e->e_xfr, 0x81);
+	xfr_tx_byte(e->e_xfr, pdol->p_len);
+	if ( !_emv_dol_xfr(pdol, e->e_xfr) ) {	/* Data: PDOL */
+		_emv_sys_error(e);
+		return 0;
+	}
+	xfr_tx_byte(e->e_xfr, 0);		/* Le */
+
+	return transact_get_response(e);
+}
+
 int _emv_generate_ac(emv_t e, uint8_t ref,
 			const uint8_t *data, uint8_t len)
 {
-	uint8_t sw2;
-
 	xfr_reset(e->e_xfr);
 	xfr_tx_byte(e->e_xfr, 0x80);		/* CLA */
 	xfr_tx_byte(e->e_xfr, 0xae);		/* INS: GENERATE AC */
@@ -231,41 +321,29 @@ int _emv_generate_ac(emv_t e, uint8_t ref,
 	xfr_tx_buf(e->e_xfr, data, len);	/* Data: */
 	xfr_tx_byte(e->e_xfr, 0);		/* Le */
 
-	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
-		_emv_ccid_error(e);
-		return 0;
-	}
-
-	if ( xfr_rx_sw1(e->e_xfr) != 0x61 ) {
-		_emv_icc_error(e);
-		return 0;
-	}
-	sw2 = xfr_rx_sw2(e->e_xfr);
+	return transact_get_response(e);
+}
 
+int _emv_generate_ac_dol(emv_t e, uint8_t ref,
+				const struct _emv_dol_plan *cdol)
+{
 	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x00);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xc0);		/* INS: GET RESPONSE */
-	xfr_tx_byte(e->e_xfr, 0);		/* P1 */
+	xfr_tx_byte(e->e_xfr, 0x80);		/* CLA */
+	xfr_tx_byte(e->e_xfr, 0xae);		/* INS: GENERATE AC */
+	xfr_tx_byte(e->e_xfr, ref);		/* P1 */
 	xfr_tx_byte(e->e_xfr, 0);		/* P2 */
-	xfr_tx_byte(e->e_xfr, sw2);		/* Le */
-
-	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
-		_emv_ccid_error(e);
-		return 0;
-	}
-
-	if ( xfr_rx_sw1(e->e_xfr) != 0x90 ) {
-		_emv_icc_error(e);
+	xfr_tx_byte(e->e_xfr, cdol->p_len);	/* Lc */
+	if ( !_emv_dol_xfr(cdol, e->e_xfr) ) {	/* Data: CDOL */
+		_emv_sys_error(e);
 		return 0;
 	}
+	xfr_tx_byte(e->e_xfr, 0);		/* Le */
 
-	return 1;
+	return transact_get_response(e);
 }
 
 _private int _emv_int_authenticate(emv_t e, const uint8_t *data, uint8_t len)
 {
-	uint8_t sw2;
-
 	xfr_reset(e->e_xfr);
 	xfr_tx_byte(e->e_xfr, 0x00);		/* CLA */
 	xfr_tx_byte(e->e_xfr, 0x88);		/* INS: INT_AUTHENTICATE */
@@ -275,33 +353,5 @@ _private int _emv_int_authenticate(emv_t e, const uint8_t *data, uint8_t len)
 	xfr_tx_buf(e->e_xfr, data, len);	/* Data: */
 	xfr_tx_byte(e->e_xfr, 0);		/* Le */
 
-	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
-		_emv_ccid_error(e);
-		return 0;
-	}
-
-	if ( xfr_rx_sw1(e->e_xfr) != 0x61 ) {
-		_emv_icc_error(e);
-		return 0;
-	}
-	sw2 = xfr_rx_sw2(e->e_xfr);
-
-	xfr_reset(e->e_xfr);
-	xfr_tx_byte(e->e_xfr, 0x00);		/* CLA */
-	xfr_tx_byte(e->e_xfr, 0xc0);		/* INS: GET RESPONSE */
-	xfr_tx_byte(e->e_xfr, 0);		/* P1 */
-	xfr_tx_byte(e->e_xfr, 0);		/* P2 */
-	xfr_tx_byte(e->e_xfr, sw2);		/* Le */
-
-	if ( !cci_transact(e->e_dev, e->e_xfr) ) {
-		_emv_ccid_error(e);
-		return 0;
-	}
-
-	if ( xfr_rx_sw1(e->e_xfr) != 0x90 ) {
-		_emv_icc_error(e);
-		return 0;
-	}
-
-	return 1;
+	return transact_get_response(e);
 }
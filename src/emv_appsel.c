@@ -10,6 +10,47 @@
 #include <ber.h>
 #include "emv-internal.h"
 
+/* Apps are recycled across selections and cards, up to EMV_APP_KEEP spare
+ * ones are kept around
+ */
+static struct _emv_app *app_new(struct _emv *e)
+{
+	struct _emv_app *a;
+
+	if ( list_empty(&e->e_app_spare) )
+		return calloc(1, sizeof(*a));
+
+	a = list_entry(e->e_app_spare.next, struct _emv_app, a_list);
+	list_del(&a->a_list);
+	e->e_num_spare--;
+
+	memset(a, 0, sizeof(*a));
+	return a;
+}
+
+static void app_put(struct _emv *e, struct _emv_app *a)
+{
+	if ( e->e_num_spare >= EMV_APP_KEEP ) {
+		free(a);
+		return;
+	}
+
+	list_add(&a->a_list, &e->e_app_spare);
+	e->e_num_spare++;
+}
+
+static void put_applist(struct _emv *e)
+{
+	struct _emv_app *a, *t;
+
+	list_for_each_entry_safe(a, t, &e->e_apps, a_list) {
+		list_del(&a->a_list);
+		app_put(e, a);
+	}
+
+	e->e_num_apps = 0;
+}
+
 static int bop_adfname(const uint8_t *ptr, size_t len, void *priv)
 {
 	struct _emv_app *a = priv;
@@ -35,8 +76,11 @@ static int bop_pname(const uint8_t *ptr, size_t len, void *priv)
 
 static int bop_pdol(const uint8_t *ptr, size_t len, void *priv)
 {
-	//struct _emv_app *a = priv;
-	hex_dump(ptr, len, 16);
+	struct _emv_app *a = priv;
+	if ( len > sizeof(a->a_pdol) )
+		return 0;
+	a->a_pdol_len = len;
+	memcpy(a->a_pdol, ptr, len);
 	return 1;
 }
 
@@ -59,7 +103,7 @@ static int bop_dtemp(const uint8_t *ptr, size_t len, void *priv)
 		{ .tag = "\x9f\x12", .tag_len = 2, .op = bop_pname },
 	};
 
-	app = calloc(1, sizeof(*app));
+	app = app_new(e);
 	if ( NULL == app )
 		return 0;
 
@@ -69,7 +113,7 @@ static int bop_dtemp(const uint8_t *ptr, size_t len, void *priv)
 		return 1;
 	}else{
 		_emv_error(e, EMV_ERR_DATA_ELEMENT_NOT_FOUND);
-		free(app);
+		app_put(e, app);
 		return 0;
 	}
 }
@@ -101,13 +145,28 @@ static int add_app(emv_t e)
 		return 1;
 }
 
+void _emv_reset_applist(emv_t e)
+{
+	put_applist(e);
+
+	if ( e->e_app ) {
+		app_put(e, e->e_app);
+		e->e_app = NULL;
+	}
+}
+
 void _emv_free_applist(emv_t e)
 {
 	struct _emv_app *a, *t;
-	list_for_each_entry_safe(a, t, &e->e_apps, a_list) {
+
+	_emv_reset_applist(e);
+
+	list_for_each_entry_safe(a, t, &e->e_app_spare, a_list) {
 		list_del(&a->a_list);
 		free(a);
 	}
+
+	e->e_num_spare = 0;
 }
 
 void emv_app_rid(emv_app_t a, emv_rid_t ret)
@@ -146,16 +205,12 @@ int emv_app_confirm(emv_app_t a)
 int emv_appsel_pse(emv_t e)
 {
 	static const char * const pse = "1PAY.SYS.DDF01";
-	struct _emv_app *a, *tmp;
 	unsigned int i;
 
 	if ( !_emv_select(e, (uint8_t *)pse, strlen(pse)) )
 		return 0;
 
-	list_for_each_entry_safe(a, tmp, &e->e_apps, a_list) {
-		list_del(&a->a_list);
-		free(a);
-	}
+	put_applist(e);
 
 	for (i = 1; ; i++) {
 		if ( !_emv_read_record(e, 1, i) )
@@ -199,7 +254,6 @@ static int bop_fci2(const uint8_t *ptr, size_t len, void *priv)
 		{ .tag = "\x9f\x12", .tag_len = 2, .op = bop_pname},
 		{ .tag = "\x9f\x38", .tag_len = 2, .op = bop_pdol},
 		{ .tag = "\xbf\x0c", .tag_len = 2, .op = NULL},
-		/* FIXME: retrieve optional PDOL if present */
 	};
 	return ber_decode(tags, sizeof(tags)/sizeof(*tags), ptr, len, priv);
 }
@@ -228,15 +282,17 @@ static int set_app(emv_t e)
 	if ( NULL == fci )
 		return 0;
 
-	cur = calloc(1, sizeof(*cur));
+	cur = app_new(e);
 	if ( NULL == cur )
 		return 0;
 
 	if ( !ber_decode(tags, BER_NUM_TAGS(tags), fci, len, cur) ) {
-		free(cur);
+		app_put(e, cur);
 		return 0;
 	}
 
+	if ( e->e_app )
+		app_put(e, e->e_app);
 	e->e_app = cur;
 	return 1;
 }
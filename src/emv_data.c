@@ -11,189 +11,12 @@
 #include <ctype.h>
 #include "emv-internal.h"
 
-static const struct _emv_tag unknown_soldier = {
-	.t_tag = 0x00,
-	.t_type = EMV_DATA_ATOMIC | EMV_DATA_BINARY,
-	.t_label = "UNKNOWN",
-};
-
-static const struct _emv_tag tags[] = {
-	{.t_tag = EMV_TAG_MAGSTRIP_TRACK2,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_BINARY,
-		.t_label = "Magnetic Strip Track 2 Equivalent"},
-	{.t_tag = EMV_TAG_PAN,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_BCD,
-		.t_min = 0, .t_max = 10,
-		.t_label = "Primary Account Number"},
-	{.t_tag = EMV_TAG_RECORD,
-		.t_type = EMV_DATA_BINARY,
-		.t_label = "Application Record"},
-	{.t_tag = EMV_TAG_CDOL1,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_DOL | EMV_DATA_BINARY,
-		.t_label = "Card Risk Management DOL1"},
-	{.t_tag = EMV_TAG_CDOL2,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_DOL | EMV_DATA_BINARY,
-		.t_label = "Card Risk Management DOL2"},
-	{.t_tag = EMV_TAG_CVM_LIST,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_BINARY,
-		.t_label = "Cardholder Verification Method List"},
-	{.t_tag = EMV_TAG_CA_PK_INDEX,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_INT,
-		.t_min = 1, .t_max = 1,
-		.t_label = "CA Public Key Index"},
-	{.t_tag = EMV_TAG_ISS_PK_CERT,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_BINARY,
-		.t_label = "Issuer Public Key Certificate"},
-	{.t_tag = EMV_TAG_ISS_PK_R,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_BINARY,
-		.t_label = "Issuer Public Key Remainder"},
-	{.t_tag = EMV_TAG_SSA_DATA,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_BINARY,
-		.t_label = "Signed Static Authentication Data"},
-	{.t_tag = EMV_TAG_CARDHOLDER_NAME,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_TEXT,
-		.t_label = "Cardholder Name"},
-	{.t_tag = EMV_TAG_DATE_EXP,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_DATE,
-		.t_min = 3, .t_max = 3,
-		.t_label = "Card Expiry Date"},
-	{.t_tag = EMV_TAG_DATE_EFF,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_DATE,
-		.t_min = 3, .t_max = 3,
-		.t_label = "Card Effective Date"},
-	{.t_tag = EMV_TAG_ISSUER_COUNTRY,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_BCD,
-		.t_min = 2, .t_max = 2,
-		.t_label = "Issuer Country Code"},
-	{.t_tag = EMV_TAG_SERVICE_CODE,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_BCD,
-		.t_min = 2, .t_max = 2,
-		.t_label = "Service Code"},
-	{.t_tag = EMV_TAG_PAN_SEQ,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_BCD,
-		.t_min = 1, .t_max = 1,
-		.t_label = "PAN Sequence Number"},
-	{.t_tag = EMV_TAG_USAGE_CONTROL,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_BINARY,
-		.t_min = 2, .t_max = 2,
-		.t_label = "Application Usage Control"},
-	{.t_tag = EMV_TAG_APP_VER,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_INT,
-		.t_min = 2, .t_max = 2,
-		.t_label = "Application Version Number"},
-	{.t_tag = EMV_TAG_IAC_DEFAULT,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_BINARY,
-		.t_min = 5, .t_max = 5,
-		.t_label = "Issuer Action Code (Default)"},
-	{.t_tag = EMV_TAG_IAC_DENY,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_BINARY,
-		.t_min = 5, .t_max = 5,
-		.t_label = "Issuer Action Code (Deny)"},
-	{.t_tag = EMV_TAG_IAC_ONLINE,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_BINARY,
-		.t_min = 5, .t_max = 5,
-		.t_label = "Issuer Action Code (Online)"},
-	{.t_tag = EMV_TAG_MAGSTRIP_TRACK1,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_TEXT,
-		.t_label = "Magnetic Strip Track 1 Discretionary"},
-	{.t_tag = EMV_TAG_ISS_PK_EXP,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_BINARY,
-		.t_min = 1,
-		.t_label = "Issuer Public Key Exponent"},
-	{.t_tag = EMV_TAG_CURRENCY_CODE,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_BINARY,
-		.t_label = "Application Currency Code"},
-	{.t_tag = EMV_TAG_CURRENCY_EXP,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_BINARY,
-		.t_label = "Application Currency Exponent"},
-	{.t_tag = EMV_TAG_ICC_PK_CERT,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_BINARY,
-		.t_label = "ICC Public Key Certificate"},
-	{.t_tag = EMV_TAG_ICC_PK_EXP,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_BINARY,
-		.t_min = 1,
-		.t_label = "ICC Public Key Exponent"},
-	{.t_tag = EMV_TAG_ICC_PK_R,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_BINARY,
-		.t_label = "ICC Public Key Remainder"},
-	{.t_tag = EMV_TAG_DDOL,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_DOL | EMV_DATA_BINARY,
-		.t_label = "Dynamic Data Object List"},
-	{.t_tag = EMV_TAG_SDA_TAG_LIST,
-		.t_type = EMV_DATA_ATOMIC | EMV_DATA_BINARY,
-		.t_label = "SDA Tag List"},
-};
-static const unsigned int num_tags = sizeof(tags)/sizeof(*tags);
-
-static const struct _emv_tag *find_tag(uint16_t id)
-{
-	const struct _emv_tag *t = tags;
-	unsigned int n = num_tags;
-
-	while ( n ) {
-		unsigned int i;
-		int cmp;
-
-		i = n / 2U;
-		cmp = id - t[i].t_tag;
-		if ( cmp < 0 ) {
-			n = i;
-		}else if ( cmp > 0 ) {
-			t = t + (i + 1U);
-			n = n - (i + 1U);
-		}else
-			return t + i;
-	}
-
-	return &unknown_soldier;
-}
-
-static const struct _emv_data *find_data(struct _emv_data **db,
-					unsigned int num, uint16_t id)
-{
-	struct _emv_data **d = db;
-	unsigned int n = num;
-
-	while ( n ) {
-		unsigned int i;
-		int cmp;
-
-		i = n / 2U;
-		cmp = id - d[i]->d_id;
-		if ( cmp < 0 ) {
-			n = i;
-		}else if ( cmp > 0 ) {
-			d = d + (i + 1U);
-			n = n - (i + 1U);
-		}else
-			return d[i];
-	}
-
-	return NULL;
-}
-
-const struct _emv_data *_emv_retrieve_data(emv_t e, uint16_t id)
-{
-	return find_data(e->e_db.db_elem, e->e_db.db_nmemb, id);
-}
-
-emv_data_t emv_retrieve_data(emv_t e, uint16_t id)
-{
-	return find_data(e->e_db.db_elem, e->e_db.db_nmemb, id);
-}
-
 emv_data_t *emv_data_children(emv_data_t d, unsigned int *nmemb)
 {
 	*nmemb = d->d_nmemb;
 	return (emv_data_t *)d->d_elem;
 }
 
-emv_data_t *emv_retrieve_records(emv_t e, unsigned int *nmemb)
-{
-	*nmemb = e->e_db.db_numrec;
-	return (emv_data_t *)e->e_db.db_rec;
-}
-
 const uint8_t *emv_data(emv_data_t d, size_t *len)
 {
 	*len = d->d_len;
@@ -212,7 +35,7 @@ uint16_t emv_data_tag(emv_data_t d)
 
 const char *emv_data_tag_label(emv_data_t d)
 {
-	return (d->d_tag == &unknown_soldier) ? NULL : d->d_tag->t_label;
+	return (d->d_tag == EMV_TAG_UNKNOWN) ? NULL : d->d_tag->t_label;
 }
 
 int emv_data_int(emv_data_t d)
@@ -236,50 +59,59 @@ int emv_data_sda(emv_data_t d)
 	return !!(d->d_flags & EMV_DATA_SDA);
 }
 
-struct db_state {
-	struct _emv *e;
-	struct _emv_db *db;
-	struct _emv_data **rec;
-	struct _emv_data **sda;
-};
-
-static int composite(emv_t e, struct _emv_data *d)
+static int new_elem(struct _emv *e, unsigned int *idx)
 {
-	const uint8_t *ptr, *end;
-	struct _emv_data **elem;
-	size_t num_tags;
-	size_t i;
-
-	ptr = d->d_data;
-	end = ptr + d->d_len;
-
-	for(num_tags = 0; ptr < end; num_tags++) {
-		const uint8_t *tag;
-		size_t tag_len;
-		size_t clen;
-
-		tag = ber_decode_tag(&ptr, end, &tag_len);
-		if ( ptr >= end ) {
-			_emv_error(e, EMV_ERR_BER_DECODE);
-			return 0;
-		}
+	struct _emv_db *db = &e->e_db;
+	struct _emv_data *ent;
+	unsigned int n;
 
-		clen = ber_decode_len(&ptr, end);
-		if ( ptr + clen > end ) {
-			_emv_error(e, EMV_ERR_BER_DECODE);
-			return 0;
-		}
+	if ( db->db_nent < db->db_alloc ) {
+		*idx = db->db_nent++;
+		return 1;
+	}
 
-		ptr += clen;
+	/* no moving once pointers have been handed out */
+	if ( db->db_alloc >= EMV_DATA_MAX_ELEM || db->db_ptr ) {
+		_emv_error(e, EMV_ERR_BER_DECODE);
+		return 0;
 	}
 
-	elem = gang_alloc(e->e_files, num_tags * sizeof(*elem));
-	if ( NULL == elem ) {
+	n = (db->db_alloc) ? db->db_alloc * 2 : 64;
+	if ( n > EMV_DATA_MAX_ELEM )
+		n = EMV_DATA_MAX_ELEM;
+
+	ent = realloc(db->db_ent, n * sizeof(*ent));
+	if ( NULL == ent ) {
 		_emv_sys_error(e);
 		return 0;
 	}
 
-	for(ptr = d->d_data, i = 0; ptr < end; i++) {
+	db->db_ent = ent;
+	db->db_alloc = n;
+	*idx = db->db_nent++;
+	return 1;
+}
+
+/* Decode one level of a constructed object so that its children end up
+ * next to each other, then descend in to those which are constructed.
+ * Every tag and length is decoded exactly once. Indices rather than
+ * pointers are held across new_elem() since it may move the array.
+ */
+static int composite(struct _emv *e, unsigned int idx)
+{
+	struct _emv_db *db = &e->e_db;
+	const uint8_t *ptr, *end;
+	unsigned int first, num, i;
+	uint16_t flags;
+
+	ptr = db->db_ent[idx].d_data;
+	end = ptr + db->db_ent[idx].d_len;
+	flags = db->db_ent[idx].d_flags;
+	first = db->db_nent;
+
+	while ( ptr < end ) {
+		const struct _emv_tag *et;
+		struct _emv_data *d;
 		const uint8_t *tag;
 		size_t tag_len;
 		size_t clen;
@@ -309,40 +141,55 @@ static int composite(emv_t e, struct _emv_data *d)
 			return 0;
 		}
 
-		elem[i] = mpool_alloc(e->e_data);
-		elem[i]->d_tag = find_tag(t);
-		/* FIXME: check min/max sizes */
-		elem[i]->d_flags = d->d_flags;
-		elem[i]->d_id = t;
-		elem[i]->d_data = ptr;
-		elem[i]->d_len = clen;
-		if ( emv_data_composite(elem[i]) ) {
-			if ( !composite(e, elem[i]) )
-				return 0;
-		}else {
-			elem[i]->d_elem = NULL;
-			elem[i]->d_nmemb = 0;
+		/* zero in the dictionary means no limit */
+		et = _emv_find_tag(t);
+		if ( (et->t_min && clen < et->t_min) ||
+				(et->t_max && clen > et->t_max) ) {
+			_emv_error(e, EMV_ERR_BER_DECODE);
+			return 0;
 		}
 
+		if ( !new_elem(e, &i) )
+			return 0;
+
+		d = db->db_ent + i;
+		d->d_tag = et;
+		d->d_id = t;
+		d->d_flags = flags;
+		d->d_data = ptr;
+		d->d_len = clen;
+		d->d_parent = idx;
+		d->d_elem = NULL;
+		d->d_child = 0;
+		d->d_nmemb = 0;
+
 		ptr += clen;
 	}
 
-	d->d_nmemb = num_tags;
-	d->d_elem = elem;
+	num = db->db_nent - first;
+	db->db_ent[idx].d_child = first;
+	db->db_ent[idx].d_nmemb = num;
+
+	for(i = first; i < first + num; i++) {
+		if ( emv_data_composite(db->db_ent + i) &&
+				!composite(e, i) )
+			return 0;
+	}
 
 	return 1;
 }
 
-static int decode_record(struct db_state *s, const uint8_t *ptr,
+static int decode_record(struct _emv *e, const uint8_t *ptr,
 				size_t len, int sda)
 {
 	const uint8_t *end = ptr + len;
-	uint8_t *tmp;
 	struct _emv_data *d;
+	unsigned int idx;
+	uint8_t *tmp;
 
 	if ( len < 2 || ptr[0] != EMV_TAG_RECORD ) {
 		printf("emv: bad application data format\n");
-		_emv_error(s->e, EMV_ERR_BER_DECODE);
+		_emv_error(e, EMV_ERR_BER_DECODE);
 		return 0;
 	}
 
@@ -351,39 +198,36 @@ static int decode_record(struct db_state *s, const uint8_t *ptr,
 
 	len = ber_decode_len(&ptr, end);
 	if ( ptr + len > end ) {
-		_emv_error(s->e, EMV_ERR_BER_DECODE);
+		_emv_error(e, EMV_ERR_BER_DECODE);
 		return 0;
 	}
 
-	d = mpool_alloc(s->e->e_data);
-	if ( NULL == d ) {
-		_emv_sys_error(s->e);
-		return 0;
-	}
-
-	tmp = gang_alloc(s->e->e_files, len);
-	if ( NULL == ptr ) {
-		_emv_sys_error(s->e);
+	tmp = gang_alloc(e->e_files, len);
+	if ( NULL == tmp ) {
+		_emv_sys_error(e);
 		return 0;
 	}
 
 	memcpy(tmp, ptr, len);
 
-	d->d_tag = find_tag(EMV_TAG_RECORD);
+	if ( !new_elem(e, &idx) )
+		return 0;
+
+	d = e->e_db.db_ent + idx;
+	d->d_tag = _emv_find_tag(EMV_TAG_RECORD);
 	d->d_id = EMV_TAG_RECORD;
 	d->d_flags = (sda) ? EMV_DATA_SDA : 0;
 	d->d_data = tmp;
 	d->d_len = len;
+	d->d_parent = EMV_DATA_ROOT;
+	d->d_elem = NULL;
+	d->d_child = 0;
+	d->d_nmemb = 0;
 
-	*s->rec = d;
-	s->rec++;
-
-	if ( sda ) {
-		*s->sda = d;
-		s->sda++;
-	}
+	if ( e->e_lazy )
+		return 1;
 
-	return composite(s->e, d);
+	return composite(e, idx);
 }
 
 #if 0
@@ -425,7 +269,7 @@ static const char *label(struct _emv_data *d)
 {
 	static char buf[20];
 
-	if ( d->d_tag == &unknown_soldier ) {
+	if ( d->d_tag == EMV_TAG_UNKNOWN ) {
 		snprintf(buf, sizeof(buf),
 			"Unknown tag: 0x%.4x", d->d_id);
 		return buf;
@@ -456,148 +300,362 @@ static void dump_records(struct _emv_data **d, size_t num, unsigned depth)
 
 static int cmp(const void *A, const void *B)
 {
-	const struct _emv_data * const *a = A, * const *b = B;
-	return (*a)->d_id - (*b)->d_id;
+	const struct _emv_idx *a = A, *b = B;
+
+	if ( a->i_tag != b->i_tag )
+		return (int)a->i_tag - (int)b->i_tag;
+	return (int)a->i_elem - (int)b->i_elem;
 }
 
-static void count_elements(struct _emv_data **d, size_t num,
-				unsigned int *cnt)
+/* Tables for up to max entries: a pointer to each entry, from which child
+ * arrays are handed out, the records, the SDA records and the tag index.
+ * Entries must not move after this.
+ */
+static int alloc_tables(struct _emv *e, unsigned int max)
 {
+	struct _emv_db *db = &e->e_db;
+	struct _emv_data **rec, **sda;
 	unsigned int i;
+	uint8_t *tab;
+	size_t sz;
 
-	for(i = 0; i < num; i++) {
-		if ( emv_data_composite(d[i]) ) {
-			(*cnt)++;
-			qsort(d[i]->d_elem, d[i]->d_nmemb,
-				sizeof(d[i]->d_elem), cmp);
-
-			/* take advantage of oppertunity to sort elements
-			 * for rapid searching of children */
-			count_elements(d[i]->d_elem,
-					d[i]->d_nmemb, cnt);
+	for(i = 0; i < db->db_nent; i++) {
+		if ( db->db_ent[i].d_parent != EMV_DATA_ROOT )
 			continue;
+		db->db_numrec++;
+		if ( db->db_ent[i].d_flags & EMV_DATA_SDA )
+			db->db_numsda++;
+	}
+
+	sz = (max + db->db_numrec + db->db_numsda) * sizeof(*db->db_ptr) +
+		(max - db->db_numrec) * sizeof(*db->db_idx);
+	if ( 0 == sz )
+		return 1;
+
+	if ( sz > db->db_tab_sz ) {
+		tab = realloc(db->db_tab, sz);
+		if ( NULL == tab ) {
+			_emv_sys_error(e);
+			return 0;
 		}
-		(*cnt)++;
+		db->db_tab = tab;
+		db->db_tab_sz = sz;
+	}
+
+	tab = db->db_tab;
+	db->db_ptr = (struct _emv_data **)tab;
+	db->db_rec = rec = db->db_ptr + max;
+	db->db_sda = sda = db->db_rec + db->db_numrec;
+	db->db_idx = (struct _emv_idx *)(db->db_sda + db->db_numsda);
+
+	for(i = 0; i < db->db_nent; i++) {
+		struct _emv_data *d = db->db_ent + i;
+
+		db->db_ptr[i] = d;
+		if ( d->d_nmemb )
+			d->d_elem = db->db_ptr + d->d_child;
+
+		if ( d->d_parent != EMV_DATA_ROOT )
+			continue;
+		*rec++ = d;
+		if ( d->d_flags & EMV_DATA_SDA )
+			*sda++ = d;
 	}
+
+	return 1;
 }
 
-static void add_elements(struct _emv_data **d, size_t num,
-				struct _emv_data ***db)
+/* Index everything except the records themselves */
+static void build_index(struct _emv_db *db)
 {
+	struct _emv_idx *idx = db->db_idx;
 	unsigned int i;
 
-	for(i = 0; i < num; i++) {
-		if ( emv_data_composite(d[i]) ) {
-			(**db) = d[i];
-			(*db)++;
-			add_elements(d[i]->d_elem,
-					d[i]->d_nmemb, db);
+	for(i = 0; i < db->db_nent; i++) {
+		if ( db->db_ent[i].d_parent == EMV_DATA_ROOT )
 			continue;
+		idx->i_tag = db->db_ent[i].d_id;
+		idx->i_elem = i;
+		idx++;
+	}
+
+	db->db_nmemb = idx - db->db_idx;
+	qsort(db->db_idx, db->db_nmemb, sizeof(*db->db_idx), cmp);
+}
+
+/* Lazy mode: records are stored raw, at the start of the entry array, and
+ * decoded one at a time when a lookup gets to them. A record which fails
+ * to decode is left with no children.
+ */
+static int lazy_reserve(struct _emv *e)
+{
+	struct _emv_db *db = &e->e_db;
+	struct _emv_data *ent;
+	unsigned int i;
+	size_t n;
+
+	/* every object takes at least a tag and a length byte */
+	for(n = db->db_nent, i = 0; i < db->db_nent; i++)
+		n += db->db_ent[i].d_len / 2;
+	if ( n > EMV_DATA_MAX_ELEM )
+		n = EMV_DATA_MAX_ELEM;
+	if ( n <= db->db_alloc )
+		return 1;
+
+	ent = realloc(db->db_ent, n * sizeof(*ent));
+	if ( NULL == ent ) {
+		_emv_sys_error(e);
+		return 0;
+	}
+
+	db->db_ent = ent;
+	db->db_alloc = n;
+	return 1;
+}
+
+static void decode_next(struct _emv *e)
+{
+	struct _emv_db *db = &e->e_db;
+	unsigned int i, first = db->db_nent;
+
+	if ( !composite(e, db->db_ndecoded) ) {
+		db->db_nent = first;
+		db->db_ent[db->db_ndecoded].d_nmemb = 0;
+	}
+
+	for(i = first; i < db->db_nent; i++) {
+		struct _emv_data *d = db->db_ent + i;
+
+		db->db_ptr[i] = d;
+		if ( d->d_nmemb )
+			d->d_elem = db->db_ptr + d->d_child;
+	}
+	if ( db->db_ent[db->db_ndecoded].d_nmemb )
+		db->db_ent[db->db_ndecoded].d_elem = db->db_ptr + first;
+
+	if ( ++db->db_ndecoded == db->db_numrec )
+		build_index(db);
+}
+
+static void decode_all(struct _emv *e)
+{
+	while ( e->e_db.db_ndecoded < e->e_db.db_numrec )
+		decode_next(e);
+}
+
+/* Until everything is decoded, search what is so far and decode more as
+ * needed. Records are decoded in order so the first occurance still wins.
+ */
+static const struct _emv_data *lazy_find(struct _emv *e, uint16_t id)
+{
+	struct _emv_db *db = &e->e_db;
+	unsigned int i = db->db_numrec;
+
+	for(;;) {
+		for(; i < db->db_nent; i++) {
+			if ( db->db_ent[i].d_id == id )
+				return db->db_ent + i;
 		}
-		(**db) = d[i];
-		(*db)++;
+		if ( db->db_ndecoded == db->db_numrec )
+			return NULL;
+		decode_next(e);
 	}
 }
 
-static int read_sfi(struct db_state *s, uint8_t sfi,
-			uint8_t begin, uint8_t end, uint8_t num_sda)
+static const struct _emv_data *find_data(struct _emv *e, uint16_t id)
 {
-	const uint8_t *res;
-	unsigned int i, sda;
-	size_t len;
+	struct _emv_db *db = &e->e_db;
+	const struct _emv_idx *x = db->db_idx;
+	unsigned int n = db->db_nmemb;
 
-	for(i = begin; i <= end; i++ ) {
-		if ( !_emv_read_record(s->e, sfi, i) )
-			return 0;
+	if ( db->db_ndecoded < db->db_numrec )
+		return lazy_find(e, id);
 
-		res = xfr_rx_data(s->e->e_xfr, &len);
-		if ( NULL == res )
-			return 0;
+	/* leftmost match, so first occurance in the card wins */
+	while ( n ) {
+		unsigned int i;
 
-		sda = ( num_sda && i < begin + num_sda ) ? 1 : 0;
-		if ( !decode_record(s, res, len, sda) )
-			return 0;
+		i = n / 2U;
+		if ( x[i].i_tag < id ) {
+			x = x + (i + 1U);
+			n = n - (i + 1U);
+		}else
+			n = i;
 	}
 
-	return 1;
+	if ( x == db->db_idx + db->db_nmemb || x->i_tag != id )
+		return NULL;
+
+	return db->db_ent + x->i_elem;
 }
 
-int emv_read_app_data(struct _emv *e)
+const struct _emv_data *_emv_retrieve_data(emv_t e, uint16_t id)
+{
+	return find_data(e, id);
+}
+
+emv_data_t emv_retrieve_data(emv_t e, uint16_t id)
+{
+	return find_data(e, id);
+}
+
+emv_data_t *emv_retrieve_records(emv_t e, unsigned int *nmemb)
+{
+	decode_all(e);
+	*nmemb = e->e_db.db_numrec;
+	return (emv_data_t *)e->e_db.db_rec;
+}
+
+void emv_set_lazy(emv_t e, int lazy)
+{
+	e->e_lazy = !!lazy;
+}
+
+/* Forget the last card's data but hang on to the memory for the next one,
+ * unless that card was unusually big.
+ */
+void _emv_reset_db(struct _emv *e)
 {
 	struct _emv_db *db = &e->e_db;
-	struct db_state s;
-	struct _emv_data **pps;
-	uint8_t *ptr, *end;
-	unsigned int i;
+	struct _emv_data *ent = db->db_ent;
+	unsigned int alloc = db->db_alloc;
+	void *tab = db->db_tab;
+	size_t tab_sz = db->db_tab_sz;
+
+	if ( alloc > EMV_DB_KEEP_ELEM ) {
+		free(ent);
+		free(tab);
+		ent = tab = NULL;
+		alloc = tab_sz = 0;
+	}
+
+	memset(db, 0, sizeof(*db));
+	db->db_ent = ent;
+	db->db_alloc = alloc;
+	db->db_tab = tab;
+	db->db_tab_sz = tab_sz;
+
+	gang_reset(e->e_files, EMV_DB_KEEP_SLABS);
+}
 
-	mpool_free(e->e_data);
+void _emv_free_db(struct _emv *e)
+{
+	free(e->e_db.db_ent);
+	free(e->e_db.db_tab);
 	gang_free(e->e_files);
+	e->e_files = NULL;
 	memset(&e->e_db, 0, sizeof(e->e_db));
+}
 
-	e->e_data = mpool_new(sizeof(struct _emv_data), 0);
-	if ( NULL == e->e_data ) {
-		_emv_sys_error(e);
-		return 0;
-	}
+/* Position in the AFL, each entry is SFI, first and last record and the
+ * number of records which take part in offline data authentication.
+ */
+struct afl_pos {
+	const uint8_t *ptr, *end;
+	unsigned int rec;
+};
 
-	e->e_files = gang_new(0, 0);
-	if ( NULL == e->e_files ) {
-		_emv_sys_error(e);
-		return 0;
+static int afl_valid(struct afl_pos *p)
+{
+	while ( p->ptr + 4 <= p->end ) {
+		if ( p->rec <= p->ptr[2] )
+			return 1;
+		p->ptr += 4;
+		if ( p->ptr + 4 <= p->end )
+			p->rec = p->ptr[1];
 	}
+	return 0;
+}
 
-	for(ptr = e->e_afl, end = e->e_afl + e->e_afl_len;
-		ptr + 4 <= end; ptr += 4) {
-		//printf("SFI %u: %u rec %u sda\n",
-		//	 ptr[0] >> 3, (ptr[2] + 1) - ptr[1], ptr[3]);
-		db->db_numsda += ptr[3];
-		db->db_numrec += (ptr[2] + 1) - ptr[1];
-	}
+static int afl_first(struct afl_pos *p, const uint8_t *afl, size_t len)
+{
+	p->ptr = afl;
+	p->end = afl + len;
+	p->rec = (len >= 4) ? afl[1] : 0;
+	return afl_valid(p);
+}
 
-	pps = gang_alloc(e->e_files,
-			(db->db_numrec + db->db_numsda) * sizeof(*pps));
-	if ( NULL == pps ) {
-		_emv_sys_error(e);
+static int afl_next(struct afl_pos *p)
+{
+	p->rec++;
+	return afl_valid(p);
+}
+
+static uint8_t afl_sfi(const struct afl_pos *p)
+{
+	return p->ptr[0] >> 3;
+}
+
+static int afl_sda(const struct afl_pos *p)
+{
+	return p->rec < (unsigned int)p->ptr[1] + p->ptr[3];
+}
+
+/* Reads are pipelined across the whole AFL, the READ RECORD for the next
+ * record is submitted before the current one is decoded.
+ */
+static int read_records(struct _emv *e)
+{
+	struct afl_pos cur, nxt;
+	const uint8_t *res;
+	size_t len;
+	int more;
+
+	if ( !afl_first(&cur, e->e_afl, e->e_afl_len) )
+		return 1;
+
+	if ( !_emv_read_record_submit(e, afl_sfi(&cur), cur.rec) )
 		return 0;
-	}
-	
-	db->db_rec = pps;
-	db->db_sda = pps + db->db_numrec;
 
-	s.e = e;
-	s.db = db;
-	s.rec = db->db_rec;
-	s.sda = db->db_sda;
+	for(;;) {
+		if ( !_emv_read_record_complete(e, afl_sfi(&cur), cur.rec) )
+			return 0;
 
-	for(ptr = e->e_afl, end = e->e_afl + e->e_afl_len;
-		ptr + 4 <= end; ptr += 4) {
-		if ( !read_sfi(&s, ptr[0] >> 3, ptr[1], ptr[2], ptr[3]) )
+		nxt = cur;
+		more = afl_next(&nxt);
+		if ( more && !_emv_read_record_submit(e, afl_sfi(&nxt),
+							nxt.rec) )
 			return 0;
-	}
 
-	for(i = 0; i < db->db_numrec; i++) {
-		count_elements(db->db_rec[i]->d_elem,
-			db->db_rec[i]->d_nmemb,
-			&db->db_nmemb);
+		res = xfr_rx_data(e->e_xfr, &len);
+		if ( NULL == res || !decode_record(e, res, len,
+							afl_sda(&cur)) ) {
+			if ( more )
+				cci_complete(e->e_dev, e->e_xfr_next);
+			return 0;
+		}
+
+		if ( !more )
+			break;
+		cur = nxt;
 	}
 
-	pps = db->db_elem = gang_alloc(e->e_files,
-					db->db_nmemb * sizeof(*db->db_elem));
-	if ( NULL == pps ) {
-		_emv_sys_error(e);
+	return 1;
+}
+
+int emv_read_app_data(struct _emv *e)
+{
+	_emv_reset_db(e);
+
+	if ( !read_records(e) )
 		return 0;
-	}
 
-	for(i = 0; i < db->db_numrec; i++) {
-		add_elements(db->db_rec[i]->d_elem,
-			db->db_rec[i]->d_nmemb,
-			&pps);
+	if ( e->e_lazy ) {
+		if ( !lazy_reserve(e) )
+			return 0;
+		if ( !alloc_tables(e, e->e_db.db_alloc) )
+			return 0;
+	}else{
+		if ( !alloc_tables(e, e->e_db.db_nent) )
+			return 0;
+		e->e_db.db_ndecoded = e->e_db.db_numrec;
+		build_index(&e->e_db);
 	}
-	qsort(db->db_elem, db->db_nmemb, sizeof(*db->db_elem), cmp);
 
-	//dump_records(db->db_rec, db->db_numrec, 1);
-	//for(i = 0; i < db->db_nmemb; i++)
-	//	printf("%u. %s\n", i, label(db->db_elem[i]));
+	//dump_records(e->e_db.db_rec, e->e_db.db_numrec, 1);
+	//for(i = 0; i < e->e_db.db_nmemb; i++)
+	//	printf("%u. %s\n", i, label(e->e_db.db_ent +
+	//				e->e_db.db_idx[i].i_elem));
 	_emv_success(e);
 	return 1;
 }
@@ -109,7 +109,7 @@ static int get_required_data(struct _emv *e, struct dda_req *req)
 	return 1;
 }
 
-static RSA *get_ca_key(unsigned int idx, emv_mod_cb_t mod,
+static RSA *get_ca_key(struct _emv *e, unsigned int idx, emv_mod_cb_t mod,
 			emv_exp_cb_t exp, size_t *key_len, void *priv)
 {
 	const uint8_t *modulus, *exponent;
@@ -123,46 +123,29 @@ static RSA *get_ca_key(unsigned int idx, emv_mod_cb_t mod,
 	exponent = (*exp)(priv, idx, &exp_len);
 	if ( NULL == exponent )
 		return NULL;
-	
-	key = RSA_new();
+
+	key = _emv_rsa_key(&e->e_ca_pk, modulus, mod_len, exponent, exp_len);
 	if ( NULL == key )
 		return NULL;
 
-	key->n = BN_bin2bn(modulus, mod_len, NULL);
-	if ( NULL == key->n )
-		goto err_free_key;
-
-	key->e = BN_bin2bn(exponent, exp_len, NULL);
-	if ( NULL == key->e )
-		goto err_free_mod;
-
 	*key_len = mod_len;
 
 	return key;
-err_free_mod:
-	BN_free(key->n);
-err_free_key:
-	RSA_free(key);
-	return NULL;
 }
 
 static int recover(uint8_t *ptr, size_t len, RSA *key)
 {
-	uint8_t *tmp;
+	uint8_t tmp[len];
 	int ret;
 
-	tmp = malloc(len);
-	if ( NULL == tmp )
+	if ( len != (size_t)RSA_size(key) )
 		return 0;
 
 	ret = RSA_public_encrypt(len, ptr, tmp, key, RSA_NO_PADDING);
-	if ( ret < 0 || (unsigned)ret != len ) {
-		free(tmp);
+	if ( ret < 0 || (unsigned)ret != len )
 		return 0;
-	}
 
 	memcpy(ptr, tmp, len);
-	free(tmp);
 
 	return 1;
 }
@@ -190,7 +173,7 @@ static int check_pk_cert(struct _emv *e, struct dda_req *req)
 
 	msg_len = req->pk_cert_len - (SHA_DIGEST_LENGTH + 2) +
 			req->pk_r_len + req->pk_exp_len;
-	tmp = msg = malloc(msg_len);
+	tmp = msg = _emv_scratch(e, msg_len);
 	if ( NULL == msg ) {
 		_emv_sys_error(e);
 		return 0;
@@ -209,24 +192,17 @@ static int check_pk_cert(struct _emv *e, struct dda_req *req)
 	ret = _emsa_pss_decode(msg, msg_len, req->pk_cert, req->pk_cert_len);
 	if ( !ret )
 		_emv_error(e, EMV_ERR_CERTIFICATE);
-	free(msg);
 
 	return ret;
 }
 
 static RSA *make_issuer_pk(struct _emv *e, struct dda_req *req)
 {
-	uint8_t *tmp;
+	uint8_t tmp[req->pk_cert_len + req->pk_r_len];
 	const uint8_t *kb;
 	size_t kb_len;
 	RSA *key;
 
-	tmp = malloc(req->pk_cert_len);
-	if ( NULL == tmp ) {
-		_emv_sys_error(e);
-		return NULL;
-	}
-
 	kb = req->pk_cert + 15;
 	kb_len = req->pk_cert_len - (15 + SHA_DIGEST_LENGTH + 1);
 
@@ -234,19 +210,10 @@ static RSA *make_issuer_pk(struct _emv *e, struct dda_req *req)
 	memcpy(tmp + kb_len, req->pk_r, req->pk_r_len);
 	//printf("Retrieved issuer public key:\n");
 	//hex_dump(kb, req->pk_cert_len, 16);
-	key = RSA_new();
+	key = _emv_rsa_key(&e->e_iss_pk, tmp, req->pk_cert_len,
+				req->pk_exp, req->pk_exp_len);
 	if ( NULL == key ) {
 		_emv_sys_error(e);
-		free(tmp);
-		return NULL;
-	}
-
-	key->n = BN_bin2bn(tmp, req->pk_cert_len, NULL);
-	key->e = BN_bin2bn(req->pk_exp, req->pk_exp_len, NULL);
-	free(tmp);
-	if ( NULL == key->n || NULL == key->e ) {
-		_emv_sys_error(e);
-		RSA_free(key);
 		return NULL;
 	}
 
@@ -278,17 +245,11 @@ static RSA *get_issuer_pk(struct _emv *e, struct dda_req *req,
 
 static RSA *make_icc_pk(struct _emv *e, struct dda_req *req)
 {
-	uint8_t *tmp;
+	uint8_t tmp[req->icc_cert_len + req->icc_r_len];
 	const uint8_t *kb;
 	size_t kb_len;
 	RSA *key;
 
-	tmp = malloc(req->icc_cert_len);
-	if ( NULL == tmp ) {
-		_emv_sys_error(e);
-		return NULL;
-	}
-
 	kb = req->icc_cert + 21;
 	kb_len = req->icc_cert_len - (21 + SHA_DIGEST_LENGTH + 1);
 	req->icc_mod_len = kb_len + req->icc_r_len;
@@ -297,19 +258,10 @@ static RSA *make_icc_pk(struct _emv *e, struct dda_req *req)
 	memcpy(tmp + kb_len, req->icc_r, req->icc_r_len);
 	//printf("Retrieved ICC public key:\n");
 	//hex_dump(tmp, req->icc_mod_len, 16);
-	key = RSA_new();
+	key = _emv_rsa_key(&e->e_icc_pk, tmp, req->icc_mod_len,
+				req->icc_exp, req->icc_exp_len);
 	if ( NULL == key ) {
 		_emv_sys_error(e);
-		free(tmp);
-		return NULL;
-	}
-
-	key->n = BN_bin2bn(tmp, req->icc_mod_len, NULL);
-	key->e = BN_bin2bn(req->icc_exp, req->icc_exp_len, NULL);
-	free(tmp);
-	if ( NULL == key->n || NULL == key->e ) {
-		_emv_sys_error(e);
-		RSA_free(key);
 		return NULL;
 	}
 
@@ -347,7 +299,7 @@ static int check_icc_cert(struct _emv *e, struct dda_req *req)
 
 	msg_len = req->icc_cert_len - (SHA_DIGEST_LENGTH + 2) +
 			req->icc_r_len + req->icc_exp_len + data_len;
-	tmp = msg = malloc(msg_len);
+	tmp = msg = _emv_scratch(e, msg_len);
 	if ( NULL == msg ) {
 		_emv_sys_error(e);
 		return 0;
@@ -373,7 +325,6 @@ static int check_icc_cert(struct _emv *e, struct dda_req *req)
 	ret = _emsa_pss_decode(msg, msg_len, req->icc_cert, req->icc_cert_len);
 	if ( !ret )
 		_emv_error(e, EMV_ERR_CERTIFICATE);
-	free(msg);
 
 	if ( ret && memcmp(req->icc_cert + 2, req->pan, sizeof(req->pan)) ) {
 		printf("emv-dda: ICC certificate PAN mismatch\n");
@@ -407,19 +358,17 @@ static RSA *get_icc_pk(struct _emv *e, struct dda_req *req,
 	return make_icc_pk(e, req);
 }
 
-static int dol_cb(uint16_t tag, uint8_t *ptr, size_t len, void *priv)
+/* A fresh unpredictable number for every INTERNAL AUTHENTICATE */
+static int set_unpredictable_number(emv_t e)
 {
+	uint8_t un[4];
 	unsigned int i;
-	switch(tag) {
-	case EMV_TAG_UNPREDICTABLE_NUMBER:
-		for(i = 0; i < len; i++)
-			i = rand() & 0xff;
-		return 1;
-	default:
-		printf("Unsupported DDOL tag: 0x%x\n", tag);
-		return 0;
-		break;
-	}
+
+	for(i = 0; i < sizeof(un); i++)
+		un[i] = rand() & 0xff;
+
+	return emv_set_terminal_data(e, EMV_TAG_UNPREDICTABLE_NUMBER,
+					un, sizeof(un));
 }
 
 static int decode_da_sig(const uint8_t **pptr, size_t *psz)
@@ -446,56 +395,68 @@ static int decode_da_sig(const uint8_t **pptr, size_t *psz)
 static int verify_dynamic_sig(emv_t e, size_t icc_pk_len,
 				const uint8_t *ddol, size_t ddol_len)
 {
-	uint8_t hbuf[icc_pk_len + ddol_len];
+	const struct _emv_dol_plan *plan;
+	uint8_t hbuf[icc_pk_len + 0xff]; /* DDOL data is limited by Lc */
 	uint8_t md[SHA_DIGEST_LENGTH];
 	uint8_t da[icc_pk_len];
 	uint8_t *dol;
 	size_t dol_len;
 	const uint8_t *sig;
 	size_t sig_len;
-	int ret = 0;
 
-	dol = _emv_construct_dol(dol_cb, ddol, ddol_len, &dol_len, NULL);
-	if ( NULL == dol )
+	if ( icc_pk_len < 24 ) {
+		_emv_error(e, EMV_ERR_CERTIFICATE);
 		return 0;
+	}
+
+	if ( !set_unpredictable_number(e) )
+		return 0;
+
+	plan = _emv_dol_plan(e, ddol, ddol_len);
+	if ( NULL == plan )
+		return 0;
+
+	/* DDOL data goes right where the hash needs it */
+	dol_len = plan->p_len;
+	dol = hbuf + (icc_pk_len - 22);
+	_emv_dol_fill(plan, dol);
 
 	//printf("Constructed DDOL:\n");
 	//hex_dump(dol, dol_len, 16);
 
 	if ( !_emv_int_authenticate(e, dol, dol_len) )
-		goto out;
+		return 0;
 
 	sig = xfr_rx_data(e->e_xfr, &sig_len);
 	if ( NULL == sig )
-		goto out;
+		return 0;
 	
 	if ( !decode_da_sig(&sig, &sig_len) ) {
 		_emv_error(e, EMV_ERR_BER_DECODE);
-		goto out;
+		return 0;
 	}
 
-	if ( sig_len != icc_pk_len || icc_pk_len < 24 ) {
+	if ( sig_len != icc_pk_len ) {
 		_emv_error(e, EMV_ERR_CERTIFICATE);
-		goto out;
+		return 0;
 	}
 
 	memcpy(da, sig, icc_pk_len);
 	if ( !recover(da, icc_pk_len, e->e_icc_pk) ) {
 		_emv_error(e, EMV_ERR_CERTIFICATE);
-		goto out;
+		return 0;
 	}
 	
 	if ( da[0] != 0x6a || da[1] != 0x05 || da[2] != 0x01) {
 		printf("Dynamic application data is corrupt\n");
 		_emv_error(e, EMV_ERR_CERTIFICATE);
-		goto out;
+		return 0;
 	}
 
 	//printf("Signed authentication data:\n");
 	//hex_dump(da, icc_pk_len, 16);
 
 	memcpy(hbuf, da + 1, icc_pk_len - 22);
-	memcpy(hbuf + (icc_pk_len - 22), dol, dol_len);
 	//printf("Data covered by hash:\n");
 	//hex_dump(hbuf, (icc_pk_len - 22) + dol_len, 16);
 
@@ -503,12 +464,10 @@ static int verify_dynamic_sig(emv_t e, size_t icc_pk_len,
 
 	if ( memcmp(md, (da + icc_pk_len) - (SHA_DIGEST_LENGTH + 1),
 			SHA_DIGEST_LENGTH) ) {
-		goto out;
+		return 0;
 	}
-	ret = 1;
-out:
-	free(dol);
-	return ret;
+
+	return 1;
 }
 
 int emv_authenticate_dynamic(emv_t e, emv_mod_cb_t mod, emv_exp_cb_t exp,
@@ -531,20 +490,16 @@ int emv_authenticate_dynamic(emv_t e, emv_mod_cb_t mod, emv_exp_cb_t exp,
 		return 0;
 	}
 
-	ca_key = get_ca_key(req.ca_pk_idx, mod, exp, &ca_key_len, priv);
+	ca_key = get_ca_key(e, req.ca_pk_idx, mod, exp, &ca_key_len, priv);
 	if ( NULL == ca_key ) {
 		_emv_error(e, EMV_ERR_KEY_NOT_FOUND);
 		return 0;
 	}
 
-	e->e_ca_pk = ca_key;
-
-	e->e_iss_pk = get_issuer_pk(e, &req, ca_key, ca_key_len);
-	if ( NULL == e->e_iss_pk )
+	if ( NULL == get_issuer_pk(e, &req, ca_key, ca_key_len) )
 		return 0;
 
-	e->e_icc_pk = get_icc_pk(e, &req, e->e_iss_pk, ca_key_len);
-	if ( NULL == e->e_icc_pk )
+	if ( NULL == get_icc_pk(e, &req, e->e_iss_pk, ca_key_len) )
 		return 0;
 
 	if ( !verify_dynamic_sig(e, req.icc_mod_len, req.ddol, req.ddol_len) )
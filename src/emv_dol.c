@@ -0,0 +1,249 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Data object lists. The terminal keeps a small table of its own data
+ * objects and each DOL the card sends us is compiled once in to a list of
+ * copies out of that table. Building PDOL, CDOL and DDOL related command
+ * data is then just a handful of memcpy's straight in to the xfr buffer.
+*/
+
+#include <ccid.h>
+#include <list.h>
+#include <emv.h>
+#include <ber.h>
+#include "emv-internal.h"
+
+static const struct _emv_tdata *find_tdata(struct _emv *e, uint16_t tag)
+{
+	unsigned int i;
+
+	for(i = 0; i < e->e_num_tdata; i++) {
+		if ( e->e_tdata[i].td_tag == tag )
+			return e->e_tdata + i;
+	}
+
+	return NULL;
+}
+
+int emv_set_terminal_data(emv_t e, uint16_t tag,
+				const uint8_t *ptr, size_t len)
+{
+	struct _emv_tdata *td;
+
+	if ( len > EMV_TDATA_LEN ) {
+		_emv_error(e, EMV_ERR_FUNC_NOT_SUPPORTED);
+		return 0;
+	}
+
+	td = (struct _emv_tdata *)find_tdata(e, tag);
+	if ( NULL == td ) {
+		if ( e->e_num_tdata >= EMV_MAX_TDATA ) {
+			_emv_error(e, EMV_ERR_FUNC_NOT_SUPPORTED);
+			return 0;
+		}
+
+		/* cached plans will have zero filled this tag */
+		_emv_dol_flush(e);
+
+		td = e->e_tdata + e->e_num_tdata++;
+		td->td_tag = tag;
+	}
+
+	/* plans point at the table entry so an update in place, such as a
+	 * fresh unpredictable number, doesn't need a recompile
+	 */
+	memcpy(td->td_val, ptr, len);
+	td->td_len = len;
+
+	_emv_success(e);
+	return 1;
+}
+
+/* Walk the DOL, counting entries if step is NULL or else filling in a step
+ * for each entry that we have a data object for. Anything else, including
+ * all constructed objects, is left to be zero filled.
+ */
+static int dol_walk(struct _emv *e, const uint8_t *ptr, size_t len,
+			struct _emv_dol_step *step, unsigned int *nstep,
+			size_t *tot)
+{
+	const uint8_t *end = ptr + len;
+	unsigned int n = 0;
+	size_t sz = 0;
+
+	while ( ptr < end ) {
+		const struct _emv_tdata *td;
+		const struct _emv_tag *t;
+		size_t tag_len;
+		uint16_t tag;
+
+		tag_len = ber_tag_len(ptr, end);
+		switch(tag_len) {
+		case 1:
+			tag = ptr[0];
+			break;
+		case 2:
+			tag = (ptr[0] << 8) | ptr[1];
+			break;
+		default:
+			return 0;
+		}
+
+		ptr += tag_len;
+		if ( ptr >= end || (*ptr & 0x80) )
+			return 0;
+
+		if ( NULL == step ) {
+			n++;
+			goto next;
+		}
+
+		t = _emv_find_tag(tag);
+		if ( !(t->t_type & EMV_DATA_ATOMIC) )
+			goto next;
+
+		td = find_tdata(e, tag);
+		if ( NULL == td )
+			goto next;
+
+		step[n].s_src = td;
+		step[n].s_ofs = sz;
+		step[n].s_len = *ptr;
+		switch(t->t_type & EMV_DATA_TYPE_MASK) {
+		case EMV_DATA_BCD:
+		case EMV_DATA_DATE:
+			step[n].s_rule = EMV_DOL_NUMERIC;
+			break;
+		case EMV_DATA_CN:
+			step[n].s_rule = EMV_DOL_CN;
+			break;
+		default:
+			step[n].s_rule = EMV_DOL_DEFAULT;
+			break;
+		}
+		n++;
+next:
+		sz += *ptr;
+		ptr++;
+
+		/* has to fit in Lc along with any template, 83 81 xx */
+		if ( sz > 0xfc )
+			return 0;
+	}
+
+	*nstep = n;
+	*tot = sz;
+	return 1;
+}
+
+static struct _emv_dol_plan *dol_compile(struct _emv *e,
+					const uint8_t *dol, size_t len)
+{
+	struct _emv_dol_plan *p;
+	unsigned int nstep;
+	size_t sz;
+
+	if ( !dol_walk(e, dol, len, NULL, &nstep, &sz) ) {
+		_emv_error(e, EMV_ERR_BER_DECODE);
+		return NULL;
+	}
+
+	p = malloc(sizeof(*p) + sizeof(*p->p_step) * nstep + len);
+	if ( NULL == p ) {
+		_emv_sys_error(e);
+		return NULL;
+	}
+
+	dol_walk(e, dol, len, p->p_step, &p->p_nstep, &sz);
+	p->p_len = sz;
+
+	p->p_dol = (uint8_t *)(p->p_step + nstep);
+	p->p_dol_len = len;
+	memcpy((uint8_t *)p->p_dol, dol, len);
+
+	return p;
+}
+
+const struct _emv_dol_plan *_emv_dol_plan(emv_t e,
+					const uint8_t *dol, size_t len)
+{
+	struct _emv_dol_plan *p;
+	unsigned int i;
+
+	for(i = 0; i < EMV_DOL_CACHE; i++) {
+		p = e->e_plan[i];
+		if ( NULL == p || p->p_dol_len != len )
+			continue;
+		if ( len && memcmp(p->p_dol, dol, len) )
+			continue;
+		return p;
+	}
+
+	p = dol_compile(e, dol, len);
+	if ( NULL == p )
+		return NULL;
+
+	i = e->e_plan_next;
+	free(e->e_plan[i]);
+	e->e_plan[i] = p;
+	e->e_plan_next = (i + 1) % EMV_DOL_CACHE;
+
+	return p;
+}
+
+/* Data longer than asked for loses the leftmost bytes if numeric and the
+ * rightmost otherwise, shorter data is padded with zeros on the same side.
+ * Compressed numeric is padded on the right with 0xff instead.
+ */
+void _emv_dol_fill(const struct _emv_dol_plan *p, uint8_t *buf)
+{
+	const struct _emv_dol_step *s;
+	unsigned int i;
+
+	memset(buf, 0, p->p_len);
+
+	for(i = 0, s = p->p_step; i < p->p_nstep; i++, s++) {
+		const struct _emv_tdata *td = s->s_src;
+		uint8_t *dst = buf + s->s_ofs;
+		const uint8_t *src = td->td_val;
+		size_t n = td->td_len;
+
+		if ( n > s->s_len ) {
+			if ( s->s_rule == EMV_DOL_NUMERIC )
+				src += n - s->s_len;
+			n = s->s_len;
+		}else if ( s->s_rule == EMV_DOL_NUMERIC ) {
+			dst += s->s_len - n;
+		}else if ( s->s_rule == EMV_DOL_CN ) {
+			memset(dst + n, 0xff, s->s_len - n);
+		}
+
+		memcpy(dst, src, n);
+	}
+}
+
+int _emv_dol_xfr(const struct _emv_dol_plan *p, xfr_t xfr)
+{
+	uint8_t *ptr;
+
+	ptr = xfr_tx_reserve(xfr, p->p_len);
+	if ( NULL == ptr )
+		return 0;
+
+	_emv_dol_fill(p, ptr);
+	return 1;
+}
+
+void _emv_dol_flush(emv_t e)
+{
+	unsigned int i;
+
+	for(i = 0; i < EMV_DOL_CACHE; i++) {
+		free(e->e_plan[i]);
+		e->e_plan[i] = NULL;
+	}
+
+	e->e_plan_next = 0;
+}
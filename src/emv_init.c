@@ -17,11 +17,12 @@ static int parse_format1(emv_t e, const uint8_t *ptr, size_t len)
 
 	memcpy(e->e_aip, ptr, sizeof(e->e_aip));
 
-	e->e_afl_len = len - sizeof(e->e_aip);
-	e->e_afl = malloc(e->e_afl_len);
-	if ( NULL == e->e_afl )
+	if ( len - sizeof(e->e_aip) > sizeof(e->e_afl) ) {
+		_emv_error(e, EMV_ERR_BER_DECODE);
 		return 0;
+	}
 
+	e->e_afl_len = len - sizeof(e->e_aip);
 	memcpy(e->e_afl, ptr + sizeof(e->e_aip), e->e_afl_len);
 
 	return 1;
@@ -44,10 +45,11 @@ again:
 		memcpy(e->e_aip, inner, sizeof(e->e_aip));
 		break;
 	case 0x94:
-		e->e_afl_len = tag.ber_len;
-		e->e_afl = malloc(tag.ber_len);
-		if ( NULL == e->e_afl )
+		if ( tag.ber_len > sizeof(e->e_afl) ) {
+			_emv_error(e, EMV_ERR_BER_DECODE);
 			return 0;
+		}
+		e->e_afl_len = tag.ber_len;
 		memcpy(e->e_afl, inner, tag.ber_len);
 		break;
 	default:
@@ -66,14 +68,20 @@ again:
 
 static int get_aip(emv_t e)
 {
-	static const uint8_t pdol[] = {0x83, 0x00};
+	const struct _emv_dol_plan *pdol;
 	const uint8_t *res, *inner;
 	struct gber_tag tag;
 	size_t len;
 
-	/* TODO: handle case where PDOL was specified */
+	if ( e->e_app )
+		pdol = _emv_dol_plan(e, e->e_app->a_pdol,
+					e->e_app->a_pdol_len);
+	else
+		pdol = _emv_dol_plan(e, NULL, 0);
+	if ( NULL == pdol )
+		return 0;
 
-	if ( !_emv_get_proc_opts(e, pdol, sizeof(pdol)) ) {
+	if ( !_emv_get_proc_opts(e, pdol) ) {
 		return 0;
 	}
 	res = xfr_rx_data(e->e_xfr, &len);
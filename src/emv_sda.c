@@ -69,7 +69,7 @@ static int get_required_data(struct _emv *e, struct sda_req *req)
 	return 1;
 }
 
-static RSA *get_ca_key(unsigned int idx, emv_mod_cb_t mod,
+static RSA *get_ca_key(struct _emv *e, unsigned int idx, emv_mod_cb_t mod,
 			emv_exp_cb_t exp, size_t *key_len, void *priv)
 {
 	const uint8_t *modulus, *exponent;
@@ -84,45 +84,28 @@ static RSA *get_ca_key(unsigned int idx, emv_mod_cb_t mod,
 	if ( NULL == exponent )
 		return NULL;
 
-	key = RSA_new();
+	key = _emv_rsa_key(&e->e_ca_pk, modulus, mod_len, exponent, exp_len);
 	if ( NULL == key )
 		return NULL;
 
-	key->n = BN_bin2bn(modulus, mod_len, NULL);
-	if ( NULL == key->n )
-		goto err_free_key;
-
-	key->e = BN_bin2bn(exponent, exp_len, NULL);
-	if ( NULL == key->e )
-		goto err_free_mod;
-
 	*key_len = mod_len;
 
 	return key;
-err_free_mod:
-	BN_free(key->n);
-err_free_key:
-	RSA_free(key);
-	return NULL;
 }
 
 static int recover(uint8_t *ptr, size_t len, RSA *key)
 {
-	uint8_t *tmp;
+	uint8_t tmp[len];
 	int ret;
 
-	tmp = malloc(len);
-	if ( NULL == tmp )
+	if ( len != (size_t)RSA_size(key) )
 		return 0;
 
 	ret = RSA_public_encrypt(len, ptr, tmp, key, RSA_NO_PADDING);
-	if ( ret < 0 || (unsigned)ret != len ) {
-		free(tmp);
+	if ( ret < 0 || (unsigned)ret != len )
 		return 0;
-	}
 
 	memcpy(ptr, tmp, len);
-	free(tmp);
 
 	return 1;
 }
@@ -150,7 +133,7 @@ static int check_pk_cert(struct _emv *e, struct sda_req *req)
 
 	msg_len = req->pk_cert_len - (SHA_DIGEST_LENGTH + 2) +
 			req->pk_r_len + req->pk_exp_len;
-	tmp = msg = malloc(msg_len);
+	tmp = msg = _emv_scratch(e, msg_len);
 	if ( NULL == msg ) {
 		_emv_sys_error(e);
 		return 0;
@@ -169,24 +152,17 @@ static int check_pk_cert(struct _emv *e, struct sda_req *req)
 	ret = _emsa_pss_decode(msg, msg_len, req->pk_cert, req->pk_cert_len);
 	if ( !ret )
 		_emv_error(e, EMV_ERR_CERTIFICATE);
-	free(msg);
 
 	return ret;
 }
 
 static RSA *make_issuer_pk(struct _emv *e, struct sda_req *req)
 {
-	uint8_t *tmp;
+	uint8_t tmp[req->pk_cert_len + req->pk_r_len];
 	const uint8_t *kb;
 	size_t kb_len;
 	RSA *key;
 
-	tmp = malloc(req->pk_cert_len);
-	if ( NULL == tmp ) {
-		_emv_sys_error(e);
-		return NULL;
-	}
-
 	kb = req->pk_cert + 15;
 	kb_len = req->pk_cert_len - (15 + 21);
 
@@ -194,19 +170,10 @@ static RSA *make_issuer_pk(struct _emv *e, struct sda_req *req)
 	memcpy(tmp + kb_len, req->pk_r, req->pk_r_len);
 	printf("Retrieved issuer public key:\n");
 	hex_dump(kb, req->pk_cert_len, 16);
-	key = RSA_new();
+	key = _emv_rsa_key(&e->e_iss_pk, tmp, req->pk_cert_len,
+				req->pk_exp, req->pk_exp_len);
 	if ( NULL == key ) {
 		_emv_sys_error(e);
-		free(tmp);
-		return NULL;
-	}
-
-	key->n = BN_bin2bn(tmp, req->pk_cert_len, NULL);
-	key->e = BN_bin2bn(req->pk_exp, req->pk_exp_len, NULL);
-	free(tmp);
-	if ( NULL == key->n || NULL == key->e ) {
-		_emv_sys_error(e);
-		RSA_free(key);
 		return NULL;
 	}
 
@@ -253,7 +220,7 @@ static int check_ssa(struct _emv *e, const uint8_t *ptr, size_t len,
 	cf_len = len - (SHA_DIGEST_LENGTH + 2);
 	msg_len = cf_len + data_len;
 
-	tmp = msg = malloc(msg_len);
+	tmp = msg = _emv_scratch(e, msg_len);
 	if ( NULL == msg ) {
 		_emv_sys_error(e);
 		return 0;
@@ -279,7 +246,6 @@ static int check_ssa(struct _emv *e, const uint8_t *ptr, size_t len,
 	ret = _emsa_pss_decode(msg, msg_len, ptr, len);
 	if ( !ret )
 		_emv_error(e, EMV_ERR_SSA_SIGNATURE);
-	free(msg);
 
 	return ret;
 }
@@ -332,16 +298,13 @@ int emv_authenticate_static_data(emv_t e, emv_mod_cb_t mod, emv_exp_cb_t exp,
 		return 0;
 	}
 
-	ca_key = get_ca_key(req.ca_pk_idx, mod, exp, &ca_key_len, priv);
+	ca_key = get_ca_key(e, req.ca_pk_idx, mod, exp, &ca_key_len, priv);
 	if ( NULL == ca_key ) {
 		_emv_error(e, EMV_ERR_KEY_NOT_FOUND);
 		return 0;
 	}
 
-	e->e_ca_pk = ca_key;
-
-	e->e_iss_pk = get_issuer_pk(e, &req, ca_key, ca_key_len);
-	if ( NULL == e->e_iss_pk )
+	if ( NULL == get_issuer_pk(e, &req, ca_key, ca_key_len) )
 		return 0;
 
 	if ( !verify_ssa_data(e, e->e_db.db_sda, e->e_db.db_numsda,
@@ -0,0 +1,92 @@
+#!/usr/bin/python
+# This file is part of ccid-utils
+# Copyright (c) 2011 Gianni Tedesco
+# This is free software released under the terms of the GNU GPL v3
+#
+# Generate the EMV tag dictionary from emv_tags.db. Tags are looked up in
+# two steps, the high byte picks a page and the low byte an entry within it
+# which indexes the tag array. Page zero is empty and entry zero of the tag
+# array is for unknown tags.
+
+import sys
+
+types = {
+	'binary': 'EMV_DATA_BINARY',
+	'text': 'EMV_DATA_TEXT',
+	'int': 'EMV_DATA_INT',
+	'bcd': 'EMV_DATA_BCD',
+	'date': 'EMV_DATA_DATE',
+	'cn': 'EMV_DATA_CN',
+}
+
+def parse(fn):
+	ret = {}
+	for (lno, l) in enumerate(open(fn)):
+		l = l.strip()
+		if not l or l[0] == '#':
+			continue
+		f = l.split(None, 5)
+		if len(f) != 6:
+			raise ValueError('%s:%d: bad line' % (fn, lno + 1))
+		(tag, typ, tmin, tmax, flags, label) = f
+		tag = int(tag, 16)
+		if tag > 0xffff or tag in ret or typ not in types:
+			raise ValueError('%s:%d: bad tag' % (fn, lno + 1))
+		t = [types[typ]]
+		if 'c' not in flags:
+			t.append('EMV_DATA_ATOMIC')
+		if 'd' in flags:
+			t.append('EMV_DATA_DOL')
+		ret[tag] = (' | '.join(t), int(tmin), int(tmax), label)
+	return ret
+
+def main(argv):
+	if len(argv) != 2:
+		sys.stderr.write('Usage: %s emv_tags.db\n' % argv[0])
+		return 1
+
+	tags = parse(argv[1])
+	order = sorted(tags.keys())
+	if len(order) > 0xfe:
+		sys.stderr.write('%s: too many tags\n' % argv[0])
+		return 1
+
+	pages = [None] + sorted(set([t >> 8 for t in order]))
+
+	o = sys.stdout
+	o.write('/* Generated by emv_tags.py from emv_tags.db, do not edit */\n')
+	o.write('#include <ccid.h>\n#include <list.h>\n#include <emv.h>\n')
+	o.write('#include "emv-internal.h"\n\n')
+
+	o.write('const struct _emv_tag _emv_tags[] = {\n')
+	o.write('\t{.t_tag = 0x0000,\n')
+	o.write('\t\t.t_type = EMV_DATA_ATOMIC | EMV_DATA_BINARY,\n')
+	o.write('\t\t.t_label = "UNKNOWN"},\n')
+	for t in order:
+		(typ, tmin, tmax, label) = tags[t]
+		o.write('\t{.t_tag = 0x%.4x,\n' % t)
+		o.write('\t\t.t_type = %s,\n' % typ)
+		o.write('\t\t.t_min = %d, .t_max = %d,\n' % (tmin, tmax))
+		o.write('\t\t.t_label = "%s"},\n' % label.replace('"', '\\"'))
+	o.write('};\n\n')
+
+	o.write('const uint8_t _emv_tag_page[0x100] = {\n')
+	for (i, p) in enumerate(pages):
+		if p is not None:
+			o.write('\t[0x%.2x] = %d,\n' % (p, i))
+	o.write('};\n\n')
+
+	o.write('const uint8_t _emv_tag_idx[%d][0x100] = {\n' % len(pages))
+	for p in pages:
+		o.write('\t{\n')
+		if p is None:
+			o.write('\t\t/* unknown */\n')
+		for (i, t) in enumerate(order):
+			if t >> 8 == p:
+				o.write('\t\t[0x%.2x] = %d,\n' % (t & 0xff, i + 1))
+		o.write('\t},\n')
+	o.write('};\n')
+	return 0
+
+if __name__ == '__main__':
+	sys.exit(main(sys.argv))
@@ -25,6 +25,8 @@ struct _gang {
 	size_t g_alloc;
 	struct _slab *g_slab;
 	uint8_t *g_ptr;
+	struct _slab *g_free;
+	unsigned int g_nfree;
 };
 
 gang_t gang_new(size_t alloc, size_t align)
@@ -39,6 +41,8 @@ gang_t gang_new(size_t alloc, size_t align)
 	g->g_alloc = (0 == alloc) ? GANG_DEFAULT_ALLOC : alloc;
 	g->g_slab = NULL;
 	g->g_ptr = NULL;
+	g->g_free = NULL;
+	g->g_nfree = 0;
 
 	return g;
 }
@@ -53,16 +57,29 @@ static void *do_alloc_slow(struct _gang *g, size_t sz, size_t align)
 {
 	struct _slab *s;
 	uint8_t *ret;
-
-	s = malloc(g->g_alloc);
-	if ( NULL == s )
-		return NULL;
-
-	POISON(s, g->g_alloc);
+	int recycled = 0;
+
+	if ( g->g_free ) {
+		s = g->g_free;
+		g->g_free = s->s_next;
+		g->g_nfree--;
+		recycled = 1;
+	}else{
+		s = malloc(g->g_alloc);
+		if ( NULL == s )
+			return NULL;
+		POISON(s, g->g_alloc);
+	}
 
 	ret = ptr_align(s->s_data, align);
 	if ( ret + sz > (uint8_t *)s + g->g_alloc ) {
-		free(s);
+		if ( recycled ) {
+			s->s_next = g->g_free;
+			g->g_free = s;
+			g->g_nfree++;
+		}else{
+			free(s);
+		}
 		return NULL;
 	}
 
@@ -116,6 +133,29 @@ void *gang_alloc0_a(gang_t g, size_t sz, size_t align)
 	return ret;
 }
 
+/* Release everything allocated from the gang in one go. Up to max slabs
+ * are kept back for the next round of allocations, the rest are freed.
+ */
+void gang_reset(gang_t g, unsigned int max)
+{
+	struct _slab *s, *tmp;
+
+	for(s = g->g_slab; (tmp = s); ) {
+		s = s->s_next;
+		POISON(tmp, g->g_alloc);
+		if ( g->g_nfree < max ) {
+			tmp->s_next = g->g_free;
+			g->g_free = tmp;
+			g->g_nfree++;
+		}else{
+			free(tmp);
+		}
+	}
+
+	g->g_slab = NULL;
+	g->g_ptr = NULL;
+}
+
 void gang_free(gang_t g)
 {
 	struct _slab *s, *tmp;
@@ -128,6 +168,11 @@ void gang_free(gang_t g)
 		POISON(tmp, g->g_alloc);
 	}
 
+	for(s = g->g_free; (tmp = s); free(tmp)) {
+		s = s->s_next;
+		POISON(tmp, g->g_alloc);
+	}
+
 	POISON(g, sizeof(*g));
 	free(g);
 }
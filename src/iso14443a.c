@@ -31,6 +31,8 @@
 #define ISO14443A_SF_CMD_REQA 		0x26
 #define ISO14443A_SF_CMD_WUPA 		0x52
 #define ISO14443A_SF_CMD_OPT_TIMESLOT	0x35 /* Annex C */
+#define ISO14443A_CMD_HLTA		0x50
+#define ISO14443A_CASCADE_TAG		0x88
 /* 40 to 4f and 78 to 7f: proprietary */
 
 #define	ISO14443A_BITOFCOL_NONE		0xffffffff
@@ -43,6 +45,7 @@ enum iso14443a_state {
 	ISO14443A_STATE_NO_BITFRAME_ANTICOL,
 	ISO14443A_STATE_ANTICOL_RUNNING,
 	ISO14443A_STATE_SELECTED,
+	ISO14443A_STATE_HALTED,
 };
 
 static uint8_t fsdi_table[] = { 15, 23, 31, 39, 47, 63, 95, 127, 255 };
@@ -124,9 +127,13 @@ int _iso14443a_transceive_acf(struct _cci *cci,
 		if ( !_rfid_layer1_get_coll_pos(cci, &boc) )
 			return 0;
 
-		/* bit of collission relative to start of part 1 of
-		 * anticollision frame (!) */
-		*bit_of_col = 2*8 + boc;
+		/* CollPos counts from the first bit of the first byte
+		 * received, which is the byte we split if RxAlign is set,
+		 * make it relative to the start of the frame (SEL, NVB).
+		 */
+		if ( !boc )
+			boc = 1;
+		*bit_of_col = tx_bytes * 8 + boc;
 	}
 
 	return 1;
@@ -154,19 +161,17 @@ int _iso14443ab_transceive(struct _cci *cci,
 
 	switch (frametype) {
 	case RFID_14443A_FRAME_REGULAR:
-	case RFID_MIFARE_FRAME:
 		mode.flags = RF_PARITY_ENABLE | RF_TX_CRC | RF_RX_CRC;
 		break;
-	case RFID_14443B_FRAME_REGULAR:
-		mode.flags = RF_TX_CRC | RF_RX_CRC /* | 3309 */;
-		break;
-#if 0
 	case RFID_MIFARE_FRAME:
-		mode.flags = RF_PARITY_ENABLE;
+		mode.flags = RF_PARITY_ENABLE | RF_TX_CRC | RF_RX_CRC |
+				RF_CRYPTO1;
+		break;
+	case RFID_14443B_FRAME_REGULAR:
+		mode.flags = RF_TX_CRC | RF_RX_CRC | RF_CRC3309;
 		break;
-#endif
 	case RFID_15693_FRAME:
-		mode.flags = RF_TX_CRC | RF_RX_CRC /* | 3309 */;
+		mode.flags = RF_TX_CRC | RF_RX_CRC | RF_CRC3309;
 		break;
 	case RFID_15693_FRAME_ICODE1:
 		/* FIXME: implement */
@@ -236,42 +241,23 @@ int _iso14443a_transceive_sf(struct _cci *cci,
 	return 1;
 }
 
-static int random_bit(void)
+/* Pick the branch where the collided bit (first bit is '1') is set and
+ * forget anything received after it.
+ */
+static void set_coll_bit(uint8_t *bitfield, size_t size, unsigned int bit)
 {
-	static unsigned long randctx[4] = {0x22d4a017,
-						0x773a1f44,
-						0xc39e1460,
-						0x9cde8801};
-	unsigned long e;
-
-	e = randctx[0];
-	randctx[0] = randctx[1];
-	randctx[1] = (randctx[2]<<19) + (randctx[2]>>13) + randctx[3];
-	randctx[2] = randctx[3] ^ randctx[0];
-	randctx[3] = e+randctx[1];
-
-	return randctx[1]&1;
-}
+	unsigned int byte;
 
-/* first bit is '1', second bit '2' */
-static void rnd_toggle_bit_in_field(uint8_t *bitfield,
-					size_t size,
-					unsigned int bit)
-{
-	unsigned int byte,rnd;
+	bit--;
+	byte = bit / 8;
+	if ( byte >= size )
+		return;
 
-	if (bit && (bit <= (size*8))) {
-		rnd = random_bit();
-
-		dprintf("xor'ing bit %u with %u\n",bit,rnd);
-		bit--;
-		byte = bit/8;
-		bit = rnd << (bit % 8);
-		bitfield[byte] ^= bit;
-	}
+	bitfield[byte] &= (2U << (bit % 8)) - 1;
+	bitfield[byte] |= 1U << (bit % 8);
+	memset(bitfield + byte + 1, 0, size - byte - 1);
 }
 
-
 static int iso14443a_code_nvb_bits(unsigned char *nvb, unsigned int bits)
 {
 	unsigned int byte_count = bits / 8;
@@ -291,7 +277,7 @@ int _iso14443a_anticol(struct _cci *cci, int wup, struct rfid_tag *tag)
 	unsigned int uid_size;
 	struct iso14443a_atqa atqa;
 	struct iso14443a_anticol_cmd acf;
-	unsigned int bit_of_col;
+	unsigned int bit_of_col, known;
 	unsigned char sak[3];
 	size_t rx_len = sizeof(sak);
 
@@ -299,7 +285,7 @@ int _iso14443a_anticol(struct _cci *cci, int wup, struct rfid_tag *tag)
 	memset(&atqa, 0, sizeof(atqa));
 	memset(&acf, 0, sizeof(acf));
 
-	memset(&tag, 0, sizeof(tag));
+	memset(tag, 0, sizeof(*tag));
 	tag->state = ISO14443A_STATE_NONE;
 	tag->level = ISO14443A_LEVEL_NONE;
 
@@ -324,7 +310,7 @@ int _iso14443a_anticol(struct _cci *cci, int wup, struct rfid_tag *tag)
 	if (!atqa.bf_anticol) {
 		tag->state = ISO14443A_STATE_NO_BITFRAME_ANTICOL;
 		dprintf("no bitframe anticollission bits set, aborting\n");
-		return -1;
+		return 0;
 	}
 	dprintf("ATQA anticol bits = %d\n", atqa.bf_anticol);
 
@@ -351,11 +337,20 @@ cascade:
 	if (!ret)
 		return 0;
 
+	known = 16;
 	while (bit_of_col != ISO14443A_BITOFCOL_NONE) {
 		dprintf("collision at pos %u\n", bit_of_col);
 
+		/* each round must get further or we're going nowhere */
+		if ( bit_of_col <= known || bit_of_col > 16 + 5 * 8 ) {
+			tag->state = ISO14443A_STATE_ERROR;
+			return 0;
+		}
+		known = bit_of_col;
+
 		iso14443a_code_nvb_bits(&acf.nvb, bit_of_col);
-		rnd_toggle_bit_in_field(acf.uid_bits, sizeof(acf.uid_bits), bit_of_col);
+		set_coll_bit(acf.uid_bits, sizeof(acf.uid_bits),
+				bit_of_col - 16);
 		dprintf("acf: nvb=0x%02X uid_bits=...\n", acf.nvb);
 		dhex_dump(acf.uid_bits, sizeof(acf.uid_bits), 16);
 		if ( !_iso14443a_transceive_acf(cci, &acf, &bit_of_col) )
@@ -425,6 +420,8 @@ cascade:
 
 	tag->layer2 = RFID_LAYER2_ISO14443A;
 	tag->state = ISO14443A_STATE_SELECTED;
+	tag->sak = sak[0];
+	memcpy(tag->atqa, &atqa, sizeof(tag->atqa));
 
 	if (sak[0] & 0x20) {
 		dprintf("we have a T=CL compliant PICC\n");
@@ -436,3 +433,127 @@ cascade:
 
 	return 1;
 }
+
+/* HLTA gets no answer, a halted PICC only responds to WUPA */
+int _iso14443a_hlta(struct _cci *cci, struct rfid_tag *tag)
+{
+	static const uint8_t hlta[] = {ISO14443A_CMD_HLTA, 0x00};
+	uint8_t rx[1];
+	size_t rx_len = sizeof(rx);
+
+	if ( _iso14443ab_transceive(cci, RFID_14443A_FRAME_REGULAR,
+					hlta, sizeof(hlta), rx, &rx_len,
+					TIMEOUT) ) {
+		dprintf("PICC answered HLTA\n");
+		return 0;
+	}
+
+	tag->state = ISO14443A_STATE_HALTED;
+	return 1;
+}
+
+/* Cheapest possible check for a PICC in the field: a single short frame.
+ * REQA only finds idle PICCs, WUPA finds halted ones too. Anyone who
+ * answered is left in READY, the HLTA sends them back to idle (it is not
+ * valid outside ACTIVE) so that the next REQA gets answered as normal.
+ */
+int _iso14443a_probe(struct _cci *cci, int wup)
+{
+	struct iso14443a_atqa atqa;
+	struct rfid_tag tag;
+
+	if ( !_iso14443a_transceive_sf(cci, (wup) ? ISO14443A_SF_CMD_WUPA :
+						ISO14443A_SF_CMD_REQA, &atqa) )
+		return 0;
+
+	_iso14443a_hlta(cci, &tag);
+	return 1;
+}
+
+/* Enumerate every PICC in the field. Each time around REQA wakes those
+ * which are idle, anticollision resolves one of them and HLTA puts it to
+ * sleep so that it doesn't answer the next REQA.
+ */
+unsigned int _iso14443a_inventory(struct _cci *cci, struct rfid_tag *tags,
+					unsigned int max)
+{
+	unsigned int n;
+
+	for(n = 0; n < max; n++) {
+		if ( !_iso14443a_anticol(cci, 0, &tags[n]) )
+			break;
+		dprintf("inventory: tag %u\n", n);
+		dhex_dump(tags[n].uid, tags[n].uid_len, 16);
+		_iso14443a_hlta(cci, &tags[n]);
+	}
+
+	return n;
+}
+
+/* Wake up everything with WUPA and select one PICC whose UID we already
+ * know, no anticollision needed. The rest go back to idle/halt when they
+ * see a SELECT that isn't for them.
+ */
+int _iso14443a_select_uid(struct _cci *cci, struct rfid_tag *tag)
+{
+	static const uint8_t sel_code[] = {
+		ISO14443A_AC_SEL_CODE_CL1,
+		ISO14443A_AC_SEL_CODE_CL2,
+		ISO14443A_AC_SEL_CODE_CL3,
+	};
+	struct iso14443a_atqa atqa;
+	struct iso14443a_anticol_cmd acf;
+	unsigned int level, levels, ofs = 0;
+	unsigned char sak[3];
+	size_t rx_len;
+
+	switch(tag->uid_len) {
+	case 4:
+		levels = 1;
+		break;
+	case 7:
+		levels = 2;
+		break;
+	case 10:
+		levels = 3;
+		break;
+	default:
+		return 0;
+	}
+
+	if ( !_iso14443a_transceive_sf(cci, ISO14443A_SF_CMD_WUPA, &atqa) )
+		return 0;
+
+	for(level = 0; level < levels; level++) {
+		acf.sel_code = sel_code[level];
+		acf.nvb = 0x70;
+		if ( level + 1 < levels ) {
+			acf.uid_bits[0] = ISO14443A_CASCADE_TAG;
+			memcpy(acf.uid_bits + 1, tag->uid + ofs, 3);
+			ofs += 3;
+		}else{
+			memcpy(acf.uid_bits, tag->uid + ofs, 4);
+		}
+		acf.uid_bits[4] = acf.uid_bits[0] ^ acf.uid_bits[1] ^
+				acf.uid_bits[2] ^ acf.uid_bits[3];
+
+		rx_len = sizeof(sak);
+		if ( !_iso14443ab_transceive(cci, RFID_14443A_FRAME_REGULAR,
+					(unsigned char *)&acf, sizeof(acf),
+					sak, &rx_len, TIMEOUT) )
+			return 0;
+		if ( rx_len < 1 )
+			return 0;
+
+		/* cascade bit must be set on all but the last level */
+		if ( !(sak[0] & 0x04) != (level + 1 == levels) )
+			return 0;
+	}
+
+	tag->layer2 = RFID_LAYER2_ISO14443A;
+	tag->state = ISO14443A_STATE_SELECTED;
+	tag->level = levels;
+	tag->sak = sak[0];
+	tag->tcl_capable = !!(sak[0] & 0x20);
+	return 1;
+}
@@ -8,8 +8,13 @@
 
 /* ISO 14443-3, Chapter 6.3.2 */
 #define ISO14443A_AC_SEL_CODE_CL1	0x93
-#define ISO14443A_AC_SEL_CODE_CL2	0x92
+#define ISO14443A_AC_SEL_CODE_CL2	0x95
 #define ISO14443A_AC_SEL_CODE_CL3	0x97
+
+/* SAK bit for MIFARE Classic, NXP AN10833 */
+#define ISO14443A_SAK_MIFARE		0x08
+/* nothing but the cascade bit: NFC Forum Type 2 */
+#define ISO14443A_SAK_T2T_MASK		0x7b
 struct iso14443a_anticol_cmd {
 	uint8_t sel_code;
 	uint8_t nvb;
@@ -51,5 +56,11 @@ _private int _iso14443a_transceive_acf(struct _cci *cci,
 					unsigned int *bit_of_col);
 _private int _iso14443a_anticol(struct _cci *cci, int wup,
 				struct rfid_tag *tag);
+_private int _iso14443a_hlta(struct _cci *cci, struct rfid_tag *tag);
+_private int _iso14443a_probe(struct _cci *cci, int wup);
+_private unsigned int _iso14443a_inventory(struct _cci *cci,
+					struct rfid_tag *tags,
+					unsigned int max);
+_private int _iso14443a_select_uid(struct _cci *cci, struct rfid_tag *tag);
 
 #endif /* ISO14443A_H */
@@ -0,0 +1,201 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * ISO-14443-B Layer 2: REQB/WUPB with slot-marker anticollision, ATTRIB
+ * and HLTB.
+*/
+#include <ccid.h>
+
+#include "ccid-internal.h"
+#include "rfid.h"
+#include "rfid_layer1.h"
+#include "iso14443a.h"
+#include "iso14443b.h"
+
+#if 0
+#define dprintf printf
+#define dhex_dump hex_dump
+#else
+#define dprintf(...) do {} while(0)
+#define dhex_dump(a, b, c) do {} while(0)
+#endif
+
+/* ISO 14443-3, Chapter 7.7 */
+#define ISO14443B_APF		0x05
+#define ISO14443B_PARAM_WUP	(1 << 3)
+#define ISO14443B_ATQB		0x50
+#define ISO14443B_ATTRIB	0x1d
+#define ISO14443B_HLTB		0x50
+
+/* N is coded as 2^n slots, 16 at most */
+#define ISO14443B_MAX_N		4
+
+/* Give up after halting this many PICCs we can't talk to */
+#define ISO14443B_MAX_SKIP	4
+
+/* ATQB is due within FWT(ATQB) ~ 4.8ms of REQB or a slot marker */
+#define TIMEOUT_ATQB		5000
+
+/* Send REQB/WUPB or slot marker, see if anyone answers cleanly */
+static int atqb_slot(struct _cci *cci, const uint8_t *cmd, size_t cmd_len,
+			struct iso14443b_atqb *atqb, int *coll)
+{
+	uint8_t rx[1 + sizeof(*atqb) + 1];
+	size_t rx_len = sizeof(rx);
+	uint8_t err = 0;
+	int ret;
+
+	ret = _iso14443ab_transceive(cci, RFID_14443B_FRAME_REGULAR,
+					cmd, cmd_len, rx, &rx_len,
+					TIMEOUT_ATQB);
+
+	/* anything garbled means two or more PICCs in this slot */
+	if ( !_rfid_layer1_get_error(cci, &err) )
+		return 0;
+	if ( err & (RF_ERR_COLLISION|RF_ERR_CRC|RF_ERR_FRAMING) ) {
+		dprintf("collision in slot, err=0x%.2x\n", err);
+		*coll = 1;
+		return 0;
+	}
+
+	if ( !ret )
+		return 0;
+
+	if ( rx_len < 1 + sizeof(*atqb) || rx[0] != ISO14443B_ATQB ) {
+		dprintf("bad ATQB, %zu bytes\n", rx_len);
+		*coll = 1;
+		return 0;
+	}
+
+	memcpy(atqb, rx + 1, sizeof(*atqb));
+	return 1;
+}
+
+static int do_reqb(struct _cci *cci, int wup, struct iso14443b_atqb *atqb)
+{
+	uint8_t cmd[3], marker;
+	unsigned int n, slot;
+	int coll;
+
+	for(n = 0; n <= ISO14443B_MAX_N; n++) {
+		coll = 0;
+
+		cmd[0] = ISO14443B_APF;
+		cmd[1] = 0x00; /* AFI: all application families */
+		cmd[2] = n | ((wup) ? ISO14443B_PARAM_WUP : 0);
+		dprintf("%s with %u slots\n", (wup) ? "WUPB" : "REQB", 1U << n);
+		if ( atqb_slot(cci, cmd, sizeof(cmd), atqb, &coll) )
+			return 1;
+
+		for(slot = 2; slot <= (1U << n); slot++) {
+			marker = ((slot - 1) << 4) | ISO14443B_APF;
+			if ( atqb_slot(cci, &marker, 1, atqb, &coll) )
+				return 1;
+		}
+
+		/* nobody there */
+		if ( !coll )
+			return 0;
+
+		/* spread the PICCs over more slots and try again, the ones
+		 * which answered are in READY state and answer REQB too
+		 */
+	}
+
+	dprintf("too many collisions\n");
+	return 0;
+}
+
+int _iso14443b_hltb(struct _cci *cci, struct rfid_tag *tag)
+{
+	uint8_t cmd[5], rx[1];
+	size_t rx_len = sizeof(rx);
+
+	cmd[0] = ISO14443B_HLTB;
+	memcpy(cmd + 1, tag->uid, 4);
+
+	if ( !_iso14443ab_transceive(cci, RFID_14443B_FRAME_REGULAR,
+					cmd, sizeof(cmd), rx, &rx_len,
+					TIMEOUT_ATQB) )
+		return 0;
+
+	if ( rx_len < 1 || rx[0] != 0x00 )
+		return 0;
+
+	tag->state = ISO14443B_STATE_HALT;
+	return 1;
+}
+
+int _iso14443b_anticol(struct _cci *cci, int wup, struct rfid_tag *tag)
+{
+	struct iso14443b_atqb atqb;
+	unsigned int skip;
+
+	for(skip = 0; skip < ISO14443B_MAX_SKIP; skip++) {
+		tag->state = ISO14443B_STATE_NONE;
+
+		if ( !do_reqb(cci, wup, &atqb) )
+			return 0;
+
+		tag->layer2 = RFID_LAYER2_ISO14443B;
+		tag->state = ISO14443B_STATE_READY;
+		tag->level = ISO14443A_LEVEL_NONE;
+		tag->uid_len = sizeof(atqb.pupi);
+		memcpy(tag->uid, atqb.pupi, sizeof(atqb.pupi));
+		memcpy(tag->app_data, atqb.app_data, sizeof(tag->app_data));
+		memcpy(tag->proto_info, atqb.proto_info,
+			sizeof(tag->proto_info));
+		tag->tcl_capable = !!(atqb.proto_info[1] & ISO14443B_PROTO_TCL);
+
+		dprintf("Found ISO-14443-B PICC\n");
+		dhex_dump(tag->uid, tag->uid_len, 16);
+
+		if ( tag->tcl_capable )
+			return 1;
+
+		/* only ISO 14443-4 is defined on top of type B, halt this
+		 * one so it keeps out of the way and look for another
+		 */
+		dprintf("PICC not ISO 14443-4 compliant, halting\n");
+		_iso14443b_hltb(cci, tag);
+	}
+
+	return 0;
+}
+
+int _iso14443b_attrib(struct _cci *cci, struct rfid_tag *tag,
+			uint8_t param2, unsigned int cid,
+			uint64_t timeout, uint8_t *mbli)
+{
+	uint8_t cmd[9], rx[3];
+	size_t rx_len = sizeof(rx);
+
+	if ( tag->state != ISO14443B_STATE_READY )
+		return 0;
+
+	cmd[0] = ISO14443B_ATTRIB;
+	memcpy(cmd + 1, tag->uid, 4);
+	cmd[5] = 0x00;	/* default TR0/TR1, SOF and EOF required */
+	cmd[6] = param2;	/* bit rates and FSDI */
+	cmd[7] = tag->proto_info[1] & 0x0f;	/* confirm protocol type */
+	cmd[8] = cid & 0x0f;
+
+	if ( !_iso14443ab_transceive(cci, RFID_14443B_FRAME_REGULAR,
+					cmd, sizeof(cmd), rx, &rx_len,
+					timeout) ) {
+		tag->state = ISO14443B_STATE_ERROR;
+		return 0;
+	}
+
+	if ( rx_len < 1 || (rx[0] & 0x0f) != (cid & 0x0f) ) {
+		dprintf("bad answer to ATTRIB\n");
+		tag->state = ISO14443B_STATE_ERROR;
+		return 0;
+	}
+
+	*mbli = rx[0] >> 4;
+	tag->state = ISO14443B_STATE_ACTIVE;
+	return 1;
+}
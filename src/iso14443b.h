@@ -0,0 +1,36 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+*/
+#ifndef _ISO14443B_H
+#define _ISO14443B_H
+
+/* ISO 14443-3, Chapter 7.9.4 */
+struct iso14443b_atqb {
+	uint8_t pupi[4];
+	uint8_t app_data[4];
+	uint8_t proto_info[3];
+} _packed;
+
+/* Protocol info byte 2 and 3 */
+#define ISO14443B_PROTO_TCL		(1 << 0)
+#define ISO14443B_FO_CID		(1 << 0)
+#define ISO14443B_FO_NAD		(1 << 1)
+
+enum iso14443b_state {
+	ISO14443B_STATE_ERROR,
+	ISO14443B_STATE_NONE,
+	ISO14443B_STATE_READY,
+	ISO14443B_STATE_ACTIVE,
+	ISO14443B_STATE_HALT,
+};
+
+_private int _iso14443b_anticol(struct _cci *cci, int wup,
+				struct rfid_tag *tag);
+_private int _iso14443b_attrib(struct _cci *cci, struct rfid_tag *tag,
+				uint8_t param2, unsigned int cid,
+				uint64_t timeout, uint8_t *mbli);
+_private int _iso14443b_hltb(struct _cci *cci, struct rfid_tag *tag);
+
+#endif /* ISO14443B_H */
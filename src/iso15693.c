@@ -0,0 +1,298 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * ISO-15693 Layer 2: 16 slot inventory with mask based collision
+ * resolution, system information and multiple block reads.
+*/
+#include <ccid.h>
+
+#include "ccid-internal.h"
+#include "rfid.h"
+#include "rfid_layer1.h"
+#include "iso15693.h"
+
+#if 0
+#define dprintf printf
+#define dhex_dump hex_dump
+#else
+#define dprintf(...) do {} while(0)
+#define dhex_dump(a, b, c) do {} while(0)
+#endif
+
+#define ISO15693_NUM_SLOTS	16
+#define ISO15693_MAX_MASK	(ISO15693_UID_LEN * 8 - 4)
+#define ISO15693_MAX_BLOCKS	256
+#define ISO15693_MAX_FRAME	256
+
+/* VICC answers within t1 = 4320/fc, ~320us, of the end of our frame */
+#define TIMEOUT			1000
+
+#define XCV_OK		0
+#define XCV_NONE	1
+#define XCV_COLL	2
+#define XCV_FAIL	3
+
+/* Transceive a frame, tx_len of zero sends just an EOF to move on to the
+ * next inventory slot. Works out whether nobody answered or more than one
+ * VICC did.
+ */
+static int xcv(struct _cci *cci, const uint8_t *tx, size_t tx_len,
+		uint8_t *rx, size_t *rx_len)
+{
+	struct rf_mode mode = {
+		.flags = RF_TX_CRC | RF_RX_CRC | RF_CRC3309,
+	};
+	uint8_t rxl, err = 0;
+	int ret;
+
+	if ( !tx_len )
+		mode.flags |= RF_EOF_ONLY;
+
+	if ( !_rfid_layer1_set_rf_mode(cci, &mode) )
+		return XCV_FAIL;
+
+	rxl = (*rx_len > 0xff) ? 0xff : *rx_len;
+	ret = _rfid_layer1_transact(cci, tx, tx_len, rx, &rxl, TIMEOUT, 0);
+	*rx_len = (ret) ? rxl : 0;
+
+	if ( !_rfid_layer1_get_error(cci, &err) )
+		return XCV_FAIL;
+	if ( err & (RF_ERR_COLLISION|RF_ERR_CRC|RF_ERR_FRAMING) )
+		return XCV_COLL;
+	if ( !ret || !*rx_len )
+		return XCV_NONE;
+	return XCV_OK;
+}
+
+struct inventory {
+	uint8_t *uids;
+	unsigned int max;
+	unsigned int num;
+};
+
+static void add_uid(struct inventory *inv, const uint8_t *uid)
+{
+	unsigned int i;
+
+	for(i = 0; i < inv->num; i++) {
+		if ( !memcmp(inv->uids + i * ISO15693_UID_LEN, uid,
+				ISO15693_UID_LEN) )
+			return;
+	}
+
+	dprintf("Found ISO-15693 VICC\n");
+	dhex_dump(uid, ISO15693_UID_LEN, 16);
+	memcpy(inv->uids + inv->num * ISO15693_UID_LEN, uid, ISO15693_UID_LEN);
+	inv->num++;
+}
+
+/* One 16 slot inventory round for VICCs whose UID starts with mask. Each
+ * VICC answers in the slot given by the next 4 bits of its UID, slots with
+ * collisions are resolved by another round with those 4 bits added to the
+ * mask.
+ */
+static int inventory_round(struct _cci *cci, struct inventory *inv,
+				const uint8_t *mask, unsigned int mask_len)
+{
+	uint8_t cmd[3 + ISO15693_UID_LEN];
+	uint8_t rx[2 + ISO15693_UID_LEN];
+	uint8_t sub[ISO15693_UID_LEN];
+	unsigned int slot, n, coll = 0;
+	size_t rx_len;
+
+	n = (mask_len + 7) / 8;
+	cmd[0] = ISO15693_FLAG_HIGH_RATE | ISO15693_FLAG_INVENTORY;
+	cmd[1] = ISO15693_CMD_INVENTORY;
+	cmd[2] = mask_len;
+	memcpy(cmd + 3, mask, n);
+
+	for(slot = 0; slot < ISO15693_NUM_SLOTS; slot++) {
+		rx_len = sizeof(rx);
+		switch( xcv(cci, cmd, (slot) ? 0 : 3 + n, rx, &rx_len) ) {
+		case XCV_OK:
+			if ( rx_len < sizeof(rx) ||
+					(rx[0] & ISO15693_RESP_ERROR) ) {
+				coll |= (1U << slot);
+				break;
+			}
+			if ( inv->num < inv->max )
+				add_uid(inv, rx + 2);
+			break;
+		case XCV_COLL:
+			dprintf("collision in slot %u, mask_len %u\n",
+				slot, mask_len);
+			coll |= (1U << slot);
+			break;
+		case XCV_NONE:
+			break;
+		default:
+			return 0;
+		}
+	}
+
+	if ( mask_len + 4 > ISO15693_MAX_MASK )
+		return 1;
+
+	for(slot = 0; slot < ISO15693_NUM_SLOTS; slot++) {
+		if ( !(coll & (1U << slot)) || inv->num >= inv->max )
+			continue;
+
+		memset(sub, 0, sizeof(sub));
+		memcpy(sub, mask, n);
+		if ( mask_len % 8 )
+			sub[mask_len / 8] = (sub[mask_len / 8] & 0x0f) |
+						(slot << 4);
+		else
+			sub[mask_len / 8] = slot;
+
+		if ( !inventory_round(cci, inv, sub, mask_len + 4) )
+			return 0;
+	}
+
+	return 1;
+}
+
+unsigned int _iso15693_inventory(struct _cci *cci, uint8_t *uids,
+					unsigned int max)
+{
+	struct inventory inv = {
+		.uids = uids,
+		.max = max,
+	};
+	uint8_t mask[ISO15693_UID_LEN];
+
+	memset(mask, 0, sizeof(mask));
+	if ( !inventory_round(cci, &inv, mask, 0) )
+		return 0;
+	return inv.num;
+}
+
+static size_t build_cmd(uint8_t *cmd, uint8_t code, const uint8_t *uid)
+{
+	cmd[0] = ISO15693_FLAG_HIGH_RATE;
+	cmd[1] = code;
+	if ( NULL == uid )
+		return 2;
+	cmd[0] |= ISO15693_FLAG_ADDRESSED;
+	memcpy(cmd + 2, uid, ISO15693_UID_LEN);
+	return 2 + ISO15693_UID_LEN;
+}
+
+int _iso15693_sysinfo(struct _cci *cci, const uint8_t *uid,
+			uint8_t *blk_size, uint16_t *num_blks)
+{
+	uint8_t cmd[2 + ISO15693_UID_LEN];
+	uint8_t rx[2 + ISO15693_UID_LEN + 5];
+	size_t rx_len = sizeof(rx);
+	uint8_t *ptr;
+
+	if ( xcv(cci, cmd, build_cmd(cmd, ISO15693_CMD_GET_SYSINFO, uid),
+			rx, &rx_len) != XCV_OK )
+		return 0;
+
+	if ( rx_len < 2 + ISO15693_UID_LEN || (rx[0] & ISO15693_RESP_ERROR) )
+		return 0;
+
+	/* info flags say which of DSFID, AFI, memory size, IC ref follow */
+	ptr = rx + 2 + ISO15693_UID_LEN;
+	if ( rx[1] & 0x01 )
+		ptr++;
+	if ( rx[1] & 0x02 )
+		ptr++;
+	if ( !(rx[1] & 0x04) || ptr + 2 > rx + rx_len ) {
+		*blk_size = 0;
+		*num_blks = 0;
+		return 1;
+	}
+
+	*num_blks = ptr[0] + 1;
+	*blk_size = (ptr[1] & 0x1f) + 1;
+	return 1;
+}
+
+int _iso15693_read_multiple(struct _cci *cci, const uint8_t *uid,
+				unsigned int first, unsigned int num,
+				unsigned int blk_size, uint8_t *buf)
+{
+	uint8_t cmd[4 + ISO15693_UID_LEN];
+	uint8_t rx[ISO15693_MAX_FRAME];
+	unsigned int per_frame, n;
+	size_t cmd_len, rx_len, mru;
+
+	if ( !blk_size || first + num > ISO15693_MAX_BLOCKS )
+		return 0;
+
+	/* as many blocks as fit in one response frame */
+	mru = _rfid_layer1_mru(cci);
+	if ( mru > sizeof(rx) )
+		mru = sizeof(rx);
+	if ( mru < 1 + blk_size )
+		return 0;
+	per_frame = (mru - 1) / blk_size;
+
+	while( num ) {
+		n = (num < per_frame) ? num : per_frame;
+
+		cmd_len = build_cmd(cmd, ISO15693_CMD_READ_MULTIPLE, uid);
+		cmd[cmd_len++] = first;
+		cmd[cmd_len++] = n - 1;
+
+		rx_len = 1 + n * blk_size;
+		if ( xcv(cci, cmd, cmd_len, rx, &rx_len) != XCV_OK )
+			return 0;
+
+		if ( rx_len < 1 || (rx[0] & ISO15693_RESP_ERROR) ) {
+			dprintf("READ MULTIPLE error 0x%.2x\n",
+				(rx_len > 1) ? rx[1] : 0);
+			return 0;
+		}
+		if ( rx_len != 1 + n * blk_size )
+			return 0;
+
+		memcpy(buf, rx + 1, n * blk_size);
+		buf += n * blk_size;
+		first += n;
+		num -= n;
+	}
+
+	return 1;
+}
+
+/* Find a VICC to talk to, the first found wins */
+int _iso15693_select(struct _cci *cci, struct rfid_tag *tag)
+{
+	uint8_t uid[ISO15693_UID_LEN];
+
+	tag->state = ISO15693_STATE_NONE;
+	if ( !_iso15693_inventory(cci, uid, 1) )
+		return 0;
+
+	tag->layer2 = RFID_LAYER2_ISO15693;
+	tag->state = ISO15693_STATE_READY;
+	tag->uid_len = ISO15693_UID_LEN;
+	memcpy(tag->uid, uid, ISO15693_UID_LEN);
+
+	if ( !_iso15693_sysinfo(cci, tag->uid, &tag->blk_size,
+				&tag->num_blks) ) {
+		tag->blk_size = 0;
+		tag->num_blks = 0;
+	}
+
+	return 1;
+}
+
+/* Raw frames, there is no block protocol on top of ISO 15693. Caller
+ * supplies flags, command code and parameters and gets back the response
+ * flags and data.
+ */
+int _iso15693_transact(struct _cci *cci, struct rfid_tag *tag,
+			void *l3p,
+			const unsigned char *tx_data, size_t tx_len,
+			unsigned char *rx_data, size_t *rx_len)
+{
+	if ( !tx_len || tx_len > _rfid_layer1_mtu(cci) )
+		return 0;
+	return xcv(cci, tx_data, tx_len, rx_data, rx_len) == XCV_OK;
+}
@@ -0,0 +1,51 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+*/
+#ifndef _ISO15693_H
+#define _ISO15693_H
+
+#define ISO15693_UID_LEN		8
+
+/* ISO 15693-3, Chapter 7.3.1 request flags */
+#define ISO15693_FLAG_SUBC_TWO		(1 << 0)
+#define ISO15693_FLAG_HIGH_RATE		(1 << 1)
+#define ISO15693_FLAG_INVENTORY		(1 << 2)
+#define ISO15693_FLAG_PROTO_EXT		(1 << 3)
+/* with inventory flag set */
+#define ISO15693_FLAG_AFI		(1 << 4)
+#define ISO15693_FLAG_ONE_SLOT		(1 << 5)
+/* with inventory flag clear */
+#define ISO15693_FLAG_SELECTED		(1 << 4)
+#define ISO15693_FLAG_ADDRESSED		(1 << 5)
+#define ISO15693_FLAG_OPTION		(1 << 6)
+
+/* response flags */
+#define ISO15693_RESP_ERROR		(1 << 0)
+
+#define ISO15693_CMD_INVENTORY		0x01
+#define ISO15693_CMD_STAY_QUIET		0x02
+#define ISO15693_CMD_READ_MULTIPLE	0x23
+#define ISO15693_CMD_GET_SYSINFO	0x2b
+
+enum iso15693_state {
+	ISO15693_STATE_ERROR,
+	ISO15693_STATE_NONE,
+	ISO15693_STATE_READY,
+};
+
+_private unsigned int _iso15693_inventory(struct _cci *cci, uint8_t *uids,
+						unsigned int max);
+_private int _iso15693_select(struct _cci *cci, struct rfid_tag *tag);
+_private int _iso15693_sysinfo(struct _cci *cci, const uint8_t *uid,
+				uint8_t *blk_size, uint16_t *num_blks);
+_private int _iso15693_read_multiple(struct _cci *cci, const uint8_t *uid,
+					unsigned int first, unsigned int num,
+					unsigned int blk_size, uint8_t *buf);
+_private int _iso15693_transact(struct _cci *cci, struct rfid_tag *tag,
+				void *l3p,
+				const unsigned char *tx_data, size_t tx_len,
+				unsigned char *rx_data, size_t *rx_len);
+
+#endif /* ISO15693_H */
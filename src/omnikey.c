@@ -11,6 +11,7 @@
 #include "ccid-internal.h"
 #include "rfid.h"
 #include "clrc632.h"
+#include "rfid_layer1.h"
 
 #define RFID_SLOT 0
 
@@ -114,11 +115,85 @@ static int reg_write(struct _ccid *ccid, uint8_t reg, uint8_t val)
 	return 1;
 }
 
+/* The register access escape takes a count of writes and reads, so several
+ * registers can be done in one go. Older firmware may not get this right,
+ * the CLRC632 driver checks that it works before making use of it.
+ */
+static int reg_write_multi(struct _ccid *ccid,
+				const struct reg_file *r, unsigned int num)
+{
+	struct _xfr *xfr = ccid->d_xfr;
+	unsigned int i;
+
+	assert(num <= CLRC632_MAX_MULTI);
+
+	xfr_reset(xfr);
+	xfr_tx_byte(xfr, 0x20);
+	xfr_tx_byte(xfr, 0x00);
+	xfr_tx_byte(xfr, num);
+	xfr_tx_byte(xfr, 0x00);
+	xfr_tx_byte(xfr, 0x00);
+	xfr_tx_byte(xfr, 0x00);
+	for(i = 0; i < num; i++) {
+		trace(ccid, "     : writing reg 0x%x with 0x%.2x\n",
+			r[i].reg, r[i].val);
+		xfr_tx_byte(xfr, r[i].reg);
+		if ( !xfr_tx_byte(xfr, r[i].val) )
+			return -1;
+	}
+	if ( !_PC_to_RDR_Escape(ccid, RFID_SLOT, xfr) )
+		return 0;
+
+	if ( !_RDR_to_PC(ccid, RFID_SLOT, xfr) )
+		return 0;
+
+	return 1;
+}
+
+static int reg_read_multi(struct _ccid *ccid,
+				struct reg_file *r, unsigned int num)
+{
+	struct _xfr *xfr = ccid->d_xfr;
+	unsigned int i;
+
+	assert(num <= CLRC632_MAX_MULTI);
+
+	xfr_reset(xfr);
+	xfr_tx_byte(xfr, 0x20);
+	xfr_tx_byte(xfr, 0x00);
+	xfr_tx_byte(xfr, 0x00);
+	xfr_tx_byte(xfr, 0x00);
+	xfr_tx_byte(xfr, num);
+	xfr_tx_byte(xfr, 0x00);
+	for(i = 0; i < num; i++) {
+		if ( !xfr_tx_byte(xfr, r[i].reg) )
+			return -1;
+	}
+	if ( !_PC_to_RDR_Escape(ccid, RFID_SLOT, xfr) )
+		return 0;
+
+	if ( !_RDR_to_PC(ccid, RFID_SLOT, xfr) )
+		return 0;
+
+	if ( xfr->x_rxlen != num + 1 )
+		return -1;
+
+	for(i = 0; i < num; i++) {
+		r[i].val = xfr->x_rxbuf[i + 1];
+		trace(ccid, "     : reading reg 0x%x and got 0x%.2x\n",
+			r[i].reg, r[i].val);
+	}
+
+	return 1;
+}
+
 static const struct _clrc632_ops asic_ops = {
 	.fifo_read = fifo_read,
 	.fifo_write = fifo_write,
 	.reg_read = reg_read,
 	.reg_write = reg_write,
+	.reg_write_multi = reg_write_multi,
+	.reg_read_multi = reg_read_multi,
 };
 
 static int enable_clrc632(struct _ccid *ccid)
@@ -134,8 +209,24 @@ static int enable_clrc632(struct _ccid *ccid)
 	return 1;
 }
 
-void _omnikey_init_prox(struct _ccid *ccid)
+/* Only readers listed as RFID_NATIVE in usb-ccid-devices present ISO 14443-4
+ * cards on a CCID slot of their own, always the last one. The RF field
+ * drives that slot so it's taken away from the application, otherwise both
+ * could end up using it at once.
+ */
+static struct _cci *native_slot(struct _ccid *ccid, unsigned int flags)
 {
+	if ( !(flags & INTF_RFID_NATIVE) || ccid->d_num_slots < 2 )
+		return NULL;
+
+	ccid->d_pub_slots = ccid->d_num_slots - 1;
+	return ccid->d_slot + ccid->d_pub_slots;
+}
+
+void _omnikey_init_prox(struct _ccid *ccid, unsigned int flags)
+{
+	struct _cci *native;
+
 	trace(ccid, " o Omnikey proxcard RF interface detected\n");
 	if ( !enable_clrc632(ccid) )
 		return;
@@ -145,6 +236,12 @@ void _omnikey_init_prox(struct _ccid *ccid)
 	if ( !_clrc632_init(ccid->d_rf + ccid->d_num_rf, &asic_ops) )
 		return;
 
+	native = native_slot(ccid, flags);
+	if ( native ) {
+		trace(ccid, " o Firmware T=CL on slot %u\n", native->i_idx);
+		_rfid_set_native(ccid->d_rf + ccid->d_num_rf, native);
+	}
+
 	ccid->d_num_rf++;
 	trace(ccid, " o CMRC632 ASIC RF interface enabled\n");
 	return;
@@ -29,6 +29,12 @@
 #include "iso14443a.h"
 #include "proto_mfc.h"
 
+#if 0
+#define dprintf printf
+#else
+#define dprintf(...) do {} while(0)
+#endif
+
 #define RFID_MAX_FRAMELEN	256
 #define MIFARE_CL_READ_FWT	250
 #define MIFARE_CL_WRITE_FWT	600
@@ -63,7 +69,7 @@ int _mfc_read(struct _cci *cci, unsigned int page,
 }
 
 int _mfc_write(struct _cci *cci, unsigned int page,
-	   unsigned char *tx_data, unsigned int tx_len)
+	   const unsigned char *tx_data, unsigned int tx_len)
 {
 	unsigned char tx[2];
 	unsigned char rx[1];
@@ -161,3 +167,144 @@ int mfcl_sector_blocks(uint8_t sector)
 	else
 		return 0;
 }
+
+/* Size from SAK, NXP AN10833 */
+unsigned int _mfc_num_sectors(const struct rfid_tag *tag)
+{
+	if ( tag->sak & 0x10 )
+		return (tag->sak & 0x01) ? MIFARE_CL_SMALL_SECTORS :
+						MIFARE_CL_MAX_SECTORS;
+	if ( tag->sak & 0x01 )
+		return 5;
+	return 16;
+}
+
+size_t _mfc_sector_size(unsigned int sector)
+{
+	if ( sector >= MIFARE_CL_MAX_SECTORS )
+		return 0;
+	return mfcl_sector_blocks(sector) * MIFARE_CL_PAGE_SIZE;
+}
+
+static int load_key(struct _cci *cci, const struct mfc_keys *keys,
+			unsigned int slot)
+{
+	if ( keys->in_ee & (1U << slot) )
+		return _rfid_layer1_mfc_set_key_ee(cci, slot);
+	return _rfid_layer1_mfc_set_key(cci, keys->key[slot]);
+}
+
+/* A failed authentication sends the card back to idle, so it must be
+ * selected again before the next attempt. Returns -1 if it's gone.
+ */
+static int try_key(struct _cci *cci, struct rfid_tag *tag,
+			struct mfc_handle *mh, const struct mfc_keys *keys,
+			unsigned int sector, uint8_t k)
+{
+	uint32_t serno;
+	uint8_t cmd;
+
+	/* 7 byte UIDs authenticate with the last 4 bytes */
+	memcpy(&serno, tag->uid + tag->uid_len - 4, sizeof(serno));
+	cmd = (k & MIFARE_CL_KEY_B) ? RFID_CMD_MIFARE_AUTH1B :
+					RFID_CMD_MIFARE_AUTH1A;
+
+	if ( load_key(cci, keys, (k & ~MIFARE_CL_KEY_B) - 1) &&
+			_rfid_layer1_mfc_auth(cci, cmd, serno,
+					mfcl_sector2block(sector)) ) {
+		mh->sector = sector + 1;
+		mh->key[sector] = k;
+		return 1;
+	}
+
+	mh->sector = 0;
+	if ( !_iso14443a_select_uid(cci, tag) )
+		return -1;
+	return 0;
+}
+
+/* Authenticate once per sector. The key which worked last time is tried
+ * first, then the whole dictionary, key B first if we want to write.
+ */
+static int auth_sector(struct _cci *cci, struct rfid_tag *tag,
+			struct mfc_handle *mh, const struct mfc_keys *keys,
+			unsigned int sector, int want_b)
+{
+	unsigned int i, pass;
+	uint8_t k;
+	int ret;
+
+	if ( mh->sector == sector + 1 )
+		return 1;
+
+	if ( mh->key[sector] ) {
+		ret = try_key(cci, tag, mh, keys, sector, mh->key[sector]);
+		if ( ret )
+			return (ret > 0);
+	}
+
+	for(pass = 0; pass < 2; pass++) {
+		for(i = 0; i < keys->num; i++) {
+			k = i + 1;
+			if ( (pass == 0) == !!want_b )
+				k |= MIFARE_CL_KEY_B;
+			if ( k == mh->key[sector] )
+				continue;
+			ret = try_key(cci, tag, mh, keys, sector, k);
+			if ( ret )
+				return (ret > 0);
+		}
+	}
+
+	dprintf("no key for sector %u\n", sector);
+	return 0;
+}
+
+int _mfc_read_sector(struct _cci *cci, struct rfid_tag *tag,
+			struct mfc_handle *mh, const struct mfc_keys *keys,
+			unsigned int sector, uint8_t *buf)
+{
+	unsigned int i, blk, num, len;
+
+	if ( !auth_sector(cci, tag, mh, keys, sector, 0) )
+		return 0;
+
+	blk = mfcl_sector2block(sector);
+	num = mfcl_sector_blocks(sector);
+	for(i = 0; i < num; i++, buf += MIFARE_CL_PAGE_SIZE) {
+		len = MIFARE_CL_PAGE_SIZE;
+		if ( !_mfc_read(cci, blk + i, buf, &len) ||
+				len != MIFARE_CL_PAGE_SIZE ) {
+			mh->sector = 0;
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Data blocks only: the sector trailer holds the keys and access bits and
+ * one bad write makes the whole sector unusable, block 0 is read-only.
+ */
+int _mfc_write_sector(struct _cci *cci, struct rfid_tag *tag,
+			struct mfc_handle *mh, const struct mfc_keys *keys,
+			unsigned int sector, const uint8_t *buf)
+{
+	unsigned int i, blk, num;
+
+	if ( !auth_sector(cci, tag, mh, keys, sector, 1) )
+		return 0;
+
+	blk = mfcl_sector2block(sector);
+	num = mfcl_sector_blocks(sector);
+	for(i = 0; i + 1 < num; i++, buf += MIFARE_CL_PAGE_SIZE) {
+		if ( blk + i == 0 )
+			continue;
+		if ( !_mfc_write(cci, blk + i, buf, MIFARE_CL_PAGE_SIZE) ) {
+			mh->sector = 0;
+			return 0;
+		}
+	}
+
+	return 1;
+}
@@ -6,8 +6,31 @@
 #ifndef _PROTO_MFC_H
 #define _PROTO_MFC_H
 
+#define MIFARE_CL_BLOCKS_P_SECTOR_1k	4
+#define MIFARE_CL_BLOCKS_P_SECTOR_4k	16
+#define MIFARE_CL_SMALL_SECTORS		32
+#define MIFARE_CL_LARGE_SECTORS		8
+#define MIFARE_CL_MAX_SECTORS		\
+		(MIFARE_CL_SMALL_SECTORS + MIFARE_CL_LARGE_SECTORS)
+
+#define MIFARE_CL_KEY_LEN	6
+#define MIFARE_CL_KEY_B		0x80
+
+/* key dictionary, the first num slots are used */
+struct mfc_keys {
+	unsigned int num;
+	/* slots for which the reader holds the same key in its EEPROM */
+	uint32_t in_ee;
+	uint8_t key[RFID_MFC_KEY_SLOTS][MIFARE_CL_KEY_LEN];
+};
+
 struct mfc_handle {
-	/* stateless */
+	/* sector currently authenticated for, plus one */
+	unsigned int sector;
+	/* key which last worked for each sector: slot plus one, with
+	 * MIFARE_CL_KEY_B for key B, or zero if none yet
+	 */
+	uint8_t key[MIFARE_CL_MAX_SECTORS];
 };
 
 #define MIFARE_CL_KEYA_DEFAULT	(const uint8_t *)"\xa0\xa1\xa2\xa3\xa4\xa5"
@@ -16,18 +39,12 @@ struct mfc_handle {
 #define MIFARE_CL_KEYA_DEFAULT_INFINEON	(const uint8_t *)"\xff\xff\xff\xff\xff\xff"
 #define MIFARE_CL_KEYB_DEFAULT_INFINEON MIFARE_CL_KEYA_DEFAULT_INFINEON
 
-#define MIFARE_CL_KEY_LEN	(sizeof(MIFARE_CL_KEYA_DEFAULT)-1)
-
 #define MIFARE_CL_PAGE_MAX	0xff
 #define MIFARE_CL_PAGE_SIZE	0x10
 
 #define RFID_CMD_MIFARE_AUTH1A	0x60
 #define RFID_CMD_MIFARE_AUTH1B	0x61
 
-#define MIFARE_CL_BLOCKS_P_SECTOR_1k	4
-#define MIFARE_CL_BLOCKS_P_SECTOR_4k	16
-#define MIFARE_CL_SMALL_SECTORS		32
-#define MIFARE_CL_LARGE_SECTORS		4
 
 enum rfid_proto_mfcl_opt {
 	RFID_OPT_P_MFCL_SIZE	=	0x10000001,
@@ -46,7 +63,18 @@ extern const struct rfid_protocol rfid_protocol_mfcl;
 _private int _mfc_read(struct _cci *cci, unsigned int page,
 			unsigned char *rx_data, unsigned int *rx_len);
 _private int _mfc_write(struct _cci *cci, unsigned int page,
-			unsigned char *tx_data, unsigned int tx_len);
+			const unsigned char *tx_data, unsigned int tx_len);
+
+_private unsigned int _mfc_num_sectors(const struct rfid_tag *tag);
+_private size_t _mfc_sector_size(unsigned int sector);
+_private int _mfc_read_sector(struct _cci *cci, struct rfid_tag *tag,
+				struct mfc_handle *mh,
+				const struct mfc_keys *keys,
+				unsigned int sector, uint8_t *buf);
+_private int _mfc_write_sector(struct _cci *cci, struct rfid_tag *tag,
+				struct mfc_handle *mh,
+				const struct mfc_keys *keys,
+				unsigned int sector, const uint8_t *buf);
 
 extern int mfcl_sector2block(uint8_t sector);
 extern int mfcl_block2sector(uint8_t block);
@@ -0,0 +1,204 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * NFC Forum Type 2 tags. READ returns four pages at a time, NTAG and
+ * Ultralight EV1 also have FAST_READ which returns any range of pages in
+ * one frame. Tag size comes from GET_VERSION where the tag has it, or else
+ * the capability container.
+*/
+#include <ccid.h>
+
+#include "ccid-internal.h"
+#include "rfid.h"
+#include "rfid_layer1.h"
+#include "iso14443a.h"
+#include "proto_t2t.h"
+
+#if 0
+#define dprintf printf
+#else
+#define dprintf(...) do {} while(0)
+#endif
+
+/* NTAG21x max response time */
+#define T2T_FWT			5000
+#define T2T_MAX_FRAME		0xff
+#define T2T_CRC_LEN		2
+
+#define T2T_VENDOR_NXP		0x04
+#define T2T_CC_PAGE		3
+#define T2T_CC_MAGIC		0xe1
+#define T2T_HDR_PAGES		4
+#define T2T_UL_PAGES		16
+
+/* GET_VERSION storage size byte to total pages, including config pages */
+static const struct {
+	uint8_t type;
+	uint8_t storage;
+	uint8_t pages;
+} nxp_sizes[] = {
+	{0x03, 0x0b, 20},	/* MF0UL11 */
+	{0x03, 0x0e, 41},	/* MF0UL21 */
+	{0x04, 0x0b, 20},	/* NTAG210 */
+	{0x04, 0x0e, 41},	/* NTAG212 */
+	{0x04, 0x0f, 45},	/* NTAG213 */
+	{0x04, 0x11, 135},	/* NTAG215 */
+	{0x04, 0x13, 231},	/* NTAG216 */
+};
+
+/* GET_VERSION outcomes. Only a tag which didn't answer, or NAK'd, has gone
+ * idle, any other answer leaves it selected.
+ */
+#define T2T_VERSION_NONE	0
+#define T2T_VERSION_UNKNOWN	1
+#define T2T_VERSION_KNOWN	2
+
+static int get_version(struct _cci *cci, struct t2t_handle *th)
+{
+	static const uint8_t cmd = T2T_CMD_GET_VERSION;
+	uint8_t ver[8];
+	size_t rx_len = sizeof(ver);
+	unsigned int i;
+
+	/* a NAK is 4 bits with no CRC, so it doesn't get this far */
+	if ( !_iso14443ab_transceive(cci, RFID_14443A_FRAME_REGULAR,
+				&cmd, sizeof(cmd), ver, &rx_len, T2T_FWT) )
+		return T2T_VERSION_NONE;
+	if ( rx_len != sizeof(ver) )
+		return T2T_VERSION_NONE;
+	if ( ver[1] != T2T_VENDOR_NXP )
+		return T2T_VERSION_UNKNOWN;
+
+	for(i = 0; i < sizeof(nxp_sizes)/sizeof(*nxp_sizes); i++) {
+		if ( nxp_sizes[i].type == ver[2] &&
+				nxp_sizes[i].storage == ver[6] ) {
+			th->pages = nxp_sizes[i].pages;
+			th->flags |= T2T_HANDLE_F_FAST_READ;
+			return T2T_VERSION_KNOWN;
+		}
+	}
+
+	return T2T_VERSION_UNKNOWN;
+}
+
+static int read4(struct _cci *cci, unsigned int page, uint8_t *buf)
+{
+	uint8_t cmd[2];
+	size_t rx_len = T2T_READ_PAGES * T2T_PAGE_SIZE;
+
+	cmd[0] = T2T_CMD_READ;
+	cmd[1] = page;
+
+	if ( !_iso14443ab_transceive(cci, RFID_14443A_FRAME_REGULAR,
+				cmd, sizeof(cmd), buf, &rx_len, T2T_FWT) )
+		return 0;
+
+	/* anything shorter is a NAK */
+	return (rx_len == T2T_READ_PAGES * T2T_PAGE_SIZE);
+}
+
+/* Work out size and commands supported. Tags which don't know GET_VERSION
+ * NAK it and go idle, so have to be selected again. Those which answer
+ * with a version we don't know are still selected and the capability
+ * container can be read straight away.
+ */
+int _t2t_probe(struct _cci *cci, struct rfid_tag *tag, struct t2t_handle *th)
+{
+	uint8_t hdr[T2T_READ_PAGES * T2T_PAGE_SIZE];
+	const uint8_t *cc;
+	int ver;
+
+	th->flags = 0;
+	th->pages = 0;
+
+	ver = get_version(cci, th);
+	if ( ver != T2T_VERSION_KNOWN ) {
+		if ( ver == T2T_VERSION_NONE &&
+				!_iso14443a_select_uid(cci, tag) )
+			return 0;
+		if ( !read4(cci, 0, hdr) )
+			return 0;
+
+		/* data area size in units of 8 bytes */
+		cc = hdr + T2T_CC_PAGE * T2T_PAGE_SIZE;
+		if ( cc[0] == T2T_CC_MAGIC && cc[2] )
+			th->pages = T2T_HDR_PAGES + cc[2] * 2;
+		else
+			th->pages = T2T_UL_PAGES;
+	}
+
+	dprintf("T2T: %u pages%s\n", th->pages,
+		(th->flags & T2T_HANDLE_F_FAST_READ) ? ", FAST_READ" : "");
+	th->flags |= T2T_HANDLE_F_PROBED;
+	return 1;
+}
+
+static int fast_read(struct _cci *cci, unsigned int page, unsigned int num,
+			uint8_t *buf)
+{
+	uint8_t cmd[3];
+	size_t rx_len = num * T2T_PAGE_SIZE;
+
+	cmd[0] = T2T_CMD_FAST_READ;
+	cmd[1] = page;
+	cmd[2] = page + num - 1;
+
+	if ( !_iso14443ab_transceive(cci, RFID_14443A_FRAME_REGULAR,
+				cmd, sizeof(cmd), buf, &rx_len, T2T_FWT) )
+		return 0;
+
+	return (rx_len == num * T2T_PAGE_SIZE);
+}
+
+/* As many pages per frame as the reader can take in one go */
+static unsigned int frame_pages(struct _cci *cci)
+{
+	unsigned int mru = _rfid_layer1_mru(cci);
+
+	if ( mru > T2T_MAX_FRAME )
+		mru = T2T_MAX_FRAME;
+	return (mru - T2T_CRC_LEN) / T2T_PAGE_SIZE;
+}
+
+int _t2t_read(struct _cci *cci, struct rfid_tag *tag, struct t2t_handle *th,
+		unsigned int page, unsigned int num, uint8_t *buf)
+{
+	uint8_t tmp[T2T_READ_PAGES * T2T_PAGE_SIZE];
+	unsigned int n, max;
+
+	if ( !(th->flags & T2T_HANDLE_F_PROBED) &&
+			!_t2t_probe(cci, tag, th) )
+		return 0;
+
+	if ( page + num > th->pages )
+		return 0;
+
+	if ( th->flags & T2T_HANDLE_F_FAST_READ ) {
+		max = frame_pages(cci);
+		for(; num; page += n, num -= n, buf += n * T2T_PAGE_SIZE) {
+			n = (num < max) ? num : max;
+			if ( !fast_read(cci, page, n, buf) )
+				return 0;
+		}
+		return 1;
+	}
+
+	/* READ wraps around at the end, so use a bounce buffer for the
+	 * last few pages
+	 */
+	for(; num; page += n, num -= n, buf += n * T2T_PAGE_SIZE) {
+		n = (num < T2T_READ_PAGES) ? num : T2T_READ_PAGES;
+		if ( n == T2T_READ_PAGES ) {
+			if ( !read4(cci, page, buf) )
+				return 0;
+			continue;
+		}
+		if ( !read4(cci, page, tmp) )
+			return 0;
+		memcpy(buf, tmp, n * T2T_PAGE_SIZE);
+	}
+
+	return 1;
+}
@@ -0,0 +1,31 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+*/
+#ifndef _PROTO_T2T_H
+#define _PROTO_T2T_H
+
+/* NFC Forum Type 2 tags: MIFARE Ultralight, NTAG and friends */
+#define T2T_PAGE_SIZE		4
+#define T2T_READ_PAGES		4
+
+#define T2T_CMD_GET_VERSION	0x60
+#define T2T_CMD_READ		0x30
+#define T2T_CMD_FAST_READ	0x3a
+
+#define T2T_HANDLE_F_PROBED	(1 << 0)
+#define T2T_HANDLE_F_FAST_READ	(1 << 1)
+
+struct t2t_handle {
+	unsigned int pages;
+	unsigned int flags;
+};
+
+_private int _t2t_probe(struct _cci *cci, struct rfid_tag *tag,
+			struct t2t_handle *th);
+_private int _t2t_read(struct _cci *cci, struct rfid_tag *tag,
+			struct t2t_handle *th, unsigned int page,
+			unsigned int num, uint8_t *buf);
+
+#endif /* PROTO_T2T_H */
@@ -16,10 +16,9 @@
 #include "rfid.h"
 #include "rfid_layer1.h"
 #include "iso14443a.h"
+#include "iso14443b.h"
 #include "proto_tcl.h"
 
-#define RFID_MAX_FRAMELEN	256
-
 #if 0
 #define dprintf printf
 #else
@@ -138,62 +137,6 @@ static unsigned int di_to_speed(unsigned char DI)
 	abort();
 }
 
-/* start a PPS run (autimatically configure highest possible speed */
-static int do_pps(struct _cci *cci, struct rfid_tag *tag,
-			struct tcl_handle *h)
-{
-	unsigned char ppss[3];
-	/* FIXME: this stinks like hell. IF we reduce pps_response size to one,
-	   we'll get stack corruption! */
-	unsigned char pps_response[10];
-	size_t rx_len = 1;
-	unsigned char Dr, Ds, DrI, DsI;
-	unsigned int speed;
-
-	if (h->state != TCL_STATE_ATS_RCVD)
-		return 0;
-
-	Dr = h->ta & 0x07;
-	Ds = h->ta & 0x70 >> 4;
-	//dprintf("Dr = 0x%x, Ds = 0x%x\n", Dr, Ds);
-
-	if (Dr != Ds && !(h->ta & 0x80)) {
-		/* device supports different divisors for rx and tx, but not
-		 * really ?!? */
-		dprintf("PICC has contradictory TA, aborting PPS\n");
-		return 0;
-	};
-
-	/* ISO 14443-4:2000(E) Section 5.3. */
-
-	ppss[0] = 0xd0 | (h->cid & 0x0f);
-	ppss[1] = 0x11;
-	ppss[2] = 0x00;
-
-	/* FIXME: deal with different speed for each direction */
-	DrI = d_to_di(cci, Dr);
-	DsI = d_to_di(cci, Ds);
-	//dprintf("DrI = 0x%x, DsI = 0x%x\n", DrI, DsI);
-
-	ppss[2] = (ppss[2] & 0xf0) | (DrI | DsI << 2);
-
-	if ( !_iso14443ab_transceive(cci, RFID_14443A_FRAME_REGULAR,
-					ppss, 3, pps_response, &rx_len,
-					h->fwt) )
-		return 0;
-
-	if (pps_response[0] != ppss[0]) {
-		dprintf("PPS Response != PPSS\n");
-		return 0;
-	}
-
-	speed = di_to_speed(DrI);
-	if ( !_rfid_layer1_set_speed(cci, speed) )
-		return 0;
-
-	return 1;
-}
-
 static int parse_ats(struct _cci *cci, struct rfid_tag *tag,
 			struct tcl_handle *h,
 			uint8_t *ats, size_t size)
@@ -268,319 +211,581 @@ static int parse_ats(struct _cci *cci, struct rfid_tag *tag,
 	return 1;
 }
 
-struct fr_buff {
-	size_t frame_len;		/* length of frame */
-	size_t hdr_len;		/* length of header within frame */
-	unsigned char data[RFID_MAX_FRAMELEN];
-};
-
-#define frb_payload(x)	(x.data + x.hdr_len)
+#define TCL_MAX_FRAME	256
+#define TCL_MAX_PRLG	3
+#define TCL_CRC_LEN	2
+#define TCL_MAX_RETRY	3
+
+#define TCL_PCB_I		0x02
+#define TCL_PCB_R		0xa2
+#define TCL_PCB_S		0xc2
+#define TCL_PCB_CHAIN		0x10
+#define TCL_PCB_NAK		0x10
+#define TCL_PCB_WTX		0x30
+#define TCL_PCB_BN		0x01
+
+#define is_s_block(x) ((x & 0xc7) == TCL_PCB_S)
+#define is_r_block(x) ((x & 0xe6) == TCL_PCB_R)
+#define is_i_block(x) ((x & 0xe2) == TCL_PCB_I)
+
+/* Build block prologue, ISO 14443-4:2000(E) Section 7.1.1. Block number
+ * goes on I and R blocks, NAD only on the first I-block of a chain.
+ */
+static size_t tcl_prologue(struct tcl_handle *th, uint8_t *prlg,
+				uint8_t pcb, int first)
+{
+	size_t len = 1;
 
+	if ( !is_s_block(pcb) )
+		pcb |= th->toggle & TCL_PCB_BN;
 
-/* RFID transceive buffer. */
-struct rfid_xcvb {
-	struct rfix_xcvb *next;		/* next in queue of buffers */
+	if ( th->flags & TCL_HANDLE_F_CID_USED ) {
+		pcb |= TCL_PCB_CID_FOLLOWING;
+		prlg[len++] = th->cid & 0x0f;
+	}
 
-	uint64_t timeout;		/* timeout to wait for reply */
-	struct fr_buff tx;
-	struct fr_buff rx;
-};
+	if ( (th->flags & TCL_HANDLE_F_NAD_USED) && is_i_block(pcb) && first ) {
+		pcb |= TCL_PCB_NAD_FOLLOWING;
+		prlg[len++] = th->nad;
+	}
 
-struct tcl_tx_context {
-	const unsigned char *tx;
-	unsigned char *rx;
-	const unsigned char *next_tx_byte;
-	unsigned char *next_rx_byte;
-	unsigned int rx_len;
-	unsigned int tx_len;
-	struct rfid_protocol_handle *h;
-};
+	prlg[0] = pcb;
+	return len;
+}
 
-#define tcl_ctx_todo(ctx) (ctx->tx_len - (ctx->next_tx_byte - ctx->tx))
-#define is_s_block(x) ((x & 0xc0) == 0xc0)
-#define is_r_block(x) ((x & 0xc0) == 0x80)
-#define is_i_block(x) ((x & 0xc0) == 0x00)
+#define TA_SAME_D	0x80
 
-static int
-tcl_build_prologue2(struct tcl_handle *th, 
-		    unsigned char *prlg, size_t *prlg_len, 
-		    unsigned char pcb)
+static uint32_t rate_hash(const uint8_t *ptr, size_t len)
 {
-	*prlg_len = 1;
+	uint32_t h = 2166136261U;
 
-	*prlg = pcb;
-
-	if (!is_s_block(pcb)) {
-		if (th->toggle) {
-			/* we've sent a toggle bit last time */
-			th->toggle = 0;
-		} else {
-			/* we've not sent a toggle last time: send one */
-			th->toggle = 1;
-			*prlg |= 0x01;
-		}
-	}
-
-	if (th->flags & TCL_HANDLE_F_CID_USED) {
-		/* ISO 14443-4:2000(E) Section 7.1.1.2 */
-		*prlg |= TCL_PCB_CID_FOLLOWING;
-		(*prlg_len)++;
-		prlg[*prlg_len] = th->cid & 0x0f;
-	}
+	while( len-- )
+		h = (h ^ *ptr++) * 16777619U;
+	return h;
+}
 
-	/* nad only for I-block */
-	if ((th->flags & TCL_HANDLE_F_NAD_USED) && is_i_block(pcb)) {
-		/* ISO 14443-4:2000(E) Section 7.1.1.3 */
-		/* FIXME: in case of chaining only for first frame */
-		*prlg |= TCL_PCB_NAD_FOLLOWING;
-		prlg[*prlg_len] = th->nad;
-		(*prlg_len)++;
+static struct tcl_rate *rate_lookup(struct tcl_rate_cache *rc,
+					const struct rfid_tag *tag,
+					const uint8_t *ats, size_t len)
+{
+	struct tcl_rate *r, *lru = NULL;
+	uint32_t h = rate_hash(ats, len);
+	unsigned int i;
+
+	if ( NULL == rc )
+		return NULL;
+
+	for(i = 0; i < TCL_RATE_CACHE; i++) {
+		r = &rc->ent[i];
+		if ( (r->flags & TCL_RATE_VALID) && r->ats_hash == h &&
+				r->uid_len == tag->uid_len &&
+				!memcmp(r->uid, tag->uid, tag->uid_len) )
+			goto out;
+		if ( NULL == lru || !(r->flags & TCL_RATE_VALID) ||
+				r->used < lru->used )
+			lru = r;
 	}
 
-	return 0;
+	/* new PICC: no limit until something fails */
+	r = lru;
+	r->uid_len = tag->uid_len;
+	memcpy(r->uid, tag->uid, tag->uid_len);
+	r->ats_hash = h;
+	r->dri = r->dsi = PPS_DIV_8;
+	r->flags = TCL_RATE_VALID;
+out:
+	r->used = ++rc->clock;
+	return r;
 }
 
-static int
-tcl_build_prologue_i(struct tcl_handle *th,
-		     unsigned char *prlg, size_t *prlg_len)
+/* Give up on the faster of the two directions for this PICC */
+static void rate_demote(struct _cci *cci, struct tcl_handle *h)
 {
-	/* ISO 14443-4:2000(E) Section 7.1.1.1 */
-	return tcl_build_prologue2(th, prlg, prlg_len, 0x02);
+	struct tcl_rate *r = h->rate;
+	uint8_t dri, dsi;
+
+	if ( NULL == r || (!h->dri && !h->dsi) )
+		return;
+
+	dri = h->dri;
+	dsi = h->dsi;
+	if ( dri >= dsi )
+		dri--;
+	else
+		dsi--;
+
+	/* once per session is enough */
+	if ( r->dri == dri && r->dsi == dsi &&
+			!(r->flags & TCL_RATE_GOOD) )
+		return;
+
+	r->dri = dri;
+	r->dsi = dsi;
+	r->flags &= ~TCL_RATE_GOOD;
+	_rfid_layer1_demoted(cci);
+	dprintf("T=CL: rates for this PICC now at most DRI=%u DSI=%u\n",
+		r->dri, r->dsi);
 }
 
-static int
-tcl_build_prologue_r(struct tcl_handle *th,
-		     unsigned char *prlg, size_t *prlg_len,
-		     unsigned int nak)
+/* Fastest rates in each direction that the PICC, the reader and what we
+ * know about this PICC allow. TA bits 3-1 are PCD to PICC (DR), bits 7-5
+ * PICC to PCD (DS), and bit 8 says both must be the same.
+ */
+static void pick_rates(struct _cci *cci, struct tcl_handle *h)
 {
-	unsigned char pcb = 0xa2;
-	/* ISO 14443-4:2000(E) Section 7.1.1.1 */
+	unsigned char Dr, Ds;
+
+	Dr = h->ta & 0x07;
+	Ds = (h->ta & 0x70) >> 4;
+	if ( h->rate ) {
+		Dr &= (1 << h->rate->dri) - 1;
+		Ds &= (1 << h->rate->dsi) - 1;
+	}
+
+	/* frames already getting garbled, don't go chancing 424k or 848k
+	 * on a PICC which hasn't proved itself
+	 */
+	if ( _rfid_layer1_noisy(cci) &&
+			(NULL == h->rate || !(h->rate->flags & TCL_RATE_GOOD)) ) {
+		Dr &= ATS_TA_DIV_2;
+		Ds &= ATS_TA_DIV_2;
+	}
 
-	if (nak)
-		pcb |= 0x10;
+	if ( (h->ta & TA_SAME_D) ||
+			!(_rfid_layer1_get_speeds(cci) & RFID_SPEEDS_ASYM) ) {
+		Dr = Ds = Dr & Ds;
+	}
 
-	return tcl_build_prologue2(th, prlg, prlg_len, pcb);
+	h->dri = d_to_di(cci, Dr);
+	h->dsi = d_to_di(cci, Ds);
 }
 
-static int
-tcl_build_prologue_s(struct tcl_handle *th,
-		     unsigned char *prlg, size_t *prlg_len)
+/* R(NAK) for a block number we haven't used gets an R(ACK) back, rule 12,
+ * cheapest way to check we can hear each other at the new rates.
+ */
+static int rate_check(struct _cci *cci, struct rfid_tag *tag,
+			struct tcl_handle *h)
 {
-	/* ISO 14443-4:2000(E) Section 7.1.1.1 */
+	uint8_t frame[TCL_MAX_PRLG];
+	uint8_t rx[TCL_MAX_PRLG];
+	size_t frame_len, rx_len = sizeof(rx);
 
-	/* the only S-block from PCD->PICC is DESELECT,
-	 * well, actually there is the S(WTX) response. */
-	return tcl_build_prologue2(th, prlg, prlg_len, 0xc2);
-}
+	frame_len = tcl_prologue(h, frame, TCL_PCB_R | TCL_PCB_NAK, 0);
+	if ( !_iso14443ab_transceive(cci, l2_to_frame(tag->layer2),
+				frame, frame_len, rx, &rx_len, h->fwt) )
+		return 0;
 
-/* FIXME: WTXM implementation */
+	return (rx_len >= 1 && is_r_block(rx[0]) && !(rx[0] & TCL_PCB_NAK));
+}
 
-static int tcl_prlg_len(struct tcl_handle *th)
+/* Switch to the new rates, checking they work unless known good */
+static int rate_switch(struct _cci *cci, struct rfid_tag *tag,
+			struct tcl_handle *h)
 {
-	int prlg_len = 1;
+	if ( !_tcl_set_rates(cci, h) )
+		return 0;
 
-	if (th->flags & TCL_HANDLE_F_CID_USED)
-		prlg_len++;
+	if ( NULL == h->rate || (h->rate->flags & TCL_RATE_GOOD) )
+		return 1;
 
-	if (th->flags & TCL_HANDLE_F_NAD_USED)
-		prlg_len++;
+	if ( !rate_check(cci, tag, h) ) {
+		trace(cci->i_parent, " o T=CL: no response at DRI=%u DSI=%u\n",
+			h->dri, h->dsi);
+		rate_demote(cci, h);
+		h->flags |= TCL_HANDLE_F_RATE_FAIL;
+		_rfid_layer1_set_speed(cci, RFID_14443A_SPEED_106K);
+		return 0;
+	}
 
-	return prlg_len;
+	h->rate->dri = h->dri;
+	h->rate->dsi = h->dsi;
+	h->rate->flags |= TCL_RATE_GOOD;
+	return 1;
 }
 
-#define max_net_tx_framesize(x)	(x->fsc - tcl_prlg_len(x))
+/* See if an active PICC is still in the field. Block numbers aren't
+ * touched so the session carries on as if nothing was sent.
+ */
+int _tcl_ping(struct _cci *cci, struct rfid_tag *tag, struct tcl_handle *h)
+{
+	return rate_check(cci, tag, h);
+}
 
-static int 
-tcl_refill_xcvb(struct tcl_handle *th, struct rfid_xcvb *xcvb,
-		struct tcl_tx_context *ctx)
+/* Put the reader back to the rates agreed with this PICC, something else
+ * in the field may have been using different ones.
+ */
+int _tcl_set_rates(struct _cci *cci, struct tcl_handle *h)
 {
-	if (ctx->next_tx_byte >= ctx->tx + ctx->tx_len) {
-		dprintf("tyring to refill tx xcvb but no data left!\n");
-		return 0;
-	}
+	return _rfid_layer1_set_speeds(cci, di_to_speed(h->dri),
+					di_to_speed(h->dsi));
+}
+
+/* start a PPS run (autimatically configure highest possible speed */
+static int do_pps(struct _cci *cci, struct rfid_tag *tag,
+			struct tcl_handle *h)
+{
+	unsigned char ppss[3];
+	/* FIXME: this stinks like hell. IF we reduce pps_response size to one,
+	   we'll get stack corruption! */
+	unsigned char pps_response[10];
+	size_t rx_len = 1;
 
-	if (tcl_build_prologue_i(th, xcvb->tx.data, 
-				 &xcvb->tx.hdr_len) < 0)
+	if (h->state != TCL_STATE_ATS_RCVD)
 		return 0;
 
-	if (tcl_ctx_todo(ctx) > th->fsc - xcvb->tx.hdr_len)
-		xcvb->tx.frame_len = max_net_tx_framesize(th);
-	else
-		xcvb->tx.frame_len = tcl_ctx_todo(ctx);
+	pick_rates(cci, h);
+	dprintf("DRI = 0x%x, DSI = 0x%x\n", h->dri, h->dsi);
 
-	memcpy(frb_payload(xcvb->tx), ctx->next_tx_byte,
-		xcvb->tx.frame_len);
+	/* PPS is optional, nothing to say if staying at 106kbit/s */
+	if ( h->dri == PPS_DIV_1 && h->dsi == PPS_DIV_1 )
+		return 1;
 
-	ctx->next_tx_byte += xcvb->tx.frame_len;
+	/* ISO 14443-4:2000(E) Section 5.3. */
 
-	/* check whether we need to set the chaining bit */
-	if (ctx->next_tx_byte < ctx->tx + ctx->tx_len)
-		xcvb->tx.data[0] |= 0x10;
+	ppss[0] = 0xd0 | (h->cid & 0x0f);
+	ppss[1] = 0x11;
+	ppss[2] = (h->dsi << 2) | h->dri;
 
-	/* add hdr_len after copying the net payload */
-	xcvb->tx.frame_len += xcvb->tx.hdr_len;
+	if ( !_iso14443ab_transceive(cci, RFID_14443A_FRAME_REGULAR,
+					ppss, 3, pps_response, &rx_len,
+					h->fwt) )
+		return 0;
 
-	xcvb->timeout = th->fwt;
+	if (pps_response[0] != ppss[0]) {
+		dprintf("PPS Response != PPSS\n");
+		return 0;
+	}
 
-	return 1;
+	return rate_switch(cci, tag, h);
 }
 
-static void fill_xcvb_wtxm(struct tcl_handle *th, struct rfid_xcvb *xcvb,
-			unsigned char inf)
+/* INF bytes that fit in an I-block to the PICC. FSC includes the prologue
+ * and CRC, the CRC is appended by the ASIC and doesn't occupy the FIFO.
+ */
+static size_t tcl_tx_room(struct _cci *cci, struct tcl_handle *th,
+				size_t prlg_len)
 {
-	/* Acknowledge WTXM */
-	tcl_build_prologue_s(th, xcvb->tx.data, &xcvb->tx.hdr_len);
-	/* set two bits that make this block a wtx */
-	xcvb->tx.data[0] |= 0x30;
-	xcvb->tx.data[xcvb->tx.hdr_len] = inf;
-	xcvb->tx.frame_len = xcvb->tx.hdr_len+1;
-	xcvb->timeout = th->fwt * inf;
+	size_t max = th->fsc - TCL_CRC_LEN;
+
+	if ( max > _rfid_layer1_mtu(cci) )
+		max = _rfid_layer1_mtu(cci);
+	if ( max > TCL_MAX_FRAME )
+		max = TCL_MAX_FRAME;
+	return max - prlg_len;
 }
 
-static int check_cid(struct tcl_handle *th, struct rfid_xcvb *xcvb)
+/* Check that a received block is well formed and addressed to us. Returns
+ * the prologue length or zero if the block is invalid.
+ */
+static size_t tcl_check_block(struct tcl_handle *th,
+				const uint8_t *rx, size_t len)
 {
-	if (xcvb->rx.data[0] & TCL_PCB_CID_FOLLOWING) {
-		if (xcvb->rx.data[1] != th->cid) {
-			dprintf("CID %u is not valid, we expected %u\n", 
-				xcvb->rx.data[1], th->cid);
+	size_t hlen = 1;
+	uint8_t pcb;
+
+	if ( len < 1 )
+		return 0;
+
+	pcb = rx[0];
+	if ( !is_i_block(pcb) && !is_r_block(pcb) && !is_s_block(pcb) )
+		return 0;
+
+	if ( !(pcb & TCL_PCB_CID_FOLLOWING) !=
+			!(th->flags & TCL_HANDLE_F_CID_USED) )
+		return 0;
+
+	if ( pcb & TCL_PCB_CID_FOLLOWING ) {
+		if ( len < 2 || (rx[1] & 0x0f) != (th->cid & 0x0f) ) {
+			dprintf("CID %u is not valid, we expected %u\n",
+				rx[1] & 0x0f, th->cid);
 			return 0;
 		}
+		hlen++;
 	}
-	return 1;
-}
 
-int _tcl_transact(struct _cci *cci, struct rfid_tag *tag,
-		struct tcl_handle *th,
-		const unsigned char *tx_data, unsigned int tx_len,
-		unsigned char *rx_data, unsigned int *rx_len)
-{
-	int ret;
+	if ( is_i_block(pcb) && (pcb & TCL_PCB_NAD_FOLLOWING) )
+		hlen++;
 
-	struct rfid_xcvb xcvb;
-	struct tcl_tx_context tcl_ctx;
+	/* S-blocks carry a parameter byte, WTXM or none for DESELECT */
+	if ( is_s_block(pcb) && (pcb & TCL_PCB_WTX) == TCL_PCB_WTX &&
+			len < hlen + 1 )
+		return 0;
 
-	unsigned char ack[10];
-	unsigned int ack_len;
+	if ( len < hlen )
+		return 0;
 
-	/* initialize context */
-	tcl_ctx.next_tx_byte = tcl_ctx.tx = tx_data;
-	tcl_ctx.next_rx_byte = tcl_ctx.rx = rx_data;
-	tcl_ctx.rx_len = *rx_len;
-	tcl_ctx.tx_len = tx_len;
+	return hlen;
+}
 
-	/* initialize xcvb */
-	xcvb.timeout = th->fwt;
+enum tcl_next {
+	TCL_SEND_I,
+	TCL_SEND_ACK,
+	TCL_SEND_NAK,
+	TCL_SEND_WTX,
+};
 
-tx_refill:
-	if (!tcl_refill_xcvb(th, &xcvb, &tcl_ctx)) {
-		ret = 0;
-		goto out;
-	}
+/* Exchange an APDU with the PICC, ISO 14443-4:2000(E) Section 7.5.
+ *
+ * Command I-blocks are sized to FSC and chained. Response I-blocks are
+ * received directly in to rx_data: the prologue of each frame lands on top
+ * of the tail of the previous one, those bytes are saved beforehand and put
+ * back afterwards. Only the first frame, and one which might overrun the
+ * end of rx_data, go via a bounce buffer.
+ */
+int _tcl_transact(struct _cci *cci, struct rfid_tag *tag,
+		struct tcl_handle *th,
+		const unsigned char *tx_data, size_t tx_len,
+		unsigned char *rx_data, size_t *rx_len)
+{
+	struct _ccid *ccid = cci->i_parent;
+	enum rfid_frametype ft = l2_to_frame(tag->layer2);
+	uint8_t frame[TCL_MAX_FRAME];
+	uint8_t bounce[TCL_MAX_FRAME];
+	uint8_t saved[TCL_MAX_PRLG];
+	size_t frame_len, tx_ofs = 0, tx_chunk = 0;
+	size_t rx_max = *rx_len, got = 0;
+	size_t mru = _rfid_layer1_mru(cci);
+	enum tcl_next next = TCL_SEND_I;
+	unsigned int retry = 0, rx_chain = 0, wtxm = 1, slack = 1;
+	uint8_t *dst;
+	size_t len, hlen, hexp;
+	uint64_t timeout, fwt_max = fwi_to_fwt(cci, 14);
+	uint8_t pcb;
+	int direct;
+
+	if ( mru > TCL_MAX_FRAME )
+		mru = TCL_MAX_FRAME;
+
+	for(;;) {
+		/* build the block to send */
+		switch(next) {
+		case TCL_SEND_I:
+			frame_len = tcl_prologue(th, frame, TCL_PCB_I,
+						tx_ofs == 0);
+			tx_chunk = tcl_tx_room(cci, th, frame_len);
+			if ( tx_chunk >= tx_len - tx_ofs )
+				tx_chunk = tx_len - tx_ofs;
+			else
+				frame[0] |= TCL_PCB_CHAIN;
+			memcpy(frame + frame_len, tx_data + tx_ofs, tx_chunk);
+			frame_len += tx_chunk;
+			break;
+		case TCL_SEND_ACK:
+			frame_len = tcl_prologue(th, frame, TCL_PCB_R, 0);
+			break;
+		case TCL_SEND_NAK:
+			frame_len = tcl_prologue(th, frame,
+						TCL_PCB_R | TCL_PCB_NAK, 0);
+			break;
+		case TCL_SEND_WTX:
+			frame_len = tcl_prologue(th, frame,
+						TCL_PCB_S | TCL_PCB_WTX, 0);
+			frame[frame_len++] = wtxm;
+			break;
+		}
 
-do_tx:
-	xcvb.rx.frame_len = sizeof(xcvb.rx.data);
-	ret = _iso14443ab_transceive(cci, l2_to_frame(tag->layer2),
-				     xcvb.tx.data, xcvb.tx.frame_len,
-				     xcvb.rx.data, &xcvb.rx.frame_len,
-				     xcvb.timeout);
-	if ( !ret )
-		return 0;
+		/* S(WTX) extends the wait for one block, up to FWT max */
+		timeout = (uint64_t)th->fwt * wtxm * slack;
+		if ( (wtxm > 1 || slack > 1) && timeout > fwt_max )
+			timeout = fwt_max;
+		wtxm = 1;
+
+		/* decide where the response goes */
+		hexp = 1 + !!(th->flags & TCL_HANDLE_F_CID_USED);
+		direct = (got >= hexp && rx_max - got + hexp >= mru);
+		if ( direct ) {
+			dst = rx_data + got - hexp;
+			memcpy(saved, dst, hexp);
+		}else{
+			dst = bounce;
+		}
+		len = mru;
+
+		if ( !_iso14443ab_transceive(cci, ft, frame, frame_len,
+						dst, &len, timeout) )
+			len = 0;
+
+		hlen = tcl_check_block(th, dst, len);
+		pcb = (hlen) ? dst[0] : 0;
+
+		if ( !hlen || (is_r_block(pcb) && (pcb & TCL_PCB_NAK)) ) {
+			/* Rules 4 and 5: timeout or invalid block */
+			if ( direct )
+				memcpy(dst, saved, hexp);
+			if ( !_rfid_layer1_may_retry(cci, retry++,
+							TCL_MAX_RETRY) ) {
+				trace(ccid, " o T=CL: no valid response\n");
+				ccid->d_error = CCID_ERROR_CARD_IO;
+				/* use something slower next time */
+				rate_demote(cci, th);
+				goto err;
+			}
+			dprintf("T=CL: bad block, retry %u\n", retry);
+
+			/* a weakly coupled PICC can run late */
+			if ( (_rfid_layer1_last_error(cci) & RF_ERR_TIMEOUT) &&
+					slack < RFID_MAX_SLACK )
+				slack *= 2;
+			if ( _rfid_layer1_noisy(cci) )
+				rate_demote(cci, th);
+			next = (rx_chain) ? TCL_SEND_ACK : TCL_SEND_NAK;
+			continue;
+		}
 
-	dprintf("l2 transceive finished\n");
+		if ( is_s_block(pcb) ) {
+			if ( (pcb & TCL_PCB_WTX) != TCL_PCB_WTX ) {
+				dprintf("S-Block but not WTX?\n");
+				goto err_proto;
+			}
 
-	if (is_r_block(xcvb.rx.data[0])) {
-		dprintf("R-Block\n");
+			wtxm = dst[hlen] & 0x3f;
+			if ( direct )
+				memcpy(dst, saved, hexp);
+			if ( wtxm == 0 || wtxm >= 60 ) {
+				dprintf("WTXM %u is RFU!\n", wtxm);
+				goto err_proto;
+			}
 
-		if ((xcvb.rx.data[0] & 0x01) != th->toggle) {
-			dprintf("response with wrong toggle bit\n");
-			goto out;
+			/* answer with same WTXM, the extended wait applies
+			 * to the next block only
+			 */
+			next = TCL_SEND_WTX;
+			continue;
 		}
 
-		/* Handle ACK frame in case of chaining */
-		if (!check_cid(th, &xcvb))
-			goto out;
+		if ( is_r_block(pcb) ) {
+			if ( direct )
+				memcpy(dst, saved, hexp);
 
-		goto tx_refill;
-	} else if (is_s_block(xcvb.rx.data[0])) {
-		unsigned char inf;
+			if ( rx_chain ) {
+				dprintf("R(ACK) while PICC chaining\n");
+				goto err_proto;
+			}
 
-		dprintf("S-Block\n");
-		/* Handle Wait Time Extension */
-		
-		if (!check_cid(th, &xcvb))
-			goto out;
+			if ( (pcb & TCL_PCB_BN) != th->toggle ) {
+				/* Rule 6: re-transmit last I-block */
+				if ( !_rfid_layer1_may_retry(cci, retry++,
+							TCL_MAX_RETRY) )
+					goto err_proto;
+				next = TCL_SEND_I;
+				continue;
+			}
 
-		if (xcvb.rx.data[0] & TCL_PCB_CID_FOLLOWING) {
-			if (xcvb.rx.frame_len < 3) {
-				dprintf("S-Block with CID but short len\n");
-				ret = 0;
-				goto out;
+			/* Rule 7: continue chaining, if we were */
+			if ( tx_ofs + tx_chunk >= tx_len ) {
+				dprintf("R(ACK) but not chaining\n");
+				goto err_proto;
 			}
-			inf = xcvb.rx.data[2];
-		} else
-			inf = xcvb.rx.data[1];
 
-		if ((xcvb.rx.data[0] & 0x30) != 0x30) {
-			dprintf("S-Block but not WTX?\n");
-			ret = 0;
-			goto out;
+			th->toggle ^= TCL_PCB_BN;
+			tx_ofs += tx_chunk;
+			tx_chunk = 0;
+			retry = 0;
+			slack = 1;
+			next = TCL_SEND_I;
+			continue;
 		}
-		inf &= 0x3f;	/* only lower 6 bits code WTXM */
-		if (inf == 0 || (inf >= 60 && inf <= 63)) {
-			dprintf("WTXM %u is RFU!\n", inf);
-			ret = 0;
-			goto out;
-		}
-		
-		fill_xcvb_wtxm(th, &xcvb, inf);
-		/* start over with next transceive */
-		goto do_tx; 
-	} else if (is_i_block(xcvb.rx.data[0])) {
-		unsigned int net_payload_len;
-		/* we're actually receiving payload data */
-
-		dprintf("I-Block: ");
-
-		if ((xcvb.rx.data[0] & 0x01) != th->toggle) {
-			dprintf("response with wrong toggle bit\n");
-			goto out;
+
+		/* I-block */
+		if ( (pcb & TCL_PCB_BN) != th->toggle ||
+				tx_ofs + tx_chunk < tx_len ) {
+			dprintf("I-Block with bad block number or early\n");
+			if ( direct )
+				memcpy(dst, saved, hexp);
+			if ( !_rfid_layer1_may_retry(cci, retry++,
+						TCL_MAX_RETRY) )
+				goto err_proto;
+			next = (rx_chain) ? TCL_SEND_ACK : TCL_SEND_NAK;
+			continue;
 		}
 
-		xcvb.rx.hdr_len = 1;
+		len -= hlen;
+		if ( len > rx_max - got ) {
+			trace(ccid, " o T=CL: response too big for buffer\n");
+			if ( direct )
+				memcpy(dst, saved, hexp);
+			ccid->d_error = CCID_ERROR_IN_VALUE;
+			goto err;
+		}
 
-		if (!check_cid(th, &xcvb))
-			goto out;
+		if ( !direct )
+			memcpy(rx_data + got, dst + hlen, len);
+		else if ( hlen != hexp )
+			memmove(rx_data + got, dst + hlen, len);
+		if ( direct )
+			memcpy(dst, saved, hexp);
+		got += len;
+
+		/* Rule B */
+		th->toggle ^= TCL_PCB_BN;
+		tx_ofs = tx_len;
+		tx_chunk = 0;
+		retry = 0;
+		slack = 1;
+
+		if ( !(pcb & TCL_PCB_CHAIN) )
+			break;
 
-		if (xcvb.rx.data[0] & TCL_PCB_CID_FOLLOWING)
-			xcvb.rx.hdr_len++;
-		if (xcvb.rx.data[0] & TCL_PCB_NAD_FOLLOWING)
-			xcvb.rx.hdr_len++;
-	
-		net_payload_len = xcvb.rx.frame_len - xcvb.rx.hdr_len;
-		dprintf("%u bytes\n", net_payload_len);
-		memcpy(tcl_ctx.next_rx_byte, &xcvb.rx.data[xcvb.rx.hdr_len], 
-			net_payload_len);
-		tcl_ctx.next_rx_byte += net_payload_len;
-
-		if (xcvb.rx.data[0] & 0x10) {
-			/* we're not the last frame in the chain, continue rx */
-			dprintf("not the last frame in the chain, continue\n");
-			ack_len = sizeof(ack);
-			tcl_build_prologue_r(th, xcvb.tx.data, &xcvb.tx.frame_len, 0);
-			xcvb.timeout = th->fwt;
-			goto do_tx;
-		}
+		/* Rule 2: acknowledge chained I-block */
+		rx_chain = 1;
+		next = TCL_SEND_ACK;
 	}
 
-out:
-	*rx_len = tcl_ctx.next_rx_byte - tcl_ctx.rx;
-	return ret;
+	*rx_len = got;
+	return 1;
+
+err_proto:
+	trace(ccid, " o T=CL: protocol error\n");
+	ccid->d_error = CCID_ERROR_CARD_PROTO;
+err:
+	*rx_len = got;
+	return 0;
+}
+
+
+/* S(DESELECT) puts the PICC in HALT, ISO 14443-4:2000(E) Section 8. It
+ * can then be woken up with WUPA and selected again.
+ */
+int _tcl_deselect(struct _cci *cci, struct rfid_tag *tag,
+			struct tcl_handle *th)
+{
+	uint8_t frame[TCL_MAX_PRLG];
+	uint8_t rx[TCL_MAX_PRLG];
+	size_t frame_len, rx_len = sizeof(rx);
+
+	frame_len = tcl_prologue(th, frame, TCL_PCB_S, 0);
+
+	th->state = TCL_STATE_DESELECT_SENT;
+	if ( !_iso14443ab_transceive(cci, l2_to_frame(tag->layer2),
+				frame, frame_len, rx, &rx_len, th->fwt) )
+		return 0;
+
+	if ( rx_len < 1 || !is_s_block(rx[0]) || (rx[0] & TCL_PCB_WTX) )
+		return 0;
+
+	th->state = TCL_STATE_DESELECTED;
+	return 1;
+}
+
+/* Largest frame size we can receive in one go */
+static uint8_t tcl_fsdi(struct _cci *cci, struct tcl_handle *th)
+{
+	uint8_t fsdi;
+
+	for(fsdi = 8; fsdi; fsdi--) {
+		_iso14443_fsdi_to_fsd(fsdi, &th->fsd);
+		if ( th->fsd <= _rfid_layer1_mru(cci) + TCL_CRC_LEN )
+			break;
+	}
+	if ( !fsdi )
+		_iso14443_fsdi_to_fsd(fsdi, &th->fsd);
+	return fsdi;
 }
 
 #define CID	0
 #define TIMEOUT	(((uint64_t)1000000 * 65536 / ISO14443_FREQ_CARRIER))
 int _tcl_get_ats(struct _cci *cci, struct rfid_tag *tag,
-		 struct tcl_handle *th)
+		 struct tcl_handle *th, struct tcl_rate_cache *rc)
 {
 	struct _ccid *ccid;
 	uint8_t ats[64];
@@ -588,11 +793,12 @@ int _tcl_get_ats(struct _cci *cci, struct rfid_tag *tag,
 	size_t ats_len;
 	uint8_t fsdi;
 
-	th->toggle = 1;
+	/* Rule A: block number starts at zero */
+	th->toggle = 0;
+	fsdi = tcl_fsdi(cci, th);
 
-	_iso14443_fsd_to_fsdi(_rfid_layer1_mtu(cci), &fsdi);
 	rats[0] = 0xe0;
-	rats[1] = (CID & 0xf) | ((fsdi & 0xf) << 4);
+	rats[1] = (th->cid & 0xf) | ((fsdi & 0xf) << 4);
 
 	ats_len = sizeof(ats);
 	if ( !_iso14443ab_transceive(cci, RFID_14443A_FRAME_REGULAR,
@@ -608,6 +814,20 @@ int _tcl_get_ats(struct _cci *cci, struct rfid_tag *tag,
 		return 0;
 	}
 
+	/* A PICC that ignores CID answers blocks meant for any other, so it
+	 * can only share the field as CID 0
+	 */
+	if ( th->cid ) {
+		if ( !(th->flags & TCL_HANDLE_F_CID_SUPPORTED) ) {
+			trace(ccid, " o T=CL: PICC doesn't support CID\n");
+			_tcl_deselect(cci, tag, th);
+			return 0;
+		}
+		th->flags |= TCL_HANDLE_F_CID_USED;
+	}
+
+	th->rate = rate_lookup(rc, tag, ats, ats_len);
+
 	if ( !do_pps(cci, tag, th) )
 		return 0;
 
@@ -615,3 +835,58 @@ int _tcl_get_ats(struct _cci *cci, struct rfid_tag *tag,
 	ccid->d_xfr->x_rxlen = ats_len;
 	return 1;
 }
+
+/* Type B has no RATS/ATS, the same parameters come from the ATQB protocol
+ * info and are agreed with ATTRIB, ISO 14443-3:2001(E) Section 7.10.
+ */
+int _tcl_connect_b(struct _cci *cci, struct rfid_tag *tag,
+			struct tcl_handle *th, struct tcl_rate_cache *rc)
+{
+	struct _ccid *ccid = cci->i_parent;
+	const uint8_t *pi = tag->proto_info;
+	uint8_t fsdi, mbli;
+
+	th->toggle = 0;
+	th->flags = 0;
+	th->cid = CID;
+	th->nad = 0;
+
+	_iso14443_fsdi_to_fsd(pi[1] >> 4, &th->fsc);
+	if ( th->fsc > _rfid_layer1_mtu(cci) )
+		th->fsc = _rfid_layer1_mtu(cci);
+	th->fwt = fwi_to_fwt(cci, pi[2] >> 4);
+	th->sfgt = sfgi_to_sfgt(cci, 0);
+	th->ta = pi[0];
+	if ( pi[2] & ISO14443B_FO_NAD )
+		th->flags |= TCL_HANDLE_F_NAD_SUPPORTED;
+	if ( pi[2] & ISO14443B_FO_CID )
+		th->flags |= TCL_HANDLE_F_CID_SUPPORTED;
+
+	fsdi = tcl_fsdi(cci, th);
+
+	/* bit rate capability is laid out like TA(1) in the ATS */
+	th->rate = rate_lookup(rc, tag, pi, sizeof(tag->proto_info));
+	pick_rates(cci, th);
+
+	if ( !_iso14443b_attrib(cci, tag, (th->dsi << 6) | (th->dri << 4) |
+				fsdi, th->cid, th->fwt, &mbli) )
+		return 0;
+
+	dprintf("ATTRIB ok: fsc=%zu fwt=%u mbli=%u DRI=%u DSI=%u\n",
+		th->fsc, th->fwt, mbli, th->dri, th->dsi);
+	th->state = TCL_STATE_ESTABLISHED;
+
+	/* new bit rate applies from the first block after ATTRIB */
+	if ( (th->dri || th->dsi) && !rate_switch(cci, tag, th) )
+		return 0;
+
+	/* as good as an ATS: application data, protocol info and MBLI */
+	memcpy(ccid->d_xfr->x_rxbuf, tag->app_data, sizeof(tag->app_data));
+	memcpy(ccid->d_xfr->x_rxbuf + sizeof(tag->app_data),
+		tag->proto_info, sizeof(tag->proto_info));
+	ccid->d_xfr->x_rxbuf[sizeof(tag->app_data) +
+				sizeof(tag->proto_info)] = mbli << 4;
+	ccid->d_xfr->x_rxlen = sizeof(tag->app_data) +
+				sizeof(tag->proto_info) + 1;
+	return 1;
+}
@@ -6,6 +6,28 @@
 #ifndef _PROTO_TCL_H
 #define _PROTO_TCL_H
 
+/* Bit rates which worked, or the most to try after a failure, for each of
+ * the last few PICCs seen. Keyed on UID and ATS since random UIDs are
+ * common.
+ */
+#define TCL_RATE_CACHE		8
+struct tcl_rate {
+	uint8_t uid_len;
+	uint8_t uid[10];
+	uint8_t dri;		/* PCD to PICC */
+	uint8_t dsi;		/* PICC to PCD */
+	uint8_t flags;
+	uint32_t ats_hash;
+	unsigned int used;
+};
+#define TCL_RATE_VALID		(1 << 0)
+#define TCL_RATE_GOOD		(1 << 1)
+
+struct tcl_rate_cache {
+	struct tcl_rate ent[TCL_RATE_CACHE];
+	unsigned int clock;
+};
+
 struct tcl_handle {
 	/* derived from ats */
 	size_t fsc;	/* max frame size accepted by card */
@@ -21,14 +43,28 @@ struct tcl_handle {
 	unsigned int flags;
 	unsigned int state;	/* protocol state */
 
-	unsigned int toggle;	/* send toggle with next frame */
+	unsigned int toggle;	/* current block number */
+
+	/* negotiated bit rates and where to report how they went */
+	uint8_t dri;
+	uint8_t dsi;
+	struct tcl_rate *rate;
 };
+/* flags: PPS went through but the PICC can't be heard at the new rates */
+#define TCL_HANDLE_F_RATE_FAIL	0x0100
 
 _private int _tcl_get_ats(struct _cci *cci, struct rfid_tag *tag,
-			  struct tcl_handle *th);
+			  struct tcl_handle *th, struct tcl_rate_cache *rc);
+_private int _tcl_connect_b(struct _cci *cci, struct rfid_tag *tag,
+			  struct tcl_handle *th, struct tcl_rate_cache *rc);
+_private int _tcl_set_rates(struct _cci *cci, struct tcl_handle *th);
+_private int _tcl_ping(struct _cci *cci, struct rfid_tag *tag,
+			struct tcl_handle *th);
+_private int _tcl_deselect(struct _cci *cci, struct rfid_tag *tag,
+			struct tcl_handle *th);
 _private int _tcl_transact(struct _cci *cci, struct rfid_tag *tag,
 			struct tcl_handle *th,
-			const unsigned char *tx_data, unsigned int tx_len,
-			unsigned char *rx_data, unsigned int *rx_len);
+			const unsigned char *tx_data, size_t tx_len,
+			unsigned char *rx_data, size_t *rx_len);
 
 #endif /* PROTO_TCL_H */
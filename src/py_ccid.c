@@ -293,6 +293,19 @@ static PyObject *cp_cci_wait(struct cp_cci *self, PyObject *args)
 	return Py_None;
 }
 
+static PyObject *cp_cci_wait_removal(struct cp_cci *self, PyObject *args)
+{
+	if ( NULL == self->slot ) {
+		PyErr_SetString(_ccid_err, "Bad slot");
+		return NULL;
+	}
+
+	cci_wait_for_removal(self->slot);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
 static PyObject *cp_cci_status(struct cp_cci *self)
 {
 	if ( NULL == self->slot ) {
@@ -370,6 +383,9 @@ static PyMethodDef cp_cci_methods[] = {
 		"cci.wait_for_card()\n"
 		"Sleep until the end of time, or until a card is inserted."
 		"whichever comes soonest."},
+	{"wait_for_removal", (PyCFunction)cp_cci_wait_removal, METH_NOARGS,
+		"cci.wait_for_removal()\n"
+		"Sleep until the card is taken away."},
 	{"on", (PyCFunction)cp_cci_on, METH_VARARGS,	
 		"slotchipcard.on(voltage=CHIPCARD_AUTO_VOLTAGE)\n"
 		"Power on card and retrieve ATR."},
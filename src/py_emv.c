@@ -131,6 +131,7 @@ static PyObject *cp_data_repr(struct cp_data *self)
 			return ret->ob_type->tp_repr(ret);
 		}while(0);
 	case EMV_DATA_BCD:
+	case EMV_DATA_CN:
 		return bcd_convert(ptr, len);
 	case EMV_DATA_DATE:
 		return date_convert(ptr, len);
@@ -933,6 +934,7 @@ PyMODINIT_FUNC initemv(void)
 	_INT_CONST(m, DATA_INT);
 	_INT_CONST(m, DATA_BCD);
 	_INT_CONST(m, DATA_DATE);
+	_INT_CONST(m, DATA_CN);
 
 	_INT_CONST(m, ERR_SYSTEM);
 	_INT_CONST(m, ERR_CCID);
@@ -10,10 +10,26 @@
 #include "rfid_layer1.h"
 #include "proto_tcl.h"
 #include "proto_mfc.h"
+#include "proto_t2t.h"
 
 union _rfid_layer3 {
 	struct tcl_handle tcl;
 	struct mfc_handle mfc;
+	struct t2t_handle t2t;
+};
+
+/* An ISO 14443-4 PICC given a CID of its own so that it can be used
+ * alongside others in the same field, see cci_rfid_open(). CID 0 is left
+ * for whatever the field itself selects, 15 is RFU.
+ */
+#define RFID_MAX_CID	14
+struct _rfid_cid {
+	struct _cci c_cci;
+	struct _cci *c_field;
+	unsigned int c_open;
+	unsigned int c_gen;
+	struct rfid_tag c_tag;
+	struct tcl_handle c_tcl;
 };
 
 typedef int (*rfid_l3_t)(struct _cci *cci, struct rfid_tag *tag,
@@ -30,6 +46,56 @@ struct _rfid {
 
 	rfid_l3_t rf_l3;
 	union _rfid_layer3 rf_l3p;
+
+	/* reader firmware ISO 14443-4 path, if there is one */
+	struct _cci *rf_native;
+	unsigned int rf_flags;
+
+	/* card types to look for at power on, CCI_RFID_PROTO_* */
+	unsigned int rf_protos;
+
+	/* presence polling, see cci_wait_for_card() */
+	unsigned int rf_poll_usec;
+
+	/* bumped whenever PICCs in the field may have lost their state */
+	unsigned int rf_gen;
+	struct _rfid_cid rf_cid[RFID_MAX_CID];
+
+	/* link telemetry, see cci_rfid_stats() */
+	struct cci_rfid_stats rf_stats;
+	unsigned int rf_last_err;
+	unsigned int rf_timeouts;	/* unanswered frames in a row */
+	unsigned int rf_noise;		/* garbled frames, smoothed */
+
+	/* T=CL bit rates which worked for recently seen PICCs */
+	struct tcl_rate_cache rf_rates;
+
+	/* MIFARE Classic key dictionary, see cci_mfc_set_keys() */
+	struct mfc_keys rf_mfc_keys;
 };
+#define RFID_POLL_USEC		50000
+/* consecutive silent probes before a card is considered gone */
+#define RFID_POLL_MISSES	2
+
+/* rf_noise is the share of garbled frames over roughly the last 16, in
+ * 1/4096ths. Unanswered frames don't count, nothing answers polling
+ * with no card about.
+ */
+#define RFID_NOISE_SHIFT	4
+#define RFID_NOISE_ONE		(256U << RFID_NOISE_SHIFT)
+/* more than 1 frame in 8 garbled */
+#define RFID_NOISE_POOR		(RFID_NOISE_ONE / 8)
+/* extra goes at an exchange lost to noise */
+#define RFID_NOISY_RETRIES	2
+
+#define RFID_NATIVE_ENABLE	(1 << 0)
+#define RFID_NATIVE_ACTIVE	(1 << 1)
+#define RFID_NATIVE_MISS	(1 << 2)
+#define RFID_FIELD_ON		(1 << 3)
+#define RFID_PERSIST		(1 << 4)
+/* rf_tag is a deselected T=CL PICC which can be woken and selected again */
+#define RFID_TAG_KNOWN		(1 << 5)
+/* MIFARE keys may be written to the reader's EEPROM key store */
+#define RFID_MFC_STORE		(1 << 6)
 
 #endif /* RFID_INTERNAL_H */
@@ -33,6 +33,18 @@ struct rfid_tag {
 	uint8_t level;
 
 	uint8_t tcl_capable;
+
+	/* ISO 14443-A: answer to request and select acknowledge */
+	uint8_t atqa[2];
+	uint8_t sak;
+
+	/* ISO 14443-B: from ATQB, the PUPI goes in uid */
+	uint8_t app_data[4];
+	uint8_t proto_info[3];
+
+	/* ISO 15693: from GET SYSTEM INFORMATION, zero if unknown */
+	uint8_t blk_size;
+	uint16_t num_blks;
 };
 
 /* ==================[ API ]================== */
@@ -1,5 +1,6 @@
 #include <ccid.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "ccid-internal.h"
 #include "rfid-internal.h"
@@ -20,6 +21,8 @@ int _rfid_init(struct _cci *cci,
 	rf->rf_ccid = cci->i_parent;
 	rf->rf_l1 = ops;
 	rf->rf_l1p = priv;
+	rf->rf_poll_usec = RFID_POLL_USEC;
+	rf->rf_protos = CCI_RFID_PROTO_14443A;
 
 	cci->i_priv = rf;
 
@@ -27,10 +30,26 @@ int _rfid_init(struct _cci *cci,
 	return 1;
 }
 
+void _rfid_set_native(struct _cci *cci, struct _cci *slot)
+{
+	struct _rfid *rf = cci->i_priv;
+
+	rf->rf_native = slot;
+	rf->rf_flags |= RFID_NATIVE_ENABLE;
+}
+
 int _rfid_layer1_rf_power(struct _cci *cci, unsigned int on)
 {
 	struct _rfid *rf = cci->i_priv;
-	return (*rf->rf_l1->rf_power)(cci->i_parent, rf->rf_l1p, on);
+
+	rf->rf_flags &= ~RFID_FIELD_ON;
+	if ( !on )
+		rf->rf_gen++;
+	if ( !(*rf->rf_l1->rf_power)(cci->i_parent, rf->rf_l1p, on) )
+		return 0;
+	if ( on )
+		rf->rf_flags |= RFID_FIELD_ON;
+	return 1;
 }
 
 int _rfid_layer1_set_rf_mode(struct _cci *cci, const struct rf_mode *mode)
@@ -63,6 +82,66 @@ int _rfid_layer1_set_speed(struct _cci *cci, unsigned int i)
 	return (*rf->rf_l1->set_speed)(cci->i_parent, rf->rf_l1p, i);
 }
 
+int _rfid_layer1_set_speeds(struct _cci *cci, unsigned int tx, unsigned int rx)
+{
+	struct _rfid *rf = cci->i_priv;
+
+	if ( NULL == rf->rf_l1->set_speeds ) {
+		if ( tx != rx )
+			return 0;
+		return (*rf->rf_l1->set_speed)(cci->i_parent, rf->rf_l1p, tx);
+	}
+	return (*rf->rf_l1->set_speeds)(cci->i_parent, rf->rf_l1p, tx, rx);
+}
+
+uint64_t _rfid_usec_since(const struct timespec *start)
+{
+	struct timespec now;
+	int64_t us;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (int64_t)(now.tv_sec - start->tv_sec) * 1000000LL +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+	return (us < 0) ? 0 : us;
+}
+
+static void account(struct _rfid *rf, int ok, uint64_t rtt)
+{
+	struct cci_rfid_stats *st = &rf->rf_stats;
+	unsigned int err = rf->rf_last_err;
+	unsigned int b;
+
+	st->frames++;
+
+	rf->rf_noise -= rf->rf_noise >> RFID_NOISE_SHIFT;
+	if ( !ok && (err & RF_ERR_CORRUPT) )
+		rf->rf_noise += RFID_NOISE_ONE >> RFID_NOISE_SHIFT;
+
+	if ( !ok && (err & RF_ERR_TIMEOUT) )
+		rf->rf_timeouts++;
+	else
+		rf->rf_timeouts = 0;
+
+	if ( ok ) {
+		for(b = 0; b + 1 < CCI_RFID_RTT_BUCKETS &&
+				rtt >= (256ULL << b); b++)
+			;
+		st->rtt[b]++;
+		return;
+	}
+
+	if ( err & RF_ERR_TIMEOUT )
+		st->timeouts++;
+	else if ( err & RF_ERR_COLLISION )
+		st->collisions++;
+	else if ( err & RF_ERR_CRC )
+		st->crc_errors++;
+	else if ( err & RF_ERR_FRAMING )
+		st->framing_errors++;
+	else
+		st->other_errors++;
+}
+
 int _rfid_layer1_transact(struct _cci *cci,
 					const uint8_t *tx_buf,
 					uint8_t tx_len,
@@ -72,10 +151,62 @@ int _rfid_layer1_transact(struct _cci *cci,
 					unsigned int toggle)
 {
 	struct _rfid *rf = cci->i_priv;
-	return (*rf->rf_l1->transact)(cci->i_parent, rf->rf_l1p,
+	struct timespec start;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = (*rf->rf_l1->transact)(cci->i_parent, rf->rf_l1p,
 					 tx_buf, tx_len,
 					 rx_buf, rx_len,
 					 timer, toggle);
+
+	rf->rf_last_err = 0;
+	if ( !ret && rf->rf_l1->last_error )
+		rf->rf_last_err = (*rf->rf_l1->last_error)(cci->i_parent,
+								rf->rf_l1p);
+	account(rf, ret, _rfid_usec_since(&start));
+	return ret;
+}
+
+unsigned int _rfid_layer1_last_error(struct _cci *cci)
+{
+	struct _rfid *rf = cci->i_priv;
+	return rf->rf_last_err;
+}
+
+/* Whether to have another go at an exchange, n goes in. A card which has
+ * stopped answering altogether has most likely left the field, waiting
+ * out the timeout over and over just holds everything up. Garbled frames
+ * mean it's there but coupling is marginal, worth persevering with.
+ */
+int _rfid_layer1_may_retry(struct _cci *cci, unsigned int n,
+				unsigned int max)
+{
+	struct _rfid *rf = cci->i_priv;
+
+	if ( rf->rf_timeouts >= RFID_GONE_TIMEOUTS )
+		max = 0;
+	else if ( rf->rf_last_err & RF_ERR_CORRUPT )
+		max += RFID_NOISY_RETRIES;
+
+	if ( n >= max )
+		return 0;
+
+	rf->rf_stats.retries++;
+	return 1;
+}
+
+/* Enough frames are getting garbled that slower bit rates would help */
+int _rfid_layer1_noisy(struct _cci *cci)
+{
+	struct _rfid *rf = cci->i_priv;
+	return rf->rf_noise > RFID_NOISE_POOR;
+}
+
+void _rfid_layer1_demoted(struct _cci *cci)
+{
+	struct _rfid *rf = cci->i_priv;
+	rf->rf_stats.demotions++;
 }
 
 int _rfid_layer1_14443a_init(struct _cci *cci)
@@ -84,16 +215,42 @@ int _rfid_layer1_14443a_init(struct _cci *cci)
 	return (*rf->rf_l1->iso14443a_init)(cci->i_parent, rf->rf_l1p);
 }
 
+int _rfid_layer1_14443b_init(struct _cci *cci)
+{
+	struct _rfid *rf = cci->i_priv;
+	if ( NULL == rf->rf_l1->iso14443b_init )
+		return 0;
+	return (*rf->rf_l1->iso14443b_init)(cci->i_parent, rf->rf_l1p);
+}
+
+int _rfid_layer1_15693_init(struct _cci *cci)
+{
+	struct _rfid *rf = cci->i_priv;
+	if ( NULL == rf->rf_l1->iso15693_init )
+		return 0;
+	return (*rf->rf_l1->iso15693_init)(cci->i_parent, rf->rf_l1p);
+}
+
 int _rfid_layer1_mfc_set_key(struct _cci *cci, const uint8_t *key)
 {
 	struct _rfid *rf = cci->i_priv;
 	return (*rf->rf_l1->mfc_set_key)(cci->i_parent, rf->rf_l1p, key);
 }
 
-int _rfid_layer1_mfc_set_key_ee(struct _cci *cci, unsigned int addr)
+int _rfid_layer1_mfc_set_key_ee(struct _cci *cci, unsigned int slot)
 {
 	struct _rfid *rf = cci->i_priv;
-	return (*rf->rf_l1->mfc_set_key_ee)(cci->i_parent, rf->rf_l1p, addr);
+	return (*rf->rf_l1->mfc_set_key_ee)(cci->i_parent, rf->rf_l1p, slot);
+}
+
+int _rfid_layer1_mfc_store_key(struct _cci *cci, unsigned int slot,
+				const uint8_t *key)
+{
+	struct _rfid *rf = cci->i_priv;
+	if ( NULL == rf->rf_l1->mfc_store_key )
+		return 0;
+	return (*rf->rf_l1->mfc_store_key)(cci->i_parent, rf->rf_l1p,
+						slot, key);
 }
 
 int _rfid_layer1_mfc_auth(struct _cci *cci, uint8_t cmd,
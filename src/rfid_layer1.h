@@ -10,6 +10,8 @@
 #define RFID_14443A_SPEED_212K	1
 #define RFID_14443A_SPEED_424K  2
 #define RFID_14443A_SPEED_848K  3
+/* in get_speeds: each direction can have its own rate */
+#define RFID_SPEEDS_ASYM	(1 << 8)
 
 #define ISO14443_FREQ_CARRIER		13560000
 #define ISO14443_FREQ_SUBCARRIER	(ISO14443_FREQ_CARRIER/16)
@@ -19,6 +21,8 @@
 #define RF_TX_CRC		(1<<2)
 #define RF_RX_CRC		(1<<3)
 #define RF_CRYPTO1		(1<<4)
+#define RF_CRC3309		(1<<5)
+#define RF_EOF_ONLY		(1<<6)
 struct rf_mode {
 	uint8_t tx_last_bits;
 	uint8_t rx_last_bits;
@@ -29,6 +33,22 @@ struct rf_mode {
 #define RF_ERR_COLLISION	(1<<0)
 #define RF_ERR_CRC		(1<<1)
 #define RF_ERR_TIMEOUT		(1<<2)
+#define RF_ERR_FRAMING		(1<<3)
+#define RF_ERR_CORRUPT		(RF_ERR_CRC|RF_ERR_FRAMING)
+
+/* Unanswered frames in a row before the card is taken to have gone, see
+ * _rfid_layer1_may_retry(). Protocols which double their wait for each
+ * unanswered frame get to retry RFID_GONE_TIMEOUTS - 1 times, so the
+ * wait is never stretched beyond RFID_MAX_SLACK. Change one and the other
+ * follows.
+ */
+#define RFID_GONE_TIMEOUTS	2
+#define RFID_MAX_SLACK		(1U << (RFID_GONE_TIMEOUTS - 1))
+
+/* MIFARE keys the reader can keep for itself, CLRC632 EEPROM has room for
+ * 32 of them
+ */
+#define RFID_MFC_KEY_SLOTS	32
 _private int _rfid_layer1_rf_power(struct _cci *cci, unsigned int on);
 
 _private int _rfid_layer1_set_rf_mode(struct _cci *cci,
@@ -38,6 +58,8 @@ _private int _rfid_layer1_get_rf_mode(struct _cci *cci,
 _private int _rfid_layer1_get_error(struct _cci *cci, uint8_t *err);
 _private int _rfid_layer1_get_coll_pos(struct _cci *cci, uint8_t *pos);
 _private int _rfid_layer1_set_speed(struct _cci *cc, unsigned int i);
+_private int _rfid_layer1_set_speeds(struct _cci *cc, unsigned int tx,
+					unsigned int rx);
 _private int _rfid_layer1_transact(struct _cci *cci,
 					const uint8_t *tx_buf,
 					uint8_t tx_len,
@@ -45,11 +67,20 @@ _private int _rfid_layer1_transact(struct _cci *cci,
 					uint8_t *rx_len,
 					uint64_t timer,
 					unsigned int toggle);
+_private unsigned int _rfid_layer1_last_error(struct _cci *cci);
+_private int _rfid_layer1_may_retry(struct _cci *cci, unsigned int n,
+					unsigned int max);
+_private int _rfid_layer1_noisy(struct _cci *cci);
+_private void _rfid_layer1_demoted(struct _cci *cci);
 
 _private int _rfid_layer1_14443a_init(struct _cci *cci);
+_private int _rfid_layer1_14443b_init(struct _cci *cci);
+_private int _rfid_layer1_15693_init(struct _cci *cci);
 
 _private int _rfid_layer1_mfc_set_key(struct _cci *cci, const uint8_t *key);
-_private int _rfid_layer1_mfc_set_key_ee(struct _cci *cci, unsigned int addr);
+_private int _rfid_layer1_mfc_set_key_ee(struct _cci *cci, unsigned int slot);
+_private int _rfid_layer1_mfc_store_key(struct _cci *cci, unsigned int slot,
+					const uint8_t *key);
 _private int _rfid_layer1_mfc_auth(struct _cci *cci, uint8_t cmd,
 				uint32_t serial_no, uint8_t block);
 
@@ -68,6 +99,9 @@ struct rfid_layer1_ops {
 	int (*get_error)(struct _ccid *ccid, void *p, uint8_t *err);
 	int (*get_coll_pos)(struct _ccid *ccid, void *p, uint8_t *pos);
 	int (*set_speed)(struct _ccid *ccid, void *p, unsigned int i);
+	/* Optional: PCD to PICC and PICC to PCD rates, RFID_SPEEDS_ASYM */
+	int (*set_speeds)(struct _ccid *ccid, void *p, unsigned int tx,
+				unsigned int rx);
 	int (*transact)(struct _ccid *ccid, void *p,
 				 const uint8_t *tx_buf,
 				 uint8_t tx_len,
@@ -75,11 +109,19 @@ struct rfid_layer1_ops {
 				 uint8_t *rx_len,
 				 uint64_t timer,
 				 unsigned int toggle);
+	/* Optional: RF_ERR_* bits saying why the last transact failed */
+	unsigned int (*last_error)(struct _ccid *ccid, void *p);
 
 	int (*iso14443a_init)(struct _ccid *ccid, void *p);
+	/* Optional */
+	int (*iso14443b_init)(struct _ccid *ccid, void *p);
+	int (*iso15693_init)(struct _ccid *ccid, void *p);
 
 	int (*mfc_set_key)(struct _ccid *ccid, void *p, const uint8_t *key);
-	int (*mfc_set_key_ee)(struct _ccid *ccid, void *p, unsigned int addr);
+	int (*mfc_set_key_ee)(struct _ccid *ccid, void *p, unsigned int slot);
+	/* Optional */
+	int (*mfc_store_key)(struct _ccid *ccid, void *p, unsigned int slot,
+				const uint8_t *key);
 	int (*mfc_auth)(struct _ccid *ccid, void *p, uint8_t cmd,
 			uint32_t serial_no, uint8_t block);
 
@@ -94,5 +136,10 @@ struct rfid_layer1_ops {
 _private int _rfid_init(struct _cci *cci,
 			const struct rfid_layer1_ops *ops,
 			void *priv);
+_private void _rfid_set_native(struct _cci *cci, struct _cci *slot);
+
+struct timespec;
+/* microseconds of CLOCK_MONOTONIC since start */
+_private uint64_t _rfid_usec_since(const struct timespec *start);
 
 #endif /* RFID_LAYER1_H */
@@ -0,0 +1,1265 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Simulated RF field. Implements the layer 1 ops of an RF ASIC on top of
+ * a handful of virtual ISO 14443-A tags so that the anticollision, T=CL,
+ * MIFARE Classic and Type 2 code can be run without a reader. Collisions
+ * between tags are worked out bit by bit, time on air is added up for
+ * each exchange and frames can be lost or garbled at random.
+*/
+
+#include <ccid.h>
+
+#include "ccid-internal.h"
+#include "rfid-internal.h"
+#include "iso14443a.h"
+
+#if 0
+#define dprintf printf
+#else
+#define dprintf(...) do {} while(0)
+#endif
+
+#define RFSIM_MAX_TAGS		16
+#define RFSIM_FIFO		64
+#define RFSIM_MAX_FRAME		256
+#define RFSIM_MAX_APDU		4096
+#define RFSIM_XFR		1024
+
+#define REQA			0x26
+#define WUPA			0x52
+#define HLTA			0x50
+#define RATS			0xe0
+#define PPS			0xd0
+#define CASCADE_TAG		0x88
+#define SAK_CASCADE		0x04
+
+#define PCB_I			0x02
+#define PCB_R			0xa2
+#define PCB_S			0xc2
+#define PCB_CHAIN		0x10
+#define PCB_NAK			0x10
+#define PCB_WTX			0x30
+#define PCB_CID			0x08
+#define PCB_NAD			0x04
+#define PCB_BN			0x01
+#define is_s_block(x) ((x & 0xc7) == PCB_S)
+#define is_r_block(x) ((x & 0xe6) == PCB_R)
+#define is_i_block(x) ((x & 0xe2) == PCB_I)
+
+/* 4 bit NAK from MIFARE and Type 2 tags */
+#define TAG_NAK			0x04
+#define WTXM_MAX		59
+
+/* TL, T0 with FSCI 256 and TA, TB, TC present, any rate up to 848k
+ * either way, FWI 7, CID supported
+ */
+static const uint8_t default_ats[] = {0x05, 0x78, 0x77, 0x70, 0x02};
+
+/* ISO 14443-3 PICC states, and ISO 14443-4 once RATS has been seen */
+enum picc_state {
+	PICC_IDLE,
+	PICC_READY,
+	PICC_ACTIVE,
+	PICC_HALT,
+	PICC_L4,
+};
+
+struct picc {
+	struct ccid_rfsim_tag p_tag;
+	enum picc_state p_state;
+	/* cascade level being resolved while READY */
+	unsigned int p_level;
+	/* woken from HALT by WUPA, goes back there rather than IDLE */
+	unsigned int p_halted;
+
+	/* bit rates, PCD to PICC and PICC to PCD */
+	uint8_t p_dri;
+	uint8_t p_dsi;
+
+	/* ISO 14443-4 */
+	uint8_t p_cid;
+	uint8_t p_cid_used;
+	uint8_t p_bn;
+	uint8_t p_pps_ok;
+	uint8_t p_wtx;
+	size_t p_fsd;
+	size_t p_cmd_len;
+	size_t p_rsp_len;
+	size_t p_rsp_ofs;
+	size_t p_last_len;
+	uint8_t p_last[RFSIM_MAX_FRAME];
+	uint8_t p_cmd[RFSIM_MAX_APDU];
+	uint8_t p_rsp[RFSIM_MAX_APDU];
+
+	/* MIFARE Classic: sector trailer authenticated for, plus one, and
+	 * block awaiting the second half of a WRITE, plus one
+	 */
+	unsigned int p_auth;
+	unsigned int p_write;
+};
+
+struct _rfsim {
+	struct picc *s_tag[RFSIM_MAX_TAGS];
+	unsigned int s_num_tags;
+
+	unsigned int s_field;
+	struct rf_mode s_mode;
+	unsigned int s_tx_speed;
+	unsigned int s_rx_speed;
+	unsigned int s_mtu;
+	unsigned int s_mru;
+
+	/* what get_error, get_coll_pos and last_error report */
+	uint8_t s_err;
+	uint8_t s_coll_pos;
+	unsigned int s_last_err;
+
+	uint8_t s_key[MIFARE_CL_KEY_LEN];
+	unsigned int s_key_valid;
+	uint32_t s_ee_valid;
+	uint8_t s_ee[RFID_MFC_KEY_SLOTS][MIFARE_CL_KEY_LEN];
+
+	struct ccid_rfsim_faults s_faults;
+	uint32_t s_rand;
+
+	uint64_t s_air_usec;
+};
+
+/* Same sums as the CLRC632 driver: bytes are 9 bits with parity plus a
+ * couple for start and end of frame, one etu is 128/fc at 106kbit/s and
+ * halves with each step up.
+ */
+static uint64_t frame_usec(struct _rfsim *s, unsigned int tx_len,
+				unsigned int rx_len)
+{
+	uint64_t bits, usec;
+
+	bits = tx_len * 9ULL + 2;
+	usec = (bits * 128 * 1000000ULL) /
+		((uint64_t)ISO14443_FREQ_CARRIER << s->s_tx_speed);
+	if ( !rx_len )
+		return usec;
+
+	bits = rx_len * 9ULL + 2;
+	usec += (bits * 128 * 1000000ULL) /
+		((uint64_t)ISO14443_FREQ_CARRIER << s->s_rx_speed);
+	return usec + ISO14443A_FDT_ANTICOL_LAST0;
+}
+
+/* Deterministic so that a failing run can be repeated with the same seed */
+static int fault(struct _rfsim *s, unsigned int per_mille)
+{
+	if ( !per_mille )
+		return 0;
+	s->s_rand = s->s_rand * 1103515245U + 12345U;
+	return ((s->s_rand >> 16) % 1000) < per_mille;
+}
+
+static unsigned int uid_levels(const struct ccid_rfsim_tag *t)
+{
+	switch(t->uid_len) {
+	case 7:
+		return 2;
+	case 10:
+		return 3;
+	default:
+		return 1;
+	}
+}
+
+/* UID bits and BCC the tag gives out at a cascade level */
+static void cascade_bits(const struct ccid_rfsim_tag *t, unsigned int level,
+				uint8_t *cl)
+{
+	if ( level + 1 < uid_levels(t) ) {
+		cl[0] = CASCADE_TAG;
+		memcpy(cl + 1, t->uid + level * 3, 3);
+	}else{
+		memcpy(cl, t->uid + level * 3, 4);
+	}
+	cl[4] = cl[0] ^ cl[1] ^ cl[2] ^ cl[3];
+}
+
+static int sel_level(uint8_t sel)
+{
+	switch(sel) {
+	case ISO14443A_AC_SEL_CODE_CL1:
+		return 0;
+	case ISO14443A_AC_SEL_CODE_CL2:
+		return 1;
+	case ISO14443A_AC_SEL_CODE_CL3:
+		return 2;
+	default:
+		return -1;
+	}
+}
+
+static void picc_reset(struct picc *p, enum picc_state state)
+{
+	p->p_state = state;
+	p->p_level = 0;
+	p->p_dri = p->p_dsi = RFID_14443A_SPEED_106K;
+	p->p_wtx = 0;
+	p->p_pps_ok = 0;
+	p->p_cmd_len = 0;
+	p->p_rsp_len = p->p_rsp_ofs = 0;
+	p->p_last_len = 0;
+	p->p_auth = 0;
+	p->p_write = 0;
+}
+
+/* Anything unexpected sends a PICC back to where it was woken from */
+static void picc_sleep(struct picc *p)
+{
+	picc_reset(p, (p->p_halted) ? PICC_HALT : PICC_IDLE);
+}
+
+static int is_tcl(const struct picc *p)
+{
+	return !!(p->p_tag.sak & 0x20);
+}
+
+static int is_mfc(const struct picc *p)
+{
+	return !is_tcl(p) && (p->p_tag.sak & ISO14443A_SAK_MIFARE);
+}
+
+static int is_t2t(const struct picc *p)
+{
+	return !(p->p_tag.sak & ISO14443A_SAK_T2T_MASK);
+}
+
+static unsigned int mfc_trailer(unsigned int block)
+{
+	return (block < MIFARE_CL_SMALL_SECTORS *
+			MIFARE_CL_BLOCKS_P_SECTOR_1k) ?
+		(block | (MIFARE_CL_BLOCKS_P_SECTOR_1k - 1)) :
+		(block | (MIFARE_CL_BLOCKS_P_SECTOR_4k - 1));
+}
+
+static size_t nak(struct picc *p, uint8_t *rsp)
+{
+	picc_sleep(p);
+	rsp[0] = TAG_NAK;
+	return 1;
+}
+
+static size_t mfc_frame(struct _rfsim *s, struct picc *p,
+			const uint8_t *tx, size_t tx_len, uint8_t *rsp)
+{
+	const struct ccid_rfsim_tag *t = &p->p_tag;
+	unsigned int blk;
+
+	if ( p->p_write ) {
+		blk = p->p_write - 1;
+		p->p_write = 0;
+		if ( tx_len != MIFARE_CL_PAGE_SIZE || blk == 0 )
+			return nak(p, rsp);
+		memcpy(t->mem + blk * MIFARE_CL_PAGE_SIZE, tx,
+			MIFARE_CL_PAGE_SIZE);
+		rsp[0] = MIFARE_CL_RESP_ACK;
+		return 1;
+	}
+
+	if ( tx_len != 2 || (tx[0] != MIFARE_CL_CMD_READ &&
+				tx[0] != MIFARE_CL_CMD_WRITE16) ) {
+		picc_sleep(p);
+		return 0;
+	}
+
+	blk = tx[1];
+	if ( !(s->s_mode.flags & RF_CRYPTO1) ||
+			p->p_auth != mfc_trailer(blk) + 1 ||
+			(blk + 1) * MIFARE_CL_PAGE_SIZE > t->mem_len )
+		return nak(p, rsp);
+
+	if ( tx[0] == MIFARE_CL_CMD_WRITE16 ) {
+		p->p_write = blk + 1;
+		rsp[0] = MIFARE_CL_RESP_ACK;
+		return 1;
+	}
+
+	memcpy(rsp, t->mem + blk * MIFARE_CL_PAGE_SIZE,
+		MIFARE_CL_PAGE_SIZE);
+	/* key A never reads back */
+	if ( blk == mfc_trailer(blk) )
+		memset(rsp, 0, MIFARE_CL_KEY_LEN);
+	return MIFARE_CL_PAGE_SIZE;
+}
+
+/* READ wraps around at the end of memory, FAST_READ doesn't */
+static size_t t2t_frame(struct picc *p, const uint8_t *tx, size_t tx_len,
+			uint8_t *rsp)
+{
+	const struct ccid_rfsim_tag *t = &p->p_tag;
+	unsigned int pages = t->mem_len / T2T_PAGE_SIZE;
+	unsigned int i, first, last;
+	static const uint8_t none[8];
+
+	switch(tx[0]) {
+	case T2T_CMD_GET_VERSION:
+		if ( tx_len != 1 || !memcmp(t->version, none, sizeof(none)) )
+			return nak(p, rsp);
+		memcpy(rsp, t->version, sizeof(t->version));
+		return sizeof(t->version);
+	case T2T_CMD_READ:
+		if ( tx_len != 2 || tx[1] >= pages )
+			return nak(p, rsp);
+		for(i = 0; i < T2T_READ_PAGES; i++) {
+			memcpy(rsp + i * T2T_PAGE_SIZE,
+				t->mem + ((tx[1] + i) % pages) * T2T_PAGE_SIZE,
+				T2T_PAGE_SIZE);
+		}
+		return T2T_READ_PAGES * T2T_PAGE_SIZE;
+	case T2T_CMD_FAST_READ:
+		if ( tx_len != 3 || !memcmp(t->version, none, sizeof(none)) )
+			return nak(p, rsp);
+		first = tx[1];
+		last = tx[2];
+		if ( last < first || last >= pages ||
+				(last - first + 1) * T2T_PAGE_SIZE >
+					RFSIM_MAX_FRAME )
+			return nak(p, rsp);
+		memcpy(rsp, t->mem + first * T2T_PAGE_SIZE,
+			(last - first + 1) * T2T_PAGE_SIZE);
+		return (last - first + 1) * T2T_PAGE_SIZE;
+	default:
+		picc_sleep(p);
+		return 0;
+	}
+}
+
+static size_t rats(struct picc *p, const uint8_t *tx, size_t tx_len,
+			uint8_t *rsp)
+{
+	const struct ccid_rfsim_tag *t = &p->p_tag;
+	uint8_t fsdi;
+
+	if ( tx_len != 2 ) {
+		picc_sleep(p);
+		return 0;
+	}
+
+	fsdi = tx[1] >> 4;
+	if ( fsdi > 8 )
+		fsdi = 8;
+	_iso14443_fsdi_to_fsd(fsdi, &p->p_fsd);
+
+	p->p_state = PICC_L4;
+	p->p_cid = tx[1] & 0x0f;
+	p->p_bn = 1;
+	p->p_pps_ok = 1;
+
+	if ( !t->ats_len ) {
+		memcpy(rsp, default_ats, sizeof(default_ats));
+		return sizeof(default_ats);
+	}
+	memcpy(rsp, t->ats, t->ats_len);
+	return t->ats_len;
+}
+
+static size_t active_frame(struct _rfsim *s, struct picc *p,
+			const uint8_t *tx, size_t tx_len, uint8_t *rsp)
+{
+	if ( tx[0] == HLTA && tx_len == 2 && !tx[1] ) {
+		picc_reset(p, PICC_HALT);
+		return 0;
+	}
+
+	if ( is_tcl(p) ) {
+		if ( tx[0] == RATS )
+			return rats(p, tx, tx_len, rsp);
+	}else if ( is_mfc(p) && p->p_tag.mem ) {
+		return mfc_frame(s, p, tx, tx_len, rsp);
+	}else if ( is_t2t(p) && p->p_tag.mem ) {
+		return t2t_frame(p, tx, tx_len, rsp);
+	}
+
+	picc_sleep(p);
+	return 0;
+}
+
+static size_t tcl_prologue(struct picc *p, uint8_t pcb, uint8_t *rsp)
+{
+	size_t len = 0;
+
+	rsp[len++] = pcb | ((p->p_cid_used) ? PCB_CID : 0);
+	if ( p->p_cid_used )
+		rsp[len++] = p->p_cid;
+	return len;
+}
+
+/* Next piece of the response, chained if it doesn't fit in FSD */
+static size_t tcl_send_i(struct picc *p, uint8_t *rsp)
+{
+	size_t len, max, chunk;
+
+	len = tcl_prologue(p, PCB_I | p->p_bn, rsp);
+	max = p->p_fsd - 2 - len;
+	chunk = p->p_rsp_len - p->p_rsp_ofs;
+	if ( chunk > max ) {
+		chunk = max;
+		rsp[0] |= PCB_CHAIN;
+	}
+
+	memcpy(rsp + len, p->p_rsp + p->p_rsp_ofs, chunk);
+	p->p_rsp_ofs += chunk;
+	return len + chunk;
+}
+
+static void tcl_apdu(struct picc *p)
+{
+	const struct ccid_rfsim_tag *t = &p->p_tag;
+	size_t len = sizeof(p->p_rsp);
+
+	p->p_rsp_ofs = 0;
+	if ( t->apdu && (*t->apdu)(t->priv, p->p_cmd, p->p_cmd_len,
+					p->p_rsp, &len) ) {
+		p->p_rsp_len = (len < sizeof(p->p_rsp)) ?
+					len : sizeof(p->p_rsp);
+	}else if ( t->apdu ) {
+		p->p_rsp_len = 0;
+	}else{
+		p->p_rsp[0] = 0x6d;
+		p->p_rsp[1] = 0x00;
+		p->p_rsp_len = 2;
+	}
+	p->p_cmd_len = 0;
+}
+
+/* ISO 14443-4:2000(E) Section 7.5.4, the PICC side. A block which isn't
+ * for us, or which makes no sense, gets no answer.
+ */
+static size_t tcl_frame(struct picc *p, const uint8_t *tx, size_t tx_len,
+			uint8_t *rsp, uint64_t timer, uint64_t *delay)
+{
+	const struct ccid_rfsim_tag *t = &p->p_tag;
+	size_t hlen = 1, len, wtxm;
+	uint8_t pcb = tx[0];
+
+	if ( p->p_pps_ok && tx_len == 3 && pcb == (PPS | p->p_cid) &&
+			tx[1] == 0x11 ) {
+		p->p_pps_ok = 0;
+		p->p_dsi = (tx[2] >> 2) & 0x3;
+		p->p_dri = tx[2] & 0x3;
+		rsp[0] = pcb;
+		return 1;
+	}
+
+	if ( !is_i_block(pcb) && !is_r_block(pcb) && !is_s_block(pcb) )
+		return 0;
+
+	if ( pcb & PCB_CID ) {
+		if ( tx_len < 2 || (tx[1] & 0x0f) != p->p_cid )
+			return 0;
+		hlen++;
+	}else if ( p->p_cid ) {
+		return 0;
+	}
+	if ( is_i_block(pcb) && (pcb & PCB_NAD) )
+		hlen++;
+	if ( tx_len < hlen )
+		return 0;
+
+	p->p_pps_ok = 0;
+	p->p_cid_used = !!(pcb & PCB_CID);
+
+	if ( is_s_block(pcb) ) {
+		if ( (pcb & PCB_WTX) == PCB_WTX ) {
+			/* PCD agreed to the extension, out comes the answer */
+			if ( !p->p_wtx )
+				return 0;
+			p->p_wtx = 0;
+			*delay = t->apdu_usec;
+			len = tcl_send_i(p, rsp);
+		}else{
+			len = tcl_prologue(p, PCB_S, rsp);
+			picc_reset(p, PICC_HALT);
+			return len;
+		}
+	}else if ( is_r_block(pcb) ) {
+		if ( (pcb & PCB_BN) == p->p_bn ) {
+			/* Rule 11: send the last block again */
+			memcpy(rsp, p->p_last, p->p_last_len);
+			return p->p_last_len;
+		}
+		if ( pcb & PCB_NAK ) {
+			/* Rule 12 */
+			len = tcl_prologue(p, PCB_R | p->p_bn, rsp);
+		}else{
+			/* Rule 13: carry on chaining */
+			if ( p->p_rsp_ofs >= p->p_rsp_len )
+				return 0;
+			p->p_bn ^= PCB_BN;
+			len = tcl_send_i(p, rsp);
+		}
+	}else{
+		/* Rule D */
+		p->p_bn = pcb & PCB_BN;
+		p->p_wtx = 0;
+
+		len = tx_len - hlen;
+		if ( p->p_cmd_len + len > sizeof(p->p_cmd) ) {
+			p->p_cmd_len = 0;
+			return 0;
+		}
+		memcpy(p->p_cmd + p->p_cmd_len, tx + hlen, len);
+		p->p_cmd_len += len;
+
+		if ( pcb & PCB_CHAIN ) {
+			len = tcl_prologue(p, PCB_R | p->p_bn, rsp);
+		}else{
+			tcl_apdu(p);
+			if ( !p->p_rsp_len )
+				return 0;
+			if ( timer && t->apdu_usec > timer ) {
+				/* ask for more time, ISO 14443-4 7.3 */
+				wtxm = (t->apdu_usec + timer - 1) / timer;
+				if ( wtxm > WTXM_MAX )
+					wtxm = WTXM_MAX;
+				len = tcl_prologue(p, PCB_S | PCB_WTX, rsp);
+				rsp[len++] = wtxm;
+				p->p_wtx = 1;
+				*delay = timer;
+			}else{
+				*delay = t->apdu_usec;
+				len = tcl_send_i(p, rsp);
+			}
+		}
+	}
+
+	memcpy(p->p_last, rsp, len);
+	p->p_last_len = len;
+	return len;
+}
+
+static size_t picc_frame(struct _rfsim *s, struct picc *p,
+			const uint8_t *tx, size_t tx_len, uint8_t *rsp,
+			uint64_t timer, uint64_t *delay)
+{
+	int level;
+	uint8_t cl[5];
+
+	switch(p->p_state) {
+	case PICC_IDLE:
+	case PICC_HALT:
+		return 0;
+	case PICC_READY:
+		level = sel_level(tx[0]);
+		if ( level < 0 || tx_len != 7 || tx[1] != 0x70 ) {
+			picc_sleep(p);
+			return 0;
+		}
+		if ( level != (int)p->p_level )
+			return 0;
+
+		cascade_bits(&p->p_tag, level, cl);
+		if ( memcmp(cl, tx + 2, sizeof(cl)) ) {
+			picc_sleep(p);
+			return 0;
+		}
+
+		if ( p->p_level + 1 < uid_levels(&p->p_tag) ) {
+			p->p_level++;
+			rsp[0] = SAK_CASCADE;
+		}else{
+			p->p_state = PICC_ACTIVE;
+			rsp[0] = p->p_tag.sak & ~SAK_CASCADE;
+		}
+		return 1;
+	case PICC_ACTIVE:
+		return active_frame(s, p, tx, tx_len, rsp);
+	case PICC_L4:
+		return tcl_frame(p, tx, tx_len, rsp, timer, delay);
+	}
+
+	return 0;
+}
+
+/* REQA and WUPA, 7 bit short frames. All the ATQAs come back at once */
+static int short_frame(struct _rfsim *s, uint8_t cmd, uint8_t *rx_buf,
+			uint8_t *rx_len)
+{
+	uint8_t atqa[2], all[2] = {0xff, 0xff};
+	unsigned int i, n = 0, bit, diff;
+	struct picc *p;
+
+	memset(rx_buf, 0, 2);
+	for(i = 0; i < s->s_num_tags; i++) {
+		p = s->s_tag[i];
+
+		if ( cmd == WUPA && p->p_state == PICC_HALT ) {
+			p->p_halted = 1;
+		}else if ( p->p_state == PICC_IDLE ) {
+			if ( cmd != REQA && cmd != WUPA )
+				continue;
+			p->p_halted = 0;
+		}else{
+			/* not valid in READY or ACTIVE either */
+			if ( p->p_state != PICC_L4 && p->p_state != PICC_HALT )
+				picc_sleep(p);
+			continue;
+		}
+
+		picc_reset(p, PICC_READY);
+		if ( p->p_tag.atqa[0] || p->p_tag.atqa[1] ) {
+			atqa[0] = p->p_tag.atqa[0];
+			atqa[1] = p->p_tag.atqa[1];
+		}else{
+			atqa[0] = ((uid_levels(&p->p_tag) - 1) << 6) | 0x04;
+			atqa[1] = 0;
+		}
+
+		rx_buf[0] |= atqa[0];
+		rx_buf[1] |= atqa[1];
+		all[0] &= atqa[0];
+		all[1] &= atqa[1];
+		n++;
+	}
+
+	s->s_air_usec += frame_usec(s, 1, (n) ? 2 : 0);
+	if ( !n ) {
+		s->s_air_usec += ISO14443A_FDT_ANTICOL_LAST1;
+		s->s_last_err = RF_ERR_TIMEOUT;
+		return 0;
+	}
+
+	diff = (rx_buf[0] ^ all[0]) | ((rx_buf[1] ^ all[1]) << 8);
+	if ( diff ) {
+		for(bit = 0; !(diff & (1U << bit)); bit++)
+			;
+		s->s_err = RF_ERR_COLLISION;
+		s->s_coll_pos = bit + 1;
+	}
+
+	*rx_len = 2;
+	return 1;
+}
+
+/* Bit oriented anticollision frame: everyone in READY whose UID starts
+ * with the bits sent answers with the rest. Where they differ the PCD
+ * hears a collision.
+ */
+static int anticol_frame(struct _rfsim *s, const uint8_t *tx, uint8_t tx_len,
+			uint8_t *rx_buf, uint8_t *rx_len)
+{
+	unsigned int i, k, n = 0, byte, bits, len = 0, r;
+	uint8_t cl[5], mask, any[5], all[5];
+	struct picc *p;
+	int level;
+
+	level = sel_level(tx[0]);
+	byte = (tx[1] >> 4) - 2;
+	bits = tx[1] & 0x7;
+	if ( level < 0 || (tx[1] >> 4) < 2 || byte >= sizeof(cl) ||
+			tx_len < 2 + byte + !!bits )
+		return 0;
+
+	memset(any, 0, sizeof(any));
+	memset(all, 0xff, sizeof(all));
+	mask = (1U << bits) - 1;
+
+	for(i = 0; i < s->s_num_tags; i++) {
+		p = s->s_tag[i];
+		if ( p->p_state != PICC_READY || p->p_level != (unsigned)level )
+			continue;
+
+		cascade_bits(&p->p_tag, level, cl);
+		if ( memcmp(cl, tx + 2, byte) )
+			continue;
+		if ( bits && ((cl[byte] ^ tx[2 + byte]) & mask) )
+			continue;
+
+		for(k = byte; k < sizeof(cl); k++) {
+			uint8_t b = (k == byte) ? cl[k] & ~mask : cl[k];
+			any[k] |= b;
+			all[k] &= b;
+		}
+		n++;
+	}
+
+	len = sizeof(cl) - byte;
+	s->s_air_usec += frame_usec(s, tx_len, (n) ? len : 0);
+	if ( !n ) {
+		s->s_air_usec += ISO14443A_FDT_ANTICOL_LAST1;
+		s->s_last_err = RF_ERR_TIMEOUT;
+		return 0;
+	}
+
+	if ( len > *rx_len )
+		len = *rx_len;
+	memcpy(rx_buf, any + byte, len);
+	*rx_len = len;
+
+	/* CollPos counts from bit 0 of the first byte received */
+	for(r = 0, k = byte; k < sizeof(cl); k++) {
+		uint8_t diff = any[k] ^ all[k];
+		if ( k == byte )
+			diff &= ~mask;
+		if ( diff ) {
+			for(i = 0; !(diff & (1U << i)); i++)
+				;
+			s->s_err = RF_ERR_COLLISION;
+			s->s_coll_pos = r + i + 1;
+			break;
+		}
+		r += 8;
+	}
+
+	return 1;
+}
+
+static int rf_power(struct _ccid *ccid, void *priv, unsigned int on)
+{
+	struct _rfsim *s = priv;
+	unsigned int i;
+
+	/* everyone loses power, and any state with it */
+	if ( !on ) {
+		for(i = 0; i < s->s_num_tags; i++) {
+			s->s_tag[i]->p_halted = 0;
+			picc_reset(s->s_tag[i], PICC_IDLE);
+		}
+	}
+	s->s_field = on;
+	return 1;
+}
+
+static int set_rf_mode(struct _ccid *ccid, void *priv,
+			const struct rf_mode *rf)
+{
+	struct _rfsim *s = priv;
+	memcpy(&s->s_mode, rf, sizeof(s->s_mode));
+	return 1;
+}
+
+static int get_rf_mode(struct _ccid *ccid, void *priv,
+			const struct rf_mode *rf)
+{
+	return 0;
+}
+
+static int get_error(struct _ccid *ccid, void *priv, uint8_t *err)
+{
+	struct _rfsim *s = priv;
+	*err = s->s_err;
+	return 1;
+}
+
+static unsigned int last_error(struct _ccid *ccid, void *priv)
+{
+	struct _rfsim *s = priv;
+	return s->s_last_err;
+}
+
+static int get_coll_pos(struct _ccid *ccid, void *priv, uint8_t *pos)
+{
+	struct _rfsim *s = priv;
+	*pos = s->s_coll_pos;
+	return 1;
+}
+
+static int set_speeds(struct _ccid *ccid, void *priv, unsigned int tx,
+			unsigned int rx)
+{
+	struct _rfsim *s = priv;
+
+	if ( tx > RFID_14443A_SPEED_848K || rx > RFID_14443A_SPEED_848K )
+		return 0;
+
+	s->s_tx_speed = tx;
+	s->s_rx_speed = rx;
+	return 1;
+}
+
+static int set_speed(struct _ccid *ccid, void *priv, unsigned int i)
+{
+	return set_speeds(ccid, priv, i, i);
+}
+
+static int transact(struct _ccid *ccid, void *priv,
+			 const uint8_t *tx_buf,
+			 uint8_t tx_len,
+			 uint8_t *rx_buf,
+			 uint8_t *rx_len,
+			 uint64_t timer,
+			 unsigned int toggle)
+{
+	struct _rfsim *s = priv;
+	uint8_t rsp[RFSIM_MAX_FRAME], tmp[RFSIM_MAX_FRAME];
+	struct picc *p;
+	uint64_t delay = 0, d;
+	unsigned int i, n = 0, garbled = 0;
+	uint8_t dsi = 0, bad = 0, p_dsi, p_bad;
+	size_t len = 0, l;
+
+	s->s_err = 0;
+	s->s_coll_pos = 0;
+	s->s_last_err = 0;
+
+	if ( !s->s_field || !tx_len || fault(s, s->s_faults.lost) ) {
+		dprintf("rfsim: frame lost\n");
+		s->s_air_usec += frame_usec(s, tx_len, 0) + timer;
+		s->s_last_err = RF_ERR_TIMEOUT;
+		return 0;
+	}
+
+	if ( tx_len == 1 && s->s_mode.tx_last_bits == 7 )
+		return short_frame(s, tx_buf[0] & 0x7f, rx_buf, rx_len);
+
+	if ( !(s->s_mode.flags & RF_TX_CRC) && sel_level(tx_buf[0]) >= 0 &&
+			tx_len >= 2 )
+		return anticol_frame(s, tx_buf, tx_len, rx_buf, rx_len);
+
+	for(i = 0; i < s->s_num_tags; i++) {
+		p = s->s_tag[i];
+
+		/* sent at a rate this PICC isn't listening at */
+		if ( p->p_dri != s->s_tx_speed )
+			continue;
+
+		/* PPS changes these, but only after the answer */
+		d = 0;
+		p_dsi = p->p_dsi;
+		p_bad = p->p_tag.bad_speeds &
+			((1U << p->p_dri) | (1U << p->p_dsi));
+		l = picc_frame(s, p, tx_buf, tx_len, (n) ? tmp : rsp,
+				timer, &d);
+		if ( !l )
+			continue;
+		if ( !n++ ) {
+			len = l;
+			delay = d;
+			dsi = p_dsi;
+			bad = p_bad;
+		}else if ( l != len || memcmp(rsp, tmp, len) ) {
+			/* the same bits at the same time is no collision */
+			garbled = 1;
+		}
+	}
+
+	if ( !n ) {
+		s->s_air_usec += frame_usec(s, tx_len, 0) + timer;
+		s->s_last_err = RF_ERR_TIMEOUT;
+		return 0;
+	}
+
+	s->s_air_usec += frame_usec(s, tx_len, len) + delay;
+
+	if ( garbled ) {
+		dprintf("rfsim: %u PICCs answered\n", n);
+		s->s_err = s->s_last_err = RF_ERR_COLLISION;
+		return 0;
+	}
+
+	if ( dsi != s->s_rx_speed || fault(s, s->s_faults.framing) ) {
+		s->s_err = s->s_last_err = RF_ERR_FRAMING;
+		return 0;
+	}
+
+	if ( bad || fault(s, s->s_faults.crc) ) {
+		s->s_err = s->s_last_err = (s->s_mode.flags & RF_RX_CRC) ?
+						RF_ERR_CRC : RF_ERR_FRAMING;
+		return 0;
+	}
+
+	if ( len > *rx_len )
+		len = *rx_len;
+	memcpy(rx_buf, rsp, len);
+	*rx_len = len;
+	return 1;
+}
+
+static int iso14443a_init(struct _ccid *ccid, void *priv)
+{
+	struct _rfsim *s = priv;
+
+	s->s_tx_speed = s->s_rx_speed = RFID_14443A_SPEED_106K;
+	memset(&s->s_mode, 0, sizeof(s->s_mode));
+	return 1;
+}
+
+static int mfc_set_key(struct _ccid *ccid, void *priv, const uint8_t *key)
+{
+	struct _rfsim *s = priv;
+
+	memcpy(s->s_key, key, sizeof(s->s_key));
+	s->s_key_valid = 1;
+	return 1;
+}
+
+static int mfc_set_key_ee(struct _ccid *ccid, void *priv, unsigned int slot)
+{
+	struct _rfsim *s = priv;
+
+	if ( slot >= RFID_MFC_KEY_SLOTS || !(s->s_ee_valid & (1U << slot)) )
+		return 0;
+
+	return mfc_set_key(ccid, priv, s->s_ee[slot]);
+}
+
+static int mfc_store_key(struct _ccid *ccid, void *priv, unsigned int slot,
+				const uint8_t *key)
+{
+	struct _rfsim *s = priv;
+
+	if ( slot >= RFID_MFC_KEY_SLOTS )
+		return 0;
+
+	memcpy(s->s_ee[slot], key, MIFARE_CL_KEY_LEN);
+	s->s_ee_valid |= (1U << slot);
+	return 1;
+}
+
+/* Three pass authentication, as far as the PCD can tell: either the
+ * PICC goes along with it or it drops back to idle.
+ */
+static int mfc_auth(struct _ccid *ccid, void *priv, uint8_t cmd,
+			uint32_t serial_no, uint8_t block)
+{
+	struct _rfsim *s = priv;
+	const uint8_t *key;
+	unsigned int i, trailer;
+	struct picc *p;
+
+	s->s_air_usec += frame_usec(s, 4, 4) + frame_usec(s, 8, 4);
+
+	for(i = 0; i < s->s_num_tags; i++) {
+		p = s->s_tag[i];
+		if ( p->p_state == PICC_ACTIVE && is_mfc(p) &&
+				!memcmp(&serial_no, p->p_tag.uid +
+					p->p_tag.uid_len - 4, 4) )
+			break;
+	}
+	if ( i >= s->s_num_tags )
+		return 0;
+
+	trailer = mfc_trailer(block);
+	if ( !s->s_key_valid || NULL == p->p_tag.mem ||
+			(trailer + 1) * MIFARE_CL_PAGE_SIZE >
+				p->p_tag.mem_len ) {
+		picc_sleep(p);
+		return 0;
+	}
+
+	key = p->p_tag.mem + trailer * MIFARE_CL_PAGE_SIZE;
+	if ( cmd == RFID_CMD_MIFARE_AUTH1B )
+		key += MIFARE_CL_PAGE_SIZE - MIFARE_CL_KEY_LEN;
+	if ( memcmp(key, s->s_key, MIFARE_CL_KEY_LEN) ) {
+		picc_sleep(p);
+		return 0;
+	}
+
+	p->p_auth = trailer + 1;
+	p->p_write = 0;
+	return 1;
+}
+
+static unsigned int carrier_freq(struct _ccid *ccid, void *priv)
+{
+	return ISO14443_FREQ_CARRIER;
+}
+
+static unsigned int get_speeds(struct _ccid *ccid, void *priv)
+{
+	return (1 << RFID_14443A_SPEED_106K) |
+		(1 << RFID_14443A_SPEED_212K) |
+		(1 << RFID_14443A_SPEED_424K) |
+		(1 << RFID_14443A_SPEED_848K) |
+		RFID_SPEEDS_ASYM;
+}
+
+static unsigned int get_mtu(struct _ccid *ccid, void *priv)
+{
+	struct _rfsim *s = priv;
+	return s->s_mtu;
+}
+
+static unsigned int get_mru(struct _ccid *ccid, void *priv)
+{
+	struct _rfsim *s = priv;
+	return s->s_mru;
+}
+
+static void dtor(struct _ccid *ccid, void *priv)
+{
+	struct _rfsim *s = priv;
+	unsigned int i;
+
+	for(i = 0; i < s->s_num_tags; i++)
+		free(s->s_tag[i]);
+	free(s);
+}
+
+static const struct rfid_layer1_ops l1_ops = {
+	.rf_power = rf_power,
+
+	.set_rf_mode = set_rf_mode,
+	.get_rf_mode = get_rf_mode,
+	.get_error = get_error,
+	.get_coll_pos = get_coll_pos,
+	.set_speed = set_speed,
+	.set_speeds = set_speeds,
+	.transact = transact,
+	.last_error = last_error,
+
+	.iso14443a_init = iso14443a_init,
+
+	.mfc_set_key = mfc_set_key,
+	.mfc_set_key_ee = mfc_set_key_ee,
+	.mfc_store_key = mfc_store_key,
+	.mfc_auth = mfc_auth,
+
+	.carrier_freq = carrier_freq,
+	.get_speeds = get_speeds,
+	.mtu = get_mtu,
+	.mru = get_mru,
+
+	.dtor = dtor,
+};
+
+static struct _rfsim *rfsim(struct _ccid *ccid)
+{
+	struct _rfid *rf;
+
+	if ( !ccid->d_num_rf )
+		goto bad;
+
+	rf = ccid->d_rf[0].i_priv;
+	if ( rf->rf_l1 != &l1_ops )
+		goto bad;
+
+	return rf->rf_l1p;
+bad:
+	ccid->d_error = CCID_ERROR_IN_VALUE;
+	return NULL;
+}
+
+/** Open a simulated RF field.
+ * \ingroup g_ccid
+ * @param tracefile filename to open for trace logging (or NULL).
+ *
+ * Creates a \ref ccid_t with one RF field and no contact slots, behind
+ * which there is no hardware at all. Tags are put in the field with
+ * \ref ccid_rfsim_add_tag and talked to with the usual \ref cci_t calls.
+ * Meant for exercising and benchmarking the RF protocol code.
+ *
+ * @return NULL on failure, valid \ref ccid_t object otherwise.
+ */
+ccid_t ccid_rfsim_open(const char *tracefile)
+{
+	struct _ccid *ccid;
+	struct _rfsim *s = NULL;
+
+	ccid = calloc(1, sizeof(*ccid));
+	if ( NULL == ccid )
+		goto err;
+
+	if ( tracefile ) {
+		if ( !strcmp("-", tracefile) )
+			ccid->d_tf = stdout;
+		else
+			ccid->d_tf = fopen(tracefile, "w");
+		if ( ccid->d_tf == NULL )
+			goto err;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if ( NULL == s )
+		goto err;
+	s->s_mtu = s->s_mru = RFSIM_FIFO;
+	s->s_rand = 1;
+
+	ccid->d_name = strdup("Simulated RF field");
+	ccid->d_xfr = _xfr_do_alloc(RFSIM_XFR, RFSIM_XFR);
+	if ( NULL == ccid->d_name || NULL == ccid->d_xfr )
+		goto err;
+
+	ccid->d_rf[0].i_parent = ccid;
+	ccid->d_rf[0].i_ops = &_rfid_ops;
+	if ( !_rfid_init(ccid->d_rf, &l1_ops, s) )
+		goto err;
+	ccid->d_num_rf = 1;
+
+	trace(ccid, "Simulated RF field\n");
+	return ccid;
+err:
+	free(s);
+	ccid_close(ccid);
+	return NULL;
+}
+
+/** Put a virtual tag in to a simulated RF field.
+ * \ingroup g_ccid
+ * @param ccid \ref ccid_t from \ref ccid_rfsim_open.
+ * @param tag Description of the tag, copied. Any memory it points to is
+ * not, it must stay around until the tag is removed.
+ *
+ * The tag is powered up, in the idle state, if the field is on. Several
+ * tags may be in the field at once, though not two with the same UID.
+ *
+ * @return zero on failure.
+ */
+int ccid_rfsim_add_tag(ccid_t ccid, const struct ccid_rfsim_tag *tag)
+{
+	struct _rfsim *s = rfsim(ccid);
+	struct picc *p;
+	unsigned int i;
+
+	if ( NULL == s )
+		return 0;
+
+	if ( s->s_num_tags >= RFSIM_MAX_TAGS ||
+			(tag->uid_len != 4 && tag->uid_len != 7 &&
+			 tag->uid_len != 10) ||
+			tag->ats_len > sizeof(tag->ats) ) {
+		ccid->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	for(i = 0; i < s->s_num_tags; i++) {
+		if ( s->s_tag[i]->p_tag.uid_len == tag->uid_len &&
+				!memcmp(s->s_tag[i]->p_tag.uid, tag->uid,
+					tag->uid_len) ) {
+			ccid->d_error = CCID_ERROR_IN_VALUE;
+			return 0;
+		}
+	}
+
+	p = calloc(1, sizeof(*p));
+	if ( NULL == p ) {
+		ccid->d_error = CCID_ERROR_NO_MEM;
+		return 0;
+	}
+
+	memcpy(&p->p_tag, tag, sizeof(p->p_tag));
+	picc_reset(p, PICC_IDLE);
+	s->s_tag[s->s_num_tags++] = p;
+	trace(ccid, " o RFSIM: tag added, %u in the field\n", s->s_num_tags);
+	return 1;
+}
+
+/** Take a virtual tag out of a simulated RF field.
+ * \ingroup g_ccid
+ * @param ccid \ref ccid_t from \ref ccid_rfsim_open.
+ * @param uid UID of the tag.
+ * @param uid_len Length of uid.
+ *
+ * @return zero if there is no such tag.
+ */
+int ccid_rfsim_remove_tag(ccid_t ccid, const uint8_t *uid, size_t uid_len)
+{
+	struct _rfsim *s = rfsim(ccid);
+	unsigned int i;
+
+	if ( NULL == s )
+		return 0;
+
+	for(i = 0; i < s->s_num_tags; i++) {
+		if ( s->s_tag[i]->p_tag.uid_len != uid_len ||
+				memcmp(s->s_tag[i]->p_tag.uid, uid, uid_len) )
+			continue;
+
+		free(s->s_tag[i]);
+		s->s_num_tags--;
+		memmove(s->s_tag + i, s->s_tag + i + 1,
+			(s->s_num_tags - i) * sizeof(*s->s_tag));
+		trace(ccid, " o RFSIM: tag removed, %u in the field\n",
+			s->s_num_tags);
+		return 1;
+	}
+
+	ccid->d_error = CCID_ERROR_IN_VALUE;
+	return 0;
+}
+
+/** Set how often frames go astray in a simulated RF field.
+ * \ingroup g_ccid
+ * @param ccid \ref ccid_t from \ref ccid_rfsim_open.
+ * @param f Rates of each kind of fault, or NULL for none.
+ *
+ * A lost frame never reaches the tag, the reader times out. A garbled
+ * one is acted on by the tag but its answer arrives with a bad CRC, or
+ * framing errors. The same seed gives the same faults each run.
+ *
+ * @return zero on failure.
+ */
+int ccid_rfsim_faults(ccid_t ccid, const struct ccid_rfsim_faults *f)
+{
+	struct _rfsim *s = rfsim(ccid);
+
+	if ( NULL == s )
+		return 0;
+
+	if ( NULL == f ) {
+		memset(&s->s_faults, 0, sizeof(s->s_faults));
+		return 1;
+	}
+
+	if ( f->lost > 1000 || f->crc > 1000 || f->framing > 1000 ) {
+		ccid->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	memcpy(&s->s_faults, f, sizeof(s->s_faults));
+	s->s_rand = f->seed;
+	return 1;
+}
+
+/** Set the frame sizes of a simulated RF field.
+ * \ingroup g_ccid
+ * @param ccid \ref ccid_t from \ref ccid_rfsim_open.
+ * @param mtu Largest frame the reader can send, not counting CRC.
+ * @param mru Largest frame the reader can receive, not counting CRC.
+ *
+ * The default of 64 matches the CLRC632 FIFO. Bigger frames mean less
+ * chaining and fewer round trips.
+ *
+ * @return zero on failure.
+ */
+int ccid_rfsim_frame_size(ccid_t ccid, unsigned int mtu, unsigned int mru)
+{
+	struct _rfsim *s = rfsim(ccid);
+
+	if ( NULL == s )
+		return 0;
+
+	if ( mtu < 16 || mru < 16 || mtu > RFSIM_MAX_FRAME ||
+			mru > RFSIM_MAX_FRAME ) {
+		ccid->d_error = CCID_ERROR_IN_VALUE;
+		return 0;
+	}
+
+	s->s_mtu = mtu;
+	s->s_mru = mru;
+	return 1;
+}
+
+/** Retrieve simulated time on air.
+ * \ingroup g_ccid
+ * @param ccid \ref ccid_t from \ref ccid_rfsim_open.
+ * @param reset non-zero to start counting again from zero.
+ *
+ * Adds up, for every exchange so far, how long the frames would take to
+ * send at the bit rates in use, the time the tags take to answer and the
+ * whole timeout where none does. This is what the exchanges would cost
+ * on a real reader, less any overheads of getting to the ASIC.
+ *
+ * @return microseconds, zero if ccid is not a simulated field.
+ */
+uint64_t ccid_rfsim_air_time(ccid_t ccid, int reset)
+{
+	struct _rfsim *s = rfsim(ccid);
+	uint64_t ret;
+
+	if ( NULL == s )
+		return 0;
+
+	ret = s->s_air_usec;
+	if ( reset )
+		s->s_air_usec = 0;
+	return ret;
+}
@@ -0,0 +1,274 @@
+/*
+ * This file is part of ccid-utils
+ * Copyright (c) 2011 Gianni Tedesco <gianni@scaramanga.co.uk>
+ * Released under the terms of the GNU GPL version 3
+ *
+ * Runs the RF stack against the simulated field: anticollision of 4, 7 and
+ * 10 byte UIDs, T=CL chaining both ways and WTX, MIFARE Classic dump and
+ * write back and falling back to a slower bit rate. Run by make check.
+*/
+
+#include <ccid.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BIG_RSP		300
+#define BIG_CMD		250
+
+#define MFC_1K		1024
+#define MFC_SECTOR	64
+
+static const uint8_t uid4[] = {0xde, 0xad, 0xbe, 0xef};
+static const uint8_t uid7[] = {0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+static const uint8_t uid10[] = {0x08, 0x01, 0x02, 0x03, 0x04,
+				0x05, 0x06, 0x07, 0x08, 0x09};
+
+static const uint8_t read_big[] = {0x00, 0xb0, 0x00, 0x00, 0x00};
+
+static unsigned int failures;
+
+static void check(int ok, const char *what)
+{
+	printf("%s: %s\n", (ok) ? "PASS" : "FAIL", what);
+	if ( !ok )
+		failures++;
+}
+
+/* READ BINARY gets BIG_RSP bytes of pattern, anything else is echoed */
+static int apdu(void *priv, const uint8_t *cmd, size_t len,
+		uint8_t *rsp, size_t *rsp_len)
+{
+	size_t i, n;
+
+	n = (len >= 2 && cmd[1] == 0xb0) ? BIG_RSP : len;
+	if ( n + 2 > *rsp_len )
+		return 0;
+
+	for(i = 0; i < n; i++)
+		rsp[i] = (n == BIG_RSP) ? (uint8_t)i : cmd[i];
+	rsp[n] = 0x90;
+	rsp[n + 1] = 0x00;
+	*rsp_len = n + 2;
+	return 1;
+}
+
+static void tcl_tag(struct ccid_rfsim_tag *t, const uint8_t *uid,
+			size_t uid_len)
+{
+	memset(t, 0, sizeof(*t));
+	t->uid_len = uid_len;
+	memcpy(t->uid, uid, uid_len);
+	t->sak = 0x20;
+	t->apdu = apdu;
+}
+
+static const struct cci_rfid_tag *found(const struct cci_rfid_tag *tags,
+					unsigned int num,
+					const uint8_t *uid, size_t uid_len)
+{
+	unsigned int i;
+
+	for(i = 0; i < num; i++) {
+		if ( tags[i].uid_len == uid_len &&
+				!memcmp(tags[i].uid, uid, uid_len) )
+			return tags + i;
+	}
+	return NULL;
+}
+
+static void test_anticol(ccid_t ccid, cci_t f)
+{
+	struct ccid_rfsim_tag t;
+	struct cci_rfid_tag tags[8];
+	const struct cci_rfid_tag *tag;
+	unsigned int n;
+
+	tcl_tag(&t, uid4, sizeof(uid4));
+	ccid_rfsim_add_tag(ccid, &t);
+	tcl_tag(&t, uid7, sizeof(uid7));
+	ccid_rfsim_add_tag(ccid, &t);
+	tcl_tag(&t, uid10, sizeof(uid10));
+	ccid_rfsim_add_tag(ccid, &t);
+
+	n = cci_rfid_inventory(f, tags, sizeof(tags)/sizeof(*tags));
+	check(n == 3, "inventory finds three tags");
+	check(NULL != found(tags, n, uid4, sizeof(uid4)),
+		"4 byte UID resolved");
+	check(NULL != found(tags, n, uid7, sizeof(uid7)),
+		"7 byte UID resolved");
+	tag = found(tags, n, uid10, sizeof(uid10));
+	check(NULL != tag, "10 byte UID resolved");
+
+	check(NULL != tag && cci_rfid_select(f, tag),
+		"select 10 byte UID tag");
+	cci_power_off(f);
+
+	ccid_rfsim_remove_tag(ccid, uid4, sizeof(uid4));
+	ccid_rfsim_remove_tag(ccid, uid7, sizeof(uid7));
+	ccid_rfsim_remove_tag(ccid, uid10, sizeof(uid10));
+}
+
+static void test_tcl(ccid_t ccid, cci_t f, xfr_t xfr)
+{
+	struct ccid_rfsim_tag t;
+	const uint8_t *rx;
+	uint8_t cmd[BIG_CMD];
+	unsigned int i;
+	size_t len;
+	int ok;
+
+	tcl_tag(&t, uid7, sizeof(uid7));
+	ccid_rfsim_add_tag(ccid, &t);
+	check(NULL != cci_power_on(f, CHIPCARD_AUTO_VOLTAGE, NULL),
+		"power on ISO 14443-4 tag");
+
+	xfr_reset(xfr);
+	xfr_tx_buf(xfr, read_big, sizeof(read_big));
+	ok = cci_transact(f, xfr);
+	rx = xfr_rx_data(xfr, &len);
+	for(i = 0; ok && i < BIG_RSP; i++)
+		ok = (rx[i] == (uint8_t)i);
+	check(ok && len == BIG_RSP && xfr_rx_sw1(xfr) == 0x90,
+		"chained response");
+
+	for(i = 0; i < sizeof(cmd); i++)
+		cmd[i] = i;
+	xfr_reset(xfr);
+	xfr_tx_buf(xfr, cmd, sizeof(cmd));
+	ok = cci_transact(f, xfr);
+	rx = xfr_rx_data(xfr, &len);
+	check(ok && len == sizeof(cmd) && !memcmp(rx, cmd, len),
+		"chained command");
+
+	cci_power_off(f);
+	ccid_rfsim_remove_tag(ccid, uid7, sizeof(uid7));
+
+	/* takes longer than FWT, has to ask for more time */
+	tcl_tag(&t, uid10, sizeof(uid10));
+	t.apdu_usec = 20000;
+	ccid_rfsim_add_tag(ccid, &t);
+	check(NULL != cci_power_on(f, CHIPCARD_AUTO_VOLTAGE, NULL),
+		"power on slow tag");
+
+	xfr_reset(xfr);
+	xfr_tx_buf(xfr, read_big, sizeof(read_big));
+	ok = cci_transact(f, xfr);
+	xfr_rx_data(xfr, &len);
+	check(ok && len == BIG_RSP, "response after WTX");
+
+	cci_power_off(f);
+	ccid_rfsim_remove_tag(ccid, uid10, sizeof(uid10));
+}
+
+static void test_mfc(ccid_t ccid, cci_t f)
+{
+	static const uint8_t keys[] = {
+		0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	};
+	static uint8_t mem[MFC_1K], buf[MFC_1K];
+	struct ccid_rfsim_tag t;
+	unsigned int i;
+	size_t len;
+
+	/* transport keys in every trailer, pattern everywhere else */
+	for(i = 0; i < sizeof(mem); i++)
+		mem[i] = i;
+	for(i = MFC_SECTOR - 16; i < sizeof(mem); i += MFC_SECTOR) {
+		memset(mem + i, 0xff, 6);
+		memset(mem + i + 10, 0xff, 6);
+	}
+
+	memset(&t, 0, sizeof(t));
+	t.uid_len = sizeof(uid4);
+	memcpy(t.uid, uid4, sizeof(uid4));
+	t.sak = 0x08;
+	t.mem = mem;
+	t.mem_len = sizeof(mem);
+	ccid_rfsim_add_tag(ccid, &t);
+
+	check(NULL != cci_power_on(f, CHIPCARD_AUTO_VOLTAGE, NULL),
+		"power on MIFARE Classic");
+	check(cci_mfc_set_keys(f, keys, sizeof(keys) / CCI_MFC_KEY_LEN),
+		"set MIFARE keys");
+
+	len = sizeof(buf);
+	check(cci_mfc_read_card(f, buf, &len) && len == sizeof(mem),
+		"MIFARE dump");
+	/* block 0 and the trailers don't read back as stored */
+	check(!memcmp(buf + 16, mem + 16, 32) &&
+		!memcmp(buf + MFC_SECTOR * 15, mem + MFC_SECTOR * 15, 48),
+		"MIFARE dump contents");
+
+	memset(buf, 0x5a, 48);
+	check(cci_mfc_write_sector(f, 1, buf, MFC_SECTOR) &&
+		!memcmp(mem + MFC_SECTOR, buf, 48),
+		"MIFARE sector write");
+
+	cci_power_off(f);
+	ccid_rfsim_remove_tag(ccid, uid4, sizeof(uid4));
+}
+
+static void test_rates(ccid_t ccid, cci_t f, xfr_t xfr)
+{
+	struct ccid_rfsim_tag t;
+	struct cci_rfid_stats st;
+	int ok;
+
+	/* can't hear 848kbit/s */
+	tcl_tag(&t, uid4, sizeof(uid4));
+	t.bad_speeds = (1 << 3);
+	ccid_rfsim_add_tag(ccid, &t);
+	cci_rfid_stats(f, NULL, 1);
+
+	ok = (NULL != cci_power_on(f, CHIPCARD_AUTO_VOLTAGE, NULL));
+	xfr_reset(xfr);
+	xfr_tx_buf(xfr, read_big, sizeof(read_big));
+	ok = ok && cci_transact(f, xfr);
+	cci_power_off(f);
+	cci_rfid_stats(f, &st, 1);
+	check(ok && st.demotions, "fall back to slower rate");
+
+	ok = (NULL != cci_power_on(f, CHIPCARD_AUTO_VOLTAGE, NULL));
+	xfr_reset(xfr);
+	xfr_tx_buf(xfr, read_big, sizeof(read_big));
+	ok = ok && cci_transact(f, xfr);
+	cci_power_off(f);
+	cci_rfid_stats(f, &st, 1);
+	check(ok && !st.demotions && !st.timeouts && !st.crc_errors,
+		"slower rate remembered");
+
+	ccid_rfsim_remove_tag(ccid, uid4, sizeof(uid4));
+}
+
+int main(int argc, char **argv)
+{
+	ccid_t ccid;
+	xfr_t xfr;
+	cci_t f;
+
+	ccid = ccid_rfsim_open((argc > 1) ? argv[1] : NULL);
+	if ( NULL == ccid ) {
+		fprintf(stderr, "%s: ccid_rfsim_open failed\n", argv[0]);
+		return 1;
+	}
+
+	f = ccid_get_field(ccid, 0);
+	xfr = xfr_alloc(BIG_CMD + 16, BIG_RSP + 16);
+	if ( NULL == f || NULL == xfr ) {
+		fprintf(stderr, "%s: setup failed\n", argv[0]);
+		return 1;
+	}
+
+	test_anticol(ccid, f);
+	test_tcl(ccid, f, xfr);
+	test_mfc(ccid, f);
+	test_rates(ccid, f, xfr);
+
+	xfr_free(xfr);
+	ccid_close(ccid);
+
+	if ( failures )
+		printf("%u checks failed\n", failures);
+	return (failures) ? 1 : 0;
+}
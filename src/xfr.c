@@ -27,7 +27,7 @@ struct _xfr *_xfr_do_alloc(size_t txbuf, size_t rxbuf)
 	ptr += sizeof(*xfr);
 
 	xfr->x_txmax = txbuf;
-	xfr->x_rxmax = txbuf;
+	xfr->x_rxmax = rxbuf;
 
 	xfr->x_txhdr = (struct ccid_msg *)ptr;
 	ptr += sizeof(*xfr->x_txhdr);
@@ -105,6 +105,30 @@ int xfr_tx_buf(xfr_t xfr, const uint8_t *ptr, size_t len)
 	return 1;
 }
 
+/** Reserve space at the end of the transmit buffer.
+ * \ingroup g_xfr
+ * @param xfr \ref xfr_t representing the transaction buffer.
+ * @param len Number of bytes to reserve.
+ *
+ * Lets the caller build command data in place rather than in a temporary
+ * buffer which is then copied with xfr_tx_buf(). The contents of the
+ * reserved space are undefined until the caller writes to it.
+ *
+ * @return pointer to the reserved bytes, or NULL on error.
+*/
+uint8_t *xfr_tx_reserve(xfr_t xfr, size_t len)
+{
+	uint8_t *ret;
+
+	if ( xfr->x_txlen + len > xfr->x_txmax )
+		return NULL;
+
+	ret = xfr->x_txbuf + xfr->x_txlen;
+	xfr->x_txlen += len;
+
+	return ret;
+}
+
 /** Retrieve status word 1 from the receive buffer.
  * \ingroup g_xfr
  * @param xfr \ref xfr_t representing the transaction buffer.